@@ -104,6 +104,11 @@ This call does not block, because it returns data that is saved in
 the handle from the NBD protocol handshake."
 
 (* Closures. *)
+let buffer_closure = {
+  cbname = "buffer";
+  cbargs = [ CBUInt "slot"; CBBytesIn ("buf", "count");
+             CBUInt64 "offset"; CBMutable (Int "error") ]
+}
 let chunk_closure = {
   cbname = "chunk";
   cbargs = [ CBBytesIn ("subbuf", "count");
@@ -126,7 +131,7 @@ let extent_closure = {
                             "nr_entries");
              CBMutable (Int "error") ]
 }
-let all_closures = [ chunk_closure; completion_closure;
+let all_closures = [ buffer_closure; chunk_closure; completion_closure;
                      debug_closure; extent_closure ]
 
 (* Enums. *)
@@ -588,6 +593,173 @@ the time of compilation.";
                 Link "aio_is_created"; Link "aio_is_ready"];
   };
 
+  "set_pipeline_handshake", {
+    default_call with
+    args = [Bool "pipeline"]; ret = RErr;
+    permitted_states = [ Created ];
+    shortdesc = "control pipelining of the handshake";
+    longdesc = "\
+By default, libnbd sends each option during the fixed newstyle
+handshake and waits for the reply before sending the next one, so
+negotiating structured replies, meta contexts and the export takes
+one round trip each.  If this flag is set, the
+C<NBD_OPT_STRUCTURED_REPLY>, C<NBD_OPT_SET_META_CONTEXT> and
+C<NBD_OPT_GO> requests are all sent together (after the TLS upgrade,
+if any), and the replies are read in order, so the handshake only
+waits once for the server.
+
+Since the meta context request is sent before the server has
+agreed to structured replies, a server which does not support
+structured replies will see (and reject) a meta context request,
+which is allowed by the NBD protocol but may be logged by the server
+as an error.  The default is false.";
+    see_also = [Link "get_pipeline_handshake";
+                Link "set_request_structured_replies";
+                Link "add_meta_context"; Link "set_spare_connections"];
+  };
+
+  "get_pipeline_handshake", {
+    default_call with
+    args = []; ret = RBool;
+    may_set_error = false;
+    shortdesc = "see if the handshake is pipelined";
+    longdesc = "\
+Return the state of the pipeline handshake flag on this handle.";
+    see_also = [Link "set_pipeline_handshake"];
+  };
+
+  "set_multi_conn", {
+    default_call with
+    args = [ UInt32 "nr" ]; ret = RErr;
+    permitted_states = [ Created ];
+    shortdesc = "set the number of connections to open to the server";
+    longdesc = "\
+Ask libnbd to open up to C<nr> connections to the server, and to
+spread commands over them.  The default is C<1>, and the maximum
+is C<64>.
+
+When the handle is connected using one of the synchronous connect
+calls such as L<nbd_connect_tcp(3)> or L<nbd_connect_uri(3)>, and
+the server advertises multi-conn (see L<nbd_can_multi_conn(3)>),
+libnbd opens the extra connections to the same export using the
+same settings.  Each new command is then sent on the connection
+with the fewest commands in flight.  Cookies are unique across all
+connections, so the aio calls work in the same way as with a single
+connection.
+
+If the server does not support multi-conn, or the handle was
+connected to a local command or an existing socket, or opening an
+extra connection fails, the handle carries on with fewer
+connections.  Use L<nbd_get_nr_connections(3)> to find out how many
+are in use.
+
+L<nbd_poll(3)>, L<nbd_loop_poll(3)> and the synchronous calls such
+as L<nbd_pread(3)> service all of the connections.  Programs which
+integrate the handle into their own main loop must poll the file
+descriptor of each connection, using L<nbd_aio_get_fd_n(3)>,
+L<nbd_aio_get_direction_n(3)>, L<nbd_aio_notify_read_n(3)> and
+L<nbd_aio_notify_write_n(3)>.  Once there is more than one
+connection, L<nbd_aio_get_fd(3)>, L<nbd_aio_notify_read(3)> and
+L<nbd_aio_notify_write(3)> fail with C<EINVAL>.";
+    see_also = [Link "get_multi_conn"; Link "get_nr_connections";
+                Link "can_multi_conn"; SectionLink "Multi-conn"];
+  };
+
+  "get_multi_conn", {
+    default_call with
+    args = []; ret = RUInt;
+    may_set_error = false;
+    shortdesc = "see how many connections will be opened to the server";
+    longdesc = "\
+Return the number of connections set with L<nbd_set_multi_conn(3)>.
+Use L<nbd_get_nr_connections(3)> to find out how many connections
+were actually opened.";
+    see_also = [Link "set_multi_conn"; Link "get_nr_connections"];
+  };
+
+  "set_spare_connections", {
+    default_call with
+    args = [ UInt32 "nr" ]; ret = RErr;
+    permitted_states = [ Created ];
+    shortdesc = "set the number of spare connections to keep open";
+    longdesc = "\
+Ask libnbd to keep C<nr> spare connections open to the server, so
+that L<nbd_failover(3)> can replace a connection which has died
+without waiting for a new connection and handshake.  The default is
+C<0>, and the maximum is C<16>.
+
+When the handle is connected using one of the synchronous connect
+calls such as L<nbd_connect_tcp(3)> or L<nbd_connect_uri(3)>, libnbd
+opens the spare connections to the same export using the same
+settings, and leaves them idle.  Opening a spare connection can fail
+(for example if the server limits the number of clients), in which
+case the handle carries on with fewer spares.  Spare connections
+cannot be used with handles connected to a local command or an
+existing socket.
+
+Spare connections use resources on the server, and some servers drop
+idle clients after a timeout, so they are checked again when
+L<nbd_failover(3)> uses them.";
+    see_also = [Link "get_spare_connections"; Link "failover";
+                Link "fill_spare_connections";
+                Link "set_pipeline_handshake"];
+  };
+
+  "get_spare_connections", {
+    default_call with
+    args = []; ret = RUInt;
+    may_set_error = false;
+    shortdesc = "see how many spare connections will be kept open";
+    longdesc = "\
+Return the number of spare connections set with
+L<nbd_set_spare_connections(3)>.";
+    see_also = [Link "set_spare_connections"];
+  };
+
+  "fill_spare_connections", {
+    default_call with
+    args = []; ret = RErr;
+    permitted_states = [ Connected; Closed; Dead ];
+    shortdesc = "open spare connections";
+    longdesc = "\
+Open new spare connections until the number set with
+L<nbd_set_spare_connections(3)> are open.  Spare connections are
+opened automatically when the handle connects, but
+L<nbd_failover(3)> uses them up, so call this to replace them once
+the handle is running again.  This blocks until the connections have
+completed the handshake.  If a connection cannot be opened this
+returns an error, and the spare connections which were opened are
+kept.";
+    see_also = [Link "set_spare_connections"; Link "failover"];
+  };
+
+  "failover", {
+    default_call with
+    args = []; ret = RErr;
+    permitted_states = [ Closed; Dead ];
+    shortdesc = "replace a dead connection";
+    longdesc = "\
+If the connection of this handle has died (see L<nbd_aio_is_dead(3)>)
+or was closed, replace it with a new connection to the same export,
+so that the handle can be used again.  Commands which were in flight
+on the old connection have already failed, and are not resent.
+
+If a spare connection is available (see
+L<nbd_set_spare_connections(3)>), it is used, which avoids the
+connection setup and handshake round trips.  Spare connections which
+the server has dropped are discarded.  Otherwise a new connection is
+opened, which blocks until the handshake is complete.
+
+The size and flags of the export must be the same as on the old
+connection.  If they differ, this fails with C<EINVAL> and the handle
+is left as it was.  Extra connections opened by L<nbd_set_multi_conn(3)>
+are not replaced.  This cannot be used with handles connected to a
+local command or an existing socket.";
+    see_also = [Link "set_spare_connections";
+                Link "fill_spare_connections";
+                Link "aio_is_dead"; Link "aio_is_closed"];
+  };
+
   "add_meta_context", {
     default_call with
     args = [ String "name" ]; ret = RErr;
@@ -1097,10 +1269,22 @@ way to check for this is to open one connection, check
 this flag is true, then open further connections as
 required."
 ^ non_blocking_test_call_description;
-    see_also = [SectionLink "Multi-conn"];
+    see_also = [SectionLink "Multi-conn"; Link "set_multi_conn"];
     example = Some "examples/server-flags.c";
   };
 
+  "get_nr_connections", {
+    default_call with
+    args = []; ret = RInt;
+    permitted_states = [ Connected; Closed ];
+    shortdesc = "return the number of connections to the server";
+    longdesc = "\
+Return the number of connections to the server which this handle
+uses.  This is C<1> unless L<nbd_set_multi_conn(3)> was used and the
+extra connections could be opened.";
+    see_also = [Link "set_multi_conn"; SectionLink "Multi-conn"];
+  };
+
   "can_cache", {
     default_call with
     args = []; ret = RBool;
@@ -1647,6 +1831,38 @@ Other parameters behave as documented in L<nbd_pread_structured(3)>.";
                 Link "aio_pread"; Link "pread_structured"];
   };
 
+  "aio_pread_registered", {
+    default_call with
+    args = [ UInt64 "count"; UInt64 "offset"; Closure buffer_closure ];
+    optargs = [ OClosure completion_closure; OFlags ("flags", cmd_flags) ];
+    ret = RCookie;
+    permitted_states = [ Connected ];
+    shortdesc = "read from the NBD server into a registered buffer";
+    longdesc = "\
+Issue a read command to the NBD server, reading C<count> bytes at
+C<offset> into one of the buffers registered with
+L<nbd_register_buffers(3)>.  C<count> must not be larger than the
+buffer size.  If all of the registered buffers are in use this fails
+with C<ENOBUFS>.
+
+When the command completes, C<buffer_callback> is called before the
+optional C<completion_callback>.  It receives the number of the
+buffer in C<slot>, and C<buf> and C<count> describe the data.  If the
+read failed, C<*error> contains the error and the contents of the
+buffer are undefined.  As with the other callbacks, the callback can
+return C<-1> after setting C<*error> to make the command fail.
+
+The buffer stays reserved until it is given back with
+L<nbd_release_buffer(3)>, so the caller can keep or forward the data
+without copying it, even after the command has been retired.  The
+buffer must be released whether or not the read succeeded.
+
+The C<flags> parameter must be C<0> for now (it exists for future NBD
+protocol extensions).";
+    see_also = [Link "register_buffers"; Link "release_buffer";
+                Link "aio_pread"; SectionLink "Registered buffers"];
+  };
+
   "aio_pwrite", {
     default_call with
     args = [ BytesPersistIn ("buf", "count"); UInt64 "offset" ];
@@ -1796,8 +2012,14 @@ Return the underlying file descriptor associated with this
 connection.  You can use this to check if the file descriptor
 is ready for reading or writing and call L<nbd_aio_notify_read(3)>
 or L<nbd_aio_notify_write(3)>.  See also L<nbd_aio_get_direction(3)>.
-Do not do anything else with the file descriptor.";
-    see_also = [Link "aio_get_direction"];
+Do not do anything else with the file descriptor.
+
+If the handle has opened more than one connection to the server
+(see L<nbd_set_multi_conn(3)>) this fails with C<EINVAL>, since
+the other connections would not be polled.  Use
+L<nbd_aio_get_fd_n(3)> instead.";
+    see_also = [Link "aio_get_direction"; Link "aio_get_fd_n";
+                Link "set_multi_conn"];
   };
 
   "aio_get_direction", {
@@ -1863,7 +2085,12 @@ and invalidate the need to write more commands.
 Send notification to the state machine that the connection
 is readable.  Typically this is called after your main loop
 has detected that the file descriptor associated with this
-connection is readable.";
+connection is readable.
+
+This fails with C<EINVAL> if the handle has opened more than
+one connection to the server, see L<nbd_aio_notify_read_n(3)>.";
+    see_also = [Link "aio_get_fd"; Link "aio_notify_read_n";
+                Link "set_multi_conn"];
   };
 
   "aio_notify_write", {
@@ -1874,7 +2101,77 @@ connection is readable.";
 Send notification to the state machine that the connection
 is writable.  Typically this is called after your main loop
 has detected that the file descriptor associated with this
-connection is writable.";
+connection is writable.
+
+This fails with C<EINVAL> if the handle has opened more than
+one connection to the server, see L<nbd_aio_notify_write_n(3)>.";
+    see_also = [Link "aio_get_fd"; Link "aio_notify_write_n";
+                Link "set_multi_conn"];
+  };
+
+  "aio_get_fd_n", {
+    default_call with
+    args = [ UInt32 "conn" ]; ret = RFd;
+    shortdesc = "return file descriptor of one connection";
+    longdesc = "\
+Return the file descriptor of connection C<conn> of the handle,
+where C<conn> is between C<0> and L<nbd_get_nr_connections(3)> - 1.
+Connection C<0> is the one returned by L<nbd_aio_get_fd(3)> when
+the handle has only one connection.
+
+Programs with their own main loop use this with
+L<nbd_set_multi_conn(3)>: poll the file descriptor of every
+connection for the events returned by L<nbd_aio_get_direction_n(3)>,
+and call L<nbd_aio_notify_read_n(3)> or
+L<nbd_aio_notify_write_n(3)> for the connections which are ready.
+Do not do anything else with the file descriptors.
+
+The file descriptor of a connection can change after
+L<nbd_failover(3)>, so call this again after a failover.  Once a
+connection has failed L<nbd_aio_get_direction_n(3)> returns C<0>
+for it, so stop polling it.";
+    see_also = [Link "aio_get_fd"; Link "aio_get_direction_n";
+                Link "get_nr_connections"; SectionLink "Multi-conn"];
+  };
+
+  "aio_get_direction_n", {
+    default_call with
+    args = [ UInt32 "conn" ]; ret = RUInt; may_set_error = false;
+    shortdesc = "return the read or write direction of one connection";
+    longdesc = "\
+Return the current direction of connection C<conn> of the handle,
+in the same way as L<nbd_aio_get_direction(3)>.  This returns C<0>
+if C<conn> is not a connection of the handle, or if it has
+failed.";
+    see_also = [Link "aio_get_direction"; Link "aio_get_fd_n"];
+  };
+
+  "aio_notify_read_n", {
+    default_call with
+    args = [ UInt32 "conn" ]; ret = RErr;
+    shortdesc = "notify that one connection is readable";
+    longdesc = "\
+Send notification to the state machine that connection C<conn>
+of the handle is readable, see L<nbd_aio_get_fd_n(3)>.
+
+A failure of one of the extra connections opened by
+L<nbd_set_multi_conn(3)> is not returned: its commands complete
+with an error, L<nbd_aio_get_direction_n(3)> returns C<0> for it
+from then on, and new commands are sent on the other connections.";
+    see_also = [Link "aio_notify_read"; Link "aio_get_fd_n"];
+  };
+
+  "aio_notify_write_n", {
+    default_call with
+    args = [ UInt32 "conn" ]; ret = RErr;
+    shortdesc = "notify that one connection is writable";
+    longdesc = "\
+Send notification to the state machine that connection C<conn>
+of the handle is writable, see L<nbd_aio_get_fd_n(3)>.
+
+Failures of the extra connections are handled as in
+L<nbd_aio_notify_read_n(3)>.";
+    see_also = [Link "aio_notify_write"; Link "aio_get_fd_n"];
   };
 
   "aio_is_created", {
@@ -1992,6 +2289,96 @@ those commands as failed with a status of C<ENOTCONN>.";
     see_also = [Link "aio_disconnect"];
   };
 
+  "register_buffers", {
+    default_call with
+    args = [ BytesPersistOut ("buf", "count"); UInt32 "buffer_size" ];
+    ret = RErr;
+    shortdesc = "register buffers for nbd_aio_pread_registered";
+    longdesc = "\
+Register the memory C<buf> of C<count> bytes with the handle, for
+use by L<nbd_aio_pread_registered(3)>.  The memory is divided into
+as many buffers of C<buffer_size> bytes as will fit, which are
+numbered from C<0>.  The memory still belongs to the caller, and must
+stay valid until the handle is closed or the buffers are unregistered
+with L<nbd_unregister_buffers(3)>.  It can, for example, be allocated
+from huge pages or locked in memory.  The Python bindings keep a
+reference to the buffer object for as long as it is registered, but
+in OCaml the caller must keep the buffer referenced.
+
+Calling this again replaces the previously registered buffers.  This
+fails with C<EBUSY> if any of the previous buffers has not been
+released with L<nbd_release_buffer(3)>.";
+    see_also = [Link "aio_pread_registered"; Link "release_buffer";
+                Link "unregister_buffers";
+                SectionLink "Registered buffers"];
+  };
+
+  "unregister_buffers", {
+    default_call with
+    args = []; ret = RErr;
+    shortdesc = "unregister buffers registered with nbd_register_buffers";
+    longdesc = "\
+Stop using the memory registered with L<nbd_register_buffers(3)>.
+This fails with C<EBUSY> if any of the buffers has not been released
+with L<nbd_release_buffer(3)>.  It is not an error to call this when
+no buffers are registered.";
+    see_also = [Link "register_buffers"];
+  };
+
+  "release_buffer", {
+    default_call with
+    args = [ UInt32 "slot" ]; ret = RErr;
+    shortdesc = "give back a buffer used by nbd_aio_pread_registered";
+    longdesc = "\
+Give back the registered buffer C<slot>, which was passed to the
+C<buffer_callback> of L<nbd_aio_pread_registered(3)>, so that it can
+be used by another read.  Like other libnbd calls, this must not be
+called from within the callback itself, but only after the command
+has completed.";
+    see_also = [Link "aio_pread_registered"; Link "register_buffers"];
+  };
+
+  "aio_begin_batch", {
+    default_call with
+    args = []; ret = RErr;
+    shortdesc = "start queuing aio commands";
+    longdesc = "\
+After this call, aio commands such as L<nbd_aio_pread(3)> are
+queued in the handle but not sent to the server.  The queued
+commands are sent together, with as few system calls as possible,
+when L<nbd_aio_end_batch(3)> is called.  L<nbd_poll(3)> and
+L<nbd_loop_poll(3)> also send them before waiting, and libnbd
+sends them as soon as the connection finishes receiving an earlier
+reply.
+
+A queued command does not change L<nbd_aio_get_direction(3)>, so
+programs which integrate the handle into their own main loop and
+call L<nbd_aio_notify_read(3)> or L<nbd_aio_notify_write(3)> must
+call L<nbd_aio_end_batch(3)> after queuing the commands, otherwise
+the main loop may wait forever for replies to commands that were
+never sent.
+
+This reduces the per-command overhead when an application submits
+many small commands at once.  It is not an error to call this when
+a batch is already started.";
+    see_also = [Link "aio_end_batch"; Link "aio_in_flight";
+                Link "aio_get_direction";
+                SectionLink "Issuing multiple in-flight requests"];
+  };
+
+  "aio_end_batch", {
+    default_call with
+    args = []; ret = RErr;
+    shortdesc = "send aio commands queued since nbd_aio_begin_batch";
+    longdesc = "\
+End a batch started with L<nbd_aio_begin_batch(3)> and start
+sending the queued commands to the server.  As with a single aio
+command, this does not wait for the commands to be sent; the
+application must continue to poll the handle.  It is not an error
+to call this when no batch is started.";
+    see_also = [Link "aio_begin_batch"; Link "aio_in_flight"];
+  };
+
   "connection_state", {
     default_call with
     args = []; ret = RStaticString;
@@ -2197,6 +2584,27 @@ let first_version = [
   "set_uri_allow_tls", (1, 2);
   "set_uri_allow_local_file", (1, 2);
 
+  (* Added in 1.3.x development cycle, will be stable and supported in 1.4. *)
+  "aio_begin_batch", (1, 4);
+  "aio_end_batch", (1, 4);
+  "set_multi_conn", (1, 4);
+  "get_multi_conn", (1, 4);
+  "get_nr_connections", (1, 4);
+  "register_buffers", (1, 4);
+  "unregister_buffers", (1, 4);
+  "release_buffer", (1, 4);
+  "aio_pread_registered", (1, 4);
+  "set_pipeline_handshake", (1, 4);
+  "get_pipeline_handshake", (1, 4);
+  "set_spare_connections", (1, 4);
+  "get_spare_connections", (1, 4);
+  "fill_spare_connections", (1, 4);
+  "failover", (1, 4);
+  "aio_get_fd_n", (1, 4);
+  "aio_get_direction_n", (1, 4);
+  "aio_notify_read_n", (1, 4);
+  "aio_notify_write_n", (1, 4);
+
   (* These calls are proposed for a future version of libnbd, but
    * have not been added to any released version so far.
   "get_tls_certificates", (1, ??);
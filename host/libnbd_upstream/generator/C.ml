@@ -44,6 +44,14 @@ let generate_lib_libnbd_syms () =
         pr "    nbd_get_errno;\n";
         pr "    nbd_get_error;\n"
       );
+      if (major, minor) = (1, 4) then (
+        pr "    nbd_loop_create;\n";
+        pr "    nbd_loop_close;\n";
+        pr "    nbd_loop_add;\n";
+        pr "    nbd_loop_remove;\n";
+        pr "    nbd_loop_set_busy_poll;\n";
+        pr "    nbd_loop_poll;\n"
+      );
       List.iter (fun (name, _) -> pr "    nbd_%s;\n" name) calls;
       (match !prev with
        | None ->
@@ -325,6 +333,7 @@ let generate_include_libnbd_h () =
   pr "#endif\n";
   pr "\n";
   pr "struct nbd_handle;\n";
+  pr "struct nbd_loop;\n";
   pr "\n";
   List.iter (
     fun { enum_prefix; enums } ->
@@ -362,6 +371,25 @@ let generate_include_libnbd_h () =
   pr "extern int nbd_get_errno (void);\n";
   pr "#define LIBNBD_HAVE_NBD_GET_ERRNO 1\n";
   pr "\n";
+  pr "extern struct nbd_loop *nbd_loop_create (void);\n";
+  pr "#define LIBNBD_HAVE_NBD_LOOP_CREATE 1\n";
+  pr "\n";
+  pr "extern void nbd_loop_close (struct nbd_loop *loop);\n";
+  pr "#define LIBNBD_HAVE_NBD_LOOP_CLOSE 1\n";
+  pr "\n";
+  pr "extern int nbd_loop_add (struct nbd_loop *loop, struct nbd_handle *h);\n";
+  pr "#define LIBNBD_HAVE_NBD_LOOP_ADD 1\n";
+  pr "\n";
+  pr "extern int nbd_loop_remove (struct nbd_loop *loop, struct nbd_handle *h);\n";
+  pr "#define LIBNBD_HAVE_NBD_LOOP_REMOVE 1\n";
+  pr "\n";
+  pr "extern int nbd_loop_set_busy_poll (struct nbd_loop *loop,\n";
+  pr "                                   unsigned usecs);\n";
+  pr "#define LIBNBD_HAVE_NBD_LOOP_SET_BUSY_POLL 1\n";
+  pr "\n";
+  pr "extern int nbd_loop_poll (struct nbd_loop *loop, int timeout);\n";
+  pr "#define LIBNBD_HAVE_NBD_LOOP_POLL 1\n";
+  pr "\n";
   print_closure_structs ();
   List.iter (
     fun (name, { args; optargs; ret }) ->
@@ -725,6 +753,7 @@ let generate_docs_api_links_pod () =
     "nbd_close(3)" ::
     "nbd_get_error(3)" ::
     "nbd_get_errno(3)" ::
+    "nbd_loop_create(3)" ::
     pages in
   let pages = List.sort compare pages in
 
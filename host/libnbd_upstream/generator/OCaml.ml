@@ -587,11 +587,16 @@ let print_ocaml_binding (name, { args; optargs; ret }) =
   (* If there is a BytesPersistIn/Out parameter then we need to
    * register it as a global root and save that into the
    * completion_callback.user_data so the root is removed on
-   * command completion.
+   * command completion.  Calls without a completion callback
+   * (nbd_register_buffers) rely on the caller keeping the buffer
+   * alive.
    *)
+  let has_completion =
+    List.exists (function OClosure { cbname = "completion" } -> true
+                        | _ -> false) optargs in
   List.iter (
     function
-    | BytesPersistIn (n, _) | BytesPersistOut (n, _) ->
+    | BytesPersistIn (n, _) | BytesPersistOut (n, _) when has_completion ->
        pr "  completion_user_data->bufv = %sv;\n" n;
        pr "  caml_register_generational_global_root (&completion_user_data->bufv);\n"
     | _ -> ()
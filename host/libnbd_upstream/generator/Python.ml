@@ -32,6 +32,7 @@ let generate_python_methods_h () =
   pr "#include <Python.h>\n";
   pr "\n";
   pr "#include <assert.h>\n";
+  pr "#include <stdbool.h>\n";
   pr "\n";
   pr "\
 struct py_aio_buffer {
@@ -42,13 +43,31 @@ struct py_aio_buffer {
 extern char **nbd_internal_py_get_string_list (PyObject *);
 extern void nbd_internal_py_free_string_list (char **);
 extern struct py_aio_buffer *nbd_internal_py_get_aio_buffer (PyObject *);
+extern int nbd_internal_py_get_buffer_view (PyObject *, bool, Py_buffer *);
+
+/* The handle capsule points to this.  Memory registered with
+ * nbd_register_buffers is used by libnbd until it is unregistered or
+ * the handle is closed, so the Python object and its buffer view are
+ * kept here until then.
+ */
+struct py_handle {
+  struct nbd_handle *h;
+  PyObject *registered_buf;
+  Py_buffer registered_view;
+};
 
-static inline struct nbd_handle *
-get_handle (PyObject *obj)
+static inline struct py_handle *
+get_py_handle (PyObject *obj)
 {
   assert (obj);
   assert (obj != Py_None);
-  return (struct nbd_handle *) PyCapsule_GetPointer(obj, \"nbd_handle\");
+  return (struct py_handle *) PyCapsule_GetPointer(obj, \"nbd_handle\");
+}
+
+static inline struct nbd_handle *
+get_handle (PyObject *obj)
+{
+  return get_py_handle (obj)->h;
 }
 
 /* nbd.Error exception. */
@@ -74,7 +93,8 @@ raise_exception ()
        "aio_buffer_from_bytearray";
        "aio_buffer_to_bytearray";
        "aio_buffer_size";
-       "aio_buffer_is_zero" ] @ List.map fst handle_calls);
+       "aio_buffer_is_zero";
+       "poll_completions" ] @ List.map fst handle_calls);
 
   pr "\n";
   pr "#endif /* LIBNBD_METHODS_H */\n"
@@ -105,7 +125,8 @@ let generate_python_libnbdmod_c () =
        "aio_buffer_from_bytearray";
        "aio_buffer_to_bytearray";
        "aio_buffer_size";
-       "aio_buffer_is_zero" ] @ List.map fst handle_calls);
+       "aio_buffer_is_zero";
+       "poll_completions" ] @ List.map fst handle_calls);
   pr "  { NULL, NULL, 0, NULL }\n";
   pr "};\n";
   pr "\n";
@@ -150,16 +171,15 @@ PyInit_libnbdmod (void)
  * callbacks back to Python.
  *)
 let print_python_closure_wrapper { cbname; cbargs } =
-  pr "/* Wrapper for %s callback. */\n" cbname;
+  pr "/* Wrapper for %s callback, called with the GIL held. */\n" cbname;
   pr "static int\n";
-  pr "%s_wrapper " cbname;
+  pr "%s_wrapper_locked " cbname;
   C.print_cbarg_list ~wrap:true cbargs;
   pr "\n";
   pr "{\n";
   pr "  const struct user_data *data = user_data;\n";
   pr "  int ret = 0;\n";
   pr "\n";
-  pr "  PyGILState_STATE py_save = PyGILState_UNLOCKED;\n";
   pr "  PyObject *py_args, *py_ret;\n";
   List.iter (
     function
@@ -212,14 +232,8 @@ let print_python_closure_wrapper { cbname; cbargs } =
   pr ");\n";
   pr "  Py_INCREF (py_args);\n";
   pr "\n";
-  pr "  if (PyEval_ThreadsInitialized ())\n";
-  pr "    py_save = PyGILState_Ensure ();\n";
-  pr "\n";
   pr "  py_ret = PyObject_CallObject (data->fn, py_args);\n";
   pr "\n";
-  pr "  if (PyEval_ThreadsInitialized ())\n";
-  pr "    PyGILState_Release (py_save);\n";
-  pr "\n";
   pr "  Py_DECREF (py_args);\n";
   pr "\n";
   pr "  if (py_ret != NULL) {\n";
@@ -257,8 +271,35 @@ let print_python_closure_wrapper { cbname; cbargs } =
   ) cbargs;
   pr "  return ret;\n";
   pr "}\n";
+  pr "\n";
+
+  (* The bindings release the GIL while calling libnbd, so the
+   * callback must take it before touching any Python object.
+   *)
+  pr "/* Wrapper for %s callback. */\n" cbname;
+  pr "static int\n";
+  pr "%s_wrapper " cbname;
+  C.print_cbarg_list ~wrap:true cbargs;
+  pr "\n";
+  pr "{\n";
+  pr "  PyGILState_STATE py_save;\n";
+  pr "  int ret;\n";
+  pr "\n";
+  pr "  py_save = PyGILState_Ensure ();\n";
+  pr "  ret = %s_wrapper_locked " cbname;
+  C.print_cbarg_list ~types:false cbargs;
+  pr ";\n";
+  pr "  PyGILState_Release (py_save);\n";
+  pr "  return ret;\n";
+  pr "}\n";
   pr "\n"
 
+(* Calls which are written by hand in python/handle.c.  The buffer
+ * passed to nbd_register_buffers must stay alive and pinned until it
+ * is unregistered, which the generated code cannot express.
+ *)
+let hand_written_calls = [ "register_buffers"; "unregister_buffers" ]
+
 (* Generate the Python binding. *)
 let print_python_binding name { args; optargs; ret; may_set_error } =
   pr "PyObject *\n";
@@ -278,9 +319,9 @@ let print_python_binding name { args; optargs; ret; may_set_error } =
        pr "  Py_ssize_t %s;\n" count
     | BytesPersistIn (n, _)
     | BytesPersistOut (n, _) ->
-       pr "  PyObject *%s; /* PyCapsule pointing to struct py_aio_buffer */\n"
+       pr "  PyObject *%s; /* nbd.Buffer or any buffer protocol object */\n"
           n;
-       pr "  struct py_aio_buffer *%s_buf;\n" n
+       pr "  Py_buffer %s_view;\n" n
     | Closure { cbname } ->
        pr "  struct user_data *%s_user_data = alloc_user_data ();\n" cbname;
        pr "  if (%s_user_data == NULL) return NULL;\n" cbname;
@@ -395,8 +436,14 @@ let print_python_binding name { args; optargs; ret; may_set_error } =
     | BytesIn _ -> ()
     | BytesOut (n, count) ->
        pr "  %s = malloc (%s);\n" n count
-    | BytesPersistIn (n, _) | BytesPersistOut (n, _) ->
-       pr "  %s_buf = nbd_internal_py_get_aio_buffer (%s);\n" n n
+    | BytesPersistIn (n, _) ->
+       pr "  if (nbd_internal_py_get_buffer_view (%s, false, &%s_view) == -1)\n"
+          n n;
+       pr "    return NULL;\n"
+    | BytesPersistOut (n, _) ->
+       pr "  if (nbd_internal_py_get_buffer_view (%s, true, &%s_view) == -1)\n"
+          n n;
+       pr "    return NULL;\n"
     | Closure { cbname } ->
        pr "  /* Increment refcount since pointer may be saved by libnbd. */\n";
        pr "  Py_INCREF (%s_user_data->fn);\n" cbname;
@@ -434,15 +481,17 @@ let print_python_binding name { args; optargs; ret; may_set_error } =
        pr "      return NULL;\n";
        pr "    }\n";
        pr "  }\n";
-       pr "  else\n";
-       pr "    %s.callback = NULL; /* we're not going to call it */\n" cbname
+       pr "  else {\n";
+       pr "    %s.callback = NULL; /* we're not going to call it */\n" cbname;
+       pr "    %s_user_data->fn = NULL; /* no reference was taken */\n" cbname;
+       pr "  }\n"
     | OFlags (n, _) -> pr "  %s_u32 = %s;\n" n n
   ) optargs;
 
   (* If there is a BytesPersistIn/Out parameter then we need to
-   * increment the refcount and save the pointer into
-   * completion_callback.user_data so we can decrement the
-   * refcount on command completion.
+   * increment the refcount and save the pointer and the buffer view
+   * into completion_callback.user_data so we can release them on
+   * command completion.
    *)
   List.iter (
     function
@@ -450,10 +499,14 @@ let print_python_binding name { args; optargs; ret; may_set_error } =
        pr "  /* Increment refcount since buffer may be saved by libnbd. */\n";
        pr "  Py_INCREF (%s);\n" n;
        pr "  completion_user_data->buf = %s;\n" n;
+       pr "  completion_user_data->view = %s_view;\n" n;
     | _ -> ()
   ) args;
 
-  (* Call the underlying C function. *)
+  (* Call the underlying C function without holding the GIL, so
+   * that other Python threads can run while it blocks.
+   *)
+  pr "  Py_BEGIN_ALLOW_THREADS\n";
   pr "  ret = nbd_%s (h" name;
   List.iter (
     function
@@ -461,7 +514,7 @@ let print_python_binding name { args; optargs; ret; may_set_error } =
     | BytesIn (n, _) -> pr ", %s.buf, %s.len" n n
     | BytesOut (n, count) -> pr ", %s, %s" n count
     | BytesPersistIn (n, _)
-    | BytesPersistOut (n, _) -> pr ", %s_buf->data, %s_buf->len" n n
+    | BytesPersistOut (n, _) -> pr ", %s_view.buf, %s_view.len" n n
     | Closure { cbname } -> pr ", %s" cbname
     | Enum (n, _) -> pr ", %s" n
     | Flags (n, _) -> pr ", %s_u32" n
@@ -481,6 +534,7 @@ let print_python_binding name { args; optargs; ret; may_set_error } =
     | OFlags (n, _) -> pr ", %s_u32" n
   ) optargs;
   pr ");\n";
+  pr "  Py_END_ALLOW_THREADS\n";
   if may_set_error then (
     pr "  if (ret == %s) {\n"
       (match C.errcode_of_ret ret with Some s -> s | None -> assert false);
@@ -582,6 +636,7 @@ let generate_python_methods_c () =
   pr "struct user_data {\n";
   pr "  PyObject *fn;    /* Optional pointer to Python function. */\n";
   pr "  PyObject *buf;   /* Optional pointer to persistent buffer. */\n";
+  pr "  Py_buffer view;  /* View of persistent buffer, if buf is set. */\n";
   pr "};\n";
   pr "\n";
   pr "static struct user_data *\n";
@@ -599,11 +654,16 @@ let generate_python_methods_c () =
   pr "free_user_data (void *user_data)\n";
   pr "{\n";
   pr "  struct user_data *data = user_data;\n";
+  pr "  PyGILState_STATE py_save;\n";
   pr "\n";
+  pr "  py_save = PyGILState_Ensure ();\n";
   pr "  if (data->fn != NULL)\n";
   pr "    Py_DECREF (data->fn);\n";
-  pr "  if (data->buf != NULL)\n";
+  pr "  if (data->buf != NULL) {\n";
+  pr "    PyBuffer_Release (&data->view);\n";
   pr "    Py_DECREF (data->buf);\n";
+  pr "  }\n";
+  pr "  PyGILState_Release (py_save);\n";
   pr "  free (data);\n";
   pr "}\n";
   pr "\n";
@@ -611,7 +671,8 @@ let generate_python_methods_c () =
   List.iter print_python_closure_wrapper all_closures;
   List.iter (
     fun (name, fn) ->
-      print_python_binding name fn
+      if not (List.mem name hand_written_calls) then
+        print_python_binding name fn
   ) handle_calls
 
 let py_fn_rex = Str.regexp "L<nbd_\\([a-z0-9_]+\\)(3)>"
@@ -742,6 +803,16 @@ class Buffer (object):
         '''
         return libnbdmod.aio_buffer_is_zero (self._o, offset, size)
 
+def _buffer_object (buf):
+    '''
+    Persistent buffers can be nbd.Buffer objects or any object
+    supporting the buffer protocol (bytearray, memoryview, numpy
+    arrays, mmap, ...), which libnbd uses in place without copying.
+    '''
+    if isinstance (buf, Buffer):
+        return buf._o
+    return buf
+
 class NBD (object):
     '''NBD handle'''
 
@@ -753,6 +824,22 @@ class NBD (object):
         '''close the NBD handle and underlying connection'''
         libnbdmod.close (self._o)
 
+    def poll_completions (self, max=64, timeout=-1):
+        '''
+        Retire up to max completed commands and return a list of
+        (cookie, errnum) tuples, where errnum is 0 if the command
+        succeeded or the errno of the failure.  If no command has
+        completed yet this waits for up to timeout milliseconds
+        (-1 means forever) like nbd.poll.  An empty list is returned
+        if nothing completed or no commands are in flight.
+
+        This is much cheaper than calling nbd.aio_command_completed
+        for each cookie or using a completion callback per command.
+        Commands which were retired by their completion callback are
+        not returned.
+        '''
+        return libnbdmod.poll_completions (self._o, max, timeout)
+
 ";
 
   List.iter (
@@ -763,8 +850,9 @@ class NBD (object):
           | Bool n -> n, None, None
           | BytesIn (n, _) -> n, None, None
           | BytesOut (_, count) -> count, None, None
-          | BytesPersistIn (n, _) -> n, None, Some (sprintf "%s._o" n)
-          | BytesPersistOut (n, _) -> n, None, Some (sprintf "%s._o" n)
+          | BytesPersistIn (n, _)
+          | BytesPersistOut (n, _) ->
+             n, None, Some (sprintf "_buffer_object (%s)" n)
           | Closure { cbname } -> cbname, None, None
           | Enum (n, _) -> n, None, None
           | Flags (n, _) -> n, None, None
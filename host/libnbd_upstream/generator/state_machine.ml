@@ -273,6 +273,7 @@ and newstyle_state_machine = [
    * state needs to run and skip to the next state in the list if not.
    *)
   Group ("OPT_STARTTLS", newstyle_opt_starttls_state_machine);
+  Group ("OPT_PIPELINE", newstyle_opt_pipeline_state_machine);
   Group ("OPT_STRUCTURED_REPLY", newstyle_opt_structured_reply_state_machine);
   Group ("OPT_SET_META_CONTEXT", newstyle_opt_set_meta_context_state_machine);
   Group ("OPT_GO", newstyle_opt_go_state_machine);
@@ -341,6 +342,26 @@ and newstyle_opt_starttls_state_machine = [
   };
 ]
 
+(* Fixed newstyle pipelined options.  If enabled, the options sent by
+ * the following groups are all sent in one go, and those groups only
+ * read the replies.
+ *)
+and newstyle_opt_pipeline_state_machine = [
+  State {
+    default_state with
+    name = "START";
+    comment = "Try to send the remaining newstyle options together";
+    external_events = [];
+  };
+
+  State {
+    default_state with
+    name = "SEND";
+    comment = "Send the pipelined newstyle options";
+    external_events = [ NotifyWrite, "" ];
+  };
+]
+
 (* Fixed newstyle NBD_OPT_STRUCTURED_REPLY option. *)
 and newstyle_opt_structured_reply_state_machine = [
   State {
@@ -575,7 +596,7 @@ and issue_command_state_machine = [
   State {
     default_state with
     name = "SEND_REQUEST";
-    comment = "Sending a request to the remote server";
+    comment = "Sending requests and write payloads to the remote server";
     external_events = [ NotifyWrite, "";
                         NotifyRead, "PAUSE_SEND_REQUEST" ];
   };
@@ -587,28 +608,6 @@ and issue_command_state_machine = [
     external_events = [];
   };
 
-  State {
-    default_state with
-    name = "PREPARE_WRITE_PAYLOAD";
-    comment = "Prepare the write payload to send to the remote server";
-    external_events = [];
-  };
-
-  State {
-    default_state with
-    name = "SEND_WRITE_PAYLOAD";
-    comment = "Sending the write payload to the remote server";
-    external_events = [ NotifyWrite, "";
-                        NotifyRead, "PAUSE_WRITE_PAYLOAD" ];
-  };
-
-  State {
-    default_state with
-    name = "PAUSE_WRITE_PAYLOAD";
-    comment = "Interrupt write payload to receive an earlier command's reply";
-    external_events = [];
-  };
-
   State {
     default_state with
     name = "SEND_WRITE_SHUTDOWN";
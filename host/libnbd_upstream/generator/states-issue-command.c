@@ -16,72 +16,116 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <assert.h>
+
 /* State machine for issuing commands (requests) to the server. */
 
+/* Return the number of elements of h->wiov used by a command. */
+static size_t
+request_iovs (const struct command *cmd)
+{
+  return cmd->type == NBD_CMD_WRITE && cmd->count > 0 ? 2 : 1;
+}
+
+/* Move commands which have been completely sent, including the
+ * payload of a write, to cmds_in_flight, since the server may reply
+ * to them at any time.  The last command of the batch is always left
+ * at the front of cmds_to_issue, for SEND_WRITE_SHUTDOWN and FINISH.
+ */
+static void
+issue_sent_requests (struct nbd_handle *h)
+{
+  struct command *cmd;
+  size_t n;
+
+  while (h->nr_requests_issued < h->nr_requests - 1) {
+    cmd = h->cmds_to_issue;
+    assert (cmd != NULL && cmd->next != NULL);
+    assert (cmd->cookie ==
+            be64toh (h->request[h->nr_requests_issued].handle));
+    n = request_iovs (cmd);
+    if (h->wiov_issued + n > h->wiov_next)
+      break;
+    h->cmds_to_issue = cmd->next;
+    cmd->next = NULL;
+    nbd_internal_command_table_insert (&h->cmds_in_flight, cmd);
+    h->wiov_issued += n;
+    h->nr_requests_issued++;
+  }
+}
+
 STATE_MACHINE {
  ISSUE_COMMAND.START:
-  struct command *cmd;
+  struct command *cmd, *last;
+  size_t i;
 
   assert (h->cmds_to_issue != NULL);
-  cmd = h->cmds_to_issue;
 
   /* Were we interrupted by reading a reply to an earlier command? If
    * so, we can only get back here after a non-blocking jaunt through
    * the REPLY engine, which means we are unlikely to be unblocked for
    * writes yet; we want to advance back to the correct state but
-   * without trying a send_from_wbuf that will likely return 1.
+   * without trying a send_from_wiov that will likely return 1.
    */
-  if (h->in_write_shutdown)
+  if (h->in_write_shutdown) {
     SET_NEXT_STATE_AND_BLOCK (%SEND_WRITE_SHUTDOWN);
-  else if (h->wlen) {
-    if (h->in_write_payload)
-      SET_NEXT_STATE_AND_BLOCK (%SEND_WRITE_PAYLOAD);
-    else
-      SET_NEXT_STATE_AND_BLOCK (%SEND_REQUEST);
+    return 0;
+  }
+  if (h->wlen) {
+    SET_NEXT_STATE_AND_BLOCK (%SEND_REQUEST);
     return 0;
   }
 
-  h->request.magic = htobe32 (NBD_REQUEST_MAGIC);
-  h->request.flags = htobe16 (cmd->flags);
-  h->request.type = htobe16 (cmd->type);
-  h->request.handle = htobe64 (cmd->cookie);
-  h->request.offset = htobe64 (cmd->offset);
-  h->request.count = htobe32 ((uint32_t) cmd->count);
-  h->wbuf = &h->request;
-  h->wlen = sizeof (h->request);
-  if (cmd->type == NBD_CMD_WRITE || cmd->next)
+  /* Put as many queued commands as possible, with the payloads of
+   * writes, into h->wiov, so that a burst of commands (for example
+   * one queued between nbd_aio_begin_batch and nbd_aio_end_batch) is
+   * sent with a single call.  The batch ends after a disconnect.
+   */
+  i = 0;
+  h->nr_wiov = 0;
+  h->wlen = 0;
+  cmd = h->cmds_to_issue;
+  do {
+    h->request[i].magic = htobe32 (NBD_REQUEST_MAGIC);
+    h->request[i].flags = htobe16 (cmd->flags);
+    h->request[i].type = htobe16 (cmd->type);
+    h->request[i].handle = htobe64 (cmd->cookie);
+    h->request[i].offset = htobe64 (cmd->offset);
+    h->request[i].count = htobe32 ((uint32_t) cmd->count);
+    h->wiov[h->nr_wiov].iov_base = &h->request[i];
+    h->wiov[h->nr_wiov].iov_len = sizeof h->request[i];
+    h->nr_wiov++;
+    h->wlen += sizeof h->request[i];
+    if (request_iovs (cmd) == 2) {
+      h->wiov[h->nr_wiov].iov_base = cmd->data;
+      h->wiov[h->nr_wiov].iov_len = cmd->count;
+      h->nr_wiov++;
+      h->wlen += cmd->count;
+    }
+    i++;
+    last = cmd;
+    cmd = cmd->next;
+  } while (cmd != NULL && i < MAX_ISSUE_BATCH &&
+           last->type != NBD_CMD_DISC);
+  h->nr_requests = i;
+  h->nr_requests_issued = 0;
+  h->wiov_next = h->wiov_issued = 0;
+  if (last->next)
     h->wflags = MSG_MORE;
   SET_NEXT_STATE (%SEND_REQUEST);
   return 0;
 
  ISSUE_COMMAND.SEND_REQUEST:
-  switch (send_from_wbuf (h)) {
+  switch (send_from_wiov (h)) {
   case -1: SET_NEXT_STATE (%.DEAD); return 0;
-  case 0:  SET_NEXT_STATE (%PREPARE_WRITE_PAYLOAD);
+  case 1:  return 0;
   }
-  return 0;
-
- ISSUE_COMMAND.PAUSE_SEND_REQUEST:
-  assert (h->wlen);
-  assert (h->cmds_to_issue != NULL);
-  h->in_write_payload = false;
-  SET_NEXT_STATE (%^REPLY.START);
-  return 0;
 
- ISSUE_COMMAND.PREPARE_WRITE_PAYLOAD:
-  struct command *cmd;
-
-  assert (h->cmds_to_issue != NULL);
-  cmd = h->cmds_to_issue;
-  assert (cmd->cookie == be64toh (h->request.handle));
-  if (cmd->type == NBD_CMD_WRITE) {
-    h->wbuf = cmd->data;
-    h->wlen = cmd->count;
-    if (cmd->next && cmd->count < 64 * 1024)
-      h->wflags = MSG_MORE;
-    SET_NEXT_STATE (%SEND_WRITE_PAYLOAD);
-  }
-  else if (cmd->type == NBD_CMD_DISC) {
+  issue_sent_requests (h);
+  assert (h->nr_requests_issued == h->nr_requests - 1);
+  assert (h->cmds_to_issue->cookie ==
+          be64toh (h->request[h->nr_requests-1].handle));
+  if (h->cmds_to_issue->type == NBD_CMD_DISC) {
     h->in_write_shutdown = true;
     SET_NEXT_STATE (%SEND_WRITE_SHUTDOWN);
   }
@@ -89,17 +133,10 @@ STATE_MACHINE {
     SET_NEXT_STATE (%FINISH);
   return 0;
 
- ISSUE_COMMAND.SEND_WRITE_PAYLOAD:
-  switch (send_from_wbuf (h)) {
-  case -1: SET_NEXT_STATE (%.DEAD); return 0;
-  case 0:  SET_NEXT_STATE (%FINISH);
-  }
-  return 0;
-
- ISSUE_COMMAND.PAUSE_WRITE_PAYLOAD:
+ ISSUE_COMMAND.PAUSE_SEND_REQUEST:
   assert (h->wlen);
   assert (h->cmds_to_issue != NULL);
-  h->in_write_payload = true;
+  issue_sent_requests (h);
   SET_NEXT_STATE (%^REPLY.START);
   return 0;
 
@@ -119,12 +156,12 @@ STATE_MACHINE {
   assert (!h->wlen);
   assert (h->cmds_to_issue != NULL);
   cmd = h->cmds_to_issue;
-  assert (cmd->cookie == be64toh (h->request.handle));
+  assert (cmd->cookie == be64toh (h->request[h->nr_requests-1].handle));
   h->cmds_to_issue = cmd->next;
   if (h->cmds_to_issue_tail == cmd)
     h->cmds_to_issue_tail = NULL;
-  cmd->next = h->cmds_in_flight;
-  h->cmds_in_flight = cmd;
+  cmd->next = NULL;
+  nbd_internal_command_table_insert (&h->cmds_in_flight, cmd);
   SET_NEXT_STATE (%.READY);
   return 0;
 
@@ -20,6 +20,18 @@
 
 STATE_MACHINE {
  NEWSTYLE.OPT_GO.START:
+  /* The request was already sent by OPT_PIPELINE.  This is the last
+   * pipelined option, and the fallback to NBD_OPT_EXPORT_NAME sends
+   * its own request.
+   */
+  if (h->opts_pipelined) {
+    h->opts_pipelined = false;
+    h->rbuf = &h->sbuf;
+    h->rlen = sizeof h->sbuf.or.option_reply;
+    SET_NEXT_STATE (%RECV_REPLY);
+    return 0;
+  }
+
   h->sbuf.option.version = htobe64 (NBD_NEW_VERSION);
   h->sbuf.option.option = htobe32 (NBD_OPT_GO);
   h->sbuf.option.optlen =
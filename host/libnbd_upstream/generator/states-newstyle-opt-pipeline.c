@@ -0,0 +1,137 @@
+/* nbd client library in userspace: state machine
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* State machine for sending the remaining options in one go. */
+
+/* True if NBD_OPT_SET_META_CONTEXT is sent together with the other
+ * options.  Without pipelining the option is only sent once the
+ * server has agreed to structured replies, but here we cannot wait
+ * for that, so it is sent whenever structured replies are requested.
+ */
+static bool
+pipeline_meta_context (struct nbd_handle *h)
+{
+  return h->request_sr &&
+    h->request_meta_contexts != NULL &&
+    nbd_internal_string_list_length (h->request_meta_contexts) > 0;
+}
+
+static void
+append_to_opts (char **p, const void *data, size_t len)
+{
+  memcpy (*p, data, len);
+  *p += len;
+}
+
+/* Build the NBD_OPT_STRUCTURED_REPLY, NBD_OPT_SET_META_CONTEXT and
+ * NBD_OPT_GO requests in h->opts_buf, exactly as the following
+ * groups would send them one at a time.
+ */
+static int
+build_pipelined_options (struct nbd_handle *h)
+{
+  const uint32_t exportnamelen = strlen (h->export_name);
+  struct nbd_new_option option;
+  size_t i, nr_queries = 0;
+  uint32_t len = 0, metalen = 0, be32;
+  uint16_t nrinfos = 0;
+  char *p;
+
+  if (h->request_sr)
+    len += sizeof option;
+  if (pipeline_meta_context (h)) {
+    metalen = 4 /* exportname len */ + exportnamelen + 4 /* nr queries */;
+    nr_queries = nbd_internal_string_list_length (h->request_meta_contexts);
+    for (i = 0; i < nr_queries; ++i)
+      metalen += 4 /* length of query */ + strlen (h->request_meta_contexts[i]);
+    len += sizeof option + metalen;
+  }
+  len += sizeof option + 4 + exportnamelen + 2 /* nrinfos */;
+
+  free (h->opts_buf);
+  h->opts_buf = malloc (len);
+  if (h->opts_buf == NULL) {
+    set_error (errno, "malloc");
+    return -1;
+  }
+  p = h->opts_buf;
+
+  option.version = htobe64 (NBD_NEW_VERSION);
+  if (h->request_sr) {
+    option.option = htobe32 (NBD_OPT_STRUCTURED_REPLY);
+    option.optlen = htobe32 (0);
+    append_to_opts (&p, &option, sizeof option);
+  }
+  if (pipeline_meta_context (h)) {
+    option.option = htobe32 (NBD_OPT_SET_META_CONTEXT);
+    option.optlen = htobe32 (metalen);
+    append_to_opts (&p, &option, sizeof option);
+    be32 = htobe32 (exportnamelen);
+    append_to_opts (&p, &be32, sizeof be32);
+    append_to_opts (&p, h->export_name, exportnamelen);
+    be32 = htobe32 (nr_queries);
+    append_to_opts (&p, &be32, sizeof be32);
+    for (i = 0; i < nr_queries; ++i) {
+      const char *query = h->request_meta_contexts[i];
+
+      be32 = htobe32 (strlen (query));
+      append_to_opts (&p, &be32, sizeof be32);
+      append_to_opts (&p, query, strlen (query));
+    }
+  }
+  option.option = htobe32 (NBD_OPT_GO);
+  option.optlen = htobe32 (4 + exportnamelen + 2);
+  append_to_opts (&p, &option, sizeof option);
+  be32 = htobe32 (exportnamelen);
+  append_to_opts (&p, &be32, sizeof be32);
+  append_to_opts (&p, h->export_name, exportnamelen);
+  append_to_opts (&p, &nrinfos, sizeof nrinfos);
+  assert (p == h->opts_buf + len);
+
+  h->wbuf = h->opts_buf;
+  h->wlen = len;
+  return 0;
+}
+
+STATE_MACHINE {
+ NEWSTYLE.OPT_PIPELINE.START:
+  h->opts_pipelined = false;
+  if (!h->pipeline_handshake) {
+    SET_NEXT_STATE (%^OPT_STRUCTURED_REPLY.START);
+    return 0;
+  }
+
+  if (build_pipelined_options (h) == -1) {
+    SET_NEXT_STATE (%.DEAD);
+    return 0;
+  }
+  SET_NEXT_STATE (%SEND);
+  return 0;
+
+ NEWSTYLE.OPT_PIPELINE.SEND:
+  switch (send_from_wbuf (h)) {
+  case -1: SET_NEXT_STATE (%.DEAD); return 0;
+  case 0:
+    free (h->opts_buf);
+    h->opts_buf = NULL;
+    h->opts_pipelined = true;
+    SET_NEXT_STATE (%^OPT_STRUCTURED_REPLY.START);
+  }
+  return 0;
+
+} /* END STATE MACHINE */
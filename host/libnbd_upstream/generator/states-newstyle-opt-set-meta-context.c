@@ -23,6 +23,19 @@ STATE_MACHINE {
   size_t i, nr_queries;
   uint32_t len;
 
+  /* If the request was already sent by OPT_PIPELINE, the server
+   * replies to it even if it did not agree to structured replies.
+   */
+  if (h->opts_pipelined) {
+    if (!pipeline_meta_context (h)) {
+      SET_NEXT_STATE (%^OPT_GO.START);
+      return 0;
+    }
+    assert (h->meta_contexts == NULL);
+    SET_NEXT_STATE (%PREPARE_FOR_REPLY);
+    return 0;
+  }
+
   /* If the server doesn't support SRs then we must skip this group.
    * Also we skip the group if the client didn't request any metadata
    * contexts.
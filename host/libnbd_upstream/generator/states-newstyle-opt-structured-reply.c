@@ -25,6 +25,14 @@ STATE_MACHINE {
     return 0;
   }
 
+  /* The request was already sent by OPT_PIPELINE. */
+  if (h->opts_pipelined) {
+    h->rbuf = &h->sbuf;
+    h->rlen = sizeof h->sbuf.or.option_reply;
+    SET_NEXT_STATE (%RECV_REPLY);
+    return 0;
+  }
+
   h->sbuf.option.version = htobe64 (NBD_NEW_VERSION);
   h->sbuf.option.option = htobe32 (NBD_OPT_STRUCTURED_REPLY);
   h->sbuf.option.optlen = htobe32 (0);
@@ -38,9 +38,14 @@ STATE_MACHINE {
 
   cmd->error = nbd_internal_errno_of_nbd_error (error);
   if (cmd->error == 0 && cmd->type == NBD_CMD_READ) {
+    /* A simple reply always carries the whole buffer. */
+    if (nbd_internal_command_add_range (cmd, 0, cmd->count) == -1) {
+      set_error (errno, "realloc");
+      SET_NEXT_STATE (%.DEAD);
+      return 0;
+    }
     h->rbuf = cmd->data;
     h->rlen = cmd->count;
-    cmd->data_seen = true;
     SET_NEXT_STATE (%RECV_READ_PAYLOAD);
   }
   else {
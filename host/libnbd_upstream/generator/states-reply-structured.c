@@ -354,7 +354,6 @@ STATE_MACHINE {
     assert (cmd); /* guaranteed by CHECK */
 
     assert (cmd->data && cmd->type == NBD_CMD_READ);
-    cmd->data_seen = true;
 
     /* Length of the data following. */
     length -= 8;
@@ -390,6 +389,10 @@ STATE_MACHINE {
     offset = be64toh (h->sbuf.sr.payload.offset_data.offset);
 
     assert (cmd); /* guaranteed by CHECK */
+    if (nbd_internal_command_add_range (cmd, offset - cmd->offset,
+                                        length - sizeof offset) == -1 &&
+        cmd->error == 0)
+      cmd->error = ENOMEM;
     if (CALLBACK_IS_NOT_NULL (cmd->cb.fn.chunk)) {
       int error = cmd->error;
 
@@ -422,7 +425,6 @@ STATE_MACHINE {
     assert (cmd); /* guaranteed by CHECK */
 
     assert (cmd->data && cmd->type == NBD_CMD_READ);
-    cmd->data_seen = true;
 
     /* Is the data within bounds? */
     if (! structured_reply_in_bounds (offset, length, cmd)) {
@@ -437,6 +439,9 @@ STATE_MACHINE {
      * them as an extension, and this works even when length == 0.
      */
     memset (cmd->data + offset, 0, length);
+    if (nbd_internal_command_add_range (cmd, offset, length) == -1 &&
+        cmd->error == 0)
+      cmd->error = ENOMEM;
     if (CALLBACK_IS_NOT_NULL (cmd->cb.fn.chunk)) {
       int error = cmd->error;
 
@@ -52,11 +52,12 @@ STATE_MACHINE {
   }
 
   /* This state is entered when a read notification is received in the
-   * READY state.  Therefore we know the socket is readable here.
-   * Reading a zero length now would indicate that the socket has been
-   * closed by the server and so we should jump to the CLOSED state.
-   * However recv_into_rbuf will fail in this case, so test it as a
-   * special case.
+   * READY state, or when there is data waiting in the receive buffer.
+   * Therefore we know there is something to read here.  Reading a
+   * zero length now would indicate that the socket has been closed by
+   * the server and so we should jump to the CLOSED state.  However
+   * recv_into_rbuf will fail in this case, so test it as a special
+   * case.
    */
   ssize_t r;
 
@@ -67,35 +68,45 @@ STATE_MACHINE {
   assert (h->reply_cmd == NULL);
   assert (h->rlen == 0);
 
+  /* The receive buffer is allocated on the first reply, so it is
+   * not used during the handshake.
+   */
+  if (h->rbuffer == NULL) {
+    h->rbuffer = malloc (RECV_BUFFER_SIZE);
+    if (h->rbuffer == NULL) {
+      SET_NEXT_STATE (%.DEAD);
+      set_error (errno, "malloc");
+      return 0;
+    }
+  }
+
   h->rbuf = &h->sbuf;
   h->rlen = sizeof h->sbuf.simple_reply;
 
-  r = h->sock->ops->recv (h, h->sock, h->rbuf, h->rlen);
-  if (r == -1) {
-    /* This should never happen because when we enter this state we
-     * should have notification that the socket is ready to read.
-     * However if for some reason it does happen, ignore it - we will
-     * reenter this same state again next time the socket is ready to
-     * read.
-     */
-    if (errno == EAGAIN || errno == EWOULDBLOCK)
+  if (h->rbuffer_start == h->rbuffer_end) {
+    r = fill_rbuffer (h);
+    if (r == -1) {
+      /* This can happen with TLS when the socket was readable but
+       * only contained a TLS handshake message such as a key update.
+       * Wait in READY, and since rlen is set we will resume in
+       * RECV_REPLY next time the socket is ready to read.
+       */
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        SET_NEXT_STATE (%.READY);
+        return 0;
+      }
+
+      /* sock->ops->recv called set_error already. */
+      SET_NEXT_STATE (%.DEAD);
       return 0;
-
-    /* sock->ops->recv called set_error already. */
-    SET_NEXT_STATE (%.DEAD);
-    return 0;
-  }
-  if (r == 0) {
-    SET_NEXT_STATE (%.CLOSED);
-    return 0;
+    }
+    if (r == 0) {
+      SET_NEXT_STATE (%.CLOSED);
+      return 0;
+    }
   }
-#ifdef DUMP_PACKETS
-  if (h->rbuf != NULL)
-    nbd_internal_hexdump (h->rbuf, r, stderr);
-#endif
 
-  h->rbuf += r;
-  h->rlen -= r;
+  copy_from_rbuffer (h);
   SET_NEXT_STATE (%RECV_REPLY);
   return 0;
 
@@ -130,10 +141,7 @@ STATE_MACHINE {
    */
   cookie = be64toh (h->sbuf.simple_reply.handle);
   /* Find the command amongst the commands in flight. */
-  for (cmd = h->cmds_in_flight; cmd != NULL; cmd = cmd->next) {
-    if (cmd->cookie == cookie)
-      break;
-  }
+  cmd = nbd_internal_command_table_lookup (&h->cmds_in_flight, cookie);
   if (cmd == NULL) {
     /* An unexpected structured reply could be skipped, since it
      * includes a length; similarly an unexpected simple reply can be
@@ -149,27 +157,34 @@ STATE_MACHINE {
   return 0;
 
  REPLY.FINISH_COMMAND:
-  struct command *prev_cmd, *cmd;
-  uint64_t cookie;
+  struct command *cmd;
   bool retire;
 
-  /* NB: This works for both simple and structured replies because the
+  /* The command was found by CHECK_SIMPLE_OR_STRUCTURED_REPLY.
+   *
+   * NB: This works for both simple and structured replies because the
    * handle (our cookie) is stored at the same offset.
    */
-  cookie = be64toh (h->sbuf.simple_reply.handle);
-  /* Find the command amongst the commands in flight. */
-  for (cmd = h->cmds_in_flight, prev_cmd = NULL;
-       cmd != NULL;
-       prev_cmd = cmd, cmd = cmd->next) {
-    if (cmd->cookie == cookie)
-      break;
-  }
+  cmd = h->reply_cmd;
   assert (cmd != NULL);
-  assert (h->reply_cmd == cmd);
+  assert (cmd->cookie == be64toh (h->sbuf.simple_reply.handle));
   h->reply_cmd = NULL;
   retire = cmd->type == NBD_CMD_DISC;
 
+  /* For structured reads, zero any part of the buffer that the server
+   * did not send, and fail the read if the server claimed success
+   * without sending all of it.  The spec states that a 0-length read
+   * request is unspecified; but it is easy enough to treat it as
+   * successful as an extension.
+   */
+  if (cmd->type == NBD_CMD_READ && h->structured_replies &&
+      !nbd_internal_command_zero_gaps (cmd) && cmd->error == 0) {
+    debug (h, "server did not send all the data for a read");
+    cmd->error = EIO;
+  }
+
   /* Notify the user */
+  nbd_internal_command_deliver_buffer (cmd, cmd->error);
   if (CALLBACK_IS_NOT_NULL (cmd->cb.completion)) {
     int error = cmd->error;
     int r;
@@ -188,13 +203,10 @@ STATE_MACHINE {
   }
 
   /* Move it to the end of the cmds_done list. */
-  if (prev_cmd != NULL)
-    prev_cmd->next = cmd->next;
-  else
-    h->cmds_in_flight = cmd->next;
+  nbd_internal_command_table_remove (&h->cmds_in_flight, cmd);
   cmd->next = NULL;
   if (retire)
-    nbd_internal_retire_and_free_command (cmd);
+    nbd_internal_retire_and_free_command (h, cmd);
   else {
     if (h->cmds_done_tail != NULL)
       h->cmds_done_tail = h->cmds_done_tail->next = cmd;
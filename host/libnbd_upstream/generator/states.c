@@ -38,6 +38,46 @@
 /* Uncomment this to dump received protocol packets to stderr. */
 /*#define DUMP_PACKETS 1*/
 
+/* Receive more data from the server into h->rbuffer, which must be
+ * empty.  Returns the result of sock->ops->recv.
+ */
+static ssize_t
+fill_rbuffer (struct nbd_handle *h)
+{
+  ssize_t r;
+
+  assert (h->rbuffer != NULL);
+  assert (h->rbuffer_start == h->rbuffer_end);
+
+  h->rbuffer_start = h->rbuffer_end = 0;
+  r = h->sock->ops->recv (h, h->sock, h->rbuffer, RECV_BUFFER_SIZE);
+  if (r > 0) {
+#ifdef DUMP_PACKETS
+    nbd_internal_hexdump (h->rbuffer, r, stderr);
+#endif
+    h->rbuffer_end = r;
+  }
+  return r;
+}
+
+/* Copy as much as possible of the data waiting in h->rbuffer to
+ * h->rbuf.
+ */
+static void
+copy_from_rbuffer (struct nbd_handle *h)
+{
+  size_t n = h->rbuffer_end - h->rbuffer_start;
+
+  if (n > h->rlen)
+    n = h->rlen;
+  if (h->rbuf) {
+    memcpy (h->rbuf, h->rbuffer + h->rbuffer_start, n);
+    h->rbuf += n;
+  }
+  h->rbuffer_start += n;
+  h->rlen -= n;
+}
+
 static int
 recv_into_rbuf (struct nbd_handle *h)
 {
@@ -49,6 +89,35 @@ recv_into_rbuf (struct nbd_handle *h)
   if (h->rlen == 0)
     return 0;                   /* move to next state */
 
+  /* Use up any data already received into the buffer first. */
+  if (h->rbuffer_start < h->rbuffer_end) {
+    copy_from_rbuffer (h);
+    if (h->rlen == 0)
+      return 0;                 /* move to next state */
+  }
+
+  /* Small reads go through the buffer, so that the following replies
+   * are received by the same recv call.  Large reads bypass it.
+   */
+  if (h->rbuffer && h->rlen < RECV_BUFFER_BYPASS) {
+    r = fill_rbuffer (h);
+    if (r == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;               /* more data */
+      /* sock->ops->recv called set_error already. */
+      return -1;
+    }
+    if (r == 0) {
+      set_error (0, "recv: server disconnected unexpectedly");
+      return -1;
+    }
+    copy_from_rbuffer (h);
+    if (h->rlen == 0)
+      return 0;                 /* move to next state */
+    else
+      return 1;                 /* more data */
+  }
+
   /* As a special case h->rbuf is allowed to be NULL, meaning
    * throw away the data.
    */
@@ -111,6 +180,46 @@ send_from_wbuf (struct nbd_handle *h)
   return 0;                     /* move to next state */
 }
 
+/* Send as much as possible of h->wiov, starting at h->wiov_next.
+ * h->wlen is the number of bytes left to send.
+ */
+static int
+send_from_wiov (struct nbd_handle *h)
+{
+  struct iovec *iov;
+  ssize_t r;
+
+  if (h->wlen == 0)
+    goto next_state;
+  r = h->sock->ops->sendv (h, h->sock, &h->wiov[h->wiov_next],
+                           h->nr_wiov - h->wiov_next, h->wflags);
+  if (r == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 1;                 /* more data */
+    /* sock->ops->sendv called set_error already. */
+    return -1;
+  }
+  h->wlen -= r;
+  while (r > 0) {
+    iov = &h->wiov[h->wiov_next];
+    if ((size_t) r < iov->iov_len) {
+      iov->iov_base = (char *) iov->iov_base + r;
+      iov->iov_len -= r;
+      break;
+    }
+    r -= iov->iov_len;
+    h->wiov_next++;
+  }
+  if (h->wlen == 0)
+    goto next_state;
+  else
+    return 1;                   /* more data */
+
+ next_state:
+  h->wflags = 0;                /* reset this when moving to next state */
+  return 0;                     /* move to next state */
+}
+
 /* Forcefully fail any remaining in-flight commands in list */
 void abort_commands (struct nbd_handle *h,
                      struct command **list)
@@ -121,6 +230,8 @@ void abort_commands (struct nbd_handle *h,
     bool retire = cmd->type == NBD_CMD_DISC;
 
     next = cmd->next;
+    nbd_internal_command_deliver_buffer (cmd,
+                                         cmd->error ? cmd->error : ENOTCONN);
     if (CALLBACK_IS_NOT_NULL (cmd->cb.completion)) {
       int error = cmd->error ? cmd->error : ENOTCONN;
       int r;
@@ -140,7 +251,7 @@ void abort_commands (struct nbd_handle *h,
     if (cmd->error == 0)
       cmd->error = ENOTCONN;
     if (retire)
-      nbd_internal_retire_and_free_command (cmd);
+      nbd_internal_retire_and_free_command (h, cmd);
     else {
       cmd->next = NULL;
       if (h->cmds_done_tail)
@@ -160,16 +271,24 @@ STATE_MACHINE {
     SET_NEXT_STATE (%ISSUE_COMMAND.START);
   else {
     assert (h->sock);
-    if (h->sock->ops->pending && h->sock->ops->pending (h->sock))
+    /* Replies may already be waiting in the receive buffer or in
+     * the TLS layer, in which case the socket may not become
+     * readable.
+     */
+    if (h->rbuffer_start < h->rbuffer_end ||
+        (h->sock->ops->pending && h->sock->ops->pending (h->sock)))
       SET_NEXT_STATE (%REPLY.START);
   }
   return 0;
 
  DEAD:
+  struct command *cmds;
+
   /* The caller should have used set_error() before reaching here */
   assert (nbd_get_error ());
   abort_commands (h, &h->cmds_to_issue);
-  abort_commands (h, &h->cmds_in_flight);
+  cmds = nbd_internal_command_table_take_all (&h->cmds_in_flight);
+  abort_commands (h, &cmds);
   h->in_flight = 0;
   if (h->sock) {
     h->sock->ops->close (h->sock);
@@ -178,8 +297,11 @@ STATE_MACHINE {
   return -1;
 
  CLOSED:
+  struct command *cmds;
+
   abort_commands (h, &h->cmds_to_issue);
-  abort_commands (h, &h->cmds_in_flight);
+  cmds = nbd_internal_command_table_take_all (&h->cmds_in_flight);
+  abort_commands (h, &cmds);
   h->in_flight = 0;
   if (h->sock) {
     h->sock->ops->close (h->sock);
@@ -29,21 +29,42 @@
 
 /* Internal function which retires and frees a command. */
 void
-nbd_internal_retire_and_free_command (struct command *cmd)
+nbd_internal_retire_and_free_command (struct nbd_handle *h,
+                                      struct command *cmd)
 {
   /* Free the callbacks. */
   if (cmd->type == NBD_CMD_BLOCK_STATUS)
     FREE_CALLBACK (cmd->cb.fn.extent);
   if (cmd->type == NBD_CMD_READ)
     FREE_CALLBACK (cmd->cb.fn.chunk);
+  if (cmd->cb.registered)
+    FREE_CALLBACK (cmd->cb.buffer);
   FREE_CALLBACK (cmd->cb.completion);
 
-  free (cmd);
+  nbd_internal_free_command (h, cmd);
+}
+
+/* With multi-conn the extra connections have their own file
+ * descriptors which a caller's main loop would never see, so commands
+ * sent on them would never complete.  Such callers must use the _n
+ * variants below.
+ */
+static int
+check_single_conn (struct nbd_handle *h)
+{
+  if (h->nr_conns > 0) {
+    set_error (EINVAL, "handle has %zu connections, "
+               "use the nbd_aio_*_n calls instead", h->nr_conns + 1);
+    return -1;
+  }
+  return 0;
 }
 
 int
 nbd_unlocked_aio_get_fd (struct nbd_handle *h)
 {
+  if (check_single_conn (h) == -1)
+    return -1;
   if (!h->sock) {
     set_error (EINVAL, "connection is not in a connected state");
     return -1;
@@ -51,49 +72,143 @@ nbd_unlocked_aio_get_fd (struct nbd_handle *h)
   return h->sock->ops->get_fd (h->sock);
 }
 
+/* Return connection i of the handle, where 0 is the handle itself and
+ * 1 to h->nr_conns are the extra connections opened for multi-conn.
+ */
+static struct nbd_handle *
+get_conn (struct nbd_handle *h, size_t i)
+{
+  return i == 0 ? h : h->conns[i-1];
+}
+
 int
 nbd_unlocked_aio_notify_read (struct nbd_handle *h)
 {
+  if (check_single_conn (h) == -1)
+    return -1;
   return nbd_internal_run (h, notify_read);
 }
 
 int
 nbd_unlocked_aio_notify_write (struct nbd_handle *h)
 {
+  if (check_single_conn (h) == -1)
+    return -1;
   return nbd_internal_run (h, notify_write);
 }
 
+static int
+check_conn (struct nbd_handle *h, uint32_t conn)
+{
+  if (conn > h->nr_conns) {
+    set_error (EINVAL, "connection %" PRIu32 " out of range, "
+               "the handle has %zu connections", conn, h->nr_conns + 1);
+    return -1;
+  }
+  return 0;
+}
+
+int
+nbd_unlocked_aio_get_fd_n (struct nbd_handle *h, uint32_t conn)
+{
+  struct nbd_handle *c;
+
+  if (check_conn (h, conn) == -1)
+    return -1;
+  c = get_conn (h, conn);
+  if (!c->sock) {
+    set_error (EINVAL, "connection %" PRIu32 " is not in a connected state",
+               conn);
+    return -1;
+  }
+  return c->sock->ops->get_fd (c->sock);
+}
+
+/* NB: may_set_error = false.
+ *
+ * The extra connections are only run with the parent's lock held, so
+ * their public state is not updated: use the real state instead.
+ */
+unsigned
+nbd_unlocked_aio_get_direction_n (struct nbd_handle *h, uint32_t conn)
+{
+  struct nbd_handle *c;
+
+  if (conn > h->nr_conns)
+    return 0;
+  c = get_conn (h, conn);
+  if (c->sock == NULL)
+    return 0;
+  return nbd_internal_aio_get_direction (get_next_state (c));
+}
+
+/* As in nbd_poll, a failure of an extra connection is not returned:
+ * the connection moves to the dead state, which fails its commands
+ * and stops new commands being sent on it.
+ */
+static int
+notify_conn (struct nbd_handle *h, uint32_t conn, enum external_event ev)
+{
+  struct nbd_handle *c;
+  int r;
+
+  if (check_conn (h, conn) == -1)
+    return -1;
+  c = get_conn (h, conn);
+  r = nbd_internal_run (c, ev);
+  if (r == -1 && c != h) {
+    debug (c, "multi-conn: connection failed: %s", nbd_get_error ());
+    return 0;
+  }
+  return r;
+}
+
+int
+nbd_unlocked_aio_notify_read_n (struct nbd_handle *h, uint32_t conn)
+{
+  return notify_conn (h, conn, notify_read);
+}
+
+int
+nbd_unlocked_aio_notify_write_n (struct nbd_handle *h, uint32_t conn)
+{
+  return notify_conn (h, conn, notify_write);
+}
+
 int
 nbd_unlocked_aio_command_completed (struct nbd_handle *h,
                                     uint64_t cookie)
 {
-  struct command *prev_cmd, *cmd;
+  struct nbd_handle *conn;
+  struct command *prev_cmd, *cmd = NULL;
   uint16_t type;
   uint32_t error;
+  size_t i;
 
   if (cookie < 1) {
     set_error (EINVAL, "invalid aio cookie %" PRId64, cookie);
     return -1;
   }
 
-  /* Find the command amongst the completed commands. */
-  for (cmd = h->cmds_done, prev_cmd = NULL;
-       cmd != NULL;
-       prev_cmd = cmd, cmd = cmd->next) {
-    if (cmd->cookie == cookie)
-      break;
+  /* Find the command amongst the completed commands of each
+   * connection.
+   */
+  for (i = 0; cmd == NULL && i <= h->nr_conns; ++i) {
+    conn = get_conn (h, i);
+    for (cmd = conn->cmds_done, prev_cmd = NULL;
+         cmd != NULL;
+         prev_cmd = cmd, cmd = cmd->next) {
+      if (cmd->cookie == cookie)
+        break;
+    }
   }
   if (!cmd)
     return 0;
+  h = conn;
 
   type = cmd->type;
   error = cmd->error;
   assert (cmd->type != NBD_CMD_DISC);
-  /* The spec states that a 0-length read request is unspecified; but
-   * it is easy enough to treat it as successful as an extension.
-   */
-  if (type == NBD_CMD_READ && !cmd->data_seen && cmd->count && !error)
-    error = EIO;
 
   /* Retire it from the list and free it. */
   if (h->cmds_done_tail == cmd) {
@@ -105,7 +220,7 @@ nbd_unlocked_aio_command_completed (struct nbd_handle *h,
   else
     h->cmds_done = cmd->next;
 
-  nbd_internal_retire_and_free_command (cmd);
+  nbd_internal_retire_and_free_command (h, cmd);
 
   /* If the command was successful, return true. */
   if (error == 0)
@@ -120,12 +235,21 @@ nbd_unlocked_aio_command_completed (struct nbd_handle *h,
 int64_t
 nbd_unlocked_aio_peek_command_completed (struct nbd_handle *h)
 {
-  if (h->cmds_done != NULL) {
-    assert (h->cmds_done->type != NBD_CMD_DISC);
-    return h->cmds_done->cookie;
+  struct nbd_handle *conn;
+  bool pending = false;
+  size_t i;
+
+  for (i = 0; i <= h->nr_conns; ++i) {
+    conn = get_conn (h, i);
+    if (conn->cmds_done != NULL) {
+      assert (conn->cmds_done->type != NBD_CMD_DISC);
+      return conn->cmds_done->cookie;
+    }
+    if (conn->cmds_in_flight.nr_commands > 0 || conn->cmds_to_issue != NULL)
+      pending = true;
   }
 
-  if (h->cmds_in_flight != NULL || h->cmds_to_issue != NULL) {
+  if (pending) {
     set_error (0, "no in-flight command has completed yet");
     return 0;
   }
@@ -136,5 +260,37 @@ nbd_unlocked_aio_peek_command_completed (struct nbd_handle *h)
 int
 nbd_unlocked_aio_in_flight (struct nbd_handle *h)
 {
-  return h->in_flight;
+  int r = h->in_flight;
+  size_t i;
+
+  for (i = 0; i < h->nr_conns; ++i)
+    r += h->conns[i]->in_flight;
+  return r;
+}
+
+int
+nbd_unlocked_aio_begin_batch (struct nbd_handle *h)
+{
+  size_t i;
+
+  for (i = 0; i <= h->nr_conns; ++i)
+    get_conn (h, i)->in_batch = true;
+  return 0;
+}
+
+int
+nbd_unlocked_aio_end_batch (struct nbd_handle *h)
+{
+  struct nbd_handle *conn;
+  size_t i;
+
+  for (i = 1; i <= h->nr_conns; ++i) {
+    conn = get_conn (h, i);
+    conn->in_batch = false;
+    if (nbd_internal_issue_queued_commands (conn) == -1)
+      debug (conn, "multi-conn: ignoring state machine failure");
+  }
+
+  h->in_batch = false;
+  return nbd_internal_issue_queued_commands (h);
 }
@@ -0,0 +1,138 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Registered read buffers.  The caller gives the handle a region of
+ * memory (for example pinned or hugepage memory), which is divided
+ * into fixed size slots.  nbd_aio_pread_registered reads into a free
+ * slot and passes it to the caller, who gives it back with
+ * nbd_release_buffer once it has finished with the data.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include "internal.h"
+
+void
+nbd_internal_free_buffers (struct nbd_handle *h)
+{
+  free (h->free_buffers);
+  free (h->buffer_in_use);
+  h->buffers = NULL;
+  h->buffer_size = h->nr_buffers = h->nr_free_buffers = 0;
+  h->free_buffers = NULL;
+  h->buffer_in_use = NULL;
+}
+
+int
+nbd_unlocked_register_buffers (struct nbd_handle *h, void *buf,
+                               size_t count, uint32_t buffer_size)
+{
+  uint32_t *free_buffers;
+  bool *in_use;
+  size_t n, i;
+
+  if (h->nr_free_buffers != h->nr_buffers) {
+    set_error (EBUSY, "registered buffers are still in use");
+    return -1;
+  }
+  if (buffer_size == 0 || buffer_size > MAX_REQUEST_SIZE) {
+    set_error (EINVAL, "buffer size must be between 1 and %d",
+               MAX_REQUEST_SIZE);
+    return -1;
+  }
+  n = count / buffer_size;
+  if (n == 0) {
+    set_error (EINVAL, "buffer is smaller than the buffer size");
+    return -1;
+  }
+  if (n > UINT32_MAX)
+    n = UINT32_MAX;
+
+  free_buffers = malloc (n * sizeof *free_buffers);
+  in_use = calloc (n, sizeof *in_use);
+  if (free_buffers == NULL || in_use == NULL) {
+    set_error (errno, "malloc");
+    free (free_buffers);
+    free (in_use);
+    return -1;
+  }
+  /* Hand out the lowest slots first. */
+  for (i = 0; i < n; ++i)
+    free_buffers[i] = n - 1 - i;
+
+  nbd_internal_free_buffers (h);
+  h->buffers = buf;
+  h->buffer_size = buffer_size;
+  h->nr_buffers = h->nr_free_buffers = n;
+  h->free_buffers = free_buffers;
+  h->buffer_in_use = in_use;
+  return 0;
+}
+
+int
+nbd_unlocked_unregister_buffers (struct nbd_handle *h)
+{
+  if (h->nr_free_buffers != h->nr_buffers) {
+    set_error (EBUSY, "registered buffers are still in use");
+    return -1;
+  }
+
+  nbd_internal_free_buffers (h);
+  return 0;
+}
+
+int
+nbd_unlocked_release_buffer (struct nbd_handle *h, uint32_t slot)
+{
+  if (slot >= h->nr_buffers || !h->buffer_in_use[slot]) {
+    set_error (EINVAL, "buffer %" PRIu32 " is not in use", slot);
+    return -1;
+  }
+
+  nbd_internal_put_buffer (h, slot);
+  return 0;
+}
+
+/* Take a free slot, or return NULL if there are none. */
+void *
+nbd_internal_get_buffer (struct nbd_handle *h, uint32_t *slot)
+{
+  if (h->nr_free_buffers == 0)
+    return NULL;
+
+  *slot = h->free_buffers[--h->nr_free_buffers];
+  h->buffer_in_use[*slot] = true;
+  return h->buffers + (size_t) *slot * h->buffer_size;
+}
+
+/* Return a slot to the free stack.  The most recently used slot is
+ * handed out next, while it is likely to still be in the cache.
+ */
+void
+nbd_internal_put_buffer (struct nbd_handle *h, uint32_t slot)
+{
+  h->buffer_in_use[slot] = false;
+  h->free_buffers[h->nr_free_buffers++] = slot;
+}
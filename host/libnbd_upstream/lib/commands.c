@@ -0,0 +1,323 @@
+/* NBD client library in userspace
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Allocating commands, and the table of commands in flight.
+ *
+ * Retired commands are kept on a per-handle free list and reused, so
+ * that issuing and retiring commands does not normally call the
+ * allocator.
+ *
+ * The table of commands in flight is indexed by cookie.  This is an
+ * open addressing hash table with linear probing.  Cookies
+ * are allocated sequentially from h->unique, so the low bits of the
+ * cookie are used directly as the hash and commands in flight at the
+ * same time rarely collide.  Removal shifts later entries back
+ * instead of leaving tombstones, so lookups never have to skip over
+ * deleted entries.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "internal.h"
+
+#define MIN_SLOTS 16
+
+struct command *
+nbd_internal_alloc_command (struct nbd_handle *h)
+{
+  struct command *cmd = h->cmds_free;
+  struct read_range *ranges;
+  size_t ranges_alloc;
+
+  if (cmd == NULL)
+    return calloc (1, sizeof *cmd);
+
+  h->cmds_free = cmd->next;
+  h->nr_cmds_free--;
+  ranges = cmd->ranges;
+  ranges_alloc = cmd->ranges_alloc;
+  memset (cmd, 0, sizeof *cmd);
+  cmd->ranges = ranges;
+  cmd->ranges_alloc = ranges_alloc;
+  return cmd;
+}
+
+void
+nbd_internal_free_command (struct nbd_handle *h, struct command *cmd)
+{
+  if (h->nr_cmds_free < MAX_FREE_COMMANDS) {
+    cmd->next = h->cmds_free;
+    h->cmds_free = cmd;
+    h->nr_cmds_free++;
+  }
+  else {
+    free (cmd->ranges);
+    free (cmd);
+  }
+}
+
+void
+nbd_internal_free_command_pool (struct nbd_handle *h)
+{
+  struct command *cmd;
+
+  while ((cmd = h->cmds_free) != NULL) {
+    h->cmds_free = cmd->next;
+    free (cmd->ranges);
+    free (cmd);
+  }
+  h->nr_cmds_free = 0;
+}
+
+/* Record that the server has sent data (or a hole) for length bytes
+ * of a read command starting at byte start of the buffer.  Chunks
+ * normally arrive in order, in which case this just extends the last
+ * range.
+ */
+int
+nbd_internal_command_add_range (struct command *cmd,
+                                uint32_t start, uint32_t length)
+{
+  struct read_range *r;
+  uint32_t end = start + length;
+  size_t i, j, n = cmd->nr_ranges;
+
+  if (length == 0)
+    return 0;
+
+  r = cmd->ranges;
+  if (n > 0 && r[n-1].end == start) {
+    r[n-1].end = end;
+    return 0;
+  }
+
+  /* Find the ranges which overlap or touch the new range. */
+  for (i = 0; i < n && r[i].end < start; ++i)
+    ;
+  for (j = i; j < n && r[j].start <= end; ++j)
+    ;
+
+  if (i < j) {
+    /* Merge ranges i to j-1 with the new range. */
+    if (r[i].start > start)
+      r[i].start = start;
+    if (r[j-1].end > end)
+      end = r[j-1].end;
+    r[i].end = end;
+    memmove (&r[i+1], &r[j], (n - j) * sizeof *r);
+    cmd->nr_ranges -= j - i - 1;
+    return 0;
+  }
+
+  if (n >= cmd->ranges_alloc) {
+    size_t alloc = cmd->ranges_alloc ? cmd->ranges_alloc * 2 : 1;
+
+    r = realloc (r, alloc * sizeof *r);
+    if (r == NULL)
+      return -1;
+    cmd->ranges = r;
+    cmd->ranges_alloc = alloc;
+  }
+  memmove (&r[i+1], &r[i], (n - i) * sizeof *r);
+  r[i].start = start;
+  r[i].end = end;
+  cmd->nr_ranges++;
+  return 0;
+}
+
+/* Zero the parts of a read buffer not covered by any range recorded
+ * by nbd_internal_command_add_range.  This is done instead of zeroing
+ * the whole buffer before issuing the command, so that a server which
+ * does not send the whole range cannot leave uninitialized data in
+ * the buffer.  Returns true if the server sent the whole range.
+ */
+bool
+nbd_internal_command_zero_gaps (struct command *cmd)
+{
+  char *data = cmd->data;
+  uint32_t pos = 0;
+  bool complete = true;
+  size_t i;
+
+  for (i = 0; i < cmd->nr_ranges; ++i) {
+    const struct read_range *r = &cmd->ranges[i];
+
+    if (r->start > pos) {
+      memset (data + pos, 0, r->start - pos);
+      complete = false;
+    }
+    pos = r->end;
+  }
+  if (pos < cmd->count) {
+    memset (data + pos, 0, cmd->count - pos);
+    complete = false;
+  }
+  return complete;
+}
+
+/* For a read into a registered buffer, pass the buffer to the
+ * caller.  The callback can replace the error by returning -1.
+ */
+void
+nbd_internal_command_deliver_buffer (struct command *cmd, int error)
+{
+  if (!cmd->cb.registered)
+    return;
+
+  if (CALL_CALLBACK (cmd->cb.buffer, cmd->cb.slot, cmd->data, cmd->count,
+                     cmd->offset, &error) == -1 && error)
+    cmd->error = error;
+}
+
+static inline size_t
+home_slot (const struct command_table *t, uint64_t cookie)
+{
+  return cookie & (t->nr_slots - 1);
+}
+
+/* Store a command without checking for space. */
+static void
+insert_slot (struct command_table *t, struct command *cmd)
+{
+  const size_t mask = t->nr_slots - 1;
+  size_t i;
+
+  for (i = home_slot (t, cmd->cookie); t->slots[i] != NULL; i = (i+1) & mask)
+    assert (t->slots[i]->cookie != cmd->cookie);
+  t->slots[i] = cmd;
+  t->nr_commands++;
+}
+
+/* Make sure that n commands can be stored without the table being
+ * more than half full.  Call this before queuing a command, so that
+ * inserting it later when it is issued cannot fail.
+ */
+int
+nbd_internal_command_table_reserve (struct command_table *t, size_t n)
+{
+  struct command **old_slots = t->slots;
+  size_t old_nr_slots = t->nr_slots;
+  size_t nr_slots, i;
+
+  if (n <= t->nr_slots / 2)
+    return 0;
+
+  nr_slots = t->nr_slots ? t->nr_slots : MIN_SLOTS;
+  while (n > nr_slots / 2)
+    nr_slots *= 2;
+
+  t->slots = calloc (nr_slots, sizeof (struct command *));
+  if (t->slots == NULL) {
+    t->slots = old_slots;
+    return -1;
+  }
+  t->nr_slots = nr_slots;
+  t->nr_commands = 0;
+  for (i = 0; i < old_nr_slots; ++i)
+    if (old_slots[i])
+      insert_slot (t, old_slots[i]);
+  free (old_slots);
+  return 0;
+}
+
+void
+nbd_internal_command_table_insert (struct command_table *t,
+                                   struct command *cmd)
+{
+  /* Space must have been reserved already. */
+  assert (t->nr_commands < t->nr_slots / 2);
+  insert_slot (t, cmd);
+}
+
+static size_t
+find_slot (const struct command_table *t, uint64_t cookie)
+{
+  const size_t mask = t->nr_slots - 1;
+  size_t i;
+
+  if (t->nr_slots == 0)
+    return SIZE_MAX;
+
+  for (i = home_slot (t, cookie); t->slots[i] != NULL; i = (i+1) & mask)
+    if (t->slots[i]->cookie == cookie)
+      return i;
+  return SIZE_MAX;
+}
+
+struct command *
+nbd_internal_command_table_lookup (const struct command_table *t,
+                                   uint64_t cookie)
+{
+  size_t i = find_slot (t, cookie);
+
+  return i == SIZE_MAX ? NULL : t->slots[i];
+}
+
+void
+nbd_internal_command_table_remove (struct command_table *t,
+                                   struct command *cmd)
+{
+  const size_t mask = t->nr_slots - 1;
+  size_t i, j, k;
+
+  i = find_slot (t, cmd->cookie);
+  assert (i != SIZE_MAX && t->slots[i] == cmd);
+  t->slots[i] = NULL;
+  t->nr_commands--;
+
+  /* Move back any later entry in the same run which would no longer
+   * be found, because the hole is between its home slot and where
+   * it is stored.
+   */
+  for (j = (i+1) & mask; t->slots[j] != NULL; j = (j+1) & mask) {
+    k = home_slot (t, t->slots[j]->cookie);
+    if (((j - k) & mask) >= ((j - i) & mask)) {
+      t->slots[i] = t->slots[j];
+      t->slots[j] = NULL;
+      i = j;
+    }
+  }
+}
+
+/* Remove all commands from the table and return them as a linked
+ * list.  The slots are kept for reuse.
+ */
+struct command *
+nbd_internal_command_table_take_all (struct command_table *t)
+{
+  struct command *list = NULL;
+  size_t i;
+
+  for (i = 0; i < t->nr_slots; ++i) {
+    if (t->slots[i]) {
+      t->slots[i]->next = list;
+      list = t->slots[i];
+      t->slots[i] = NULL;
+    }
+  }
+  t->nr_commands = 0;
+  return list;
+}
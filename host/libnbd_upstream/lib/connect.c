@@ -69,7 +69,12 @@ nbd_internal_wait_until_connected (struct nbd_handle *h)
       return -1;
   }
 
-  return error_unless_ready (h);
+  if (error_unless_ready (h) == -1)
+    return -1;
+
+  if (nbd_internal_open_connections (h) == -1)
+    return -1;
+  return nbd_internal_open_spare_connections (h);
 }
 
 /* Connect to a Unix domain socket. */
@@ -28,6 +28,20 @@
 
 #ifdef HAVE_GNUTLS
 #include <gnutls/gnutls.h>
+
+#if defined(HAVE_LINUX_TLS_H) && defined(HAVE_GNUTLS_RECORD_GET_STATE)
+#define USE_KTLS 1
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
 #endif
 
 #include "internal.h"
@@ -181,11 +195,252 @@ nbd_unlocked_set_tls_psk_file (struct nbd_handle *h, const char *filename)
 
 #ifdef HAVE_GNUTLS
 
+#ifdef USE_KTLS
+
+/* Kernel TLS (kTLS).  After the handshake the session keys can be
+ * handed to the kernel, which then does record encryption and
+ * decryption on the socket, so we can use ordinary socket calls and
+ * avoid copying everything through GnuTLS.  If something is not
+ * supported we continue to use GnuTLS.
+ *
+ * This is only done with TLS 1.2.  In TLS 1.3 the server can send a
+ * KeyUpdate at any time, and GnuTLS would answer it with its own
+ * (stale) keys while the kernel kept using the old ones.
+ */
+
+/* TLS record content types. */
+#define TLS_RECORD_ALERT 21
+#define TLS_RECORD_APPLICATION_DATA 23
+
+/* The kernel's description of the keys for one direction. */
+struct ktls_keys {
+  union {
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 aes128;
+    struct tls12_crypto_info_aes_gcm_256 aes256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    struct tls12_crypto_info_chacha20_poly1305 chacha;
+#endif
+  } ci;
+  socklen_t len;
+};
+
+/* Get the keys for one direction of the session in the form the
+ * kernel wants.  Returns 0 on success or -1 if it cannot be
+ * offloaded.
+ */
+static int
+ktls_get_keys (struct nbd_handle *h, gnutls_session_t session, bool read,
+               struct ktls_keys *keys)
+{
+  gnutls_protocol_t version = gnutls_protocol_get_version (session);
+  gnutls_cipher_algorithm_t cipher = gnutls_cipher_get (session);
+  gnutls_datum_t mac_key, iv, cipher_key;
+  unsigned char seq[8];
+  int err;
+
+  memset (keys, 0, sizeof *keys);
+  if (version != GNUTLS_TLS1_2) {
+    debug (h, "kTLS: unsupported protocol version %s",
+           gnutls_protocol_get_name (version));
+    return -1;
+  }
+  keys->ci.info.version = TLS_1_2_VERSION;
+
+  err = gnutls_record_get_state (session, read, &mac_key, &iv, &cipher_key,
+                                 seq);
+  if (err < 0) {
+    debug (h, "kTLS: gnutls_record_get_state: %s", gnutls_strerror (err));
+    return -1;
+  }
+
+  /* The GCM ciphers use the 4 byte implicit IV as salt, and the
+   * explicit nonce is the sequence number.
+   */
+#define SET_GCM_KEYS(field, CIPHER)                                     \
+  do {                                                                  \
+    if (cipher_key.size != TLS_CIPHER_##CIPHER##_KEY_SIZE)              \
+      return -1;                                                        \
+    keys->ci.field.info.cipher_type = TLS_CIPHER_##CIPHER;              \
+    memcpy (keys->ci.field.key, cipher_key.data,                        \
+            TLS_CIPHER_##CIPHER##_KEY_SIZE);                            \
+    memcpy (keys->ci.field.salt, iv.data, TLS_CIPHER_##CIPHER##_SALT_SIZE); \
+    memcpy (keys->ci.field.iv, seq, TLS_CIPHER_##CIPHER##_IV_SIZE);     \
+    memcpy (keys->ci.field.rec_seq, seq,                                \
+            TLS_CIPHER_##CIPHER##_REC_SEQ_SIZE);                        \
+    keys->len = sizeof keys->ci.field;                                  \
+  } while (0)
+
+  switch (cipher) {
+  case GNUTLS_CIPHER_AES_128_GCM:
+    SET_GCM_KEYS (aes128, AES_GCM_128);
+    break;
+  case GNUTLS_CIPHER_AES_256_GCM:
+    SET_GCM_KEYS (aes256, AES_GCM_256);
+    break;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+  case GNUTLS_CIPHER_CHACHA20_POLY1305:
+    if (cipher_key.size != TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE ||
+        iv.size != TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE)
+      return -1;
+    keys->ci.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+    memcpy (keys->ci.chacha.key, cipher_key.data,
+            TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+    memcpy (keys->ci.chacha.iv, iv.data,
+            TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+    memcpy (keys->ci.chacha.rec_seq, seq,
+            TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+    keys->len = sizeof keys->ci.chacha;
+    break;
+#endif
+  default:
+    debug (h, "kTLS: unsupported cipher %s",
+           gnutls_cipher_get_name (cipher));
+    return -1;
+  }
+#undef SET_GCM_KEYS
+
+  return 0;
+}
+
+/* Install the keys for one direction in the kernel. */
+static bool
+ktls_set_keys (struct nbd_handle *h, int fd, bool read,
+               const struct ktls_keys *keys)
+{
+  if (setsockopt (fd, SOL_TLS, read ? TLS_RX : TLS_TX,
+                  &keys->ci, keys->len) == -1) {
+    debug (h, "kTLS: setsockopt: %s: %s",
+           read ? "TLS_RX" : "TLS_TX", strerror (errno));
+    return false;
+  }
+  return true;
+}
+
+/* Try to enable kTLS after the handshake has completed. */
+static void
+ktls_enable (struct nbd_handle *h, struct socket *sock)
+{
+  gnutls_session_t session = sock->u.tls.session;
+  int fd = sock->u.tls.oldsock->ops->get_fd (sock->u.tls.oldsock);
+  struct ktls_keys send_keys, recv_keys;
+
+  /* If GnuTLS has already buffered decrypted data we cannot switch. */
+  if (gnutls_record_check_pending (session) > 0)
+    return;
+
+  /* Check that the keys can be offloaded before attaching the TLS
+   * layer to the socket.
+   */
+  if (ktls_get_keys (h, session, false, &send_keys) == -1 ||
+      ktls_get_keys (h, session, true, &recv_keys) == -1)
+    return;
+
+  if (setsockopt (fd, SOL_TCP, TCP_ULP, "tls", sizeof "tls") == -1) {
+    debug (h, "kTLS not available: setsockopt: TCP_ULP: %s",
+           strerror (errno));
+    return;
+  }
+
+  /* Receive is offloaded first, so that if it fails GnuTLS still does
+   * both directions.  Once it has succeeded GnuTLS no longer reads,
+   * so it cannot send anything in reply behind the kernel's back,
+   * and sending can stay with GnuTLS if the kernel cannot do it.
+   */
+  sock->u.tls.ktls_recv = ktls_set_keys (h, fd, true, &recv_keys);
+  sock->u.tls.ktls_send =
+    sock->u.tls.ktls_recv && ktls_set_keys (h, fd, false, &send_keys);
+  debug (h, "kTLS enabled for: %s%s",
+         sock->u.tls.ktls_send ? "send " : "",
+         sock->u.tls.ktls_recv ? "recv" : "");
+}
+
+/* Receive from a kTLS socket.  We have to use recvmsg to see the
+ * record type, because the kernel passes non-data records through.
+ * This is only used with TLS 1.2, where the only other record we
+ * expect is the close_notify alert.
+ */
+static ssize_t
+ktls_recv (struct nbd_handle *h, struct socket *sock, void *buf, size_t len)
+{
+  int fd = sock->u.tls.oldsock->ops->get_fd (sock->u.tls.oldsock);
+  char cmsgbuf[CMSG_SPACE (sizeof (unsigned char))];
+  struct iovec iov = { .iov_base = buf, .iov_len = len };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  unsigned char type;
+  ssize_t r;
+
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsgbuf;
+  msg.msg_controllen = sizeof cmsgbuf;
+
+  r = recvmsg (fd, &msg, 0);
+  if (r == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      set_error (errno, "recvmsg");
+    return -1;
+  }
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  if (r > 0 && cmsg != NULL &&
+      cmsg->cmsg_level == SOL_TLS &&
+      cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+    type = *CMSG_DATA (cmsg);
+    switch (type) {
+    case TLS_RECORD_APPLICATION_DATA:
+      break;
+    case TLS_RECORD_ALERT:
+      if (r == 2 && ((unsigned char *) buf)[1] == 0)
+        return 0;               /* close_notify */
+      /*FALLTHROUGH*/
+    default:
+      set_error (EIO, "kTLS: unexpected TLS record type %d", type);
+      errno = EIO;
+      return -1;
+    }
+  }
+  return r;
+}
+
+/* Send a close_notify alert, the kTLS equivalent of gnutls_bye. */
+static ssize_t
+ktls_send_close_notify (int fd)
+{
+  unsigned char alert[2] = { 1 /* warning */, 0 /* close_notify */ };
+  char cmsgbuf[CMSG_SPACE (sizeof (unsigned char))];
+  struct iovec iov = { .iov_base = alert, .iov_len = sizeof alert };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsgbuf;
+  msg.msg_controllen = sizeof cmsgbuf;
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_TLS;
+  cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (unsigned char));
+  *CMSG_DATA (cmsg) = TLS_RECORD_ALERT;
+
+  return sendmsg (fd, &msg, MSG_NOSIGNAL);
+}
+
+#endif /* USE_KTLS */
+
 static ssize_t
 tls_recv (struct nbd_handle *h, struct socket *sock, void *buf, size_t len)
 {
   ssize_t r;
 
+#ifdef USE_KTLS
+  if (sock->u.tls.ktls_recv)
+    return ktls_recv (h, sock, buf, len);
+#endif
+
   r = gnutls_record_recv (sock->u.tls.session, buf, len);
   if (r < 0) {
     if (r == GNUTLS_E_INTERRUPTED || r == GNUTLS_E_AGAIN) {
@@ -205,6 +460,15 @@ tls_send (struct nbd_handle *h,
 {
   ssize_t r;
 
+#ifdef USE_KTLS
+  /* The kernel handles MSG_MORE, so the header and payload of a
+   * write can go in the same record.
+   */
+  if (sock->u.tls.ktls_send)
+    return sock->u.tls.oldsock->ops->send (h, sock->u.tls.oldsock,
+                                           buf, len, flags);
+#endif
+
   r = gnutls_record_send (sock->u.tls.session, buf, len);
   if (r < 0) {
     if (r == GNUTLS_E_INTERRUPTED || r == GNUTLS_E_AGAIN) {
@@ -218,9 +482,40 @@ tls_send (struct nbd_handle *h,
   return r;
 }
 
+/* GnuTLS has no vectored send, so gather as many of the buffers as
+ * fit into one record and send that.  A buffer too large to be
+ * gathered is sent on its own.  If GnuTLS returns EAGAIN we will be
+ * called again with the same buffers, so the record is the same.
+ */
+static ssize_t
+tls_sendv (struct nbd_handle *h, struct socket *sock,
+           const struct iovec *iov, int iovcnt, int flags)
+{
+  char buf[16384];              /* Maximum TLS record size. */
+  size_t len = 0;
+  int i;
+
+#ifdef USE_KTLS
+  if (sock->u.tls.ktls_send)
+    return sock->u.tls.oldsock->ops->sendv (h, sock->u.tls.oldsock,
+                                            iov, iovcnt, flags);
+#endif
+
+  if (iovcnt == 1 || iov[0].iov_len + iov[1].iov_len > sizeof buf)
+    return tls_send (h, sock, iov[0].iov_base, iov[0].iov_len, flags);
+
+  for (i = 0; i < iovcnt && len + iov[i].iov_len <= sizeof buf; ++i) {
+    memcpy (&buf[len], iov[i].iov_base, iov[i].iov_len);
+    len += iov[i].iov_len;
+  }
+  return tls_send (h, sock, buf, len, flags);
+}
+
 static bool
 tls_pending (struct socket *sock)
 {
+  if (sock->u.tls.ktls_recv)
+    return false;
   return gnutls_record_check_pending (sock->u.tls.session) > 0;
 }
 
@@ -233,7 +528,23 @@ tls_get_fd (struct socket *sock)
 static bool
 tls_shut_writes (struct nbd_handle *h, struct socket *sock)
 {
-  int r = gnutls_bye (sock->u.tls.session, GNUTLS_SHUT_WR);
+  int r;
+
+#ifdef USE_KTLS
+  /* GnuTLS no longer knows the sequence number, so it must not send
+   * the alert itself.
+   */
+  if (sock->u.tls.ktls_send) {
+    if (ktls_send_close_notify (tls_get_fd (sock)) == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return false;
+      debug (h, "ignoring close_notify failure: %s", strerror (errno));
+    }
+    return sock->u.tls.oldsock->ops->shut_writes (h, sock->u.tls.oldsock);
+  }
+#endif
+
+  r = gnutls_bye (sock->u.tls.session, GNUTLS_SHUT_WR);
 
   if (r == GNUTLS_E_AGAIN || r == GNUTLS_E_INTERRUPTED)
     return false;
@@ -264,6 +575,7 @@ tls_close (struct socket *sock)
 static struct socket_ops crypto_ops = {
   .recv = tls_recv,
   .send = tls_send,
+  .sendv = tls_sendv,
   .pending = tls_pending,
   .get_fd = tls_get_fd,
   .shut_writes = tls_shut_writes,
@@ -656,6 +968,8 @@ nbd_internal_crypto_create_session (struct nbd_handle *h,
   sock->u.tls.pskcreds = pskcreds;
   sock->u.tls.xcreds = xcreds;
   sock->u.tls.oldsock = oldsock;
+  sock->u.tls.ktls_send = false;
+  sock->u.tls.ktls_recv = false;
   sock->ops = &crypto_ops;
   return sock;
 }
@@ -681,8 +995,12 @@ nbd_internal_crypto_handshake (struct nbd_handle *h)
 
   assert (session);
   err = gnutls_handshake (session);
-  if (err == 0)
+  if (err == 0) {
+#ifdef USE_KTLS
+    ktls_enable (h, h->sock);
+#endif
     return 0;
+  }
   if (!gnutls_error_is_fatal (err))
     return 1;
 
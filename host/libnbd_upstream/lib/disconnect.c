@@ -26,6 +26,40 @@
 
 #include "internal.h"
 
+/* True if all the connections of the handle are closed or dead. */
+static bool
+all_closed (struct nbd_handle *h)
+{
+  size_t i;
+
+  if (!nbd_internal_is_state_closed (get_next_state (h)) &&
+      !nbd_internal_is_state_dead (get_next_state (h)))
+    return false;
+  for (i = 0; i < h->nr_conns; ++i) {
+    if (!nbd_internal_is_state_closed (get_next_state (h->conns[i])) &&
+        !nbd_internal_is_state_dead (get_next_state (h->conns[i])))
+      return false;
+  }
+  return true;
+}
+
+/* Disconnect the extra multi-conn connections which are still up. */
+static void
+disconnect_conns (struct nbd_handle *h)
+{
+  struct nbd_handle *conn;
+  size_t i;
+
+  for (i = 0; i < h->nr_conns; ++i) {
+    conn = h->conns[i];
+    if (!conn->disconnect_request &&
+        (nbd_internal_is_state_ready (get_next_state (conn)) ||
+         nbd_internal_is_state_processing (get_next_state (conn))) &&
+        nbd_unlocked_aio_disconnect (conn, 0) == -1)
+      debug (conn, "multi-conn: could not disconnect: %s", nbd_get_error ());
+  }
+}
+
 int
 nbd_unlocked_shutdown (struct nbd_handle *h, uint32_t flags)
 {
@@ -40,9 +74,10 @@ nbd_unlocked_shutdown (struct nbd_handle *h, uint32_t flags)
     if (nbd_unlocked_aio_disconnect (h, 0) == -1)
       return -1;
   }
+  else
+    disconnect_conns (h);
 
-  while (!nbd_internal_is_state_closed (get_next_state (h)) &&
-         !nbd_internal_is_state_dead (get_next_state (h))) {
+  while (!all_closed (h)) {
     if (nbd_unlocked_poll (h, -1) == -1)
       return -1;
   }
@@ -60,6 +95,8 @@ nbd_unlocked_aio_disconnect (struct nbd_handle *h, uint32_t flags)
     return -1;
   }
 
+  disconnect_conns (h);
+
   id = nbd_internal_command_common (h, 0, NBD_CMD_DISC, 0, 0, NULL, NULL);
   if (id == -1)
     return -1;
@@ -0,0 +1,258 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Spare connections and failover.  When the caller has asked for
+ * them with nbd_set_spare_connections, the handle opens extra
+ * connections to the same export after it has connected and leaves
+ * them idle in the READY state.  If the main connection dies,
+ * nbd_failover moves the socket and the negotiated state of a spare
+ * into the handle, which can then carry on without waiting for a new
+ * TCP (and TLS) handshake and option negotiation.
+ *
+ * Spare connections are handles with h->parent set, opened in the
+ * same way as the extra multi-conn connections (see
+ * lib/multi-conn.c).
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "internal.h"
+
+int
+nbd_unlocked_set_spare_connections (struct nbd_handle *h, uint32_t nr)
+{
+  if (nr > MAX_SPARE_CONNECTIONS) {
+    set_error (EINVAL, "number of spare connections must be at most %d",
+               MAX_SPARE_CONNECTIONS);
+    return -1;
+  }
+
+  h->nr_spares_wanted = nr;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+uint32_t
+nbd_unlocked_get_spare_connections (struct nbd_handle *h)
+{
+  return h->nr_spares_wanted;
+}
+
+/* Open spare connections until there are nr_spares_wanted of them.
+ * On error the spares which were opened are kept.
+ */
+static int
+fill_spares (struct nbd_handle *h)
+{
+  const char *context = nbd_internal_get_error_context ();
+  struct nbd_handle *conn;
+
+  if (!nbd_internal_can_reconnect (h)) {
+    set_error (ENOTSUP, "connection method does not allow "
+               "spare connections");
+    return -1;
+  }
+
+  if (h->spares == NULL && h->nr_spares_wanted > 0) {
+    h->spares = calloc (MAX_SPARE_CONNECTIONS, sizeof *h->spares);
+    if (h->spares == NULL) {
+      set_error (errno, "calloc");
+      return -1;
+    }
+  }
+
+  while (h->nr_spares < h->nr_spares_wanted) {
+    conn = nbd_internal_open_connection (h, "spare", h->nr_spares);
+    /* nbd_create and nbd_close change the error context. */
+    nbd_internal_set_error_context (context);
+    if (conn == NULL)
+      return -1;
+    h->spares[h->nr_spares++] = conn;
+  }
+
+  return 0;
+}
+
+/* Called when h has connected.  Failing to open a spare connection
+ * is not an error, we just carry on with fewer spares.
+ */
+int
+nbd_internal_open_spare_connections (struct nbd_handle *h)
+{
+  if (h->parent != NULL || h->nr_spares_wanted == 0)
+    return 0;
+
+  if (fill_spares (h) == -1)
+    debug (h, "failover: could not open spare connection: %s",
+           nbd_get_error ());
+  else
+    debug (h, "failover: %zu spare connections", h->nr_spares);
+  return 0;
+}
+
+void
+nbd_internal_close_spare_connections (struct nbd_handle *h)
+{
+  size_t i;
+
+  for (i = 0; i < h->nr_spares; ++i)
+    nbd_close (h->spares[i]);
+  free (h->spares);
+  h->spares = NULL;
+  h->nr_spares = 0;
+}
+
+int
+nbd_unlocked_fill_spare_connections (struct nbd_handle *h)
+{
+  return fill_spares (h);
+}
+
+/* A spare connection is idle, so there is nothing to read on it
+ * unless the server has dropped it.
+ */
+static bool
+spare_is_usable (struct nbd_handle *conn)
+{
+  struct pollfd fds[1];
+
+  if (!nbd_internal_is_state_ready (get_next_state (conn)))
+    return false;
+  if (conn->sock->ops->pending && conn->sock->ops->pending (conn->sock))
+    return false;
+
+  fds[0].fd = conn->sock->ops->get_fd (conn->sock);
+  fds[0].events = POLLIN;
+  fds[0].revents = 0;
+  return poll (fds, 1, 0) == 0;
+}
+
+/* Move the connection of conn into h.  The old socket (if any) and
+ * meta contexts of h are swapped into conn, so that closing conn
+ * frees them.
+ */
+static void
+adopt_connection (struct nbd_handle *h, struct nbd_handle *conn)
+{
+  struct socket *sock = h->sock;
+  struct meta_context *meta_contexts = h->meta_contexts;
+
+  h->sock = conn->sock;
+  conn->sock = sock;
+  h->sock_generation++;
+  h->meta_contexts = conn->meta_contexts;
+  conn->meta_contexts = meta_contexts;
+
+  h->gflags = conn->gflags;
+  h->exportsize = conn->exportsize;
+  h->eflags = conn->eflags;
+  h->protocol = conn->protocol;
+  h->tls_negotiated = conn->tls_negotiated;
+  h->structured_replies = conn->structured_replies;
+
+  /* Forget anything left over from the dead connection. */
+  h->rbuffer_start = h->rbuffer_end = 0;
+  h->reply_cmd = NULL;
+  h->nr_requests = h->nr_requests_issued = 0;
+  h->wlen = 0;
+  h->in_write_shutdown = false;
+  h->disconnect_request = false;
+
+  set_next_state (h, STATE_READY);
+}
+
+/* The new connection must be to the same export, so that commands
+ * the caller issues next are still valid.
+ */
+static bool
+same_export (struct nbd_handle *h, struct nbd_handle *conn)
+{
+  if (h->exportsize != conn->exportsize) {
+    set_error (EINVAL, "failover: export size changed from %" PRIu64
+               " to %" PRIu64, h->exportsize, conn->exportsize);
+    return false;
+  }
+  if (h->eflags != conn->eflags) {
+    set_error (EINVAL, "failover: export flags changed from 0x%" PRIx16
+               " to 0x%" PRIx16, h->eflags, conn->eflags);
+    return false;
+  }
+  return true;
+}
+
+int
+nbd_unlocked_failover (struct nbd_handle *h)
+{
+  const char *context = nbd_internal_get_error_context ();
+  struct nbd_handle *conn = NULL;
+  bool is_spare = false;
+
+  if (!nbd_internal_can_reconnect (h)) {
+    set_error (ENOTSUP, "connection method does not allow reconnecting");
+    return -1;
+  }
+
+  /* Prefer the most recently opened spare, which is the least likely
+   * to have been dropped by the server.
+   */
+  while (conn == NULL && h->nr_spares > 0) {
+    conn = h->spares[--h->nr_spares];
+    if (!spare_is_usable (conn)) {
+      debug (h, "failover: discarding dead spare connection %s",
+             conn->hname);
+      nbd_close (conn);
+      nbd_internal_set_error_context (context);
+      conn = NULL;
+    }
+    else
+      is_spare = true;
+  }
+
+  if (conn == NULL) {
+    debug (h, "failover: no spare connection, reconnecting");
+    conn = nbd_internal_open_connection (h, "spare", h->nr_spares);
+    nbd_internal_set_error_context (context);
+    if (conn == NULL)
+      return -1;
+  }
+
+  /* Leave the handle as it was, and do not throw the spare away. */
+  if (!same_export (h, conn)) {
+    if (is_spare)
+      h->spares[h->nr_spares++] = conn;
+    else {
+      nbd_close (conn);
+      nbd_internal_set_error_context (context);
+    }
+    return -1;
+  }
+
+  debug (h, "failover: using connection %s", conn->hname);
+  adopt_connection (h, conn);
+  nbd_close (conn);
+  nbd_internal_set_error_context (context);
+  return 0;
+}
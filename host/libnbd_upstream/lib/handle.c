@@ -31,13 +31,13 @@
 #include "internal.h"
 
 static void
-free_cmd_list (struct command *list)
+free_cmd_list (struct nbd_handle *h, struct command *list)
 {
   struct command *cmd, *cmd_next;
 
   for (cmd = list; cmd != NULL; cmd = cmd_next) {
     cmd_next = cmd->next;
-    nbd_internal_retire_and_free_command (cmd);
+    nbd_internal_retire_and_free_command (h, cmd);
   }
 }
 
@@ -62,6 +62,7 @@ nbd_create (void)
   }
 
   h->unique = 1;
+  h->multi_conn = 1;
   h->tls_verify_peer = true;
   h->request_sr = true;
 
@@ -124,15 +125,27 @@ nbd_close (struct nbd_handle *h)
   /* Free user callbacks first. */
   nbd_unlocked_clear_debug_callback (h);
 
+  /* Close the extra multi-conn connections and the spare connections
+   * before h, since with socket activation closing h kills the server.
+   */
+  nbd_internal_close_connections (h);
+  nbd_internal_close_spare_connections (h);
+
   free (h->bs_entries);
+  free (h->rbuffer);
+  free (h->opts_buf);
   for (m = h->meta_contexts; m != NULL; m = m_next) {
     m_next = m->next;
     free (m->name);
     free (m);
   }
-  free_cmd_list (h->cmds_to_issue);
-  free_cmd_list (h->cmds_in_flight);
-  free_cmd_list (h->cmds_done);
+  free_cmd_list (h, h->cmds_to_issue);
+  free_cmd_list (h,
+                 nbd_internal_command_table_take_all (&h->cmds_in_flight));
+  free (h->cmds_in_flight.slots);
+  free_cmd_list (h, h->cmds_done);
+  nbd_internal_free_command_pool (h);
+  nbd_internal_free_buffers (h);
   nbd_internal_free_string_list (h->argv);
   if (h->sa_sockpath) {
     if (h->pid > 0)
@@ -296,6 +309,20 @@ nbd_unlocked_get_handshake_flags (struct nbd_handle *h)
   return h->gflags;
 }
 
+int
+nbd_unlocked_set_pipeline_handshake (struct nbd_handle *h, bool pipeline)
+{
+  h->pipeline_handshake = pipeline;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+int
+nbd_unlocked_get_pipeline_handshake (struct nbd_handle *h)
+{
+  return h->pipeline_handshake;
+}
+
 const char *
 nbd_unlocked_get_package_name (struct nbd_handle *h)
 {
@@ -30,6 +30,7 @@
 #include <string.h>
 #include <netdb.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <pthread.h>
 
@@ -62,10 +63,38 @@
  */
 #define MAX_REQUEST_SIZE (64 * 1024 * 1024)
 
+/* Maximum number of request headers sent together (see
+ * ISSUE_COMMAND.START).
+ */
+#define MAX_ISSUE_BATCH 64
+
+/* Maximum number of retired commands kept for reuse per handle. */
+#define MAX_FREE_COMMANDS 1024
+
+/* Size of the buffer used to receive replies (see recv_into_rbuf),
+ * and the size of read above which data is received directly into
+ * the caller's buffer instead of passing through it.
+ */
+#define RECV_BUFFER_SIZE (64 * 1024)
+#define RECV_BUFFER_BYPASS (16 * 1024)
+
+/* Maximum number of connections per handle (see nbd_set_multi_conn). */
+#define MAX_MULTI_CONN 64
+
+/* Maximum number of spare connections (see nbd_set_spare_connections). */
+#define MAX_SPARE_CONNECTIONS 16
+
 struct meta_context;
 struct socket;
 struct command;
 
+/* Hash table of commands indexed by cookie (see lib/commands.c). */
+struct command_table {
+  struct command **slots;       /* Array of nr_slots entries. */
+  size_t nr_slots;              /* 0 or a power of 2. */
+  size_t nr_commands;           /* Number of non-NULL slots. */
+};
+
 struct nbd_handle {
   /* Unique name assigned to this handle for debug messages
    * (to avoid having to print actual pointers).
@@ -88,6 +117,15 @@ struct nbd_handle {
   bool request_sr;
   char **request_meta_contexts;
 
+  /* Pipelined handshake (see nbd_set_pipeline_handshake).  When set,
+   * the options following NBD_OPT_STARTTLS are sent together from
+   * opts_buf, and opts_pipelined tells the option states that their
+   * request was already sent so they only have to read the reply.
+   */
+  bool pipeline_handshake;
+  bool opts_pipelined;
+  char *opts_buf;
+
   /* Allowed in URIs, see lib/uri.c. */
   uint32_t uri_allow_transports;
   int uri_allow_tls;
@@ -112,6 +150,32 @@ struct nbd_handle {
 
   int64_t unique;               /* Used for generating cookie numbers. */
 
+  /* Multi-conn (see lib/multi-conn.c).  multi_conn is the number of
+   * connections requested with nbd_set_multi_conn.  Once this handle
+   * is connected, up to multi_conn-1 extra connections are opened to
+   * the same server and stored in conns.  Each is a handle of its
+   * own with parent pointing back to this handle.  Extra connections
+   * are only accessed while holding the lock of the parent, and take
+   * their cookies from the parent so that cookies are unique across
+   * all connections.
+   */
+  uint32_t multi_conn;
+  struct nbd_handle **conns;
+  size_t nr_conns;
+  size_t next_conn;             /* Where nbd_internal_pick_connection
+                                 * starts looking. */
+  struct nbd_handle *parent;
+
+  /* Spare connections (see lib/failover.c).  Up to nr_spares_wanted
+   * connections which have completed the handshake are kept in
+   * spares, so that nbd_failover can replace a dead connection
+   * without a new handshake.  They are handles with parent set, like
+   * the extra multi-conn connections.
+   */
+  uint32_t nr_spares_wanted;
+  struct nbd_handle **spares;
+  size_t nr_spares;
+
   /* For debugging. */
   bool debug;
   nbd_debug_callback debug_callback;
@@ -136,6 +200,12 @@ struct nbd_handle {
   /* The socket or a wrapper if using GnuTLS. */
   struct socket *sock;
 
+  /* Incremented when nbd_failover replaces the socket.  The new
+   * socket may have the same fd number as the old one, so nbd_loop
+   * uses this to tell that it must register it again.
+   */
+  unsigned sock_generation;
+
   /* Generic way to read into a buffer - set rbuf to point to a
    * buffer, rlen to the amount of data you expect, and in the state
    * machine call recv_into_rbuf.
@@ -143,7 +213,19 @@ struct nbd_handle {
   void *rbuf;
   size_t rlen;
 
-  /* As above, but for writing using send_from_wbuf. */
+  /* Once the connection is ready, data from the server is received
+   * in large chunks into rbuffer, and recv_into_rbuf copies it from
+   * there.  This lets several small replies be parsed with a single
+   * recv call.  Bytes rbuffer_start to rbuffer_end are still unread.
+   * This is NULL during the handshake.
+   */
+  char *rbuffer;
+  size_t rbuffer_start, rbuffer_end;
+
+  /* As above, but for writing using send_from_wbuf.  When issuing
+   * commands, wlen is the number of bytes of wiov (below) not yet
+   * sent.
+   */
   const void *wbuf;
   size_t wlen;
   int wflags;
@@ -188,10 +270,20 @@ struct nbd_handle {
   } sbuf;
 
   /* Issuing a command must use a buffer separate from sbuf, for the
-   * case when we interrupt a request to service a reply.
+   * case when we interrupt a request to service a reply.  Several
+   * queued commands are sent together with send_from_wiov: wiov holds
+   * the header of each command followed by its payload if it is a
+   * write.  nr_requests is the number of commands in the batch, and
+   * the first nr_requests_issued of them have been completely sent
+   * and moved to cmds_in_flight.  wiov_next is the first element of
+   * wiov not completely sent, and wiov_issued is the number of
+   * elements belonging to the issued commands.
    */
-  struct nbd_request request;
-  bool in_write_payload;
+  struct nbd_request request[MAX_ISSUE_BATCH];
+  struct iovec wiov[MAX_ISSUE_BATCH * 2];
+  size_t nr_wiov, wiov_next, wiov_issued;
+  size_t nr_requests;
+  size_t nr_requests_issued;
   bool in_write_shutdown;
 
   /* When connecting, this stores the socket address. */
@@ -233,10 +325,11 @@ struct nbd_handle {
   struct command *cmds_to_issue;
   struct command *cmds_to_issue_tail;
 
-  /* Commands which have been issued and are waiting for replies.
-   * Order does not matter here, since the server can reply out-of-order.
+  /* Commands which have been issued and are waiting for replies,
+   * indexed by cookie.  Order does not matter here, since the server
+   * can reply out-of-order.
    */
-  struct command *cmds_in_flight;
+  struct command_table cmds_in_flight;
 
   /* Commands which have received replies, waiting for the main
    * program to acknowledge them.  Maintained as a queue, with new
@@ -249,6 +342,25 @@ struct nbd_handle {
   /* length (cmds_to_issue) + length (cmds_in_flight). */
   int in_flight;
 
+  /* True between nbd_aio_begin_batch and nbd_aio_end_batch. */
+  bool in_batch;
+
+  /* Retired commands kept for reuse, linked through cmd->next. */
+  struct command *cmds_free;
+  size_t nr_cmds_free;
+
+  /* Read buffers registered with nbd_register_buffers (see
+   * lib/buffers.c).  The memory is owned by the caller and divided
+   * into nr_buffers slots of buffer_size bytes.  The indexes of the
+   * free slots are kept on the free_buffers stack, and buffer_in_use
+   * is used to check the slots passed to nbd_release_buffer.
+   */
+  char *buffers;
+  uint32_t buffer_size, nr_buffers;
+  uint32_t *free_buffers;
+  uint32_t nr_free_buffers;
+  bool *buffer_in_use;
+
   /* Current command during a REPLY cycle */
   struct command *reply_cmd;
 
@@ -266,6 +378,8 @@ struct socket_ops {
                    struct socket *sock, void *buf, size_t len);
   ssize_t (*send) (struct nbd_handle *h,
                    struct socket *sock, const void *buf, size_t len, int flags);
+  ssize_t (*sendv) (struct nbd_handle *h, struct socket *sock,
+                    const struct iovec *iov, int iovcnt, int flags);
   bool (*pending) (struct socket *sock);
   int (*get_fd) (struct socket *sock);
   bool (*shut_writes) (struct nbd_handle *h, struct socket *sock);
@@ -283,6 +397,8 @@ struct socket {
       void *pskcreds;           /* really gnutls_psk_client_credentials_t */
       void *xcreds;             /* really gnutls_certificate_credentials_t */
       struct socket *oldsock;
+      bool ktls_send;           /* Kernel does encryption (kTLS). */
+      bool ktls_recv;           /* Kernel does decryption (kTLS). */
     } tls;
   } u;
   const struct socket_ops *ops;
@@ -294,6 +410,17 @@ struct command_cb {
     nbd_chunk_callback chunk;
   } fn;
   nbd_completion_callback completion;
+  /* For reads into a registered buffer (see lib/buffers.c), the
+   * callback and the slot which is passed to it when the read
+   * completes.
+   */
+  nbd_buffer_callback buffer;
+  bool registered;
+  uint32_t slot;
+};
+
+struct read_range {
+  uint32_t start, end;
 };
 
 struct command {
@@ -306,7 +433,12 @@ struct command {
   void *data; /* Buffer for read/write */
   struct command_cb cb;
   enum state state; /* State to resume with on next POLLIN */
-  bool data_seen; /* For read, true if at least one data chunk seen */
+  /* For read, the parts of data received so far, as a sorted list of
+   * disjoint [start, end) ranges relative to offset.  The array is
+   * kept when the command is reused (see lib/commands.c).
+   */
+  struct read_range *ranges;
+  size_t nr_ranges, ranges_alloc;
   uint32_t error; /* Local errno value */
 };
 
@@ -328,7 +460,32 @@ struct command {
   } while (0)
 
 /* aio.c */
-extern void nbd_internal_retire_and_free_command (struct command *);
+extern void nbd_internal_retire_and_free_command (struct nbd_handle *h,
+                                                  struct command *cmd);
+
+/* buffers.c */
+extern void nbd_internal_free_buffers (struct nbd_handle *h);
+extern void *nbd_internal_get_buffer (struct nbd_handle *h, uint32_t *slot);
+extern void nbd_internal_put_buffer (struct nbd_handle *h, uint32_t slot);
+
+/* commands.c */
+extern struct command *nbd_internal_alloc_command (struct nbd_handle *h);
+extern void nbd_internal_free_command (struct nbd_handle *h,
+                                       struct command *cmd);
+extern void nbd_internal_free_command_pool (struct nbd_handle *h);
+extern int nbd_internal_command_add_range (struct command *cmd,
+                                          uint32_t start, uint32_t length);
+extern bool nbd_internal_command_zero_gaps (struct command *cmd);
+extern void nbd_internal_command_deliver_buffer (struct command *cmd,
+                                                 int error);
+extern int nbd_internal_command_table_reserve (struct command_table *t,
+                                               size_t n);
+extern void nbd_internal_command_table_insert (struct command_table *t,
+                                               struct command *cmd);
+extern struct command *nbd_internal_command_table_lookup (const struct command_table *t, uint64_t cookie);
+extern void nbd_internal_command_table_remove (struct command_table *t,
+                                               struct command *cmd);
+extern struct command *nbd_internal_command_table_take_all (struct command_table *t);
 
 /* connect.c */
 extern int nbd_internal_wait_until_connected (struct nbd_handle *h);
@@ -367,6 +524,10 @@ extern void nbd_internal_set_last_error (int errnum, char *error);
       nbd_internal_set_last_error (_e, _errp);                          \
   } while (0)
 
+/* failover.c */
+extern int nbd_internal_open_spare_connections (struct nbd_handle *h);
+extern void nbd_internal_close_spare_connections (struct nbd_handle *h);
+
 /* flags.c */
 extern int nbd_internal_set_size_and_flags (struct nbd_handle *h,
                                             uint64_t exportsize,
@@ -380,6 +541,20 @@ extern bool nbd_internal_is_state_processing (enum state state);
 extern bool nbd_internal_is_state_dead (enum state state);
 extern bool nbd_internal_is_state_closed (enum state state);
 
+/* multi-conn.c */
+extern bool nbd_internal_can_reconnect (struct nbd_handle *h);
+extern struct nbd_handle *nbd_internal_open_connection (struct nbd_handle *h,
+                                                        const char *kind,
+                                                        size_t i);
+extern int nbd_internal_open_connections (struct nbd_handle *h);
+extern void nbd_internal_close_connections (struct nbd_handle *h);
+extern struct nbd_handle *nbd_internal_pick_connection (struct nbd_handle *h);
+
+/* poll.c */
+extern int nbd_internal_poll_prepare (struct nbd_handle *h);
+extern short nbd_internal_poll_events (struct nbd_handle *conn);
+extern int nbd_internal_poll_notify (struct nbd_handle *conn, short revents);
+
 /* protocol.c */
 extern int nbd_internal_errno_of_nbd_error (uint32_t error);
 extern const char *nbd_internal_name_of_nbd_cmd (uint16_t type);
@@ -389,6 +564,7 @@ extern int64_t nbd_internal_command_common (struct nbd_handle *h,
                                             uint16_t flags, uint16_t type,
                                             uint64_t offset, uint64_t count,
                                             void *data, struct command_cb *cb);
+extern int nbd_internal_issue_queued_commands (struct nbd_handle *h);
 
 /* socket.c */
 struct socket *nbd_internal_socket_create (int fd);
@@ -0,0 +1,499 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* An event loop for many handles using epoll(7).  See
+ * nbd_loop_create(3).
+ *
+ * Each connection of each handle in the loop (more than one with
+ * multi-conn) has a struct loop_conn, which is also the data pointer
+ * of its epoll registration.  Before waiting, the registrations are
+ * brought up to date with the direction of each connection, and only
+ * changed registrations cost an epoll_ctl call.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "internal.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* Maximum number of events fetched by one epoll_wait. */
+#define LOOP_MAX_EVENTS 64
+
+struct loop_handle;
+
+struct loop_conn {
+  struct loop_handle *lh;
+  size_t i;                     /* 0 = the handle, else h->conns[i-1] */
+  int fd;                       /* Registered fd, -1 = not registered */
+  unsigned sock_generation;     /* conn->sock_generation of fd */
+  uint32_t events;              /* Registered epoll events. */
+};
+
+struct loop_handle {
+  struct nbd_handle *h;
+  struct loop_conn conns[MAX_MULTI_CONN];
+};
+
+struct nbd_loop {
+  /* Lock protecting the loop.  It is held while waiting for events,
+   * and is always taken before the lock of any handle in the loop.
+   */
+  pthread_mutex_t lock;
+
+  int epfd;
+  struct loop_handle **handles;
+  size_t nr_handles, handles_alloc;
+  unsigned busy_poll;           /* Busy-poll time in microseconds. */
+  struct epoll_event events[LOOP_MAX_EVENTS];
+};
+
+struct nbd_loop *
+nbd_loop_create (void)
+{
+  struct nbd_loop *loop;
+
+  nbd_internal_set_error_context ("nbd_loop_create");
+
+  loop = calloc (1, sizeof *loop);
+  if (loop == NULL) {
+    set_error (errno, "calloc");
+    return NULL;
+  }
+
+  loop->epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (loop->epfd == -1) {
+    set_error (errno, "epoll_create1");
+    free (loop);
+    return NULL;
+  }
+
+  errno = pthread_mutex_init (&loop->lock, NULL);
+  if (errno != 0) {
+    set_error (errno, "pthread_mutex_init");
+    close (loop->epfd);
+    free (loop);
+    return NULL;
+  }
+
+  return loop;
+}
+
+void
+nbd_loop_close (struct nbd_loop *loop)
+{
+  size_t i;
+
+  nbd_internal_set_error_context ("nbd_loop_close");
+
+  if (loop == NULL)
+    return;
+
+  /* Closing the epoll fd drops all of the registrations. */
+  close (loop->epfd);
+  for (i = 0; i < loop->nr_handles; ++i)
+    free (loop->handles[i]);
+  free (loop->handles);
+  pthread_mutex_destroy (&loop->lock);
+  free (loop);
+}
+
+static ssize_t
+find_handle (struct nbd_loop *loop, struct nbd_handle *h)
+{
+  size_t i;
+
+  for (i = 0; i < loop->nr_handles; ++i)
+    if (loop->handles[i]->h == h)
+      return i;
+  return -1;
+}
+
+int
+nbd_loop_add (struct nbd_loop *loop, struct nbd_handle *h)
+{
+  struct loop_handle *lh, **handles;
+  size_t i, n;
+  int ret = -1;
+
+  nbd_internal_set_error_context ("nbd_loop_add");
+
+  pthread_mutex_lock (&loop->lock);
+
+  if (find_handle (loop, h) >= 0) {
+    set_error (EEXIST, "handle is already in the loop");
+    goto out;
+  }
+
+  if (loop->nr_handles == loop->handles_alloc) {
+    n = loop->handles_alloc == 0 ? 16 : loop->handles_alloc * 2;
+    handles = realloc (loop->handles, n * sizeof *handles);
+    if (handles == NULL) {
+      set_error (errno, "realloc");
+      goto out;
+    }
+    loop->handles = handles;
+    loop->handles_alloc = n;
+  }
+
+  lh = malloc (sizeof *lh);
+  if (lh == NULL) {
+    set_error (errno, "malloc");
+    goto out;
+  }
+  lh->h = h;
+  for (i = 0; i < MAX_MULTI_CONN; ++i) {
+    lh->conns[i].lh = lh;
+    lh->conns[i].i = i;
+    lh->conns[i].fd = -1;
+    lh->conns[i].sock_generation = 0;
+    lh->conns[i].events = 0;
+  }
+  loop->handles[loop->nr_handles++] = lh;
+  ret = 0;
+
+ out:
+  pthread_mutex_unlock (&loop->lock);
+  return ret;
+}
+
+/* Return the handle of the connection, or NULL if the connection no
+ * longer exists.  The handle lock must be held.
+ */
+static struct nbd_handle *
+get_conn (struct loop_conn *lc)
+{
+  struct nbd_handle *h = lc->lh->h;
+
+  if (lc->i == 0)
+    return h;
+  if (lc->i <= h->nr_conns)
+    return h->conns[lc->i-1];
+  return NULL;
+}
+
+static int
+get_conn_fd (struct nbd_handle *conn)
+{
+  if (conn == NULL || conn->sock == NULL)
+    return -1;
+  return conn->sock->ops->get_fd (conn->sock);
+}
+
+/* Return true if the current socket of the connection is the one
+ * registered.  Checking the fd is not enough, because after
+ * nbd_failover the new socket can have the fd number of the old one,
+ * whose registration went when it was closed.  The handle lock must
+ * be held.
+ */
+static bool
+is_registered (struct loop_conn *lc, struct nbd_handle *conn)
+{
+  return lc->fd >= 0 && get_conn_fd (conn) == lc->fd &&
+    conn->sock_generation == lc->sock_generation;
+}
+
+int
+nbd_loop_remove (struct nbd_loop *loop, struct nbd_handle *h)
+{
+  struct loop_handle *lh;
+  struct loop_conn *lc;
+  ssize_t idx;
+  size_t i;
+  int ret = -1;
+
+  nbd_internal_set_error_context ("nbd_loop_remove");
+
+  pthread_mutex_lock (&loop->lock);
+
+  idx = find_handle (loop, h);
+  if (idx == -1) {
+    set_error (ENOENT, "handle is not in the loop");
+    goto out;
+  }
+  lh = loop->handles[idx];
+
+  /* Registrations of sockets which were closed have already gone. */
+  pthread_mutex_lock (&h->lock);
+  for (i = 0; i < MAX_MULTI_CONN; ++i) {
+    lc = &lh->conns[i];
+    if (is_registered (lc, get_conn (lc)))
+      epoll_ctl (loop->epfd, EPOLL_CTL_DEL, lc->fd, NULL);
+  }
+  pthread_mutex_unlock (&h->lock);
+
+  loop->handles[idx] = loop->handles[--loop->nr_handles];
+  free (lh);
+  ret = 0;
+
+ out:
+  pthread_mutex_unlock (&loop->lock);
+  return ret;
+}
+
+int
+nbd_loop_set_busy_poll (struct nbd_loop *loop, unsigned usecs)
+{
+  nbd_internal_set_error_context ("nbd_loop_set_busy_poll");
+
+  pthread_mutex_lock (&loop->lock);
+  loop->busy_poll = usecs;
+  pthread_mutex_unlock (&loop->lock);
+  return 0;
+}
+
+/* Bring the epoll registration of one connection up to date.  The
+ * handle lock must be held.  Returns -1 on error, 0 if the
+ * connection is not registered, 1 if it is.
+ */
+static int
+update_conn (struct nbd_loop *loop, struct loop_conn *lc)
+{
+  struct nbd_handle *conn = get_conn (lc);
+  const int fd = get_conn_fd (conn);
+  short pevents = fd >= 0 ? nbd_internal_poll_events (conn) : 0;
+  struct epoll_event ev = { .data.ptr = lc };
+
+  ev.events = ((pevents & POLLIN) ? EPOLLIN : 0) |
+    ((pevents & POLLOUT) ? EPOLLOUT : 0);
+
+  /* A connection only gets a new socket after its old socket was
+   * closed, which removed the old registration from the epoll set.
+   */
+  if (!is_registered (lc, conn))
+    lc->fd = -1;
+
+  if (ev.events == 0) {
+    if (lc->fd >= 0)
+      epoll_ctl (loop->epfd, EPOLL_CTL_DEL, lc->fd, NULL);
+    lc->fd = -1;
+    return 0;
+  }
+
+  if (lc->fd == -1) {
+    /* If the socket is unexpectedly still registered, replace the
+     * registration.
+     */
+    if (epoll_ctl (loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1 &&
+        (errno != EEXIST ||
+         epoll_ctl (loop->epfd, EPOLL_CTL_MOD, fd, &ev) == -1)) {
+      set_error (errno, "epoll_ctl");
+      return -1;
+    }
+  }
+  else if (lc->events != ev.events) {
+    if (epoll_ctl (loop->epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+      set_error (errno, "epoll_ctl: EPOLL_CTL_MOD");
+      return -1;
+    }
+  }
+  lc->fd = fd;
+  lc->sock_generation = conn->sock_generation;
+  lc->events = ev.events;
+  return 1;
+}
+
+/* Update the registrations of all of the connections of a handle, and
+ * send the commands queued on it.  Returns the number of connections
+ * registered, or -1 on error.
+ */
+static int
+update_handle (struct nbd_loop *loop, struct loop_handle *lh)
+{
+  struct nbd_handle *h = lh->h;
+  size_t i;
+  int r, n = 0;
+
+  pthread_mutex_lock (&h->lock);
+  if (nbd_internal_poll_prepare (h) == -1)
+    debug (h, "loop: ignoring state machine failure");
+  for (i = 0; i < MAX_MULTI_CONN; ++i) {
+    if (i > h->nr_conns && lh->conns[i].fd == -1)
+      break;
+    r = update_conn (loop, &lh->conns[i]);
+    if (r == -1) {
+      n = -1;
+      break;
+    }
+    n += r;
+  }
+  if (h->public_state != get_next_state (h))
+    h->public_state = get_next_state (h);
+  pthread_mutex_unlock (&h->lock);
+  return n;
+}
+
+/* Run the state machine of the connection which has events. */
+static void
+dispatch (struct epoll_event *ev)
+{
+  struct loop_conn *lc = ev->data.ptr;
+  struct nbd_handle *h = lc->lh->h;
+  struct nbd_handle *conn;
+  short revents = 0;
+
+  pthread_mutex_lock (&h->lock);
+  conn = get_conn (lc);
+  if (is_registered (lc, conn)) {
+    /* On a socket error let the state machine find the error, so
+     * that the connection moves to the dead state and is not polled
+     * again.
+     */
+    if ((ev->events & (EPOLLERR | EPOLLHUP)) != 0)
+      ev->events |= lc->events;
+    if ((ev->events & EPOLLIN) != 0)
+      revents |= POLLIN;
+    if ((ev->events & EPOLLOUT) != 0)
+      revents |= POLLOUT;
+    if (nbd_internal_poll_notify (conn, revents) == -1)
+      debug (conn, "loop: connection failed: %s", nbd_get_error ());
+  }
+  if (h->public_state != get_next_state (h))
+    h->public_state = get_next_state (h);
+  pthread_mutex_unlock (&h->lock);
+}
+
+static int64_t
+elapsed_usecs (const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * INT64_C (1000000) +
+    (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+int
+nbd_loop_poll (struct nbd_loop *loop, int timeout)
+{
+  struct timespec start;
+  int64_t spent;
+  size_t i;
+  int r, n = 0;
+
+  nbd_internal_set_error_context ("nbd_loop_poll");
+
+  pthread_mutex_lock (&loop->lock);
+
+  for (i = 0; i < loop->nr_handles; ++i) {
+    r = update_handle (loop, loop->handles[i]);
+    if (r == -1)
+      goto err;
+    n += r;
+  }
+  if (n == 0) {
+    set_error (EINVAL, "nothing to poll for");
+    goto err;
+  }
+
+  /* In busy-poll mode, check for events without sleeping until the
+   * busy-poll time has passed.  This avoids the wakeup latency of the
+   * scheduler when replies arrive within microseconds.
+   */
+  r = 0;
+  if (loop->busy_poll > 0 && timeout != 0) {
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    do {
+      r = epoll_wait (loop->epfd, loop->events, LOOP_MAX_EVENTS, 0);
+      spent = elapsed_usecs (&start);
+    } while (r == 0 && spent < loop->busy_poll);
+    if (r == 0 && timeout > 0)
+      timeout = spent / 1000 >= timeout ? 0 : timeout - spent / 1000;
+  }
+  if (r == 0)
+    r = epoll_wait (loop->epfd, loop->events, LOOP_MAX_EVENTS, timeout);
+  if (r == -1) {
+    set_error (errno, "epoll_wait");
+    goto err;
+  }
+
+  for (i = 0; i < (size_t) r; ++i)
+    dispatch (&loop->events[i]);
+
+  pthread_mutex_unlock (&loop->lock);
+  return r;
+
+ err:
+  pthread_mutex_unlock (&loop->lock);
+  return -1;
+}
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+struct nbd_loop *
+nbd_loop_create (void)
+{
+  nbd_internal_set_error_context ("nbd_loop_create");
+  set_error (ENOTSUP, "event loops are not supported on this platform");
+  return NULL;
+}
+
+/* Since nbd_loop_create always fails, the other functions can only
+ * be called with a NULL loop.
+ */
+void
+nbd_loop_close (struct nbd_loop *loop)
+{
+}
+
+int
+nbd_loop_add (struct nbd_loop *loop, struct nbd_handle *h)
+{
+  nbd_internal_set_error_context ("nbd_loop_add");
+  set_error (ENOTSUP, "event loops are not supported on this platform");
+  return -1;
+}
+
+int
+nbd_loop_remove (struct nbd_loop *loop, struct nbd_handle *h)
+{
+  nbd_internal_set_error_context ("nbd_loop_remove");
+  set_error (ENOTSUP, "event loops are not supported on this platform");
+  return -1;
+}
+
+int
+nbd_loop_set_busy_poll (struct nbd_loop *loop, unsigned usecs)
+{
+  nbd_internal_set_error_context ("nbd_loop_set_busy_poll");
+  set_error (ENOTSUP, "event loops are not supported on this platform");
+  return -1;
+}
+
+int
+nbd_loop_poll (struct nbd_loop *loop, int timeout)
+{
+  nbd_internal_set_error_context ("nbd_loop_poll");
+  set_error (ENOTSUP, "event loops are not supported on this platform");
+  return -1;
+}
+
+#endif /* !HAVE_SYS_EPOLL_H */
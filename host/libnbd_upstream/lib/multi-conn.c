@@ -0,0 +1,255 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Multi-conn.  When the server advertises NBD_FLAG_CAN_MULTI_CONN
+ * and the caller has asked for it with nbd_set_multi_conn, the
+ * handle opens extra connections to the same export after it has
+ * connected, and new commands are sent on whichever connection has
+ * the fewest commands in flight.
+ *
+ * The extra connections are ordinary handles (with h->parent set)
+ * which the caller never sees.  They are driven by nbd_poll and the
+ * synchronous calls of the parent handle, always with the parent's
+ * lock held.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include "internal.h"
+
+int
+nbd_unlocked_set_multi_conn (struct nbd_handle *h, uint32_t nr)
+{
+  if (nr < 1 || nr > MAX_MULTI_CONN) {
+    set_error (EINVAL, "number of connections must be between 1 and %d",
+               MAX_MULTI_CONN);
+    return -1;
+  }
+
+  h->multi_conn = nr;
+  return 0;
+}
+
+/* NB: may_set_error = false. */
+uint32_t
+nbd_unlocked_get_multi_conn (struct nbd_handle *h)
+{
+  return h->multi_conn;
+}
+
+int
+nbd_unlocked_get_nr_connections (struct nbd_handle *h)
+{
+  return 1 + h->nr_conns;
+}
+
+/* Copy the settings which affect the handshake from h to conn. */
+static int
+copy_settings (struct nbd_handle *conn, struct nbd_handle *h)
+{
+  size_t i;
+
+  if (nbd_unlocked_set_export_name (conn, h->export_name) == -1)
+    return -1;
+  if (h->tls != 0) {
+    if (nbd_unlocked_set_tls (conn, h->tls) == -1)
+      return -1;
+    if (h->tls_certificates &&
+        nbd_unlocked_set_tls_certificates (conn, h->tls_certificates) == -1)
+      return -1;
+    if (nbd_unlocked_set_tls_verify_peer (conn, h->tls_verify_peer) == -1)
+      return -1;
+    if (h->tls_username &&
+        nbd_unlocked_set_tls_username (conn, h->tls_username) == -1)
+      return -1;
+    if (h->tls_psk_file &&
+        nbd_unlocked_set_tls_psk_file (conn, h->tls_psk_file) == -1)
+      return -1;
+  }
+  if (nbd_unlocked_set_request_structured_replies (conn, h->request_sr) == -1)
+    return -1;
+  for (i = 0;
+       h->request_meta_contexts && h->request_meta_contexts[i];
+       ++i) {
+    if (nbd_unlocked_add_meta_context (conn,
+                                       h->request_meta_contexts[i]) == -1)
+      return -1;
+  }
+  /* After the handshake gflags holds the flags which were agreed. */
+  if (nbd_unlocked_set_handshake_flags (conn, h->gflags) == -1)
+    return -1;
+  conn->pipeline_handshake = h->pipeline_handshake;
+  conn->debug = h->debug;
+
+  return 0;
+}
+
+/* Commands and plain sockets cannot be reconnected. */
+bool
+nbd_internal_can_reconnect (struct nbd_handle *h)
+{
+  return (h->hostname && h->port) || h->connaddrlen > 0;
+}
+
+/* Open and connect one extra connection, named after h, kind and i
+ * for debugging.  Returns NULL on error.
+ */
+struct nbd_handle *
+nbd_internal_open_connection (struct nbd_handle *h, const char *kind,
+                              size_t i)
+{
+  struct nbd_handle *conn;
+  char *name = NULL;
+  int r;
+
+  conn = nbd_create ();
+  if (conn == NULL)
+    return NULL;
+  conn->parent = h;
+
+  if (asprintf (&name, "%s.%s%zu", h->hname, kind, i) == -1) {
+    set_error (errno, "asprintf");
+    goto err;
+  }
+  r = nbd_unlocked_set_handle_name (conn, name);
+  free (name);
+  if (r == -1)
+    goto err;
+
+  if (copy_settings (conn, h) == -1)
+    goto err;
+
+  if (h->hostname && h->port)
+    r = nbd_unlocked_aio_connect_tcp (conn, h->hostname, h->port);
+  else
+    r = nbd_unlocked_aio_connect (conn, (struct sockaddr *) &h->connaddr,
+                                  h->connaddrlen);
+  if (r == -1 || nbd_internal_wait_until_connected (conn) == -1)
+    goto err;
+
+  /* Make sure we really reached the same export. */
+  if (conn->exportsize != h->exportsize || conn->eflags != h->eflags) {
+    set_error (EINVAL, "export size or flags differ on extra connection");
+    goto err;
+  }
+
+  return conn;
+
+ err:
+  nbd_close (conn);
+  return NULL;
+}
+
+/* Called when h has connected.  Open the extra connections requested
+ * by nbd_set_multi_conn, if the server and the connection method
+ * allow it.  Failing to open an extra connection is not an error, we
+ * just carry on with fewer connections.
+ */
+int
+nbd_internal_open_connections (struct nbd_handle *h)
+{
+  const char *context = nbd_internal_get_error_context ();
+  struct nbd_handle *conn;
+  size_t i;
+
+  if (h->parent != NULL || h->multi_conn <= 1 || h->nr_conns > 0)
+    return 0;
+
+  if ((h->eflags & NBD_FLAG_CAN_MULTI_CONN) == 0) {
+    debug (h, "multi-conn: server does not support multi-conn");
+    return 0;
+  }
+  if (!nbd_internal_can_reconnect (h)) {
+    debug (h, "multi-conn: connection method does not allow "
+           "extra connections");
+    return 0;
+  }
+
+  h->conns = calloc (h->multi_conn - 1, sizeof *h->conns);
+  if (h->conns == NULL) {
+    set_error (errno, "calloc");
+    return -1;
+  }
+
+  for (i = 1; i < h->multi_conn; ++i) {
+    conn = nbd_internal_open_connection (h, "conn", i);
+    /* nbd_create and nbd_close change the error context. */
+    nbd_internal_set_error_context (context);
+    if (conn == NULL) {
+      debug (h, "multi-conn: could not open connection %zu: %s",
+             i, nbd_get_error ());
+      break;
+    }
+    h->conns[h->nr_conns++] = conn;
+  }
+
+  debug (h, "multi-conn: using %zu connections", h->nr_conns + 1);
+  return 0;
+}
+
+void
+nbd_internal_close_connections (struct nbd_handle *h)
+{
+  size_t i;
+
+  for (i = 0; i < h->nr_conns; ++i)
+    nbd_close (h->conns[i]);
+  free (h->conns);
+  h->conns = NULL;
+  h->nr_conns = 0;
+}
+
+static bool
+can_issue (struct nbd_handle *conn)
+{
+  return !conn->disconnect_request &&
+    (nbd_internal_is_state_ready (get_next_state (conn)) ||
+     nbd_internal_is_state_processing (get_next_state (conn)));
+}
+
+/* Choose the connection which should carry the next command: the one
+ * with the fewest commands in flight.  Ties are broken by starting
+ * the search at a different connection each time.  If no connection
+ * can accept commands, h is returned so that the caller reports the
+ * error from the main connection.
+ */
+struct nbd_handle *
+nbd_internal_pick_connection (struct nbd_handle *h)
+{
+  const size_t n = h->nr_conns + 1;
+  struct nbd_handle *best = NULL, *conn;
+  size_t i, j;
+
+  for (i = 0; i < n; ++i) {
+    j = (h->next_conn + i) % n;
+    conn = j == 0 ? h : h->conns[j-1];
+    if (can_issue (conn) &&
+        (best == NULL || conn->in_flight < best->in_flight))
+      best = conn;
+  }
+  h->next_conn = (h->next_conn + 1) % n;
+
+  return best ? best : h;
+}
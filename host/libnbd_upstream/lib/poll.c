@@ -26,38 +26,108 @@
 
 #include "internal.h"
 
-/* A simple main loop implementation using poll(2). */
+/* Send the commands queued by nbd_aio_begin_batch on all of the
+ * connections of the handle, since they must be sent before we wait
+ * for their replies.  Only a failure of h itself is returned.
+ */
 int
-nbd_unlocked_poll (struct nbd_handle *h, int timeout)
+nbd_internal_poll_prepare (struct nbd_handle *h)
 {
-  struct pollfd fds[1];
-  int r;
+  size_t i;
 
-  /* fd might be negative, and poll will ignore it. */
-  fds[0].fd = nbd_unlocked_aio_get_fd (h);
-  switch (nbd_internal_aio_get_direction (get_next_state (h))) {
+  for (i = 0; i < h->nr_conns; ++i) {
+    if (nbd_internal_issue_queued_commands (h->conns[i]) == -1)
+      debug (h->conns[i], "multi-conn: ignoring state machine failure");
+  }
+  return nbd_internal_issue_queued_commands (h);
+}
+
+/* Return the poll(2) events to wait for on conn, or 0 if there is
+ * nothing to wait for in the current state.
+ */
+short
+nbd_internal_poll_events (struct nbd_handle *conn)
+{
+  if (conn->sock == NULL)
+    return 0;
+
+  switch (nbd_internal_aio_get_direction (get_next_state (conn))) {
   case LIBNBD_AIO_DIRECTION_READ:
-    fds[0].events = POLLIN;
-    break;
+    return POLLIN;
   case LIBNBD_AIO_DIRECTION_WRITE:
-    fds[0].events = POLLOUT;
-    break;
+    return POLLOUT;
   case LIBNBD_AIO_DIRECTION_BOTH:
-    fds[0].events = POLLIN|POLLOUT;
-    break;
+    return POLLIN|POLLOUT;
   default:
+    return 0;
+  }
+}
+
+/* Notify conn of the events returned by poll(2). */
+int
+nbd_internal_poll_notify (struct nbd_handle *conn, short revents)
+{
+  /* POLLIN and POLLOUT might both be set.  However we shouldn't call
+   * both nbd_aio_notify_read and nbd_aio_notify_write at this time
+   * since the first might change the handle state, making the second
+   * notification invalid.  Nothing bad happens by ignoring one of the
+   * notifications since if it's still valid it will be picked up by a
+   * subsequent poll.  Prefer notifying on read, since the reply is
+   * for a command older than what we are trying to write.
+   */
+  if ((revents & (POLLIN | POLLHUP)) != 0)
+    return nbd_internal_run (conn, notify_read);
+  else if ((revents & POLLOUT) != 0)
+    return nbd_internal_run (conn, notify_write);
+  else if ((revents & (POLLERR | POLLNVAL)) != 0) {
+    set_error (ENOTCONN, "server closed socket unexpectedly");
+    return -1;
+  }
+  return 0;
+}
+
+/* A simple main loop implementation using poll(2).
+ *
+ * With multi-conn this polls all of the connections of the handle.
+ * Failures of the extra connections are not returned to the caller:
+ * the commands in flight on a failed connection complete with an
+ * error, and new commands are sent on the remaining connections.
+ */
+int
+nbd_unlocked_poll (struct nbd_handle *h, int timeout)
+{
+  struct pollfd fds[MAX_MULTI_CONN];
+  struct nbd_handle *conn;
+  size_t i, nr_fds = 0;
+  int r;
+
+  if (nbd_internal_poll_prepare (h) == -1)
+    return -1;
+
+  for (i = 0; i <= h->nr_conns; ++i) {
+    conn = i == 0 ? h : h->conns[i-1];
+    fds[i].events = nbd_internal_poll_events (conn);
+    fds[i].revents = 0;
+    /* poll ignores negative fds. */
+    if (fds[i].events != 0) {
+      fds[i].fd = conn->sock->ops->get_fd (conn->sock);
+      nr_fds++;
+    }
+    else
+      fds[i].fd = -1;
+  }
+  if (nr_fds == 0) {
     set_error (EINVAL, "nothing to poll for in state %s",
                nbd_internal_state_short_string (get_next_state (h)));
     return -1;
   }
-  fds[0].revents = 0;
   debug (h, "poll start: events=%x", fds[0].events);
 
   /* Note that it's not safe to release the handle lock here, as it
    * would allow other threads to close file descriptors which we have
    * passed to poll.
    */
-  r = poll (fds, 1, timeout);
+  r = poll (fds, h->nr_conns + 1, timeout);
   debug (h, "poll end: r=%d revents=%x", r, fds[0].revents);
   if (r == -1) {
     set_error (errno, "poll");
@@ -66,24 +136,18 @@ nbd_unlocked_poll (struct nbd_handle *h, int timeout)
   if (r == 0)
     return 0;
 
-  /* POLLIN and POLLOUT might both be set.  However we shouldn't call
-   * both nbd_aio_notify_read and nbd_aio_notify_write at this time
-   * since the first might change the handle state, making the second
-   * notification invalid.  Nothing bad happens by ignoring one of the
-   * notifications since if it's still valid it will be picked up by a
-   * subsequent poll.  Prefer notifying on read, since the reply is
-   * for a command older than what we are trying to write.
-   */
-  r = 0;
-  if ((fds[0].revents & (POLLIN | POLLHUP)) != 0)
-    r = nbd_unlocked_aio_notify_read (h);
-  else if ((fds[0].revents & POLLOUT) != 0)
-    r = nbd_unlocked_aio_notify_write (h);
-  else if ((fds[0].revents & (POLLERR | POLLNVAL)) != 0) {
-    set_error (ENOTCONN, "server closed socket unexpectedly");
-    return -1;
+  for (i = 0; i < h->nr_conns; ++i) {
+    conn = h->conns[i];
+    /* On a socket error let the state machine find the error, so
+     * that the connection moves to the dead state and is not polled
+     * again.
+     */
+    if ((fds[i+1].revents & (POLLERR | POLLNVAL)) != 0)
+      fds[i+1].revents |= fds[i+1].events;
+    if (nbd_internal_poll_notify (conn, fds[i+1].revents) == -1)
+      debug (conn, "multi-conn: connection failed: %s", nbd_get_error ());
   }
-  if (r == -1)
+  if (nbd_internal_poll_notify (h, fds[0].revents) == -1)
     return -1;
 
   return 1;
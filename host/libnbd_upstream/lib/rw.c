@@ -174,6 +174,10 @@ nbd_internal_command_common (struct nbd_handle *h,
 {
   struct command *cmd;
 
+  /* With multi-conn, send the command on the least busy connection. */
+  if (h->nr_conns > 0 && type != NBD_CMD_DISC)
+    h = nbd_internal_pick_connection (h);
+
   if (h->disconnect_request) {
       set_error (EINVAL, "cannot request more commands after NBD_CMD_DISC");
       return -1;
@@ -208,34 +212,33 @@ nbd_internal_command_common (struct nbd_handle *h,
     break;
   }
 
-  cmd = calloc (1, sizeof *cmd);
+  /* Make sure the command can be stored in the table of commands in
+   * flight when it is issued.
+   */
+  if (nbd_internal_command_table_reserve (&h->cmds_in_flight,
+                                          h->in_flight + 1) == -1) {
+    set_error (errno, "calloc");
+    return -1;
+  }
+
+  cmd = nbd_internal_alloc_command (h);
   if (cmd == NULL) {
     set_error (errno, "calloc");
     return -1;
   }
   cmd->flags = flags;
   cmd->type = type;
-  cmd->cookie = h->unique++;
+  cmd->cookie = (h->parent ? h->parent : h)->unique++;
   cmd->offset = offset;
   cmd->count = count;
   cmd->data = data;
   if (cb)
     cmd->cb = *cb;
 
-  /* If structured replies were negotiated then we trust the server to
-   * send back sufficient data to cover the whole buffer.  It's tricky
-   * to check this, so an easier thing is simply to zero the buffer
-   * ahead of time which avoids any security problems.  I measured the
-   * overhead of this and for non-TLS there is no measurable overhead
-   * in the highly intensive loopback case.  For TLS we get a
-   * performance gain, go figure.
-   */
-  if (h->structured_replies && cmd->data && type == NBD_CMD_READ)
-    memset (cmd->data, 0, cmd->count);
-
   /* Add the command to the end of the queue. Kick the state machine
-   * if there is no other command being processed, otherwise, it will
-   * be handled automatically on a future cycle around to READY.
+   * if there is no other command being processed and we are not
+   * batching, otherwise, it will be handled automatically on a future
+   * cycle around to READY or by nbd_aio_end_batch.
    * Beyond this point, we have to return a cookie to the user, since
    * we are queuing the command, even if kicking the state machine
    * detects a failure.  Not reporting a state machine failure here is
@@ -245,20 +248,33 @@ nbd_internal_command_common (struct nbd_handle *h,
    */
   h->in_flight++;
   if (h->cmds_to_issue != NULL) {
-    assert (nbd_internal_is_state_processing (get_next_state (h)));
+    assert (h->in_batch ||
+            nbd_internal_is_state_processing (get_next_state (h)));
     h->cmds_to_issue_tail = h->cmds_to_issue_tail->next = cmd;
   }
   else {
     assert (h->cmds_to_issue_tail == NULL);
     h->cmds_to_issue = h->cmds_to_issue_tail = cmd;
-    if (nbd_internal_is_state_ready (get_next_state (h)) &&
-        nbd_internal_run (h, cmd_issue) == -1)
+    if (!h->in_batch &&
+        nbd_internal_issue_queued_commands (h) == -1)
       debug (h, "command queued, ignoring state machine failure");
   }
 
   return cmd->cookie;
 }
 
+/* Kick the state machine to issue queued commands, if it is waiting
+ * in the READY state.
+ */
+int
+nbd_internal_issue_queued_commands (struct nbd_handle *h)
+{
+  if (h->cmds_to_issue != NULL &&
+      nbd_internal_is_state_ready (get_next_state (h)))
+    return nbd_internal_run (h, cmd_issue);
+  return 0;
+}
+
 int64_t
 nbd_unlocked_aio_pread (struct nbd_handle *h, void *buf,
                         size_t count, uint64_t offset,
@@ -305,6 +321,47 @@ nbd_unlocked_aio_pread_structured (struct nbd_handle *h, void *buf,
                                       buf, &cb);
 }
 
+int64_t
+nbd_unlocked_aio_pread_registered (struct nbd_handle *h, uint64_t count,
+                                   uint64_t offset,
+                                   nbd_buffer_callback buffer,
+                                   nbd_completion_callback completion,
+                                   uint32_t flags)
+{
+  struct command_cb cb = { .buffer = buffer,
+                           .completion = completion,
+                           .registered = true };
+  void *buf;
+  int64_t cookie;
+
+  if (flags != 0) {
+    set_error (EINVAL, "invalid flag: %" PRIu32, flags);
+    return -1;
+  }
+
+  if (h->nr_buffers == 0) {
+    set_error (EINVAL, "no buffers are registered");
+    return -1;
+  }
+  if (count > h->buffer_size) {
+    set_error (ERANGE, "request too large: registered buffer size is %"
+               PRIu32, h->buffer_size);
+    return -1;
+  }
+
+  buf = nbd_internal_get_buffer (h, &cb.slot);
+  if (buf == NULL) {
+    set_error (ENOBUFS, "all registered buffers are in use");
+    return -1;
+  }
+
+  cookie = nbd_internal_command_common (h, 0, NBD_CMD_READ, offset, count,
+                                        buf, &cb);
+  if (cookie == -1)
+    nbd_internal_put_buffer (h, cb.slot);
+  return cookie;
+}
+
 int64_t
 nbd_unlocked_aio_pwrite (struct nbd_handle *h, const void *buf,
                          size_t count, uint64_t offset,
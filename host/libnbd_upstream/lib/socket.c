@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
@@ -57,6 +58,23 @@ socket_send (struct nbd_handle *h,
   return r;
 }
 
+static ssize_t
+socket_sendv (struct nbd_handle *h, struct socket *sock,
+              const struct iovec *iov, int iovcnt, int flags)
+{
+  struct msghdr msg;
+  ssize_t r;
+
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = (struct iovec *) iov;
+  msg.msg_iovlen = iovcnt;
+
+  r = sendmsg (sock->u.fd, &msg, flags | MSG_NOSIGNAL);
+  if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+    set_error (errno, "sendmsg");
+  return r;
+}
+
 static int
 socket_get_fd (struct socket *sock)
 {
@@ -84,6 +102,7 @@ socket_close (struct socket *sock)
 static struct socket_ops socket_ops = {
   .recv = socket_recv,
   .send = socket_send,
+  .sendv = socket_sendv,
   .get_fd = socket_get_fd,
   .shut_writes = socket_shut_writes,
   .close = socket_close,
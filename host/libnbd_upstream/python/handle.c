@@ -31,6 +31,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 
 #include <libnbd.h>
@@ -42,14 +43,39 @@
 static inline PyObject *
 put_handle (struct nbd_handle *h)
 {
+  struct py_handle *py_h;
+  PyObject *ret;
+
   assert (h);
-  return PyCapsule_New ((void *) h, "nbd_handle", NULL);
+  py_h = calloc (1, sizeof *py_h);
+  if (py_h == NULL)
+    return PyErr_NoMemory ();
+  py_h->h = h;
+
+  ret = PyCapsule_New ((void *) py_h, "nbd_handle", NULL);
+  if (ret == NULL)
+    free (py_h);
+  return ret;
+}
+
+/* Drop the buffer registered with nbd_register_buffers, once libnbd
+ * no longer uses it.
+ */
+static void
+release_registered_buffer (struct py_handle *py_h)
+{
+  if (py_h->registered_buf != NULL) {
+    PyBuffer_Release (&py_h->registered_view);
+    Py_DECREF (py_h->registered_buf);
+    py_h->registered_buf = NULL;
+  }
 }
 
 PyObject *
 nbd_internal_py_create (PyObject *self, PyObject *args)
 {
   struct nbd_handle *h;
+  PyObject *ret;
 
   if (!PyArg_ParseTuple (args, (char *) ":nbd_create"))
     return NULL;
@@ -59,25 +85,186 @@ nbd_internal_py_create (PyObject *self, PyObject *args)
     return NULL;
   }
 
-  return put_handle (h);
+  ret = put_handle (h);
+  if (ret == NULL)
+    nbd_close (h);
+  return ret;
 }
 
 PyObject *
 nbd_internal_py_close (PyObject *self, PyObject *args)
 {
   PyObject *py_h;
-  struct nbd_handle *h;
+  struct py_handle *h;
 
   if (!PyArg_ParseTuple (args, (char *) "O:nbd_close", &py_h))
     return NULL;
-  h = get_handle (py_h);
+  h = get_py_handle (py_h);
+
+  Py_BEGIN_ALLOW_THREADS
+  nbd_close (h->h);
+  Py_END_ALLOW_THREADS
+  release_registered_buffer (h);
+  free (h);
+
+  Py_INCREF (Py_None);
+  return Py_None;
+}
+
+/* nbd_register_buffers keeps using the memory after it returns, so
+ * unlike the generated bindings for calls with persistent buffers
+ * (which hand the buffer to the completion callback), this holds the
+ * buffer view and a reference on the buffer object.  The view stops a
+ * bytearray from being resized or freed while libnbd may write into
+ * it.  They are released by nbd_unregister_buffers, by registering
+ * another buffer, or by closing the handle.
+ */
+PyObject *
+nbd_internal_py_register_buffers (PyObject *self, PyObject *args)
+{
+  PyObject *py_h;
+  struct py_handle *h;
+  PyObject *buf; /* nbd.Buffer or any buffer protocol object */
+  Py_buffer view;
+  unsigned int buffer_size; /* really uint32_t */
+  int ret;
+
+  if (!PyArg_ParseTuple (args, (char *) "OOI:nbd_register_buffers",
+                         &py_h, &buf, &buffer_size))
+    return NULL;
+  h = get_py_handle (py_h);
+
+  if (nbd_internal_py_get_buffer_view (buf, true, &view) == -1)
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  ret = nbd_register_buffers (h->h, view.buf, view.len, buffer_size);
+  Py_END_ALLOW_THREADS
+  if (ret == -1) {
+    PyBuffer_Release (&view);
+    raise_exception ();
+    return NULL;
+  }
+
+  release_registered_buffer (h);
+  Py_INCREF (buf);
+  h->registered_buf = buf;
+  h->registered_view = view;
+
+  Py_INCREF (Py_None);
+  return Py_None;
+}
+
+PyObject *
+nbd_internal_py_unregister_buffers (PyObject *self, PyObject *args)
+{
+  PyObject *py_h;
+  struct py_handle *h;
+  int ret;
 
-  nbd_close (h);
+  if (!PyArg_ParseTuple (args, (char *) "O:nbd_unregister_buffers", &py_h))
+    return NULL;
+  h = get_py_handle (py_h);
+
+  Py_BEGIN_ALLOW_THREADS
+  ret = nbd_unregister_buffers (h->h);
+  Py_END_ALLOW_THREADS
+  if (ret == -1) {
+    raise_exception ();
+    return NULL;
+  }
+
+  release_registered_buffer (h);
 
   Py_INCREF (Py_None);
   return Py_None;
 }
 
+/* Retire up to max completed commands, saving their cookies and
+ * errors.  Returns the number of commands retired.
+ */
+static Py_ssize_t
+retire_completed (struct nbd_handle *h, Py_ssize_t max,
+                  int64_t *cookies, int *errors)
+{
+  Py_ssize_t n = 0;
+  int64_t cookie;
+
+  while (n < max) {
+    cookie = nbd_aio_peek_command_completed (h);
+    if (cookie <= 0)
+      break;
+    if (nbd_aio_command_completed (h, cookie) == -1)
+      errors[n] = nbd_get_errno ();
+    else
+      errors[n] = 0;
+    cookies[n++] = cookie;
+  }
+  return n;
+}
+
+/* Poll the handle if nothing has completed yet, then return the
+ * completed commands as a list of (cookie, errnum) tuples.  This
+ * saves a Python call (or a Python callback) per command.
+ */
+PyObject *
+nbd_internal_py_poll_completions (PyObject *self, PyObject *args)
+{
+  PyObject *py_h, *py_ret = NULL, *item;
+  struct nbd_handle *h;
+  Py_ssize_t max, n, i;
+  int timeout, r = 0;
+  int64_t *cookies;
+  int *errors;
+
+  if (!PyArg_ParseTuple (args, (char *) "Oni:nbd_poll_completions",
+                         &py_h, &max, &timeout))
+    return NULL;
+  h = get_handle (py_h);
+
+  if (max <= 0) {
+    PyErr_SetString (PyExc_ValueError, "max must be > 0");
+    return NULL;
+  }
+  cookies = malloc (max * sizeof *cookies);
+  errors = malloc (max * sizeof *errors);
+  if (cookies == NULL || errors == NULL) {
+    PyErr_NoMemory ();
+    goto out;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  n = retire_completed (h, max, cookies, errors);
+  if (n == 0 && nbd_aio_in_flight (h) > 0) {
+    r = nbd_poll (h, timeout);
+    if (r >= 0)
+      n = retire_completed (h, max, cookies, errors);
+  }
+  Py_END_ALLOW_THREADS
+  if (r == -1) {
+    raise_exception ();
+    goto out;
+  }
+
+  py_ret = PyList_New (n);
+  if (py_ret == NULL)
+    goto out;
+  for (i = 0; i < n; ++i) {
+    item = Py_BuildValue ("(Li)", (long long) cookies[i], errors[i]);
+    if (item == NULL) {
+      Py_DECREF (py_ret);
+      py_ret = NULL;
+      goto out;
+    }
+    PyList_SET_ITEM (py_ret, i, item);
+  }
+
+ out:
+  free (cookies);
+  free (errors);
+  return py_ret;
+}
+
 static const char aio_buffer_name[] = "nbd.Buffer";
 
 struct py_aio_buffer *
@@ -86,6 +273,30 @@ nbd_internal_py_get_aio_buffer (PyObject *capsule)
   return PyCapsule_GetPointer (capsule, aio_buffer_name);
 }
 
+/* Get a view of a persistent buffer parameter, which is either an
+ * nbd.Buffer or any object supporting the buffer protocol, such as a
+ * bytearray, memoryview or numpy array.  The memory is used in place,
+ * not copied.  The view must be released with PyBuffer_Release.
+ */
+int
+nbd_internal_py_get_buffer_view (PyObject *obj, bool writable,
+                                 Py_buffer *view)
+{
+  struct py_aio_buffer *buf;
+
+  if (PyCapsule_CheckExact (obj)) {
+    buf = nbd_internal_py_get_aio_buffer (obj);
+    if (buf == NULL)
+      return -1;
+    /* The capsule owns the memory, so the view holds no reference. */
+    return PyBuffer_FillInfo (view, NULL, buf->data, buf->len, 0,
+                              PyBUF_SIMPLE);
+  }
+
+  return PyObject_GetBuffer (obj, view,
+                             writable ? PyBUF_WRITABLE : PyBUF_SIMPLE);
+}
+
 static void
 free_aio_buffer (PyObject *capsule)
 {
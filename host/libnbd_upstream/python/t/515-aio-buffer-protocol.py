@@ -0,0 +1,68 @@
+# libnbd Python bindings
+# Copyright (C) 2010-2020 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+# Any object supporting the buffer protocol can be used as a
+# persistent buffer, and is read into or written from in place.
+
+import nbd
+
+h = nbd.NBD ()
+h.connect_command (["nbdkit", "-s", "--exit-with-parent", "-v",
+                    "memory", "size=1M"])
+
+wbuf = bytearray (b'abcd' * 1024)
+cookie = h.aio_pwrite (memoryview (wbuf)[1024:3072], 4096)
+while not (h.aio_command_completed (cookie)):
+    h.poll (-1)
+
+# Read into a slice of a larger bytearray through a memoryview.
+rbuf = bytearray (8192)
+cookie = h.aio_pread (memoryview (rbuf)[100:2148], 4096)
+while not (h.aio_command_completed (cookie)):
+    h.poll (-1)
+assert rbuf[:100] == bytearray (100)
+assert rbuf[100:2148] == wbuf[1024:3072]
+assert rbuf[2148:] == bytearray (8192 - 2148)
+
+# A bytearray cannot be resized while a command is using it.
+rbuf = bytearray (512)
+cookie = h.aio_pread (rbuf, 0)
+try:
+    rbuf.extend (b'x')
+    assert False
+except BufferError:
+    pass
+while not (h.aio_command_completed (cookie)):
+    h.poll (-1)
+rbuf.extend (b'x')
+
+# Read-only objects can be written but not read into.
+cookie = h.aio_pwrite (b'x' * 512, 0)
+while not (h.aio_command_completed (cookie)):
+    h.poll (-1)
+try:
+    h.aio_pread (b'\0' * 512, 0)
+    assert False
+except BufferError:
+    pass
+
+# nbd.Buffer still works.
+buf = nbd.Buffer (512)
+cookie = h.aio_pread (buf, 0)
+while not (h.aio_command_completed (cookie)):
+    h.poll (-1)
+assert buf.to_bytearray () == b'x' * 512
@@ -0,0 +1,68 @@
+# libnbd Python bindings
+# Copyright (C) 2010-2020 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+# Retire completed commands in bulk with nbd.poll_completions, while
+# another thread runs Python code (which needs the GIL to be released
+# while libnbd waits).
+
+import errno
+import threading
+import nbd
+
+h = nbd.NBD ()
+h.connect_command (["nbdkit", "-s", "--exit-with-parent", "-v",
+                    "memory", "size=1M"])
+
+# Nothing in flight.
+assert h.poll_completions () == []
+
+ticks = 0
+done = False
+def ticker ():
+    global ticks
+    while not done:
+        ticks += 1
+
+t = threading.Thread (target=ticker)
+t.start ()
+
+bufs = [bytearray (4096) for i in range (100)]
+cookies = set ()
+for i, buf in enumerate (bufs):
+    cookies.add (h.aio_pread (buf, i * 4096))
+# This one fails because it is beyond the end of the disk.
+bad = h.aio_pread (bytearray (4096), 1024 * 1024)
+cookies.add (bad)
+
+completed = []
+while h.aio_in_flight () > 0:
+    r = h.poll_completions (16)
+    assert len (r) <= 16
+    completed += r
+completed += h.poll_completions (1000)
+
+done = True
+t.join ()
+
+assert set (c for c, err in completed) == cookies
+assert len (completed) == len (cookies)
+for c, err in completed:
+    if c == bad:
+        assert err == errno.EINVAL
+    else:
+        assert err == 0
+assert ticks > 0
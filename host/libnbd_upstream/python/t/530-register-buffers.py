@@ -0,0 +1,70 @@
+# libnbd Python bindings
+# Copyright (C) 2010-2020 Red Hat Inc.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+# The handle keeps a registered buffer alive and pinned, even after
+# the caller has dropped its own reference.
+
+import gc
+import nbd
+
+h = nbd.NBD ()
+h.connect_command (["nbdkit", "-s", "--exit-with-parent", "-v",
+                    "pattern", "size=1M"])
+
+# While it is registered a bytearray cannot be resized.
+regbuf = bytearray (4 * 4096)
+h.register_buffers (regbuf, 4096)
+try:
+    regbuf.extend (b'x')
+    assert False
+except BufferError:
+    pass
+
+# Drop the last reference held by the caller.  libnbd must still be
+# able to read into the memory.
+del regbuf
+gc.collect ()
+for i in range (100):
+    junk = bytearray (4 * 4096)
+
+expected = b''.join ([i.to_bytes (8, 'big') for i in range (8192, 12288, 8)])
+seen = []
+
+def buffer (slot, buf, offset, error):
+    assert offset == 8192
+    assert buf == expected
+    seen.append (slot)
+    return 0
+
+for i in range (8):
+    cookie = h.aio_pread_registered (4096, 8192, buffer)
+    while not (h.aio_command_completed (cookie)):
+        h.poll (-1)
+    h.release_buffer (seen[-1])
+assert len (seen) == 8
+
+# After unregistering, the bytearray is released and can be resized.
+regbuf = bytearray (2 * 4096)
+h.register_buffers (regbuf, 4096)
+h.unregister_buffers ()
+regbuf.extend (b'x')
+
+# Registering a new buffer releases the old one.
+old = bytearray (4096)
+h.register_buffers (old, 4096)
+h.register_buffers (bytearray (4096), 4096)
+old.extend (b'x')
@@ -0,0 +1,179 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Issue a batch of mixed commands with nbd_aio_begin_batch and
+ * nbd_aio_end_batch and check that they all complete correctly, and
+ * that the writes are sent together with the other commands.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <libnbd.h>
+
+/* More than MAX_ISSUE_BATCH in lib/internal.h, so that the headers
+ * are sent in several bursts.
+ */
+#define NR_COMMANDS 200
+#define BLOCK 512
+
+static char wbuf[NR_COMMANDS][BLOCK];
+static char rbuf[NR_COMMANDS][BLOCK];
+
+/* Count the bursts of commands sent while counting is set. */
+static bool counting;
+static int nr_bursts;
+
+static int
+debug_fn (void *user_data, const char *context, const char *msg)
+{
+  if (counting &&
+      strcmp (msg, "transition: ISSUE_COMMAND.START -> "
+              "ISSUE_COMMAND.SEND_REQUEST") == 0)
+    nr_bursts++;
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  int64_t cookies[NR_COMMANDS];
+  size_t i;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent",
+                        "memory", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_debug (nbd, true) == -1 ||
+      nbd_set_debug_callback (nbd,
+                              (nbd_debug_callback) { .callback = debug_fn })
+      == -1 ||
+      nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_COMMANDS; ++i)
+    memset (wbuf[i], 'a' + i % 26, BLOCK);
+
+  /* Batch of writes, with a zero every 8 blocks.  The payloads of the
+   * writes are sent with the headers, so this should only need about
+   * one burst per MAX_ISSUE_BATCH commands.  Being interrupted to
+   * read replies adds a few more.
+   */
+  if (nbd_aio_begin_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (i % 8 == 0)
+      cookies[i] = nbd_aio_zero (nbd, BLOCK, i * BLOCK,
+                                 NBD_NULL_COMPLETION, 0);
+    else
+      cookies[i] = nbd_aio_pwrite (nbd, wbuf[i], BLOCK, i * BLOCK,
+                                   NBD_NULL_COMPLETION, 0);
+    if (cookies[i] == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_aio_in_flight (nbd) != NR_COMMANDS) {
+    fprintf (stderr, "%s: test failed: nbd_aio_in_flight\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  counting = true;
+  if (nbd_aio_end_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  counting = false;
+  if (nr_bursts > NR_COMMANDS / 8) {
+    fprintf (stderr, "%s: test failed: writes were not coalesced, "
+             "%d bursts for %d commands\n", argv[0], nr_bursts, NR_COMMANDS);
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (nbd_aio_command_completed (nbd, cookies[i]) != 1) {
+      fprintf (stderr, "%s: test failed: write %zu: %s\n",
+               argv[0], i, nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Batch of reads, which can all be sent as one burst per
+   * MAX_ISSUE_BATCH commands.
+   */
+  if (nbd_aio_begin_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    cookies[i] = nbd_aio_pread (nbd, rbuf[i], BLOCK, i * BLOCK,
+                                NBD_NULL_COMPLETION, 0);
+    if (cookies[i] == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_aio_end_batch (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (nbd_aio_command_completed (nbd, cookies[i]) != 1) {
+      fprintf (stderr, "%s: test failed: read %zu: %s\n",
+               argv[0], i, nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (i % 8 == 0)
+      memset (wbuf[i], 0, BLOCK);
+    if (memcmp (rbuf[i], wbuf[i], BLOCK) != 0) {
+      fprintf (stderr, "%s: test failed: unexpected data in block %zu\n",
+               argv[0], i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,201 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test reads into registered buffers with nbd_aio_pread_registered. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define NR_BUFFERS 4
+#define BUFFER_SIZE 65536
+
+static char pool[NR_BUFFERS * BUFFER_SIZE + 100];
+static char wbuf[BUFFER_SIZE];
+
+static bool slot_used[NR_BUFFERS];
+static unsigned calls;
+static unsigned last_slot;
+
+static int
+got_buffer (void *user_data, unsigned slot, const void *buf, size_t count,
+            uint64_t offset, int *error)
+{
+  if (*error) {
+    fprintf (stderr, "unexpected error in read at %" PRIu64 ": %s\n",
+             offset, strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  if (slot >= NR_BUFFERS || slot_used[slot] ||
+      buf != pool + (size_t) slot * BUFFER_SIZE) {
+    fprintf (stderr, "unexpected buffer slot %u\n", slot);
+    exit (EXIT_FAILURE);
+  }
+  slot_used[slot] = true;
+  last_slot = slot;
+
+  /* Block n of the disk is filled with 'a' + n. */
+  if (count != BUFFER_SIZE ||
+      *(const char *) buf != 'a' + offset / BUFFER_SIZE ||
+      memcmp (buf, (char *) buf + 1, count - 1) != 0) {
+    fprintf (stderr, "unexpected data in read at %" PRIu64 "\n", offset);
+    exit (EXIT_FAILURE);
+  }
+
+  calls++;
+  return 0;
+}
+
+static void
+check_error (struct nbd_handle *nbd, int r, int err, const char *what)
+{
+  if (r != -1 || nbd_get_errno () != err) {
+    fprintf (stderr, "test failed: %s: expected %s, got %d (%s)\n",
+             what, strerror (err), r, nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent",
+                        "memory", "size=1m", NULL };
+  nbd_buffer_callback buffer = { .callback = got_buffer };
+  int64_t cookies[NR_BUFFERS];
+  size_t i;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_BUFFERS; ++i) {
+    memset (wbuf, 'a' + i, sizeof wbuf);
+    if (nbd_pwrite (nbd, wbuf, sizeof wbuf, i * BUFFER_SIZE, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Nothing registered yet. */
+  check_error (nbd,
+               nbd_aio_pread_registered (nbd, BUFFER_SIZE, 0, buffer,
+                                         NBD_NULL_COMPLETION, 0),
+               EINVAL, "read without registered buffers");
+
+  /* The extra 100 bytes at the end of the pool are not used. */
+  if (nbd_register_buffers (nbd, pool, sizeof pool, BUFFER_SIZE) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  check_error (nbd,
+               nbd_aio_pread_registered (nbd, BUFFER_SIZE + 1, 0, buffer,
+                                         NBD_NULL_COMPLETION, 0),
+               ERANGE, "read larger than the buffer size");
+
+  /* Use every buffer, then check that one more read is refused. */
+  for (i = 0; i < NR_BUFFERS; ++i) {
+    cookies[i] = nbd_aio_pread_registered (nbd, BUFFER_SIZE, i * BUFFER_SIZE,
+                                           buffer, NBD_NULL_COMPLETION, 0);
+    if (cookies[i] == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  check_error (nbd,
+               nbd_aio_pread_registered (nbd, BUFFER_SIZE, 0, buffer,
+                                         NBD_NULL_COMPLETION, 0),
+               ENOBUFS, "read with all buffers in use");
+
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < NR_BUFFERS; ++i) {
+    if (nbd_aio_command_completed (nbd, cookies[i]) != 1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (calls != NR_BUFFERS) {
+    fprintf (stderr, "test failed: buffer callback called %u times\n", calls);
+    exit (EXIT_FAILURE);
+  }
+
+  /* The buffers stay reserved after the commands are retired. */
+  check_error (nbd, nbd_unregister_buffers (nbd), EBUSY,
+               "unregister with buffers in use");
+  check_error (nbd,
+               nbd_aio_pread_registered (nbd, BUFFER_SIZE, 0, buffer,
+                                         NBD_NULL_COMPLETION, 0),
+               ENOBUFS, "read before releasing a buffer");
+
+  for (i = 0; i < NR_BUFFERS; ++i) {
+    if (nbd_release_buffer (nbd, i) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    slot_used[i] = false;
+  }
+  check_error (nbd, nbd_release_buffer (nbd, 0), EINVAL,
+               "release a buffer twice");
+
+  /* A released buffer can be used again. */
+  if (nbd_aio_pread_registered (nbd, BUFFER_SIZE, 3 * BUFFER_SIZE, buffer,
+                                NBD_NULL_COMPLETION, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (calls != NR_BUFFERS + 1 || nbd_release_buffer (nbd, last_slot) == -1 ||
+      nbd_unregister_buffers (nbd) == -1) {
+    fprintf (stderr, "test failed: reusing a released buffer: %s\n",
+             nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,243 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2019 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test kernel TLS offload.  nbdkit runs on a TCP socket (which kTLS
+ * needs) and libnbd should offload both directions to the kernel.
+ * The test is skipped if the kernel does not have the tls module, or
+ * if TLS 1.3 is negotiated since kTLS is only used with TLS 1.2.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <libnbd.h>
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+#define SIZE (1024 * 1024)
+#define NR_COMMANDS 64
+#define BLOCK 4096
+
+static bool ktls_enabled, ktls_unsupported_version;
+
+static int
+debug_fn (void *user_data, const char *context, const char *msg)
+{
+  if (strcmp (msg, "kTLS enabled for: send recv") == 0)
+    ktls_enabled = true;
+  else if (strncmp (msg, "kTLS: unsupported protocol version", 34) == 0)
+    ktls_unsupported_version = true;
+  return 0;
+}
+
+/* Return a connected pair of TCP sockets over the loopback
+ * interface.
+ */
+static void
+tcp_pair (int fds[2])
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof addr;
+  int lsock;
+
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  lsock = socket (AF_INET, SOCK_STREAM, 0);
+  if (lsock == -1 ||
+      bind (lsock, (struct sockaddr *) &addr, sizeof addr) == -1 ||
+      listen (lsock, 1) == -1 ||
+      getsockname (lsock, (struct sockaddr *) &addr, &len) == -1) {
+    perror ("listen");
+    exit (EXIT_FAILURE);
+  }
+  fds[0] = socket (AF_INET, SOCK_STREAM, 0);
+  if (fds[0] == -1 ||
+      connect (fds[0], (struct sockaddr *) &addr, sizeof addr) == -1) {
+    perror ("connect");
+    exit (EXIT_FAILURE);
+  }
+  fds[1] = accept (lsock, NULL, NULL);
+  if (fds[1] == -1) {
+    perror ("accept");
+    exit (EXIT_FAILURE);
+  }
+  close (lsock);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  static char wbuf[NR_COMMANDS][BLOCK], rbuf[NR_COMMANDS][BLOCK];
+  static char buf[SIZE];
+  int64_t cookies[NR_COMMANDS];
+  int fds[2], status;
+  pid_t pid;
+  size_t i;
+
+  /* Skip the test unless the kernel can attach the TLS layer. */
+  tcp_pair (fds);
+  if (setsockopt (fds[0], SOL_TCP, TCP_ULP, "tls", sizeof "tls") == -1) {
+    fprintf (stderr, "%s: test skipped: kernel tls module: %s\n",
+             argv[0], strerror (errno));
+    exit (77);
+  }
+  close (fds[0]);
+  close (fds[1]);
+
+  /* Run nbdkit on one end of a TCP connection.  nbdkit does not use
+   * kTLS itself when stdin and stdout are used, so this also checks
+   * that records sent by the kernel can be read by GnuTLS.
+   */
+  tcp_pair (fds);
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    exit (EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    close (fds[0]);
+    dup2 (fds[1], 0);
+    dup2 (fds[1], 1);
+    close (fds[1]);
+    execlp ("nbdkit", "nbdkit", "-s", "--exit-with-parent",
+            "--tls=require", "--tls-psk=keys.psk",
+            "memory", "size=1M", NULL);
+    perror ("nbdkit");
+    _exit (EXIT_FAILURE);
+  }
+  close (fds[1]);
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_debug (nbd, true) == -1 ||
+      nbd_set_debug_callback (nbd,
+                              (nbd_debug_callback) { .callback = debug_fn })
+      == -1 ||
+      nbd_set_tls (nbd, LIBNBD_TLS_REQUIRE) == -1 ||
+      nbd_set_tls_username (nbd, "alice") == -1 ||
+      nbd_set_tls_psk_file (nbd, "keys.psk") == -1 ||
+      nbd_connect_socket (nbd, fds[0]) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (ktls_unsupported_version) {
+    fprintf (stderr, "%s: test skipped: kTLS needs TLS 1.2\n", argv[0]);
+    nbd_close (nbd);
+    exit (77);
+  }
+  if (!ktls_enabled) {
+    fprintf (stderr, "%s: test failed: kTLS was not used\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Many writes in flight, then read them back in one request. */
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    memset (wbuf[i], 'a' + i % 26, BLOCK);
+    cookies[i] = nbd_aio_pwrite (nbd, wbuf[i], BLOCK, i * BLOCK,
+                                 NBD_NULL_COMPLETION, 0);
+    if (cookies[i] == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (nbd_aio_command_completed (nbd, cookies[i]) != 1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_pread (nbd, buf, SIZE, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (memcmp (&buf[i * BLOCK], wbuf[i], BLOCK) != 0) {
+      fprintf (stderr, "%s: test failed: unexpected data in block %zu\n",
+               argv[0], i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Small reads, so that several replies arrive in one record. */
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    cookies[i] = nbd_aio_pread (nbd, rbuf[i], 512, i * BLOCK,
+                                NBD_NULL_COMPLETION, 0);
+    if (cookies[i] == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (nbd_aio_command_completed (nbd, cookies[i]) != 1 ||
+        memcmp (rbuf[i], wbuf[i], 512) != 0) {
+      fprintf (stderr, "%s: test failed: read %zu\n", argv[0], i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* The close_notify is sent through the kernel. */
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  if (waitpid (pid, &status, 0) == -1) {
+    perror ("waitpid");
+    exit (EXIT_FAILURE);
+  }
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+    fprintf (stderr, "%s: test failed: nbdkit exited with status 0x%x\n",
+             argv[0], status);
+    exit (EXIT_FAILURE);
+  }
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,298 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test spare connections and nbd_failover. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libnbd.h>
+
+#define NR_SPARES 2
+
+static char wbuf[512], rbuf[512];
+
+static char script[] = "/tmp/libnbd-failover-scriptXXXXXX";
+static char sizefile[] = "/tmp/libnbd-failover-sizeXXXXXX";
+
+static void
+cleanup (void)
+{
+  unlink (script);
+  unlink (sizefile);
+}
+
+static void
+set_size (const char *size)
+{
+  FILE *fp = fopen (sizefile, "w");
+
+  if (fp == NULL || fprintf (fp, "%s\n", size) < 0 || fclose (fp) == EOF) {
+    perror (sizefile);
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Fail over to a server whose export has changed size, which must
+ * fail and leave the handle unconnected.
+ */
+static void
+test_size_changed (const char *progname)
+{
+  struct nbd_handle *nbd;
+  int fd;
+  const char *cmd[] = { "nbdkit", "--exit-with-parent", "sh", script, NULL };
+
+  if (atexit (cleanup) != 0) {
+    perror ("atexit");
+    exit (EXIT_FAILURE);
+  }
+  if ((fd = mkstemp (sizefile)) == -1 || close (fd) == -1 ||
+      (fd = mkstemp (script)) == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  if (dprintf (fd, "case $1 in\n"
+               "  get_size) cat %s ;;\n"
+               "  pread) dd if=/dev/zero count=$3 iflag=count_bytes ;;\n"
+               "  *) exit 2 ;;\n"
+               "esac\n", sizefile) < 0 ||
+      fchmod (fd, 0700) == -1 || close (fd) == -1) {
+    perror (script);
+    exit (EXIT_FAILURE);
+  }
+  set_size ("1m");
+
+  nbd = nbd_create ();
+  if (nbd == NULL ||
+      nbd_connect_systemd_socket_activation (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  set_size ("2m");
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_failover (nbd) != -1 || nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: test failed: nbd_failover should fail with "
+             "EINVAL when the export size changes\n", progname);
+    exit (EXIT_FAILURE);
+  }
+  if (!nbd_aio_is_closed (nbd) || nbd_get_size (nbd) != 1024 * 1024) {
+    fprintf (stderr, "%s: test failed: handle changed by failed failover\n",
+             progname);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Once the size is back, failover works. */
+  set_size ("1m");
+  if (nbd_failover (nbd) == -1 ||
+      nbd_pread (nbd, rbuf, sizeof rbuf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_close (nbd);
+}
+
+/* Close the connection of the handle, replace it, and check that the
+ * data can still be read.
+ */
+static void
+failover (struct nbd_handle *nbd, const char *progname)
+{
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_failover (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (!nbd_aio_is_ready (nbd)) {
+    fprintf (stderr, "%s: test failed: handle is not ready after failover\n",
+             progname);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_can_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) != 1) {
+    fprintf (stderr, "%s: test failed: meta context lost in failover\n",
+             progname);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_pread (nbd, rbuf, sizeof rbuf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (rbuf, wbuf, sizeof rbuf) != 0) {
+    fprintf (stderr, "%s: test failed: unexpected data after failover\n",
+             progname);
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Fail over a handle which is in an nbd_loop.  The new socket
+ * usually gets the fd number of the old one, and the loop must still
+ * notice that it has to be registered.
+ */
+static void
+test_loop (const char *progname)
+{
+  struct nbd_handle *nbd;
+  struct nbd_loop *loop;
+  int64_t cookie;
+  int fd, r;
+  const char *cmd[] = { "nbdkit", "--exit-with-parent",
+                        "memory", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  loop = nbd_loop_create ();
+  if (nbd == NULL || loop == NULL ||
+      nbd_connect_systemd_socket_activation (nbd, (char **) cmd) == -1 ||
+      nbd_loop_add (loop, nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  memset (wbuf, 'y', sizeof wbuf);
+  cookie = nbd_aio_pwrite (nbd, wbuf, sizeof wbuf, 0,
+                           NBD_NULL_COMPLETION, 0);
+  if (cookie == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_loop_poll (loop, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  fd = nbd_aio_get_fd (nbd);
+
+  if (nbd_shutdown (nbd, 0) == -1 || nbd_failover (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_get_fd (nbd) != fd)
+    fprintf (stderr, "%s: new connection has a different fd (%d, was %d)\n",
+             progname, nbd_aio_get_fd (nbd), fd);
+
+  /* If the loop did not register the new socket this times out. */
+  cookie = nbd_aio_pread (nbd, rbuf, sizeof rbuf, 0, NBD_NULL_COMPLETION, 0);
+  if (cookie == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    r = nbd_loop_poll (loop, 10000);
+    if (r == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (r == 0) {
+      fprintf (stderr, "%s: test failed: nbd_loop_poll timed out after "
+               "failover\n", progname);
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_aio_command_completed (nbd, cookie) != 1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (rbuf, wbuf, sizeof rbuf) != 0) {
+    fprintf (stderr, "%s: test failed: unexpected data after failover\n",
+             progname);
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_loop_close (loop);
+  nbd_close (nbd);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  size_t i;
+  const char *cmd[] = { "nbdkit", "--exit-with-parent",
+                        "memory", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_spare_connections (nbd) != 0) {
+    fprintf (stderr, "%s: test failed: default spare connections "
+             "should be 0\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_spare_connections (nbd, NR_SPARES) == -1 ||
+      nbd_set_pipeline_handshake (nbd, true) == -1 ||
+      nbd_add_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_systemd_socket_activation (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* A live connection cannot be replaced. */
+  if (nbd_failover (nbd) != -1) {
+    fprintf (stderr, "%s: test failed: nbd_failover succeeded while "
+             "connected\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  memset (wbuf, 'x', sizeof wbuf);
+  if (nbd_pwrite (nbd, wbuf, sizeof wbuf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Use up the spare connections, then fail over once more, which
+   * has to open a new connection.
+   */
+  for (i = 0; i <= NR_SPARES; ++i)
+    failover (nbd, argv[0]);
+
+  if (nbd_fill_spare_connections (nbd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  failover (nbd, argv[0]);
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  test_size_changed (argv[0]);
+  test_loop (argv[0]);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,313 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* A scripted NBD server for tests, see fake-server.h. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <libnbd.h>
+
+#include "byte-swapping.h"
+#include "fake-server.h"
+
+/* Time to pause between the pieces written by fake_server_flush. */
+#define PIECE_DELAY_USECS 20000
+
+static char *out;
+static size_t out_len, out_alloc;
+
+static void
+server_error (const char *msg)
+{
+  fprintf (stderr, "fake server: %s\n", msg);
+  _exit (EXIT_FAILURE);
+}
+
+static void
+read_all (int sock, void *buf, size_t len)
+{
+  char *p = buf;
+  ssize_t r;
+
+  while (len > 0) {
+    r = read (sock, p, len);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      server_error (r == 0 ? "unexpected end of file" : strerror (errno));
+    p += r;
+    len -= r;
+  }
+}
+
+static void
+write_all (int sock, const void *buf, size_t len)
+{
+  const char *p = buf;
+  ssize_t r;
+
+  while (len > 0) {
+    r = write (sock, p, len);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r == -1)
+      server_error (strerror (errno));
+    p += r;
+    len -= r;
+  }
+}
+
+static void
+append (const void *data, size_t len)
+{
+  if (out_len + len > out_alloc) {
+    out_alloc = (out_len + len) * 2;
+    out = realloc (out, out_alloc);
+    if (out == NULL)
+      server_error ("realloc");
+  }
+  memcpy (out + out_len, data, len);
+  out_len += len;
+}
+
+static void
+option_reply (int sock, uint32_t option, uint32_t reply,
+              const void *data, uint32_t len)
+{
+  struct nbd_fixed_new_option_reply hdr;
+
+  hdr.magic = htobe64 (NBD_REP_MAGIC);
+  hdr.option = htobe32 (option);
+  hdr.reply = htobe32 (reply);
+  hdr.replylen = htobe32 (len);
+  write_all (sock, &hdr, sizeof hdr);
+  write_all (sock, data, len);
+}
+
+/* Fixed newstyle handshake, negotiating only structured replies. */
+static void
+handshake (int sock, bool structured_replies, uint64_t size)
+{
+  struct nbd_new_handshake handshake;
+  struct nbd_new_option option;
+  struct nbd_fixed_new_option_reply_info_export info;
+  uint32_t cflags, opt, optlen;
+  char *data;
+
+  handshake.nbdmagic = htobe64 (NBD_MAGIC);
+  handshake.version = htobe64 (NBD_NEW_VERSION);
+  handshake.gflags = htobe16 (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+  write_all (sock, &handshake, sizeof handshake);
+  read_all (sock, &cflags, sizeof cflags);
+
+  for (;;) {
+    read_all (sock, &option, sizeof option);
+    if (be64toh (option.version) != NBD_NEW_VERSION)
+      server_error ("bad option magic");
+    opt = be32toh (option.option);
+    optlen = be32toh (option.optlen);
+    if (optlen > NBD_MAX_STRING * 2)
+      server_error ("option too long");
+    data = malloc (optlen);
+    if (data == NULL)
+      server_error ("malloc");
+    read_all (sock, data, optlen);
+    free (data);
+
+    switch (opt) {
+    case NBD_OPT_STRUCTURED_REPLY:
+      option_reply (sock, opt,
+                    structured_replies ? NBD_REP_ACK : NBD_REP_ERR_UNSUP,
+                    NULL, 0);
+      break;
+    case NBD_OPT_GO:
+      info.info = htobe16 (NBD_INFO_EXPORT);
+      info.exportsize = htobe64 (size);
+      info.eflags = htobe16 (NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY);
+      option_reply (sock, opt, NBD_REP_INFO, &info, sizeof info);
+      option_reply (sock, opt, NBD_REP_ACK, NULL, 0);
+      return;
+    case NBD_OPT_ABORT:
+      _exit (EXIT_SUCCESS);
+    default:
+      option_reply (sock, opt, NBD_REP_ERR_UNSUP, NULL, 0);
+    }
+  }
+}
+
+pid_t
+fake_server_connect (struct nbd_handle *nbd,
+                     bool structured_replies, uint64_t size,
+                     fake_server_script script)
+{
+  int sv[2];
+  pid_t pid;
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+    perror ("socketpair");
+    return -1;
+  }
+
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    return -1;
+  }
+  if (pid == 0) {               /* Child (server). */
+    struct nbd_request request;
+
+    close (sv[0]);
+    handshake (sv[1], structured_replies, size);
+    script (sv[1]);
+    /* The client must not send anything else. */
+    if (fake_server_recv_request (sv[1], &request))
+      server_error ("unexpected request after the script finished");
+    _exit (EXIT_SUCCESS);
+  }
+
+  close (sv[1]);
+  if (nbd_connect_socket (nbd, sv[0]) == -1) {
+    fake_server_wait (pid);
+    return -1;
+  }
+  return pid;
+}
+
+int
+fake_server_wait (pid_t pid)
+{
+  int status;
+
+  if (waitpid (pid, &status, 0) == -1) {
+    perror ("waitpid");
+    return -1;
+  }
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+    return -1;
+  return 0;
+}
+
+bool
+fake_server_recv_request (int sock, struct nbd_request *request)
+{
+  ssize_t r;
+
+  r = recv (sock, request, sizeof *request, MSG_WAITALL);
+  if (r == 0)
+    return false;
+  if (r != sizeof *request)
+    server_error ("short request");
+
+  request->magic = be32toh (request->magic);
+  request->flags = be16toh (request->flags);
+  request->type = be16toh (request->type);
+  request->handle = be64toh (request->handle);
+  request->offset = be64toh (request->offset);
+  request->count = be32toh (request->count);
+  if (request->magic != NBD_REQUEST_MAGIC)
+    server_error ("bad request magic");
+  if (request->type == NBD_CMD_DISC)
+    return false;
+  if (request->type != NBD_CMD_READ)
+    server_error ("unexpected request type");
+  return true;
+}
+
+void
+fake_server_simple_reply (uint64_t handle, uint32_t error,
+                          const void *data, size_t len)
+{
+  struct nbd_simple_reply reply;
+
+  reply.magic = htobe32 (NBD_SIMPLE_REPLY_MAGIC);
+  reply.error = htobe32 (error);
+  reply.handle = htobe64 (handle);
+  append (&reply, sizeof reply);
+  append (data, len);
+}
+
+static void
+chunk_header (uint64_t handle, uint16_t flags, uint16_t type, uint32_t len)
+{
+  struct nbd_structured_reply reply;
+
+  reply.magic = htobe32 (NBD_STRUCTURED_REPLY_MAGIC);
+  reply.flags = htobe16 (flags);
+  reply.type = htobe16 (type);
+  reply.handle = htobe64 (handle);
+  reply.length = htobe32 (len);
+  append (&reply, sizeof reply);
+}
+
+void
+fake_server_data_chunk (uint64_t handle, uint16_t flags, uint64_t offset,
+                        const void *data, uint32_t len)
+{
+  struct nbd_structured_reply_offset_data payload;
+
+  chunk_header (handle, flags, NBD_REPLY_TYPE_OFFSET_DATA,
+                sizeof payload + len);
+  payload.offset = htobe64 (offset);
+  append (&payload, sizeof payload);
+  append (data, len);
+}
+
+void
+fake_server_hole_chunk (uint64_t handle, uint16_t flags, uint64_t offset,
+                        uint32_t len)
+{
+  struct nbd_structured_reply_offset_hole payload;
+
+  chunk_header (handle, flags, NBD_REPLY_TYPE_OFFSET_HOLE, sizeof payload);
+  payload.offset = htobe64 (offset);
+  payload.length = htobe32 (len);
+  append (&payload, sizeof payload);
+}
+
+void
+fake_server_done_chunk (uint64_t handle)
+{
+  chunk_header (handle, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE, 0);
+}
+
+void
+fake_server_flush (int sock, const size_t *pieces, size_t nr_pieces)
+{
+  size_t i, pos = 0;
+
+  for (i = 0; i < nr_pieces && pos < out_len; ++i) {
+    size_t n = pieces[i] < out_len - pos ? pieces[i] : out_len - pos;
+
+    write_all (sock, out + pos, n);
+    pos += n;
+    usleep (PIECE_DELAY_USECS);
+  }
+  write_all (sock, out + pos, out_len - pos);
+  out_len = 0;
+}
@@ -0,0 +1,81 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* A scripted NBD server for tests which need replies that nbdkit
+ * would never send, such as read chunks out of order, or replies
+ * split at particular points.  The server runs in a child process on
+ * one end of a socketpair.  It does the newstyle handshake, then runs
+ * the test's script, which reads requests and formats replies into an
+ * output buffer, and then writes the buffer in whatever pieces it
+ * likes with fake_server_flush.
+ */
+
+#ifndef LIBNBD_TESTS_FAKE_SERVER_H
+#define LIBNBD_TESTS_FAKE_SERVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <libnbd.h>
+
+#include "nbd-protocol.h"
+
+/* Called in the server process after the handshake. */
+typedef void (*fake_server_script) (int sock);
+
+/* Connect nbd to a new server process running script.  If
+ * structured_replies is false, the server refuses
+ * NBD_OPT_STRUCTURED_REPLY.  Returns the pid of the server, or -1 on
+ * error (with the error in nbd_get_error).
+ */
+extern pid_t fake_server_connect (struct nbd_handle *nbd,
+                                  bool structured_replies, uint64_t size,
+                                  fake_server_script script);
+
+/* Wait for the server to exit.  Returns 0 if the script succeeded. */
+extern int fake_server_wait (pid_t pid);
+
+/* The following are called by scripts.  They exit the server process
+ * with an error if anything goes wrong.
+ */
+
+/* Read the next request, returned in host byte order.  Returns false
+ * if the client sent NBD_CMD_DISC or closed the connection.
+ */
+extern bool fake_server_recv_request (int sock, struct nbd_request *request);
+
+/* Append replies to the output buffer. */
+extern void fake_server_simple_reply (uint64_t handle, uint32_t error,
+                                      const void *data, size_t len);
+extern void fake_server_data_chunk (uint64_t handle, uint16_t flags,
+                                    uint64_t offset,
+                                    const void *data, uint32_t len);
+extern void fake_server_hole_chunk (uint64_t handle, uint16_t flags,
+                                    uint64_t offset, uint32_t len);
+extern void fake_server_done_chunk (uint64_t handle);
+
+/* Write the output buffer.  If pieces is not NULL, the buffer is
+ * written in nr_pieces writes of the given sizes (followed by
+ * whatever is left), pausing after each so that the client sees
+ * them in separate reads.
+ */
+extern void fake_server_flush (int sock, const size_t *pieces,
+                               size_t nr_pieces);
+
+#endif /* LIBNBD_TESTS_FAKE_SERVER_H */
@@ -0,0 +1,194 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Drive several handles, one of them using multi-conn, with a single
+ * nbd_loop and check that all of their commands complete correctly.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libnbd.h>
+
+#define NR_HANDLES 8
+#define NR_COMMANDS 64
+#define BLOCK 4096
+
+static char wbuf[NR_HANDLES][NR_COMMANDS][BLOCK];
+static char rbuf[NR_HANDLES][NR_COMMANDS][BLOCK];
+static int64_t cookies[NR_HANDLES][NR_COMMANDS];
+
+static int
+in_flight (struct nbd_handle **nbd)
+{
+  int i, r, n = 0;
+
+  for (i = 0; i < NR_HANDLES; ++i) {
+    r = nbd_aio_in_flight (nbd[i]);
+    if (r == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    n += r;
+  }
+  return n;
+}
+
+static void
+run_loop (struct nbd_loop *loop, struct nbd_handle **nbd)
+{
+  while (in_flight (nbd) > 0) {
+    if (nbd_loop_poll (loop, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd[NR_HANDLES];
+  struct nbd_loop *loop;
+  size_t i, j;
+  const char *cmd[] = { "nbdkit", "-s", "--exit-with-parent",
+                        "memory", "size=1m", NULL };
+  const char *sa_cmd[] = { "nbdkit", "--exit-with-parent",
+                           "memory", "size=1m", NULL };
+
+  loop = nbd_loop_create ();
+  if (loop == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_loop_set_busy_poll (loop, 50) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_HANDLES; ++i) {
+    nbd[i] = nbd_create ();
+    if (nbd[i] == NULL) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    /* The first handle uses multi-conn, so the loop must serve its
+     * extra connections too.
+     */
+    if (i == 0) {
+      if (nbd_set_multi_conn (nbd[i], 4) == -1 ||
+          nbd_connect_systemd_socket_activation (nbd[i],
+                                                 (char **) sa_cmd) == -1) {
+        fprintf (stderr, "%s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+    else if (nbd_connect_command (nbd[i], (char **) cmd) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (nbd_loop_add (loop, nbd[i]) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (nbd_loop_add (loop, nbd[0]) != -1 || nbd_get_errno () != EEXIST) {
+    fprintf (stderr, "%s: test failed: handle added to the loop twice\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Writes on every handle. */
+  for (i = 0; i < NR_HANDLES; ++i) {
+    for (j = 0; j < NR_COMMANDS; ++j) {
+      memset (wbuf[i][j], 'a' + (i + j) % 26, BLOCK);
+      cookies[i][j] = nbd_aio_pwrite (nbd[i], wbuf[i][j], BLOCK, j * BLOCK,
+                                      NBD_NULL_COMPLETION, 0);
+      if (cookies[i][j] == -1) {
+        fprintf (stderr, "%s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+  run_loop (loop, nbd);
+  for (i = 0; i < NR_HANDLES; ++i) {
+    for (j = 0; j < NR_COMMANDS; ++j) {
+      if (nbd_aio_command_completed (nbd[i], cookies[i][j]) != 1) {
+        fprintf (stderr, "%s: test failed: write %zu on handle %zu: %s\n",
+                 argv[0], j, i, nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  /* Reads on every handle. */
+  for (i = 0; i < NR_HANDLES; ++i) {
+    for (j = 0; j < NR_COMMANDS; ++j) {
+      cookies[i][j] = nbd_aio_pread (nbd[i], rbuf[i][j], BLOCK, j * BLOCK,
+                                     NBD_NULL_COMPLETION, 0);
+      if (cookies[i][j] == -1) {
+        fprintf (stderr, "%s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+  run_loop (loop, nbd);
+  for (i = 0; i < NR_HANDLES; ++i) {
+    for (j = 0; j < NR_COMMANDS; ++j) {
+      if (nbd_aio_command_completed (nbd[i], cookies[i][j]) != 1) {
+        fprintf (stderr, "%s: test failed: read %zu on handle %zu: %s\n",
+                 argv[0], j, i, nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+      if (memcmp (rbuf[i][j], wbuf[i][j], BLOCK) != 0) {
+        fprintf (stderr, "%s: test failed: "
+                 "unexpected data in block %zu on handle %zu\n",
+                 argv[0], j, i);
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  for (i = 0; i < NR_HANDLES; ++i) {
+    if (nbd_loop_remove (loop, nbd[i]) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (nbd_shutdown (nbd[i], 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    nbd_close (nbd[i]);
+  }
+
+  /* The loop is empty now. */
+  if (nbd_loop_poll (loop, 0) != -1) {
+    fprintf (stderr, "%s: test failed: polling an empty loop succeeded\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  nbd_loop_close (loop);
+  exit (EXIT_SUCCESS);
+}
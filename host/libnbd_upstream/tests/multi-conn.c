@@ -0,0 +1,276 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_set_multi_conn: open several connections to the server
+ * from one handle and check that commands spread over them complete
+ * correctly, both with nbd_poll and with a main loop using the
+ * nbd_aio_*_n calls.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <libnbd.h>
+
+#define NR_CONNS 4
+#define NR_COMMANDS 200
+#define BLOCK 4096
+
+static char wbuf[NR_COMMANDS][BLOCK];
+static char rbuf[NR_COMMANDS][BLOCK];
+
+/* Poll all of the connections of the handle once, as a program with
+ * its own main loop would.
+ */
+static void
+poll_all_conns (struct nbd_handle *nbd, const char *argv0)
+{
+  struct pollfd fds[NR_CONNS];
+  unsigned dir;
+  int i, n, r;
+
+  n = nbd_get_nr_connections (nbd);
+  for (i = 0; i < n; ++i) {
+    dir = nbd_aio_get_direction_n (nbd, i);
+    fds[i].events = 0;
+    if (dir & LIBNBD_AIO_DIRECTION_READ)
+      fds[i].events |= POLLIN;
+    if (dir & LIBNBD_AIO_DIRECTION_WRITE)
+      fds[i].events |= POLLOUT;
+    fds[i].fd = -1;
+    if (fds[i].events != 0) {
+      fds[i].fd = nbd_aio_get_fd_n (nbd, i);
+      if (fds[i].fd == -1) {
+        fprintf (stderr, "%s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+  }
+
+  r = poll (fds, n, 10000);
+  if (r == -1) {
+    perror ("poll");
+    exit (EXIT_FAILURE);
+  }
+  if (r == 0) {
+    fprintf (stderr, "%s: test failed: timed out waiting for replies\n",
+             argv0);
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < n; ++i) {
+    if ((fds[i].revents & (POLLIN | POLLHUP)) != 0)
+      r = nbd_aio_notify_read_n (nbd, i);
+    else if ((fds[i].revents & POLLOUT) != 0)
+      r = nbd_aio_notify_write_n (nbd, i);
+    else
+      r = 0;
+    if (r == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  int64_t cookies[NR_COMMANDS];
+  char buf[BLOCK];
+  size_t i;
+  int r;
+  const char *cmd[] = { "nbdkit", "--exit-with-parent",
+                        "memory", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_multi_conn (nbd) != 1) {
+    fprintf (stderr, "%s: test failed: default multi-conn should be 1\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_multi_conn (nbd, 0) != -1) {
+    fprintf (stderr, "%s: test failed: nbd_set_multi_conn (0) succeeded\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_multi_conn (nbd, NR_CONNS) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_systemd_socket_activation (nbd, (char **) cmd) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  r = nbd_get_nr_connections (nbd);
+  if (r != NR_CONNS) {
+    fprintf (stderr, "%s: test failed: expected %d connections, got %d\n",
+             argv[0], NR_CONNS, r);
+    exit (EXIT_FAILURE);
+  }
+
+  /* The calls which only drive one connection must fail, since the
+   * others would never be polled.
+   */
+  if (nbd_aio_get_fd (nbd) != -1 || nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: test failed: nbd_aio_get_fd did not fail "
+             "with EINVAL\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_notify_read (nbd) != -1 || nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: test failed: nbd_aio_notify_read did not fail "
+             "with EINVAL\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_notify_write (nbd) != -1 || nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: test failed: nbd_aio_notify_write did not fail "
+             "with EINVAL\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Writes, spread over all of the connections. */
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    memset (wbuf[i], 'a' + i % 26, BLOCK);
+    cookies[i] = nbd_aio_pwrite (nbd, wbuf[i], BLOCK, i * BLOCK,
+                                 NBD_NULL_COMPLETION, 0);
+    if (cookies[i] == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (nbd_aio_command_completed (nbd, cookies[i]) != 1) {
+      fprintf (stderr, "%s: test failed: write %zu: %s\n",
+               argv[0], i, nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_aio_peek_command_completed (nbd) != -1) {
+    fprintf (stderr, "%s: test failed: commands left over\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Reads in the opposite order, checking each reply. */
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    cookies[i] = nbd_aio_pread (nbd, rbuf[i], BLOCK,
+                                (NR_COMMANDS-1-i) * BLOCK,
+                                NBD_NULL_COMPLETION, 0);
+    if (cookies[i] == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (nbd_aio_command_completed (nbd, cookies[i]) != 1) {
+      fprintf (stderr, "%s: test failed: read %zu: %s\n",
+               argv[0], i, nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (memcmp (rbuf[i], wbuf[NR_COMMANDS-1-i], BLOCK) != 0) {
+      fprintf (stderr, "%s: test failed: unexpected data in block %zu\n",
+               argv[0], NR_COMMANDS-1-i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Reads driven by the caller's main loop. */
+  if (nbd_aio_get_fd_n (nbd, NR_CONNS) != -1 || nbd_get_errno () != EINVAL) {
+    fprintf (stderr, "%s: test failed: nbd_aio_get_fd_n did not fail "
+             "with EINVAL for a connection out of range\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_aio_get_direction_n (nbd, NR_CONNS) != 0) {
+    fprintf (stderr, "%s: test failed: nbd_aio_get_direction_n returned "
+             "a direction for a connection out of range\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  memset (rbuf, 0, sizeof rbuf);
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    cookies[i] = nbd_aio_pread (nbd, rbuf[i], BLOCK, i * BLOCK,
+                                NBD_NULL_COMPLETION, 0);
+    if (cookies[i] == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  /* If a connection were not serviced its fd would stay readable, so
+   * this would spin instead of timing out.
+   */
+  for (i = 0; nbd_aio_in_flight (nbd) > 0; ++i) {
+    if (i == 100000) {
+      fprintf (stderr, "%s: test failed: replies not received\n", argv[0]);
+      exit (EXIT_FAILURE);
+    }
+    poll_all_conns (nbd, argv[0]);
+  }
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (nbd_aio_command_completed (nbd, cookies[i]) != 1) {
+      fprintf (stderr, "%s: test failed: read %zu: %s\n",
+               argv[0], i, nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (memcmp (rbuf[i], wbuf[i], BLOCK) != 0) {
+      fprintf (stderr, "%s: test failed: unexpected data in block %zu\n",
+               argv[0], i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  /* Synchronous calls must work on any connection too. */
+  for (i = 0; i < 2 * NR_CONNS; ++i) {
+    if (nbd_pread (nbd, buf, BLOCK, i * BLOCK, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (memcmp (buf, wbuf[i], BLOCK) != 0) {
+      fprintf (stderr, "%s: test failed: unexpected data in block %zu\n",
+               argv[0], i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
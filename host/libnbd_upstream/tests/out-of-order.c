@@ -0,0 +1,173 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test the table of commands in flight (lib/commands.c) by keeping
+ * many commands in flight and having the server reply in a random
+ * order.  One command is left in flight until the end, so that
+ * cookies issued later collide with it and with each other, and
+ * removing commands from the table has to move entries back across
+ * the end of the table.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libnbd.h>
+
+#include "fake-server.h"
+
+#define NR_COMMANDS 4000
+#define WINDOW 48
+#define COUNT 512
+#define SIZE (NR_COMMANDS * COUNT)
+
+static char bufs[NR_COMMANDS][COUNT];
+static size_t completed;
+
+static void
+fill (char *buf, uint64_t offset)
+{
+  uint32_t i;
+
+  for (i = 0; i < COUNT; ++i)
+    buf[i] = (offset + i) % 251 + 1;
+}
+
+/* The order of the replies must be the same every time. */
+static uint32_t
+next_random (void)
+{
+  static uint32_t state = 1;
+
+  state = state * 1103515245 + 12345;
+  return state >> 16;
+}
+
+static void
+script (int sock)
+{
+  struct nbd_request pending[WINDOW];
+  char data[COUNT];
+  size_t nr_pending = 0, received = 0, i;
+
+  while (nr_pending < WINDOW) {
+    if (!fake_server_recv_request (sock, &pending[nr_pending++]))
+      _exit (EXIT_FAILURE);
+    received++;
+  }
+
+  while (nr_pending > 0) {
+    /* pending[0] is the first request, which is answered last. */
+    if (nr_pending == 1)
+      i = 0;
+    else
+      i = 1 + next_random () % (nr_pending - 1);
+
+    if (pending[i].count != COUNT)
+      _exit (EXIT_FAILURE);
+    fill (data, pending[i].offset);
+    fake_server_simple_reply (pending[i].handle, NBD_SUCCESS, data, COUNT);
+    fake_server_flush (sock, NULL, 0);
+    pending[i] = pending[--nr_pending];
+
+    /* The client issues a new command for each one that completes. */
+    if (received < NR_COMMANDS) {
+      if (!fake_server_recv_request (sock, &pending[nr_pending++]))
+        _exit (EXIT_FAILURE);
+      received++;
+    }
+  }
+}
+
+static int
+callback (void *user_data, int *error)
+{
+  size_t i = (uintptr_t) user_data;
+  char want[COUNT];
+
+  if (*error) {
+    fprintf (stderr, "command %zu failed: %s\n", i, strerror (*error));
+    exit (EXIT_FAILURE);
+  }
+  fill (want, i * COUNT);
+  if (memcmp (bufs[i], want, COUNT) != 0) {
+    fprintf (stderr, "command %zu: unexpected buffer contents\n", i);
+    exit (EXIT_FAILURE);
+  }
+  completed++;
+  return 1;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  pid_t pid;
+  size_t issued = 0;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  pid = fake_server_connect (nbd, false, SIZE, script);
+  if (pid == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  while (completed < NR_COMMANDS) {
+    while (issued < NR_COMMANDS && issued - completed < WINDOW) {
+      if (nbd_aio_pread (nbd, bufs[issued], COUNT, issued * COUNT,
+                         (nbd_completion_callback) {
+                           .callback = callback,
+                           .user_data = (void *) (uintptr_t) issued },
+                         0) == -1) {
+        fprintf (stderr, "%s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+      issued++;
+    }
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (nbd_aio_in_flight (nbd) != 0) {
+    fprintf (stderr, "%s: commands still in flight\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  if (fake_server_wait (pid) == -1) {
+    fprintf (stderr, "%s: server failed\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  exit (EXIT_SUCCESS);
+}
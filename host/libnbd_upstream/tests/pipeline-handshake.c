@@ -0,0 +1,101 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test nbd_set_pipeline_handshake, with a server which supports
+ * structured replies and one which does not.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <libnbd.h>
+
+static void
+test (const char *progname, bool sr)
+{
+  struct nbd_handle *nbd;
+  char wbuf[512], rbuf[512];
+  const char *cmd_sr[] = { "nbdkit", "-s", "--exit-with-parent",
+                           "memory", "size=1m", NULL };
+  const char *cmd_no_sr[] = { "nbdkit", "-s", "--exit-with-parent", "--no-sr",
+                              "memory", "size=1m", NULL };
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_pipeline_handshake (nbd) != false) {
+    fprintf (stderr, "%s: test failed: pipelining should be off by default\n",
+             progname);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_pipeline_handshake (nbd, true) == -1 ||
+      nbd_add_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_connect_command (nbd, (char **) (sr ? cmd_sr : cmd_no_sr)) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_get_structured_replies_negotiated (nbd) != sr ||
+      nbd_can_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) != sr) {
+    fprintf (stderr, "%s: test failed: structured replies %s, "
+             "but negotiated %d and meta context %d\n",
+             progname, sr ? "enabled" : "disabled",
+             nbd_get_structured_replies_negotiated (nbd),
+             nbd_can_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION));
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_size (nbd) != 1024 * 1024) {
+    fprintf (stderr, "%s: test failed: unexpected export size\n", progname);
+    exit (EXIT_FAILURE);
+  }
+
+  memset (wbuf, 'x', sizeof wbuf);
+  if (nbd_pwrite (nbd, wbuf, sizeof wbuf, 0, 0) == -1 ||
+      nbd_pread (nbd, rbuf, sizeof rbuf, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (rbuf, wbuf, sizeof rbuf) != 0) {
+    fprintf (stderr, "%s: test failed: unexpected data\n", progname);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+}
+
+int
+main (int argc, char *argv[])
+{
+  test (argv[0], true);
+  test (argv[0], false);
+  exit (EXIT_SUCCESS);
+}
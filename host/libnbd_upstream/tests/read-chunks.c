@@ -0,0 +1,254 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that reads are only successful when the server sends the whole
+ * range, whatever order the chunks arrive in, and that the parts the
+ * server did not send are zeroed.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <libnbd.h>
+
+#include "fake-server.h"
+
+#define SIZE (1024 * 1024)
+#define COUNT 4096
+
+/* Contents of the disk. */
+static char
+disk_byte (uint64_t offset)
+{
+  return offset % 251 + 1;
+}
+
+static void
+fill (char *buf, uint64_t offset, uint32_t len)
+{
+  uint32_t i;
+
+  for (i = 0; i < len; ++i)
+    buf[i] = disk_byte (offset + i);
+}
+
+/* A reply chunk, with an offset and length relative to the start of
+ * the request.  Holes read as zeroes.
+ */
+struct chunk {
+  enum { DATA, HOLE, END } type;
+  uint32_t start, len;
+};
+
+struct read_test {
+  const char *name;
+  struct chunk chunks[20];
+  bool ok;                      /* Read is expected to succeed. */
+};
+
+static const struct read_test tests[] = {
+  { "in order",
+    { { DATA, 0, 2048 }, { HOLE, 2048, 1024 }, { DATA, 3072, 1024 },
+      { END } },
+    true },
+  { "out of order",
+    { { DATA, 3072, 1024 }, { HOLE, 1024, 2048 }, { DATA, 0, 1024 },
+      { END } },
+    true },
+  { "reversed small chunks",
+    { { DATA, 3840, 256 }, { DATA, 3584, 256 }, { HOLE, 3328, 256 },
+      { DATA, 3072, 256 }, { DATA, 2816, 256 }, { DATA, 2560, 256 },
+      { DATA, 2304, 256 }, { HOLE, 2048, 256 }, { DATA, 1792, 256 },
+      { DATA, 1536, 256 }, { DATA, 1280, 256 }, { DATA, 1024, 256 },
+      { DATA, 768, 256 }, { HOLE, 512, 256 }, { DATA, 256, 256 },
+      { DATA, 0, 256 }, { END } },
+    true },
+  { "filling a gap last",
+    { { DATA, 0, 1024 }, { DATA, 3072, 1024 }, { DATA, 1024, 2048 },
+      { END } },
+    true },
+  { "missing the middle",
+    { { DATA, 0, 1024 }, { DATA, 3072, 1024 }, { END } },
+    false },
+  { "missing the start and end",
+    { { DATA, 1024, 2048 }, { END } },
+    false },
+  { "no data",
+    { { END } },
+    false },
+};
+#define NR_TESTS (sizeof tests / sizeof tests[0])
+
+static void
+structured_script (int sock)
+{
+  struct nbd_request req;
+  char data[COUNT];
+  size_t i;
+  const struct chunk *c;
+
+  for (i = 0; i < NR_TESTS; ++i) {
+    if (!fake_server_recv_request (sock, &req) || req.count != COUNT)
+      _exit (EXIT_FAILURE);
+    for (c = tests[i].chunks; c->type != END; ++c) {
+      uint16_t flags = c[1].type == END ? NBD_REPLY_FLAG_DONE : 0;
+
+      if (c->type == DATA) {
+        fill (data, req.offset + c->start, c->len);
+        fake_server_data_chunk (req.handle, flags, req.offset + c->start,
+                                data, c->len);
+      }
+      else
+        fake_server_hole_chunk (req.handle, flags, req.offset + c->start,
+                                c->len);
+    }
+    if (c == tests[i].chunks)
+      fake_server_done_chunk (req.handle);
+    fake_server_flush (sock, NULL, 0);
+  }
+}
+
+static void
+simple_script (int sock)
+{
+  struct nbd_request req;
+  char data[COUNT];
+
+  if (!fake_server_recv_request (sock, &req) || req.count != COUNT)
+    _exit (EXIT_FAILURE);
+  fill (data, req.offset, COUNT);
+  fake_server_simple_reply (req.handle, NBD_SUCCESS, data, COUNT);
+  fake_server_flush (sock, NULL, 0);
+}
+
+/* What the buffer should contain after the read: the data and holes
+ * sent by the server, and zeroes in the gaps.
+ */
+static void
+expected (const struct read_test *t, uint64_t offset, char *buf)
+{
+  const struct chunk *c;
+
+  memset (buf, 0, COUNT);
+  for (c = t->chunks; c->type != END; ++c)
+    if (c->type == DATA)
+      fill (buf + c->start, offset + c->start, c->len);
+}
+
+static struct nbd_handle *
+create (void)
+{
+  struct nbd_handle *nbd = nbd_create ();
+
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return nbd;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  pid_t pid;
+  static char buf[COUNT], want[COUNT];
+  uint64_t offset;
+  size_t i;
+  int r;
+
+  nbd = create ();
+  pid = fake_server_connect (nbd, true, SIZE, structured_script);
+  if (pid == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_structured_replies_negotiated (nbd) != 1) {
+    fprintf (stderr, "%s: structured replies were not negotiated\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_TESTS; ++i) {
+    offset = (i + 1) * 8192;
+    /* Anything not sent by the server must be overwritten. */
+    memset (buf, 0xaa, COUNT);
+    r = nbd_pread (nbd, buf, COUNT, offset, 0);
+    if (tests[i].ok && r == -1) {
+      fprintf (stderr, "%s: %s: read failed: %s\n",
+               argv[0], tests[i].name, nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    if (!tests[i].ok && (r != -1 || nbd_get_errno () != EIO)) {
+      fprintf (stderr, "%s: %s: read should have failed with EIO\n",
+               argv[0], tests[i].name);
+      exit (EXIT_FAILURE);
+    }
+    expected (&tests[i], offset, want);
+    if (memcmp (buf, want, COUNT) != 0) {
+      fprintf (stderr, "%s: %s: unexpected buffer contents\n",
+               argv[0], tests[i].name);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  if (fake_server_wait (pid) == -1) {
+    fprintf (stderr, "%s: structured reply server failed\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Without structured replies, a simple reply covers the whole read. */
+  nbd = create ();
+  pid = fake_server_connect (nbd, false, SIZE, simple_script);
+  if (pid == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_pread (nbd, buf, COUNT, 0, 0) == -1) {
+    fprintf (stderr, "%s: simple reply: read failed: %s\n",
+             argv[0], nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  fill (want, 0, COUNT);
+  if (memcmp (buf, want, COUNT) != 0) {
+    fprintf (stderr, "%s: simple reply: unexpected buffer contents\n",
+             argv[0]);
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  if (fake_server_wait (pid) == -1) {
+    fprintf (stderr, "%s: simple reply server failed\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,217 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test receiving replies through the receive buffer: many replies
+ * arriving in one recv call, replies split across recv calls and
+ * across refills of the buffer, and reads either side of the size at
+ * which the data bypasses the buffer.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libnbd.h>
+
+#include "fake-server.h"
+
+/* These must match lib/internal.h. */
+#define RECV_BUFFER_SIZE (64 * 1024)
+#define RECV_BUFFER_BYPASS (16 * 1024)
+
+#define SIZE (64 * 1024 * 1024)
+#define MAX_READS 400
+
+struct round {
+  const char *name;
+  size_t nr_reads;
+  uint32_t count[MAX_READS];    /* Size of each read, 0 = same as count[0]. */
+  size_t nr_pieces;
+  size_t pieces[20];            /* See fake_server_flush. */
+};
+
+static const struct round rounds[] = {
+  /* About 2 full buffers of small replies sent in one write, so that
+   * replies are split at the end of the buffer.
+   */
+  { "many small replies", 400, { 300 } },
+  /* Headers and data split in odd places. */
+  { "split replies", 8, { 100 },
+    12, { 1, 5, 9, 20, 3, 100, 7, 13, 2, 2, 40, 11 } },
+  /* Large reads with the start of the data already in the buffer. */
+  { "bypass threshold", 9,
+    { 100, RECV_BUFFER_BYPASS - 1, RECV_BUFFER_BYPASS,
+      RECV_BUFFER_BYPASS + 1, 10, RECV_BUFFER_SIZE,
+      3 * RECV_BUFFER_SIZE + 5, 1, RECV_BUFFER_BYPASS - 1 } },
+  { "bypass threshold split", 9,
+    { 100, RECV_BUFFER_BYPASS - 1, RECV_BUFFER_BYPASS,
+      RECV_BUFFER_BYPASS + 1, 10, RECV_BUFFER_SIZE,
+      3 * RECV_BUFFER_SIZE + 5, 1, RECV_BUFFER_BYPASS - 1 },
+    6, { 150, 9000, 20000, 3, RECV_BUFFER_SIZE - 7, 100000 } },
+};
+#define NR_ROUNDS (sizeof rounds / sizeof rounds[0])
+
+static bool structured;
+
+static uint32_t
+read_count (const struct round *r, size_t i)
+{
+  return r->count[i] ? r->count[i] : r->count[0];
+}
+
+/* Contents of the disk. */
+static void
+fill (char *buf, uint64_t offset, uint32_t len)
+{
+  uint32_t i;
+
+  for (i = 0; i < len; ++i)
+    buf[i] = (offset + i) % 251 + 1;
+}
+
+static void
+script (int sock)
+{
+  static struct nbd_request reqs[MAX_READS];
+  const struct round *r;
+  char *data;
+  size_t i, j;
+
+  for (i = 0; i < NR_ROUNDS; ++i) {
+    r = &rounds[i];
+    for (j = 0; j < r->nr_reads; ++j) {
+      if (!fake_server_recv_request (sock, &reqs[j]) ||
+          reqs[j].count != read_count (r, j))
+        _exit (EXIT_FAILURE);
+    }
+    for (j = 0; j < r->nr_reads; ++j) {
+      data = malloc (reqs[j].count);
+      if (data == NULL)
+        _exit (EXIT_FAILURE);
+      fill (data, reqs[j].offset, reqs[j].count);
+      if (structured)
+        fake_server_data_chunk (reqs[j].handle, NBD_REPLY_FLAG_DONE,
+                                reqs[j].offset, data, reqs[j].count);
+      else
+        fake_server_simple_reply (reqs[j].handle, NBD_SUCCESS,
+                                  data, reqs[j].count);
+      free (data);
+    }
+    fake_server_flush (sock, r->nr_pieces ? r->pieces : NULL, r->nr_pieces);
+  }
+}
+
+static void
+run (const char *argv0)
+{
+  struct nbd_handle *nbd;
+  pid_t pid;
+  static char *bufs[MAX_READS];
+  char *want;
+  const struct round *r;
+  uint64_t offset;
+  uint32_t count;
+  size_t i, j;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  pid = fake_server_connect (nbd, structured, SIZE, script);
+  if (pid == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_ROUNDS; ++i) {
+    r = &rounds[i];
+
+    /* Issue all the reads before the server replies to any of them. */
+    offset = i * 1024 * 1024;
+    for (j = 0; j < r->nr_reads; ++j) {
+      count = read_count (r, j);
+      bufs[j] = malloc (count);
+      if (bufs[j] == NULL) {
+        perror ("malloc");
+        exit (EXIT_FAILURE);
+      }
+      if (nbd_aio_pread (nbd, bufs[j], count, offset,
+                         NBD_NULL_COMPLETION, 0) == -1) {
+        fprintf (stderr, "%s\n", nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+      offset += count;
+    }
+
+    while (nbd_aio_in_flight (nbd) > 0) {
+      if (nbd_poll (nbd, -1) == -1) {
+        fprintf (stderr, "%s: %s: %s\n", argv0, r->name, nbd_get_error ());
+        exit (EXIT_FAILURE);
+      }
+    }
+
+    offset = i * 1024 * 1024;
+    for (j = 0; j < r->nr_reads; ++j) {
+      count = read_count (r, j);
+      want = malloc (count);
+      if (want == NULL) {
+        perror ("malloc");
+        exit (EXIT_FAILURE);
+      }
+      fill (want, offset, count);
+      if (memcmp (bufs[j], want, count) != 0) {
+        fprintf (stderr, "%s: %s: %s replies: read %zu of %" PRIu32 " bytes: "
+                 "unexpected buffer contents\n",
+                 argv0, r->name, structured ? "structured" : "simple",
+                 j, count);
+        exit (EXIT_FAILURE);
+      }
+      free (want);
+      free (bufs[j]);
+      offset += count;
+    }
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  if (fake_server_wait (pid) == -1) {
+    fprintf (stderr, "%s: %s reply server failed\n",
+             argv0, structured ? "structured" : "simple");
+    exit (EXIT_FAILURE);
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  structured = false;
+  run (argv[0]);
+  structured = true;
+  run (argv[0]);
+  exit (EXIT_SUCCESS);
+}
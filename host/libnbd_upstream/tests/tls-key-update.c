@@ -0,0 +1,452 @@
+/* NBD client library in userspace
+ * Copyright (C) 2013-2020 Red Hat Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Test that a TLS 1.3 connection keeps working when the server
+ * updates its keys and asks libnbd to update its own (KeyUpdate with
+ * update_requested).  GnuTLS answers the key update itself, so libnbd
+ * must not have handed the keys of either direction to the kernel.
+ * The same server is also run with TLS 1.2, where kTLS may be used.
+ *
+ * The server runs in a child process on one end of a TCP connection,
+ * since kTLS needs TCP.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <gnutls/gnutls.h>
+
+#include <libnbd.h>
+
+#include "byte-swapping.h"
+#include "nbd-protocol.h"
+
+/* gnutls_session_key_update was added in GnuTLS 3.6.3. */
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+
+#define SIZE (1024 * 1024)
+#define NR_READS 64
+#define BLOCK 4096
+/* GnuTLS refuses more than 8 key updates a second, so only do a
+ * few.
+ */
+#define KEY_UPDATE_EVERY 16
+
+#define PSK_PRIORITY ":+ECDHE-PSK:+DHE-PSK:+PSK"
+#define TLS12_PRIORITY "NORMAL:-VERS-ALL:+VERS-TLS1.2" PSK_PRIORITY
+#define TLS13_PRIORITY "NORMAL:-VERS-ALL:+VERS-TLS1.3" PSK_PRIORITY
+
+/* Server exit status if it could not negotiate the TLS version. */
+#define SERVER_WRONG_VERSION 2
+
+static char pskfile[] = "/tmp/tls-key-update-XXXXXX";
+static bool ktls_enabled;
+
+static void
+cleanup_pskfile (void)
+{
+  unlink (pskfile);
+}
+
+/* Contents of the disk. */
+static void
+fill (char *buf, uint64_t offset, uint32_t len)
+{
+  uint32_t i;
+
+  for (i = 0; i < len; ++i)
+    buf[i] = (offset + i) % 251 + 1;
+}
+
+/* Return a connected pair of TCP sockets over the loopback
+ * interface.
+ */
+static void
+tcp_pair (int fds[2])
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof addr;
+  int lsock;
+
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  lsock = socket (AF_INET, SOCK_STREAM, 0);
+  if (lsock == -1 ||
+      bind (lsock, (struct sockaddr *) &addr, sizeof addr) == -1 ||
+      listen (lsock, 1) == -1 ||
+      getsockname (lsock, (struct sockaddr *) &addr, &len) == -1) {
+    perror ("listen");
+    exit (EXIT_FAILURE);
+  }
+  fds[0] = socket (AF_INET, SOCK_STREAM, 0);
+  if (fds[0] == -1 ||
+      connect (fds[0], (struct sockaddr *) &addr, sizeof addr) == -1) {
+    perror ("connect");
+    exit (EXIT_FAILURE);
+  }
+  fds[1] = accept (lsock, NULL, NULL);
+  if (fds[1] == -1) {
+    perror ("accept");
+    exit (EXIT_FAILURE);
+  }
+  close (lsock);
+}
+
+/* The server.  Once TLS has started, everything goes through the
+ * session.
+ */
+static int server_sock;
+static gnutls_session_t session;
+
+static void
+server_error (const char *msg)
+{
+  fprintf (stderr, "tls-key-update: server: %s\n", msg);
+  _exit (EXIT_FAILURE);
+}
+
+/* Returns false on end of file. */
+static bool
+server_read (void *buf, size_t len)
+{
+  char *p = buf;
+  ssize_t r;
+
+  while (len > 0) {
+    if (session)
+      r = gnutls_record_recv (session, p, len);
+    else
+      r = read (server_sock, p, len);
+    if (r == 0)
+      return false;
+    if (r < 0) {
+      if (session && (r == GNUTLS_E_AGAIN || r == GNUTLS_E_INTERRUPTED))
+        continue;
+      if (!session && errno == EINTR)
+        continue;
+      server_error (session ? gnutls_strerror (r) : strerror (errno));
+    }
+    p += r;
+    len -= r;
+  }
+  return true;
+}
+
+static void
+server_write (const void *buf, size_t len)
+{
+  const char *p = buf;
+  ssize_t r;
+
+  while (len > 0) {
+    if (session)
+      r = gnutls_record_send (session, p, len);
+    else
+      r = write (server_sock, p, len);
+    if (r < 0) {
+      if (session && (r == GNUTLS_E_AGAIN || r == GNUTLS_E_INTERRUPTED))
+        continue;
+      if (!session && errno == EINTR)
+        continue;
+      server_error (session ? gnutls_strerror (r) : strerror (errno));
+    }
+    p += r;
+    len -= r;
+  }
+}
+
+static void
+option_reply (uint32_t option, uint32_t reply, const void *data, uint32_t len)
+{
+  struct nbd_fixed_new_option_reply hdr;
+
+  hdr.magic = htobe64 (NBD_REP_MAGIC);
+  hdr.option = htobe32 (option);
+  hdr.reply = htobe32 (reply);
+  hdr.replylen = htobe32 (len);
+  server_write (&hdr, sizeof hdr);
+  server_write (data, len);
+}
+
+static void
+start_tls (const char *priority, gnutls_protocol_t version)
+{
+  gnutls_psk_server_credentials_t creds;
+  int err;
+
+  if (gnutls_psk_allocate_server_credentials (&creds) < 0 ||
+      gnutls_psk_set_server_credentials_file (creds, pskfile) < 0 ||
+      gnutls_init (&session, GNUTLS_SERVER) < 0 ||
+      gnutls_credentials_set (session, GNUTLS_CRD_PSK, creds) < 0)
+    server_error ("cannot set up the TLS session");
+  if (gnutls_priority_set_direct (session, priority, NULL) < 0)
+    _exit (SERVER_WRONG_VERSION);
+  gnutls_transport_set_int (session, server_sock);
+  do
+    err = gnutls_handshake (session);
+  while (err == GNUTLS_E_AGAIN || err == GNUTLS_E_INTERRUPTED);
+  if (err < 0)
+    server_error (gnutls_strerror (err));
+  if (gnutls_protocol_get_version (session) != version)
+    _exit (SERVER_WRONG_VERSION);
+}
+
+/* Fixed newstyle handshake.  The client must start TLS first. */
+static void
+handshake (const char *priority, gnutls_protocol_t version)
+{
+  struct nbd_new_handshake handshake;
+  struct nbd_new_option option;
+  struct nbd_fixed_new_option_reply_info_export info;
+  uint32_t cflags, opt, optlen;
+  char *data;
+
+  handshake.nbdmagic = htobe64 (NBD_MAGIC);
+  handshake.version = htobe64 (NBD_NEW_VERSION);
+  handshake.gflags = htobe16 (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+  server_write (&handshake, sizeof handshake);
+  if (!server_read (&cflags, sizeof cflags))
+    server_error ("unexpected end of file");
+
+  for (;;) {
+    if (!server_read (&option, sizeof option))
+      server_error ("unexpected end of file");
+    if (be64toh (option.version) != NBD_NEW_VERSION)
+      server_error ("bad option magic");
+    opt = be32toh (option.option);
+    optlen = be32toh (option.optlen);
+    if (optlen > NBD_MAX_STRING * 2)
+      server_error ("option too long");
+    data = malloc (optlen);
+    if (data == NULL)
+      server_error ("malloc");
+    if (!server_read (data, optlen))
+      server_error ("unexpected end of file");
+    free (data);
+
+    switch (opt) {
+    case NBD_OPT_STARTTLS:
+      if (session)
+        server_error ("STARTTLS sent twice");
+      option_reply (opt, NBD_REP_ACK, NULL, 0);
+      start_tls (priority, version);
+      break;
+    case NBD_OPT_GO:
+      if (!session)
+        server_error ("client did not start TLS");
+      info.info = htobe16 (NBD_INFO_EXPORT);
+      info.exportsize = htobe64 (SIZE);
+      info.eflags = htobe16 (NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY);
+      option_reply (opt, NBD_REP_INFO, &info, sizeof info);
+      option_reply (opt, NBD_REP_ACK, NULL, 0);
+      return;
+    case NBD_OPT_ABORT:
+      _exit (EXIT_SUCCESS);
+    default:
+      option_reply (opt, NBD_REP_ERR_UNSUP, NULL, 0);
+    }
+  }
+}
+
+static void
+server (int sock, const char *priority, gnutls_protocol_t version)
+{
+  struct nbd_request request;
+  struct nbd_simple_reply reply;
+  static char data[BLOCK];
+  unsigned nr_requests = 0;
+  int err;
+
+  server_sock = sock;
+  handshake (priority, version);
+
+  while (server_read (&request, sizeof request)) {
+    if (be32toh (request.magic) != NBD_REQUEST_MAGIC)
+      server_error ("bad request magic");
+    if (be16toh (request.type) == NBD_CMD_DISC)
+      break;
+    if (be16toh (request.type) != NBD_CMD_READ ||
+        be32toh (request.count) != BLOCK)
+      server_error ("unexpected request");
+
+    /* Update our keys, and ask the client to update its keys too. */
+    if (version == GNUTLS_TLS1_3 &&
+        ++nr_requests % KEY_UPDATE_EVERY == 0) {
+      err = gnutls_session_key_update (session, GNUTLS_KU_PEER);
+      if (err < 0)
+        server_error (gnutls_strerror (err));
+    }
+
+    reply.magic = htobe32 (NBD_SIMPLE_REPLY_MAGIC);
+    reply.error = htobe32 (0);
+    reply.handle = request.handle;
+    fill (data, be64toh (request.offset), BLOCK);
+    server_write (&reply, sizeof reply);
+    server_write (data, BLOCK);
+  }
+
+  gnutls_bye (session, GNUTLS_SHUT_WR);
+  _exit (EXIT_SUCCESS);
+}
+
+static int
+debug_fn (void *user_data, const char *context, const char *msg)
+{
+  if (strncmp (msg, "kTLS enabled for:", 17) == 0)
+    ktls_enabled = true;
+  return 0;
+}
+
+/* Returns false if the TLS version could not be negotiated. */
+static bool
+run (const char *argv0, const char *priority, gnutls_protocol_t version)
+{
+  const char *name = gnutls_protocol_get_name (version);
+  struct nbd_handle *nbd;
+  static char buf[BLOCK], want[BLOCK];
+  int fds[2], status;
+  pid_t pid;
+  size_t i;
+
+  tcp_pair (fds);
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    exit (EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    close (fds[0]);
+    server (fds[1], priority, version);
+  }
+  close (fds[1]);
+
+  ktls_enabled = false;
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_set_debug (nbd, true) == -1 ||
+      nbd_set_debug_callback (nbd,
+                              (nbd_debug_callback) { .callback = debug_fn })
+      == -1 ||
+      nbd_set_request_structured_replies (nbd, false) == -1 ||
+      nbd_set_tls (nbd, LIBNBD_TLS_REQUIRE) == -1 ||
+      nbd_set_tls_username (nbd, "alice") == -1 ||
+      nbd_set_tls_psk_file (nbd, pskfile) == -1 ||
+      nbd_connect_socket (nbd, fds[0]) == -1) {
+    nbd_close (nbd);
+    if (waitpid (pid, &status, 0) == pid && WIFEXITED (status) &&
+        WEXITSTATUS (status) == SERVER_WRONG_VERSION) {
+      fprintf (stderr, "%s: %s could not be negotiated\n", argv0, name);
+      return false;
+    }
+    fprintf (stderr, "%s: %s: connect failed\n", argv0, name);
+    exit (EXIT_FAILURE);
+  }
+
+  if (version == GNUTLS_TLS1_3 && ktls_enabled) {
+    fprintf (stderr, "%s: test failed: kTLS was used with TLS 1.3\n",
+             argv0);
+    exit (EXIT_FAILURE);
+  }
+  fprintf (stderr, "%s: %s: kTLS %s\n",
+           argv0, name, ktls_enabled ? "enabled" : "not enabled");
+
+  for (i = 0; i < NR_READS; ++i) {
+    if (nbd_pread (nbd, buf, BLOCK, i * BLOCK, 0) == -1) {
+      fprintf (stderr, "%s: %s: read %zu: %s\n",
+               argv0, name, i, nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    fill (want, i * BLOCK, BLOCK);
+    if (memcmp (buf, want, BLOCK) != 0) {
+      fprintf (stderr, "%s: %s: read %zu: unexpected data\n",
+               argv0, name, i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  if (waitpid (pid, &status, 0) == -1) {
+    perror ("waitpid");
+    exit (EXIT_FAILURE);
+  }
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+    fprintf (stderr, "%s: %s: server failed\n", argv0, name);
+    exit (EXIT_FAILURE);
+  }
+  return true;
+}
+
+int
+main (int argc, char *argv[])
+{
+  const char key[] = "alice:0123456789abcdef0123456789abcdef\n";
+  int fd;
+  bool tls13;
+
+  fd = mkstemp (pskfile);
+  if (fd == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  atexit (cleanup_pskfile);
+  if (write (fd, key, sizeof key - 1) != (ssize_t) sizeof key - 1 ||
+      close (fd) == -1) {
+    perror (pskfile);
+    exit (EXIT_FAILURE);
+  }
+
+  tls13 = run (argv[0], TLS13_PRIORITY, GNUTLS_TLS1_3);
+  if (!run (argv[0], TLS12_PRIORITY, GNUTLS_TLS1_2) && !tls13) {
+    fprintf (stderr, "%s: test skipped\n", argv[0]);
+    exit (77);
+  }
+  exit (EXIT_SUCCESS);
+}
+
+#else /* GnuTLS < 3.6.3 */
+
+int
+main (int argc, char *argv[])
+{
+  fprintf (stderr, "%s: test skipped: GnuTLS does not support key update\n",
+           argv[0]);
+  exit (77);
+}
+
+#endif
@@ -0,0 +1,603 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Microbenchmark driver for nbdkit.
+ *
+ * This connects one or more libnbd handles to an NBD server on a
+ * Unix domain socket (normally started by run-bench.sh using
+ * nbdkit --run) and keeps a fixed number of asynchronous commands in
+ * flight on each connection for a fixed time.  At the end it prints
+ * a single JSON object to stdout containing throughput and latency
+ * percentiles.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libnbd.h>
+
+#include "minmax.h"
+
+enum mode {
+  MODE_READ, MODE_WRITE, MODE_RANDREAD, MODE_RANDWRITE, MODE_RANDRW,
+  MODE_ZERO, MODE_EXTENTS,
+};
+static const char *mode_names[] = {
+  "read", "write", "randread", "randwrite", "randrw", "zero", "extents",
+  NULL
+};
+
+/* Command line options. */
+static const char *name = "";
+static enum mode mode = MODE_RANDREAD;
+static unsigned connections = 1;
+static unsigned depth = 8;
+static uint32_t block_size = 4096;
+static double run_time = 5;
+static double warmup_time = 1;
+static unsigned read_percent = 70;
+static uint64_t seed = 1;
+static const char *port = NULL;
+static const char *psk_file = NULL;
+
+/* Set when the threads start.  Only commands issued between
+ * measure_start and measure_end are counted.
+ */
+static uint64_t measure_start, measure_end;
+static pthread_barrier_t barrier;
+
+static uint64_t size;           /* Size of the export. */
+static uint64_t seq_offset;     /* Next offset for sequential modes. */
+
+/* Latency histogram.  Each power of 2 is split into 2^SUB_BITS
+ * linear buckets so percentiles are accurate to about 6%.
+ */
+#define SUB_BITS 4
+#define NR_BUCKETS (64 << SUB_BITS)
+
+struct histogram {
+  uint64_t count[NR_BUCKETS];
+  uint64_t n, sum, max;
+};
+
+struct worker;
+
+struct slot {
+  struct worker *w;
+  bool busy;
+  bool is_write;
+  uint64_t start;
+  char *buf;
+};
+
+struct worker {
+  pthread_t thread;
+  struct nbd_handle *nbd;
+  struct slot *slots;
+  uint64_t rng;
+  uint64_t ops, bytes, errors;
+  struct histogram hist;
+  int ret;
+};
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static unsigned
+bucket_of (uint64_t v)
+{
+  unsigned msb, shift;
+
+  if (v < (1 << SUB_BITS))
+    return v;
+  msb = 63 - __builtin_clzll (v);
+  shift = msb - SUB_BITS;
+  return ((shift + 1) << SUB_BITS) + ((v >> shift) & ((1 << SUB_BITS) - 1));
+}
+
+/* Return the middle of the range of values in bucket b. */
+static uint64_t
+bucket_value (unsigned b)
+{
+  unsigned shift;
+
+  if (b < (1 << SUB_BITS))
+    return b;
+  shift = (b >> SUB_BITS) - 1;
+  return ((uint64_t) ((1 << SUB_BITS) + (b & ((1 << SUB_BITS) - 1)))
+          << shift) + (UINT64_C(1) << shift) / 2;
+}
+
+static void
+histogram_add (struct histogram *h, uint64_t v)
+{
+  h->count[bucket_of (v)]++;
+  h->n++;
+  h->sum += v;
+  h->max = MAX (h->max, v);
+}
+
+static void
+histogram_merge (struct histogram *to, const struct histogram *from)
+{
+  size_t i;
+
+  for (i = 0; i < NR_BUCKETS; ++i)
+    to->count[i] += from->count[i];
+  to->n += from->n;
+  to->sum += from->sum;
+  to->max = MAX (to->max, from->max);
+}
+
+static uint64_t
+histogram_percentile (const struct histogram *h, double p)
+{
+  uint64_t target = p * h->n, seen = 0;
+  size_t i;
+
+  if (h->n == 0)
+    return 0;
+  for (i = 0; i < NR_BUCKETS; ++i) {
+    seen += h->count[i];
+    if (seen > target)
+      return MIN (bucket_value (i), h->max);
+  }
+  return h->max;
+}
+
+/* xorshift64* */
+static uint64_t
+rng_next (uint64_t *s)
+{
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * UINT64_C(0x2545F4914F6CDD1D);
+}
+
+static uint64_t
+next_offset (struct worker *w)
+{
+  uint64_t nr_blocks = size / block_size;
+
+  switch (mode) {
+  case MODE_READ:
+  case MODE_WRITE:
+  case MODE_ZERO:
+  case MODE_EXTENTS:
+    return __atomic_fetch_add (&seq_offset, 1, __ATOMIC_RELAXED)
+      % nr_blocks * block_size;
+  default:
+    return rng_next (&w->rng) % nr_blocks * block_size;
+  }
+}
+
+static int
+extent_callback (void *user_data, const char *metacontext, uint64_t offset,
+                 uint32_t *entries, size_t nr_entries, int *error)
+{
+  return 0;
+}
+
+static int
+completion_callback (void *user_data, int *error)
+{
+  struct slot *slot = user_data;
+  struct worker *w = slot->w;
+  uint64_t now = now_ns ();
+
+  if (*error)
+    w->errors++;
+  else if (slot->start >= measure_start && slot->start < measure_end) {
+    w->ops++;
+    if (mode != MODE_EXTENTS)
+      w->bytes += block_size;
+    histogram_add (&w->hist, now - slot->start);
+  }
+  slot->busy = false;
+  return 1;                     /* Retire the command. */
+}
+
+static int
+issue (struct worker *w, struct slot *slot)
+{
+  nbd_completion_callback cb = {
+    .callback = completion_callback, .user_data = slot
+  };
+  uint64_t offset = next_offset (w);
+  int64_t r;
+
+  slot->busy = true;
+  slot->start = now_ns ();
+  switch (mode) {
+  case MODE_READ:
+  case MODE_RANDREAD:
+    r = nbd_aio_pread (w->nbd, slot->buf, block_size, offset, cb, 0);
+    break;
+  case MODE_WRITE:
+  case MODE_RANDWRITE:
+    r = nbd_aio_pwrite (w->nbd, slot->buf, block_size, offset, cb, 0);
+    break;
+  case MODE_RANDRW:
+    if (rng_next (&w->rng) % 100 < read_percent)
+      r = nbd_aio_pread (w->nbd, slot->buf, block_size, offset, cb, 0);
+    else
+      r = nbd_aio_pwrite (w->nbd, slot->buf, block_size, offset, cb, 0);
+    break;
+  case MODE_ZERO:
+    r = nbd_aio_zero (w->nbd, block_size, offset, cb, 0);
+    break;
+  case MODE_EXTENTS:
+    r = nbd_aio_block_status (w->nbd, block_size, offset,
+                              (nbd_extent_callback) {
+                                .callback = extent_callback },
+                              cb, 0);
+    break;
+  default:
+    abort ();
+  }
+  if (r == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    slot->busy = false;
+    return -1;
+  }
+  return 0;
+}
+
+static void *
+worker_run (void *vp)
+{
+  struct worker *w = vp;
+  unsigned i;
+
+  pthread_barrier_wait (&barrier);
+
+  while (now_ns () < measure_end) {
+    for (i = 0; i < depth; ++i) {
+      if (!w->slots[i].busy && issue (w, &w->slots[i]) == -1)
+        goto err;
+    }
+    if (nbd_poll (w->nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      goto err;
+    }
+  }
+
+  /* Drain the commands still in flight. */
+  while (nbd_aio_in_flight (w->nbd) > 0) {
+    if (nbd_poll (w->nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      goto err;
+    }
+  }
+  return NULL;
+
+ err:
+  w->ret = -1;
+  return NULL;
+}
+
+/* Connect to a Unix domain socket, or with -p to a TCP port, in
+ * which case -k enables TLS using a pre-shared key.
+ */
+static struct nbd_handle *
+connect_one (const char *sock)
+{
+  struct nbd_handle *nbd;
+
+  nbd = nbd_create ();
+  if (nbd == NULL) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (mode == MODE_EXTENTS &&
+      nbd_add_meta_context (nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (psk_file &&
+      (nbd_set_tls (nbd, LIBNBD_TLS_REQUIRE) == -1 ||
+       nbd_set_tls_username (nbd, "bench") == -1 ||
+       nbd_set_tls_psk_file (nbd, psk_file) == -1)) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (port) {
+    if (nbd_connect_tcp (nbd, sock, port) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  else if (nbd_connect_unix (nbd, sock) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return nbd;
+}
+
+static void
+usage (FILE *fp, int exitcode)
+{
+  fprintf (fp,
+"nbdkit-bench: microbenchmark driver for nbdkit\n"
+"\n"
+"  nbdkit-bench [-n NAME] [-m MODE] [-c CONNECTIONS] [-q DEPTH]\n"
+"               [-b BLOCK-SIZE] [-t SECS] [-w SECS] [-r READ%%]\n"
+"               [-s SEED] [-p PORT [-k PSK-FILE]] SOCKET|HOST\n"
+"\n"
+"Connect to the Unix domain SOCKET, or with -p to HOST:PORT over TCP.\n"
+"-k enables TLS using the key for username \"bench\" in PSK-FILE.\n"
+"\n"
+"MODE is one of read, write, randread, randwrite, randrw, zero, extents.\n"
+"The results are printed on stdout as a JSON object.\n");
+  exit (exitcode);
+}
+
+static unsigned long
+parse_number (const char *opt, const char *arg)
+{
+  char *end;
+  unsigned long r;
+
+  errno = 0;
+  r = strtoul (arg, &end, 0);
+  if (errno != 0 || end == arg) {
+    fprintf (stderr, "nbdkit-bench: -%s: could not parse '%s'\n", opt, arg);
+    exit (EXIT_FAILURE);
+  }
+  switch (*end) {
+  case 'k': case 'K': r *= 1024; end++; break;
+  case 'm': case 'M': r *= 1024 * 1024; end++; break;
+  }
+  if (*end) {
+    fprintf (stderr, "nbdkit-bench: -%s: could not parse '%s'\n", opt, arg);
+    exit (EXIT_FAILURE);
+  }
+  return r;
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const char *short_options = "b:c:hk:m:n:p:q:r:s:t:w:";
+  static const struct option long_options[] = {
+    { "block-size",   required_argument, NULL, 'b' },
+    { "connections",  required_argument, NULL, 'c' },
+    { "help",         no_argument,       NULL, 'h' },
+    { "psk-file",     required_argument, NULL, 'k' },
+    { "mode",         required_argument, NULL, 'm' },
+    { "name",         required_argument, NULL, 'n' },
+    { "port",         required_argument, NULL, 'p' },
+    { "queue-depth",  required_argument, NULL, 'q' },
+    { "read-percent", required_argument, NULL, 'r' },
+    { "seed",         required_argument, NULL, 's' },
+    { "time",         required_argument, NULL, 't' },
+    { "warmup",       required_argument, NULL, 'w' },
+    { NULL }
+  };
+  const char *sock;
+  struct worker *workers;
+  struct histogram hist = { 0 };
+  uint64_t ops = 0, bytes = 0, errors = 0;
+  uint64_t start;
+  double secs;
+  unsigned i, j;
+  int c, ret = EXIT_SUCCESS;
+  int64_t r;
+
+  while ((c = getopt_long (argc, argv, short_options, long_options,
+                           NULL)) != -1) {
+    switch (c) {
+    case 'b':
+      block_size = parse_number ("b", optarg);
+      break;
+    case 'c':
+      connections = parse_number ("c", optarg);
+      break;
+    case 'h':
+      usage (stdout, EXIT_SUCCESS);
+    case 'k':
+      psk_file = optarg;
+      break;
+    case 'm':
+      for (i = 0; mode_names[i] != NULL; ++i)
+        if (strcmp (optarg, mode_names[i]) == 0)
+          break;
+      if (mode_names[i] == NULL) {
+        fprintf (stderr, "nbdkit-bench: unknown mode '%s'\n", optarg);
+        exit (EXIT_FAILURE);
+      }
+      mode = i;
+      break;
+    case 'n':
+      name = optarg;
+      break;
+    case 'p':
+      port = optarg;
+      break;
+    case 'q':
+      depth = parse_number ("q", optarg);
+      break;
+    case 'r':
+      read_percent = parse_number ("r", optarg);
+      break;
+    case 's':
+      seed = parse_number ("s", optarg);
+      break;
+    case 't':
+      run_time = atof (optarg);
+      break;
+    case 'w':
+      warmup_time = atof (optarg);
+      break;
+    default:
+      usage (stderr, EXIT_FAILURE);
+    }
+  }
+  if (optind != argc - 1)
+    usage (stderr, EXIT_FAILURE);
+  sock = argv[optind];
+
+  if (connections == 0 || depth == 0 || block_size == 0 ||
+      read_percent > 100 || run_time <= 0 || warmup_time < 0) {
+    fprintf (stderr, "nbdkit-bench: invalid parameters\n");
+    exit (EXIT_FAILURE);
+  }
+
+  workers = calloc (connections, sizeof *workers);
+  if (workers == NULL) {
+    perror ("calloc");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < connections; ++i) {
+    struct worker *w = &workers[i];
+
+    w->nbd = connect_one (sock);
+    w->rng = seed + i * UINT64_C(0x9E3779B97F4A7C15);
+    if (w->rng == 0)
+      w->rng = 1;
+    w->slots = calloc (depth, sizeof *w->slots);
+    if (w->slots == NULL) {
+      perror ("calloc");
+      exit (EXIT_FAILURE);
+    }
+    for (j = 0; j < depth; ++j) {
+      w->slots[j].w = w;
+      if (mode != MODE_ZERO && mode != MODE_EXTENTS) {
+        size_t k;
+
+        w->slots[j].buf = malloc (block_size);
+        if (w->slots[j].buf == NULL) {
+          perror ("malloc");
+          exit (EXIT_FAILURE);
+        }
+        /* Non-zero data so that writes are not treated as zeroes. */
+        for (k = 0; k < block_size; ++k)
+          w->slots[j].buf[k] = rng_next (&w->rng) | 1;
+      }
+    }
+  }
+
+  r = nbd_get_size (workers[0].nbd);
+  if (r == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  size = r;
+  if (size < block_size) {
+    fprintf (stderr, "nbdkit-bench: export is smaller than the block size\n");
+    exit (EXIT_FAILURE);
+  }
+  if ((mode == MODE_WRITE || mode == MODE_RANDWRITE || mode == MODE_RANDRW ||
+       mode == MODE_ZERO) && nbd_is_read_only (workers[0].nbd) == 1) {
+    fprintf (stderr, "nbdkit-bench: export is read-only\n");
+    exit (EXIT_FAILURE);
+  }
+
+  if (pthread_barrier_init (&barrier, NULL, connections + 1) != 0) {
+    perror ("pthread_barrier_init");
+    exit (EXIT_FAILURE);
+  }
+  for (i = 0; i < connections; ++i) {
+    errno = pthread_create (&workers[i].thread, NULL,
+                            worker_run, &workers[i]);
+    if (errno) {
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  start = now_ns ();
+  measure_start = start + warmup_time * 1e9;
+  measure_end = measure_start + run_time * 1e9;
+  pthread_barrier_wait (&barrier);
+
+  for (i = 0; i < connections; ++i) {
+    struct worker *w = &workers[i];
+
+    pthread_join (w->thread, NULL);
+    if (w->ret == -1)
+      ret = EXIT_FAILURE;
+    ops += w->ops;
+    bytes += w->bytes;
+    errors += w->errors;
+    histogram_merge (&hist, &w->hist);
+  }
+  secs = (measure_end - measure_start) / 1e9;
+
+  printf ("{\"name\": \"%s\", \"mode\": \"%s\", "
+          "\"connections\": %u, \"queue_depth\": %u, "
+          "\"block_size\": %" PRIu32 ", \"time\": %.3f, "
+          "\"ops\": %" PRIu64 ", \"errors\": %" PRIu64 ", "
+          "\"iops\": %.1f, \"mib_per_sec\": %.2f, "
+          "\"latency_us\": {\"mean\": %.2f, \"p50\": %.2f, \"p90\": %.2f, "
+          "\"p99\": %.2f, \"p99.9\": %.2f, \"max\": %.2f}}\n",
+          name, mode_names[mode], connections, depth, block_size, secs,
+          ops, errors, ops / secs, bytes / secs / (1024 * 1024),
+          hist.n ? (double) hist.sum / hist.n / 1000 : 0.,
+          histogram_percentile (&hist, 0.5) / 1000.,
+          histogram_percentile (&hist, 0.9) / 1000.,
+          histogram_percentile (&hist, 0.99) / 1000.,
+          histogram_percentile (&hist, 0.999) / 1000.,
+          hist.max / 1000.);
+
+  for (i = 0; i < connections; ++i) {
+    nbd_shutdown (workers[i].nbd, 0);
+    nbd_close (workers[i].nbd);
+    for (j = 0; j < depth; ++j)
+      free (workers[i].slots[j].buf);
+    free (workers[i].slots);
+  }
+  free (workers);
+  pthread_barrier_destroy (&barrier);
+
+  if (errors > 0)
+    ret = EXIT_FAILURE;
+  exit (ret);
+}
@@ -0,0 +1,182 @@
+#!/usr/bin/env bash
+# nbdkit
+# Copyright (C) 2020 Red Hat Inc.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# * Redistributions of source code must retain the above copyright
+# notice, this list of conditions and the following disclaimer.
+#
+# * Redistributions in binary form must reproduce the above copyright
+# notice, this list of conditions and the following disclaimer in the
+# documentation and/or other materials provided with the distribution.
+#
+# * Neither the name of Red Hat nor the names of its contributors may be
+# used to endorse or promote products derived from this software without
+# specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+# THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+# OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+# Run the nbdkit microbenchmark suite.  This is normally run using
+# ‘make bench’ from the top level.  See BENCHMARKING for details.
+#
+# Environment variables:
+#
+#   BENCH_OUTPUT    JSON output file (default: bench-results.json)
+#   BENCH_TIME      seconds to run each benchmark (default: 5)
+#   BENCH_WARMUP    seconds of warmup before measuring (default: 1)
+#   BENCH_DEPTH     commands in flight per connection (default: 16)
+#   BENCH_SIZE      size of the disk to serve (default: 1G)
+#   BENCH_FILTER    only run benchmarks whose name matches this
+#                   shell glob, eg. BENCH_FILTER='memory-*'
+
+set -e
+
+: ${NBDKIT:=nbdkit}
+: ${NBDKIT_BENCH:=./nbdkit-bench}
+: ${BENCH_OUTPUT:=bench-results.json}
+: ${BENCH_TIME:=5}
+: ${BENCH_WARMUP:=1}
+: ${BENCH_DEPTH:=16}
+: ${BENCH_SIZE:=1G}
+: ${BENCH_FILTER:=*}
+
+tmpdir="$(mktemp -d /tmp/nbdkit-bench.XXXXXX)"
+cleanup ()
+{
+    rm -rf "$tmpdir"
+}
+trap cleanup INT QUIT TERM EXIT ERR
+
+results="$tmpdir/results"
+: > "$results"
+
+# By default nbdkit listens on a private Unix socket.  The TLS
+# benchmarks change these to use TCP.
+server_args=(-U -)
+target='"$unixsocket"'
+
+# run NAME [BENCH-OPTIONS ...] -- [NBDKIT-ARGS ...]
+#
+# Start nbdkit on a private Unix domain socket with the arguments
+# given, run nbdkit-bench against it and append the JSON result.
+run ()
+{
+    local name="$1" bench_args=() cmd
+    shift
+    while [ "$1" != "--" ]; do bench_args+=("$1"); shift; done
+    shift
+
+    case "$name" in
+        $BENCH_FILTER) ;;
+        *) return 0 ;;
+    esac
+
+    cmd="$(printf '%q ' "$NBDKIT_BENCH" -n "$name" \
+             -t "$BENCH_TIME" -w "$BENCH_WARMUP" -q "$BENCH_DEPTH" \
+             "${bench_args[@]}") $target"
+    "$NBDKIT" "${server_args[@]}" "$@" --run "$cmd" >> "$results"
+    tail -n 1 "$results" | \
+        sed -e 's/^{"name": "\([^"]*\)".*"iops": \([0-9.]*\).*"p50": \([0-9.]*\).*"p99": \([0-9.]*\),.*/\1: \2 IOPS, p50 \3 us, p99 \4 us/'
+}
+
+disk="$tmpdir/disk.img"
+truncate -s "$BENCH_SIZE" "$disk"
+
+# Data which is allocated in one byte of every 64K, so it has lots of
+# small extents.
+sparse_data='( 1 @65535 0 )*16384'
+
+# Core plugins.
+for plugin in null memory file data; do
+    case $plugin in
+        null|memory) args=("$plugin" "$BENCH_SIZE") ;;
+        file) args=(file "$disk") ;;
+        data) args=(data data="$sparse_data" size="$BENCH_SIZE") ;;
+    esac
+    run $plugin-randread-4k -m randread -b 4k -- "${args[@]}"
+    run $plugin-randwrite-4k -m randwrite -b 4k -- "${args[@]}"
+    run $plugin-randrw-4k -m randrw -b 4k -- "${args[@]}"
+    run $plugin-read-256k -m read -b 256k -- "${args[@]}"
+    run $plugin-write-256k -m write -b 256k -- "${args[@]}"
+done
+
+# Overhead of stacking filters.
+for n in 1 4 16; do
+    filters=()
+    for i in $(seq 1 $n); do filters+=(--filter=nofilter); done
+    run nofilter-x$n-randread-4k -m randread -b 4k -- \
+        "${filters[@]}" null "$BENCH_SIZE"
+done
+
+# Extents-heavy workloads.
+run data-extents-1M -m extents -b 1M -- \
+    data data="$sparse_data" size="$BENCH_SIZE"
+run memory-extents-1M -m extents -b 1M -- memory "$BENCH_SIZE"
+run file-extents-1M -m extents -b 1M -- file "$disk"
+
+# Multi-connection scaling.
+for c in 1 2 4 8; do
+    run memory-randread-4k-conns$c -m randread -b 4k -c $c -- \
+        memory "$BENCH_SIZE"
+    run memory-randwrite-4k-conns$c -m randwrite -b 4k -c $c -- \
+        memory "$BENCH_SIZE"
+done
+
+# TLS over loopback TCP with a pre-shared key, with and without
+# kernel TLS offload.  kTLS is only used if the kernel supports it
+# (modprobe tls), see nbdkit-tls(1).
+if "$NBDKIT" --dump-config | grep -sq '^tls=yes'; then
+    psk="$tmpdir/keys.psk"
+    printf 'bench:%s\n' \
+           "$(od -An -tx1 -N32 /dev/urandom | tr -d ' \n')" > "$psk"
+    port=$(( 50000 + (RANDOM%15000) ))
+    target="$(printf '%q ' -p $port -k "$psk") 127.0.0.1"
+    # libnbd may have been built without TLS support.
+    if ! "$NBDKIT" -i 127.0.0.1 -p $port --tls=require --tls-psk="$psk" \
+         null 1M --run "$NBDKIT_BENCH -t 0.1 -w 0 $target" \
+         >/dev/null 2>&1; then
+        echo "$0: client does not support TLS, skipping TLS benchmarks"
+        ktls_variants=
+    else
+        ktls_variants="ktls no-ktls"
+    fi
+    for ktls in $ktls_variants; do
+        server_args=(-i 127.0.0.1 -p $port --tls=require --tls-psk="$psk")
+        if [ $ktls = no-ktls ]; then server_args+=(--no-ktls); fi
+        run tls-$ktls-read-256k -m read -b 256k -- null "$BENCH_SIZE"
+        run tls-$ktls-write-256k -m write -b 256k -- null "$BENCH_SIZE"
+        run tls-$ktls-randread-4k -m randread -b 4k -- null "$BENCH_SIZE"
+    done
+    server_args=(-U -)
+    target='"$unixsocket"'
+fi
+
+# Write the results with some information to identify the build.
+commit="$(git -C "${srcdir:-.}" rev-parse HEAD 2>/dev/null || echo unknown)"
+{
+    printf '{\n'
+    printf '  "version": "%s",\n' "$("$NBDKIT" --version | awk '{print $2}')"
+    printf '  "commit": "%s",\n' "$commit"
+    printf '  "date": "%s",\n' "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+    printf '  "host": "%s",\n' "$(uname -n)"
+    printf '  "cpus": %d,\n' "$(nproc)"
+    printf '  "results": [\n'
+    sed -e 's/^/    /' -e '$!s/$/,/' "$results"
+    printf '  ]\n'
+    printf '}\n'
+} > "$BENCH_OUTPUT"
+echo "results written to $BENCH_OUTPUT"
@@ -1,5 +1,5 @@
 /* nbdkit
- * Copyright (C) 2018 Red Hat Inc.
+ * Copyright (C) 2018-2020 Red Hat Inc.
  *
  * Redistribution and use in source and binary forms, with or without
  * modification, are permitted provided that the following conditions are
@@ -34,82 +34,259 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdint.h>
 
 #include <nbdkit-plugin.h>
 
 #include "bitmap.h"
+#include "minmax.h"
 #include "rounding.h"
-#include "nextnonzero.h"
+
+#define ALL_ONES UINT64_C(0xffffffffffffffff)
+
+/* Reallocate one array of words, zeroing any new words.  On error
+ * the old array is left alone.
+ */
+static int
+resize_words (uint64_t **p, size_t old_n, size_t new_n)
+{
+  uint64_t *np;
+
+  if (new_n == 0) {
+    free (*p);
+    *p = NULL;
+    return 0;
+  }
+  np = realloc (*p, new_n * sizeof (uint64_t));
+  if (np == NULL) {
+    nbdkit_error ("realloc: %m");
+    return -1;
+  }
+  if (old_n < new_n)
+    memset (&np[old_n], 0, (new_n - old_n) * sizeof (uint64_t));
+  *p = np;
+  return 0;
+}
+
+/* Recalculate all summary bits from the bitmap. */
+static void
+rebuild_summary (struct bitmap *bm)
+{
+  const size_t n1 = DIV_ROUND_UP (bm->nr_words, 64);
+  const size_t n2 = DIV_ROUND_UP (n1, 64);
+  size_t i;
+
+  if (bm->nr_words == 0)
+    return;
+
+  memset (bm->any[0], 0, n1 * sizeof (uint64_t));
+  memset (bm->any[1], 0, n2 * sizeof (uint64_t));
+  memset (bm->full[0], 0, n1 * sizeof (uint64_t));
+  memset (bm->full[1], 0, n2 * sizeof (uint64_t));
+  for (i = 0; i < bm->nr_words; ++i) {
+    if (bm->bitmap[i] != 0)
+      bitmap_update_summary (bm, i);
+  }
+}
 
 int
 bitmap_resize (struct bitmap *bm, uint64_t new_size)
 {
-  uint8_t *new_bitmap;
-  const size_t old_bm_size = bm->size;
+  const size_t old_words = bm->nr_words;
+  const size_t old_n1 = DIV_ROUND_UP (old_words, 64);
+  const size_t old_n2 = DIV_ROUND_UP (old_n1, 64);
   uint64_t new_bm_size_u64;
-  size_t new_bm_size;
+  size_t new_bm_size, new_words, new_n1, new_n2;
+  uint64_t nr_blks;
 
   new_bm_size_u64 = DIV_ROUND_UP (new_size,
                                   bm->blksize * UINT64_C(8) / bm->bpb);
-  if (new_bm_size_u64 > SIZE_MAX) {
+  if (new_bm_size_u64 > SIZE_MAX - 7) {
     nbdkit_error ("bitmap too large for this architecture");
     return -1;
   }
   new_bm_size = (size_t) new_bm_size_u64;
+  new_words = DIV_ROUND_UP (new_bm_size, 8);
+  new_n1 = DIV_ROUND_UP (new_words, 64);
+  new_n2 = DIV_ROUND_UP (new_n1, 64);
 
-  if (new_bm_size > 0) {
-    new_bitmap = realloc (bm->bitmap, new_bm_size);
-    if (new_bitmap == NULL) {
-      nbdkit_error ("realloc: %m");
-      return -1;
-    }
-  }
-  else {
-    free (bm->bitmap);
-    new_bitmap = NULL;
-  }
-  bm->bitmap = new_bitmap;
+  if (resize_words (&bm->bitmap, old_words, new_words) == -1 ||
+      resize_words (&bm->any[0], old_n1, new_n1) == -1 ||
+      resize_words (&bm->any[1], old_n2, new_n2) == -1 ||
+      resize_words (&bm->full[0], old_n1, new_n1) == -1 ||
+      resize_words (&bm->full[1], old_n2, new_n2) == -1)
+    return -1;
   bm->size = new_bm_size;
-  if (old_bm_size < new_bm_size)
-    memset (&bm->bitmap[old_bm_size], 0, new_bm_size-old_bm_size);
+  bm->nr_words = new_words;
+
+  /* If shrinking, clear entries past the end in the last word. */
+  nr_blks = bitmap_nr_blks (bm);
+  if (new_words > 0 && (nr_blks << bm->bitshift) & 63)
+    bm->bitmap[new_words-1] &= ~(ALL_ONES << ((nr_blks << bm->bitshift) & 63));
+
+  rebuild_summary (bm);
 
   nbdkit_debug ("bitmap resized to %zu bytes", new_bm_size);
 
   return 0;
 }
 
-int64_t
-bitmap_next (const struct bitmap *bm, uint64_t blk)
+void
+bitmap_clear (struct bitmap *bm)
 {
-  uint64_t limit = bm->size * bm->ibpb;
-  const uint8_t *p;
+  const size_t n1 = DIV_ROUND_UP (bm->nr_words, 64);
 
-  /* Align to the next byte boundary. */
-  for (; blk < limit && (blk & (bm->ibpb-1)) != 0; ++blk) {
-    if (bitmap_get_blk (bm, blk, 0) != 0)
-      return blk;
+  if (bm->nr_words == 0)
+    return;
+
+  memset (bm->bitmap, 0, bm->nr_words * sizeof (uint64_t));
+  memset (bm->any[0], 0, n1 * sizeof (uint64_t));
+  memset (bm->any[1], 0, DIV_ROUND_UP (n1, 64) * sizeof (uint64_t));
+  memset (bm->full[0], 0, n1 * sizeof (uint64_t));
+  memset (bm->full[1], 0, DIV_ROUND_UP (n1, 64) * sizeof (uint64_t));
+}
+
+void
+bitmap_set_blk_range (struct bitmap *bm,
+                      uint64_t start, uint64_t end, unsigned v)
+{
+  const uint64_t pattern = bm->lowmask * v;
+  const unsigned shift = 6 - bm->bitshift;
+
+  end = MIN (end, bitmap_nr_blks (bm));
+
+  while (start < end) {
+    const size_t i = start >> shift;
+    const uint64_t last = MIN (end, (uint64_t) (i+1) << shift);
+    const unsigned first_bit = (start << bm->bitshift) & 63;
+    const unsigned nr_bits = (last - start) << bm->bitshift;
+    const uint64_t mask =
+      nr_bits == 64 ? ALL_ONES : ((UINT64_C(1) << nr_bits) - 1) << first_bit;
+    const uint64_t old = bm->bitmap[i];
+
+    bm->bitmap[i] = (old & ~mask) | (pattern & mask);
+    if (bm->bitmap[i] != old)
+      bitmap_update_summary (bm, i);
+    start = last;
   }
-  if (blk == limit)
-    return -1;
+}
+
+/* Find the first word index >= i whose bit in the summary is set, or
+ * if ‘invert’ is all ones, whose bit is clear.  Returns nr_words if
+ * there is no such word.
+ *
+ * Padding bits past the end of each level are always clear, so when
+ * searching for clear bits we may find an index >= nr_words, which is
+ * handled the same as not finding anything.
+ */
+static size_t
+summary_next (uint64_t *const *level, size_t nr_words, size_t i,
+              uint64_t invert)
+{
+  const size_t n1 = DIV_ROUND_UP (nr_words, 64);
+  const size_t n2 = DIV_ROUND_UP (n1, 64);
+  size_t j, k;
+  uint64_t w;
+
+  if (i >= nr_words)
+    return nr_words;
+
+  /* Rest of the current level 1 word. */
+  j = i >> 6;
+  w = (level[0][j] ^ invert) & (ALL_ONES << (i & 63));
+  if (w == 0) {
+    /* Use level 2 to find the next interesting level 1 word. */
+    j++;
+    if (j >= n1)
+      return nr_words;
+    k = j >> 6;
+    w = (level[1][k] ^ invert) & (ALL_ONES << (j & 63));
+    while (w == 0) {
+      k++;
+      if (k >= n2)
+        return nr_words;
+      w = level[1][k] ^ invert;
+    }
+    j = (k << 6) + __builtin_ctzll (w);
+    if (j >= n1)
+      return nr_words;
+    w = level[0][j] ^ invert;
+    assert (w != 0);
+  }
+
+  i = (j << 6) + __builtin_ctzll (w);
+  return MIN (i, nr_words);
+}
+
+/* Common code for bitmap_next and bitmap_next_clear.  ‘invert’ is 0
+ * to find non-zero entries or all ones to find zero entries.
+ */
+static int64_t
+find_next (const struct bitmap *bm, uint64_t blk, uint64_t invert)
+{
+  const uint64_t limit = bitmap_nr_blks (bm);
+  const unsigned shift = 6 - bm->bitshift;
+  uint64_t *const *level = invert ? bm->full : bm->any;
+  size_t i;
+  uint64_t w;
 
-  /* Now we're at a byte boundary we can use a fast string function to
-   * find the next non-zero byte.
-   */
-  p = &bm->bitmap[blk >> (3 - bm->bitshift)];
-  p = (const uint8_t *) next_non_zero ((const char *) p,
-                                       &bm->bitmap[bm->size] - p);
-  if (p == NULL)
+  if (blk >= limit)
     return -1;
 
-  /* Now check the non-zero byte to find out which bit (ie. block) is set. */
-  blk = (p - bm->bitmap) << (3 - bm->bitshift);
-  for (; blk < limit; ++blk) {
-    if (bitmap_get_blk (bm, blk, 0) != 0)
-      return blk;
+  /* Rest of the current word. */
+  i = blk >> shift;
+  w = (bitmap_fold (bm, bm->bitmap[i]) ^ (invert & bm->lowmask))
+    & (ALL_ONES << ((blk << bm->bitshift) & 63));
+  if (w == 0) {
+    i = summary_next (level, bm->nr_words, i+1, invert);
+    if (i == bm->nr_words)
+      return -1;
+    w = bitmap_fold (bm, bm->bitmap[i]) ^ (invert & bm->lowmask);
+    assert (w != 0);
+  }
+
+  blk = ((uint64_t) i << shift) + (__builtin_ctzll (w) >> bm->bitshift);
+  return blk < limit ? (int64_t) blk : -1;
+}
+
+int64_t
+bitmap_next (const struct bitmap *bm, uint64_t blk)
+{
+  return find_next (bm, blk, 0);
+}
+
+int64_t
+bitmap_next_clear (const struct bitmap *bm, uint64_t blk)
+{
+  return find_next (bm, blk, ALL_ONES);
+}
+
+uint64_t
+bitmap_count (const struct bitmap *bm, uint64_t start, uint64_t end)
+{
+  const unsigned shift = 6 - bm->bitshift;
+  uint64_t count = 0;
+  size_t i, first, last;
+
+  end = MIN (end, bitmap_nr_blks (bm));
+  if (start >= end)
+    return 0;
+  first = start >> shift;
+  last = (end - 1) >> shift;
+
+  /* Words with no non-zero entries are skipped using the summary. */
+  for (i = first; i <= last;
+       i = summary_next (bm->any, bm->nr_words, i+1, 0)) {
+    uint64_t w = bitmap_fold (bm, bm->bitmap[i]);
+
+    if (i == first)
+      w &= ALL_ONES << ((start << bm->bitshift) & 63);
+    if (i == last && ((end << bm->bitshift) & 63) != 0)
+      w &= ~(ALL_ONES << ((end << bm->bitshift) & 63));
+    count += __builtin_popcountll (w);
   }
 
-  /* Should never be reached. */
-  abort ();
+  return count;
 }
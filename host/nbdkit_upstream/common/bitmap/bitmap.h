@@ -1,5 +1,5 @@
 /* nbdkit
- * Copyright (C) 2018 Red Hat Inc.
+ * Copyright (C) 2018-2020 Red Hat Inc.
  *
  * Redistribution and use in source and binary forms, with or without
  * modification, are permitted provided that the following conditions are
@@ -35,11 +35,17 @@
  * block of the disk.  You can choose the number of bits and block
  * size when creating the bitmap.  Entries in the bitmap are
  * initialized to 0.
+ *
+ * The bitmap is stored as an array of 64 bit words.  Above it are two
+ * levels of summary bits, so that searching for the next non-zero (or
+ * zero) entry takes time proportional to the number of entries
+ * skipped over divided by 262144, rather than the size of the disk.
  */
 
 #ifndef NBDKIT_BITMAP_H
 #define NBDKIT_BITMAP_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
@@ -59,9 +65,22 @@ struct bitmap {
      8          3          1
   */
   uint8_t bitshift, ibpb;
+  uint64_t lowmask;            /* Lowest bit of every entry in a word. */
 
-  uint8_t *bitmap;              /* The bitmap. */
+  uint64_t *bitmap;             /* The bitmap. */
   size_t size;                  /* Size of bitmap in bytes. */
+  size_t nr_words;              /* Size of bitmap in words. */
+
+  /* Summary levels.  Bit i of any[0] is set iff word i of the bitmap
+   * contains a non-zero entry, and bit j of any[1] is set iff word j
+   * of any[0] is non-zero.
+   *
+   * Bit i of full[0] is set iff every entry in word i of the bitmap is
+   * non-zero, and bit j of full[1] is set iff every bit in word j of
+   * full[0] is set.
+   */
+  uint64_t *any[2];
+  uint64_t *full[2];
 };
 
 static inline void __attribute__((__nonnull__ (1)))
@@ -73,16 +92,19 @@ bitmap_init (struct bitmap *bm, unsigned blocksize, unsigned bpb)
   /* bpb can be 1, 2, 4 or 8 only. */
   bm->bpb = bpb;
   switch (bpb) {
-  case 1: bm->bitshift = 0; break;
-  case 2: bm->bitshift = 1; break;
-  case 4: bm->bitshift = 2; break;
-  case 8: bm->bitshift = 3; break;
+  case 1: bm->bitshift = 0; bm->lowmask = UINT64_C(0xffffffffffffffff); break;
+  case 2: bm->bitshift = 1; bm->lowmask = UINT64_C(0x5555555555555555); break;
+  case 4: bm->bitshift = 2; bm->lowmask = UINT64_C(0x1111111111111111); break;
+  case 8: bm->bitshift = 3; bm->lowmask = UINT64_C(0x0101010101010101); break;
   default: abort ();
   }
   bm->ibpb = 8/bpb;
 
   bm->bitmap = NULL;
   bm->size = 0;
+  bm->nr_words = 0;
+  bm->any[0] = bm->any[1] = NULL;
+  bm->full[0] = bm->full[1] = NULL;
 }
 
 /* Only frees the bitmap itself, since it is assumed that the struct
@@ -91,8 +113,13 @@ bitmap_init (struct bitmap *bm, unsigned blocksize, unsigned bpb)
 static inline void
 bitmap_free (struct bitmap *bm)
 {
-  if (bm)
+  if (bm) {
     free (bm->bitmap);
+    free (bm->any[0]);
+    free (bm->any[1]);
+    free (bm->full[0]);
+    free (bm->full[1]);
+  }
 }
 
 /* Resize the bitmap to the virtual disk size in bytes.
@@ -102,25 +129,79 @@ extern int bitmap_resize (struct bitmap *bm, uint64_t new_size)
   __attribute__((__nonnull__ (1)));
 
 /* Clear the bitmap (set everything to zero). */
-static inline void  __attribute__((__nonnull__ (1)))
-bitmap_clear (struct bitmap *bm)
+extern void bitmap_clear (struct bitmap *bm)
+  __attribute__((__nonnull__ (1)));
+
+/* This macro calculates the word offset in the bitmap and which
+ * bit/mask we are addressing within that word.
+ *
+ * bpb     blk_word           blk_bit          mask
+ * 1       blk >> 6           0,1,2,...,63     any single bit
+ * 2       blk >> 5           0,2,4,...,62     0x3 << blk_bit
+ * 4       blk >> 4           0,4,8,...,60     0xf << blk_bit
+ * 8       blk >> 3           0,8,...,56       0xff << blk_bit
+ */
+#define BITMAP_WORD_BIT_MASK(bm, blk)                                   \
+  uint64_t blk_word = (blk) >> (6 - (bm)->bitshift);                    \
+  unsigned blk_bit = ((blk) << (bm)->bitshift) & 63;                    \
+  uint64_t mask = ((UINT64_C(1) << (bm)->bpb) - 1) << blk_bit
+
+/* Number of blocks represented by the bitmap. */
+static inline uint64_t __attribute__((__nonnull__ (1)))
+bitmap_nr_blks (const struct bitmap *bm)
 {
-  memset (bm->bitmap, 0, bm->size);
+  return (uint64_t) bm->size * bm->ibpb;
 }
 
-/* This macro calculates the byte offset in the bitmap and which
- * bit/mask we are addressing within that byte.
- *
- * bpb     blk_offset         blk_bit          mask
- * 1       blk >> 3           0,1,2,...,7      any single bit
- * 2       blk >> 2           0, 2, 4 or 6     0x03, 0x0c, 0x30 or 0xc0
- * 4       blk >> 1           0 or 4           0x0f or 0xf0
- * 8       blk >> 0           always 0         always 0xff
+/* Reduce each entry in a word to its lowest bit, set iff the entry
+ * is non-zero.
  */
-#define BITMAP_OFFSET_BIT_MASK(bm, blk)                         \
-  uint64_t blk_offset = (blk) >> (3 - (bm)->bitshift);          \
-  unsigned blk_bit = (bm)->bpb * ((blk) & ((bm)->ibpb - 1));    \
-  unsigned mask = ((1 << (bm)->bpb) - 1) << blk_bit
+static inline uint64_t __attribute__((__nonnull__ (1)))
+bitmap_fold (const struct bitmap *bm, uint64_t w)
+{
+  switch (bm->bpb) {
+  case 8: w |= w >> 4; /* fallthrough */
+  case 4: w |= w >> 2; /* fallthrough */
+  case 2: w |= w >> 1; /* fallthrough */
+  default: return w & bm->lowmask;
+  }
+}
+
+/* Set or clear bit i in a two level summary.  ‘all’ selects whether
+ * the upper level records words which are non-zero (false) or all
+ * ones (true).
+ */
+static inline void
+bitmap_summary_set (uint64_t **level, size_t i, bool v, bool all)
+{
+  uint64_t *w = &level[0][i >> 6];
+  const uint64_t bit = UINT64_C(1) << (i & 63);
+  const uint64_t bit2 = UINT64_C(1) << ((i >> 6) & 63);
+  bool up;
+
+  if (!!(*w & bit) == v)
+    return;
+  if (v)
+    *w |= bit;
+  else
+    *w &= ~bit;
+
+  up = all ? *w == UINT64_C(0xffffffffffffffff) : *w != 0;
+  if (up)
+    level[1][i >> 12] |= bit2;
+  else
+    level[1][i >> 12] &= ~bit2;
+}
+
+/* Update the summary bits after word i of the bitmap has changed. */
+static inline void __attribute__((__nonnull__ (1)))
+bitmap_update_summary (struct bitmap *bm, size_t i)
+{
+  const uint64_t nz = bitmap_fold (bm, bm->bitmap[i]);
+
+  bitmap_summary_set (bm->any, i, nz != 0, false);
+  bitmap_summary_set (bm->full, i, nz == bm->lowmask, true);
+}
 
 /* Return the bit(s) associated with the given block.
  * If the request is out of range, returns the default value.
@@ -128,14 +209,14 @@ bitmap_clear (struct bitmap *bm)
 static inline unsigned __attribute__((__nonnull__ (1)))
 bitmap_get_blk (const struct bitmap *bm, uint64_t blk, unsigned default_)
 {
-  BITMAP_OFFSET_BIT_MASK (bm, blk);
+  BITMAP_WORD_BIT_MASK (bm, blk);
 
-  if (blk_offset >= bm->size) {
+  if (blk >= bitmap_nr_blks (bm)) {
     nbdkit_debug ("bitmap_get: block number is out of range");
     return default_;
   }
 
-  return (bm->bitmap[blk_offset] & mask) >> blk_bit;
+  return (bm->bitmap[blk_word] & mask) >> blk_bit;
 }
 
 /* As above but works with virtual disk offset in bytes. */
@@ -149,29 +230,39 @@ bitmap_get (const struct bitmap *bm, uint64_t offset, unsigned default_)
  * If out of range, it is ignored.
  */
 static inline void __attribute__((__nonnull__ (1)))
-bitmap_set_blk (const struct bitmap *bm, uint64_t blk, unsigned v)
+bitmap_set_blk (struct bitmap *bm, uint64_t blk, unsigned v)
 {
-  BITMAP_OFFSET_BIT_MASK (bm, blk);
+  BITMAP_WORD_BIT_MASK (bm, blk);
+  uint64_t old;
 
-  if (blk_offset >= bm->size) {
+  if (blk >= bitmap_nr_blks (bm)) {
     nbdkit_debug ("bitmap_set: block number is out of range");
     return;
   }
 
-  bm->bitmap[blk_offset] &= ~mask;
-  bm->bitmap[blk_offset] |= v << blk_bit;
+  old = bm->bitmap[blk_word];
+  bm->bitmap[blk_word] = (old & ~mask) | ((uint64_t) v << blk_bit);
+  if (bm->bitmap[blk_word] != old)
+    bitmap_update_summary (bm, blk_word);
 }
 
 /* As above bit works with virtual disk offset in bytes. */
 static inline void __attribute__((__nonnull__ (1)))
-bitmap_set (const struct bitmap *bm, uint64_t offset, unsigned v)
+bitmap_set (struct bitmap *bm, uint64_t offset, unsigned v)
 {
   return bitmap_set_blk (bm, offset / bm->blksize, v);
 }
 
+/* Set the bit(s) associated with blocks [start, end) to v.
+ * Blocks which are out of range are ignored.
+ */
+extern void bitmap_set_blk_range (struct bitmap *bm,
+                                  uint64_t start, uint64_t end, unsigned v)
+  __attribute__((__nonnull__ (1)));
+
 /* Iterate over blocks represented in the bitmap. */
 #define bitmap_for(bm, /* uint64_t */ blknum)                           \
-  for ((blknum) = 0; (blknum) < (bm)->size * (bm)->ibpb; ++(blknum))
+  for ((blknum) = 0; (blknum) < bitmap_nr_blks (bm); ++(blknum))
 
 /* Find the next non-zero block in the bitmap, starting at ‘blk’.
  * Returns -1 if the bitmap is all zeroes from blk to the end of the
@@ -180,4 +271,22 @@ bitmap_set (const struct bitmap *bm, uint64_t offset, unsigned v)
 extern int64_t bitmap_next (const struct bitmap *bm, uint64_t blk)
   __attribute__((__nonnull__ (1)));
 
+/* Find the next zero block in the bitmap, starting at ‘blk’.
+ * Returns -1 if every block from blk to the end of the bitmap is
+ * non-zero.
+ */
+extern int64_t bitmap_next_clear (const struct bitmap *bm, uint64_t blk)
+  __attribute__((__nonnull__ (1)));
+
+/* Iterate over the non-zero blocks in the bitmap. */
+#define bitmap_for_each_set(bm, /* int64_t */ blknum)                   \
+  for ((blknum) = bitmap_next ((bm), 0);                                \
+       (blknum) != -1;                                                  \
+       (blknum) = bitmap_next ((bm), (blknum) + 1))
+
+/* Count the non-zero blocks in [start, end). */
+extern uint64_t bitmap_count (const struct bitmap *bm,
+                              uint64_t start, uint64_t end)
+  __attribute__((__nonnull__ (1)));
+
 #endif /* NBDKIT_BITMAP_H */
@@ -1,5 +1,5 @@
 /* nbdkit
- * Copyright (C) 2018 Red Hat Inc.
+ * Copyright (C) 2018-2020 Red Hat Inc.
  *
  * Redistribution and use in source and binary forms, with or without
  * modification, are permitted provided that the following conditions are
@@ -45,6 +45,7 @@
 #include <nbdkit-plugin.h>
 
 #include "bitmap.h"
+#include "minmax.h"
 
 static void
 test (int bpb, int blksize)
@@ -115,10 +116,143 @@ test (int bpb, int blksize)
     i = bitmap_next (&bm, i+1);
     ++j;
   }
+  assert (j == sizeof blks / sizeof blks[0]);
+
+  /* Use bitmap_next_clear to iterate over the zero entries. */
+  i = bitmap_next_clear (&bm, 0);
+  j = 0;
+  while (i != -1) {
+    while (j < sizeof blks / sizeof blks[0] && blks[j] < i)
+      ++j;
+    assert (j == sizeof blks / sizeof blks[0] || blks[j] != i);
+    i = bitmap_next_clear (&bm, i+1);
+  }
+
+  assert (bitmap_count (&bm, 0, nr_blocks) == sizeof blks / sizeof blks[0]);
+  assert (bitmap_count (&bm, 90, 95) == 5);
+  assert (bitmap_count (&bm, 91, 94) == 3);
+
+  /* Set and clear ranges. */
+  bitmap_set_blk_range (&bm, 100, 700, 1);
+  assert (bitmap_next (&bm, 100) == 100);
+  assert (bitmap_next_clear (&bm, 100) == 700);
+  assert (bitmap_count (&bm, 0, nr_blocks) ==
+          sizeof blks / sizeof blks[0] + 600);
+  bitmap_set_blk_range (&bm, 0, nr_blocks, 0);
+  assert (bitmap_next (&bm, 0) == -1);
+  assert (bitmap_count (&bm, 0, nr_blocks) == 0);
+  bitmap_set_blk_range (&bm, 0, nr_blocks, 1);
+  assert (bitmap_next_clear (&bm, 0) == -1);
+  assert (bitmap_count (&bm, 0, nr_blocks) == nr_blocks);
 
   bitmap_free (&bm);
 }
 
+static uint64_t rng_state = 1;
+
+static uint64_t
+xrand (void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+/* Compare the bitmap with a simple array after random operations,
+ * using a bitmap large enough to have several summary words.
+ */
+static void
+test_random (int bpb)
+{
+  struct bitmap bm;
+  const uint64_t nr_blocks = 600008; /* not a multiple of 64 */
+  uint8_t *ref;
+  uint64_t i, j, start, end, count;
+  unsigned v;
+  int64_t r;
+  size_t n;
+
+  printf ("random test, bpb = %d\n", bpb);
+  fflush (stdout);
+
+  ref = calloc (nr_blocks, 1);
+  assert (ref);
+  bitmap_init (&bm, 512, bpb);
+  if (bitmap_resize (&bm, nr_blocks * 512) == -1)
+    exit (EXIT_FAILURE);
+  assert (bitmap_nr_blks (&bm) == nr_blocks);
+  assert (bitmap_next (&bm, 0) == -1);
+
+  for (n = 0; n < 2000; ++n) {
+    v = xrand () & ((1 << bpb) - 1);
+    start = xrand () % nr_blocks;
+    switch (xrand () % 4) {
+    case 0:                     /* single block */
+      bitmap_set_blk (&bm, start, v);
+      ref[start] = v;
+      break;
+    case 1:                     /* short range */
+      end = MIN (start + xrand () % 200, nr_blocks);
+      bitmap_set_blk_range (&bm, start, end, v);
+      memset (&ref[start], v, end - start);
+      break;
+    case 2:                     /* long range, mostly zero */
+      end = MIN (start + xrand () % 100000, nr_blocks);
+      if (xrand () % 4)
+        v = 0;
+      bitmap_set_blk_range (&bm, start, end, v);
+      memset (&ref[start], v, end - start);
+      break;
+    case 3:                     /* check searches and counts */
+      for (i = start; i < nr_blocks && ref[i] == 0; ++i)
+        ;
+      r = bitmap_next (&bm, start);
+      assert (r == (i < nr_blocks ? (int64_t) i : -1));
+      for (i = start; i < nr_blocks && ref[i] != 0; ++i)
+        ;
+      r = bitmap_next_clear (&bm, start);
+      assert (r == (i < nr_blocks ? (int64_t) i : -1));
+      end = MIN (start + xrand () % 300000, nr_blocks);
+      for (count = 0, i = start; i < end; ++i)
+        count += ref[i] != 0;
+      assert (bitmap_count (&bm, start, end) == count);
+      break;
+    }
+  }
+
+  /* Full comparison. */
+  for (i = 0; i < nr_blocks; ++i)
+    assert (bitmap_get_blk (&bm, i, 0) == ref[i]);
+  j = 0;
+  bitmap_for_each_set (&bm, r) {
+    for (; j < (uint64_t) r; ++j)
+      assert (ref[j] == 0);
+    assert (ref[j] != 0);
+    ++j;
+  }
+  for (; j < nr_blocks; ++j)
+    assert (ref[j] == 0);
+
+  /* Shrinking and growing again must not bring back old entries. */
+  if (bitmap_resize (&bm, 1001 * 512) == -1)
+    exit (EXIT_FAILURE);
+  j = bitmap_nr_blks (&bm);
+  if (bitmap_resize (&bm, nr_blocks * 512) == -1)
+    exit (EXIT_FAILURE);
+  memset (&ref[j], 0, nr_blocks - j);
+  for (i = 0; i < nr_blocks; ++i)
+    assert (bitmap_get_blk (&bm, i, 0) == ref[i]);
+  assert (bitmap_count (&bm, 0, nr_blocks) == bitmap_count (&bm, 0, j));
+
+  bitmap_clear (&bm);
+  assert (bitmap_next (&bm, 0) == -1);
+  assert (bitmap_next_clear (&bm, 0) == 0);
+
+  bitmap_free (&bm);
+  free (ref);
+}
+
 int
 main (void)
 {
@@ -130,6 +264,8 @@ main (void)
   for (bpb = 1; bpb <= 8; bpb <<= 1)
     for (i = 0; i < sizeof blksizes / sizeof blksizes[0]; ++i)
       test (bpb, blksizes[i]);
+  for (bpb = 1; bpb <= 8; bpb <<= 1)
+    test_random (bpb);
 
   exit (EXIT_SUCCESS);
 }
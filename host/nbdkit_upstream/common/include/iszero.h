@@ -35,6 +35,11 @@
 
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#ifdef HAVE_X86_SIMD_TARGETS
+#include <immintrin.h>
+#endif
 
 /* Return true iff the buffer is all zero bytes.
  *
@@ -44,9 +49,11 @@
  *
  * See also:
  * https://gcc.gnu.org/bugzilla/show_bug.cgi?id=69908
+ *
+ * This is the portable version, also used for short buffers.
  */
 static inline bool __attribute__((__nonnull__ (1)))
-is_zero (const char *buffer, size_t size)
+is_zero_generic (const char *buffer, size_t size)
 {
   size_t i;
   const size_t limit = size < 16 ? size : 16;
@@ -60,4 +67,139 @@ is_zero (const char *buffer, size_t size)
   return true;
 }
 
+#ifdef HAVE_X86_SIMD_TARGETS
+
+/* SIMD kernels for x86.  These are only called for buffers of at
+ * least 64 bytes.  Each loop ORs several vectors together and tests
+ * once per iteration, and returns as soon as a non-zero vector is
+ * seen.  The tail is handled by an overlapping load of the last
+ * vector.  SSE2 is always present on x86-64.
+ */
+static inline bool __attribute__((__nonnull__ (1)))
+is_zero_sse2 (const char *buffer, size_t size)
+{
+  const char *p = buffer, *end = buffer + size;
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i v;
+
+  for (; p + 64 <= end; p += 64) {
+    v = _mm_or_si128 (_mm_or_si128 (_mm_loadu_si128 ((const __m128i *) p),
+                                    _mm_loadu_si128 ((const __m128i *) (p+16))),
+                      _mm_or_si128 (_mm_loadu_si128 ((const __m128i *) (p+32)),
+                                    _mm_loadu_si128 ((const __m128i *) (p+48))));
+    if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, zero)) != 0xffff)
+      return false;
+  }
+  for (; p + 16 <= end; p += 16) {
+    v = _mm_loadu_si128 ((const __m128i *) p);
+    if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, zero)) != 0xffff)
+      return false;
+  }
+  if (p < end) {
+    v = _mm_loadu_si128 ((const __m128i *) (end-16));
+    if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, zero)) != 0xffff)
+      return false;
+  }
+  return true;
+}
+
+static inline bool __attribute__((__nonnull__ (1), __target__ ("avx2")))
+is_zero_avx2 (const char *buffer, size_t size)
+{
+  const char *p = buffer, *end = buffer + size;
+  __m256i v;
+
+  for (; p + 128 <= end; p += 128) {
+    v = _mm256_or_si256 (
+      _mm256_or_si256 (_mm256_loadu_si256 ((const __m256i *) p),
+                       _mm256_loadu_si256 ((const __m256i *) (p+32))),
+      _mm256_or_si256 (_mm256_loadu_si256 ((const __m256i *) (p+64)),
+                       _mm256_loadu_si256 ((const __m256i *) (p+96))));
+    if (!_mm256_testz_si256 (v, v))
+      return false;
+  }
+  for (; p + 32 <= end; p += 32) {
+    v = _mm256_loadu_si256 ((const __m256i *) p);
+    if (!_mm256_testz_si256 (v, v))
+      return false;
+  }
+  if (p < end) {
+    v = _mm256_loadu_si256 ((const __m256i *) (end-32));
+    if (!_mm256_testz_si256 (v, v))
+      return false;
+  }
+  return true;
+}
+
+static inline bool __attribute__((__nonnull__ (1), __target__ ("avx512f")))
+is_zero_avx512 (const char *buffer, size_t size)
+{
+  const char *p = buffer, *end = buffer + size;
+  __m512i v;
+
+  for (; p + 256 <= end; p += 256) {
+    v = _mm512_or_si512 (
+      _mm512_or_si512 (_mm512_loadu_si512 (p), _mm512_loadu_si512 (p+64)),
+      _mm512_or_si512 (_mm512_loadu_si512 (p+128),
+                       _mm512_loadu_si512 (p+192)));
+    if (_mm512_test_epi64_mask (v, v))
+      return false;
+  }
+  for (; p + 64 <= end; p += 64) {
+    v = _mm512_loadu_si512 (p);
+    if (_mm512_test_epi64_mask (v, v))
+      return false;
+  }
+  if (p < end) {
+    v = _mm512_loadu_si512 (end-64);
+    if (_mm512_test_epi64_mask (v, v))
+      return false;
+  }
+  return true;
+}
+
+typedef bool (*is_zero_fn) (const char *buffer, size_t size);
+
+/* Pick the best kernel for this CPU. */
+static inline is_zero_fn
+is_zero_select (void)
+{
+  if (__builtin_cpu_supports ("avx512f"))
+    return is_zero_avx512;
+  if (__builtin_cpu_supports ("avx2"))
+    return is_zero_avx2;
+  return is_zero_sse2;
+}
+
+#endif /* HAVE_X86_SIMD_TARGETS */
+
+/* Return true iff the buffer is all zero bytes.
+ *
+ * Most buffers which are not zero have non-zero data near the start,
+ * so check the first 16 bytes before calling a vector kernel.  Where
+ * available the kernel is chosen at runtime on first use.
+ */
+static inline bool __attribute__((__nonnull__ (1)))
+is_zero (const char *buffer, size_t size)
+{
+#ifdef HAVE_X86_SIMD_TARGETS
+  static is_zero_fn kernel;
+  uint64_t a, b;
+
+  if (size < 64)
+    return is_zero_generic (buffer, size);
+
+  memcpy (&a, buffer, 8);
+  memcpy (&b, buffer + 8, 8);
+  if (a | b)
+    return false;
+
+  if (kernel == NULL)
+    kernel = is_zero_select ();
+  return kernel (buffer, size);
+#else
+  return is_zero_generic (buffer, size);
+#endif
+}
+
 #endif /* NBDKIT_ISZERO_H */
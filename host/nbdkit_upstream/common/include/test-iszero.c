@@ -35,31 +35,103 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include <assert.h>
 
 #include "iszero.h"
 
-int
-main (void)
+/* Check a zero detection function on zero buffers, and with a
+ * single non-zero byte at every position, for a range of buffer
+ * offsets and sizes.
+ */
+static void
+test (const char *name, bool (*fn) (const char *, size_t))
 {
+  const size_t bufsize = 1024 + 64;
   char *buf;
-  size_t i, j;
+  size_t i, j, k;
 
-  buf = malloc (256);
+  printf ("testing %s\n", name);
+  fflush (stdout);
+
+  buf = malloc (bufsize);
   if (buf == NULL) {
     perror ("malloc");
     exit (EXIT_FAILURE);
   }
-  memset (buf, 0, 256);
+  memset (buf, 0, bufsize);
 
   for (j = 0; j <= 16; ++j) {
     for (i = 0; i <= 16; ++i)
-      assert (is_zero (&buf[j], i));
+      assert (fn (&buf[j], i));
     for (i = 0; i <= 16; ++i)
-      assert (is_zero (&buf[j], 256-j-i));
+      assert (fn (&buf[j], 256-j-i));
+  }
+
+  for (j = 0; j < 64; j += 7) {
+    for (i = 0; i <= 1024; i += (i < 300 ? 1 : 61)) {
+      assert (fn (&buf[j], i));
+      for (k = 0; k < i; ++k) {
+        buf[j+k] = (k & 1) ? 0x80 : 1;
+        assert (!fn (&buf[j], i));
+        buf[j+k] = 0;
+      }
+      /* Bytes just outside the buffer must not matter. */
+      if (j > 0)
+        buf[j-1] = 1;
+      buf[j+i] = 1;
+      assert (fn (&buf[j], i));
+      if (j > 0)
+        buf[j-1] = 0;
+      buf[j+i] = 0;
+    }
   }
 
   free (buf);
+}
+
+#ifdef HAVE_X86_SIMD_TARGETS
+/* The SIMD kernels are only called for buffers of 64 bytes or more. */
+static bool
+sse2 (const char *buffer, size_t size)
+{
+  return size < 64 ? is_zero_generic (buffer, size)
+    : is_zero_sse2 (buffer, size);
+}
+
+static bool
+avx2 (const char *buffer, size_t size)
+{
+  return size < 64 ? is_zero_generic (buffer, size)
+    : is_zero_avx2 (buffer, size);
+}
+
+static bool
+avx512 (const char *buffer, size_t size)
+{
+  return size < 64 ? is_zero_generic (buffer, size)
+    : is_zero_avx512 (buffer, size);
+}
+#endif
+
+int
+main (void)
+{
+  test ("is_zero", is_zero);
+  test ("is_zero_generic", is_zero_generic);
+
+#ifdef HAVE_X86_SIMD_TARGETS
+  test ("is_zero_sse2", sse2);
+  if (__builtin_cpu_supports ("avx2"))
+    test ("is_zero_avx2", avx2);
+  else
+    printf ("skipped is_zero_avx2: not supported by this CPU\n");
+  if (__builtin_cpu_supports ("avx512f"))
+    test ("is_zero_avx512", avx512);
+  else
+    printf ("skipped is_zero_avx512: not supported by this CPU\n");
+#endif
+
   exit (EXIT_SUCCESS);
 }
@@ -0,0 +1,231 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Microbenchmark of region lookup.
+ *
+ * This is built by "make check" but not run as a test.  Run it by
+ * hand:
+ *
+ *   common/regions/bench-regions [NR-REGIONS [ITERATIONS]]
+ *
+ * It builds a disk of NR-REGIONS (default 16384) small regions, then
+ * measures the time per lookup for random offsets and for sequential
+ * 4K requests, comparing a plain bsearch against find_region, and
+ * looking up each region of 64K requests one at a time against
+ * find_regions.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include <nbdkit-plugin.h>
+
+#include "random.h"
+#include "tvdiff.h"
+#include "regions.h"
+
+#define REQUEST_SIZE 4096
+#define BATCH_SIZE   65536
+
+static regions rs;
+static uint64_t size;
+static size_t iterations = 10000000;
+
+/* Stops the compiler from optimizing the lookups away. */
+static volatile uintptr_t sink;
+
+static int
+compare_offset (const void *offsetp, const struct region *region)
+{
+  const uint64_t offset = *(uint64_t *)offsetp;
+
+  if (offset < region->start) return -1;
+  if (offset > region->end) return 1;
+  return 0;
+}
+
+enum pattern { RANDOM, SEQUENTIAL };
+static const char *pattern_name[] = { "random", "sequential" };
+
+static uint64_t
+next_offset (enum pattern p, struct random_state *random_state,
+             uint64_t offset, uint64_t step)
+{
+  switch (p) {
+  case RANDOM:
+    return xrandom (random_state) % (size - step + 1);
+  case SEQUENTIAL:
+    offset += step;
+    return offset + step <= size ? offset : 0;
+  }
+  abort ();
+}
+
+static void
+print_result (const char *name, enum pattern p,
+              const struct timeval *start, const struct timeval *end)
+{
+  printf ("%-12s %-10s %8.1f ns/request\n",
+          name, pattern_name[p],
+          tvdiff_usec (start, end) * 1000.0 / iterations);
+}
+
+static void
+bench_single (enum pattern p)
+{
+  struct random_state random_state;
+  struct timeval start, end;
+  uint64_t offset;
+  size_t i;
+
+  xsrandom (1, &random_state);
+  offset = 0;
+  gettimeofday (&start, NULL);
+  for (i = 0; i < iterations; ++i) {
+    offset = next_offset (p, &random_state, offset, REQUEST_SIZE);
+    sink = (uintptr_t) regions_search (&rs, &offset, compare_offset);
+  }
+  gettimeofday (&end, NULL);
+  print_result ("bsearch", p, &start, &end);
+
+  xsrandom (1, &random_state);
+  offset = 0;
+  gettimeofday (&start, NULL);
+  for (i = 0; i < iterations; ++i) {
+    offset = next_offset (p, &random_state, offset, REQUEST_SIZE);
+    sink = (uintptr_t) find_region (&rs, offset);
+  }
+  gettimeofday (&end, NULL);
+  print_result ("find_region", p, &start, &end);
+}
+
+/* Look up every region overlapping a larger request, as the
+ * partitioning plugin did before find_regions existed.
+ */
+static void
+bench_batch (enum pattern p)
+{
+  struct random_state random_state;
+  struct timeval start, end;
+  const struct region *region = NULL;
+  uint64_t offset, o, len;
+  size_t i, nr;
+
+  xsrandom (1, &random_state);
+  offset = 0;
+  gettimeofday (&start, NULL);
+  for (i = 0; i < iterations; ++i) {
+    offset = next_offset (p, &random_state, offset, BATCH_SIZE);
+    for (o = offset; o < offset + BATCH_SIZE; o += len) {
+      region = regions_search (&rs, &o, compare_offset);
+      len = region->end - o + 1;
+    }
+    sink = (uintptr_t) region;
+  }
+  gettimeofday (&end, NULL);
+  print_result ("bsearch*N", p, &start, &end);
+
+  xsrandom (1, &random_state);
+  offset = 0;
+  gettimeofday (&start, NULL);
+  for (i = 0; i < iterations; ++i) {
+    offset = next_offset (p, &random_state, offset, BATCH_SIZE);
+    sink = (uintptr_t) find_regions (&rs, offset, BATCH_SIZE, &nr);
+  }
+  gettimeofday (&end, NULL);
+  print_result ("find_regions", p, &start, &end);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct random_state random_state;
+  size_t nr = 16384, i;
+  enum pattern p;
+
+  if (argc >= 2)
+    nr = atoi (argv[1]);
+  if (argc >= 3)
+    iterations = atoi (argv[2]);
+  if (nr < 1 || iterations < 1) {
+    fprintf (stderr, "usage: %s [NR-REGIONS [ITERATIONS]]\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Regions from 512 bytes to 64K, so that a 64K request usually
+   * spans a few of them, and the disk is always larger than 64K.
+   */
+  init_regions (&rs);
+  xsrandom (0, &random_state);
+  for (i = 0; i < nr || virtual_size (&rs) < BATCH_SIZE; ++i) {
+    uint64_t len = 512 * (1 + xrandom (&random_state) % 128);
+
+    if (append_region_len (&rs, "bench", len, 0, 0, region_zero) == -1)
+      exit (EXIT_FAILURE);
+  }
+  size = virtual_size (&rs);
+  printf ("%zu regions, virtual size %" PRIu64 "\n", nr_regions (&rs), size);
+
+  for (p = RANDOM; p <= SEQUENTIAL; ++p)
+    bench_single (p);
+  for (p = RANDOM; p <= SEQUENTIAL; ++p)
+    bench_batch (p);
+
+  free_regions (&rs);
+  exit (EXIT_SUCCESS);
+}
+
+/* The regions code uses nbdkit_error, normally provided by the main
+ * server program.  So we have to provide it here.
+ */
+void
+nbdkit_error (const char *fs, ...)
+{
+  int err = errno;
+  va_list args;
+
+  va_start (args, fs);
+  fprintf (stderr, "error: ");
+  errno = err; /* Must restore in case fs contains %m */
+  vfprintf (stderr, fs, args);
+  fprintf (stderr, "\n");
+  va_end (args);
+
+  errno = err;
+}
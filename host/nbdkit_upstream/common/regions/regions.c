@@ -34,8 +34,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <nbdkit-plugin.h>
 
@@ -57,23 +59,138 @@ free_regions (struct regions *rs)
   free (rs->ptr);
 }
 
-/* Find the region corresponding to the given offset.  Use region->end
- * to find the end of the region.
+/* Each thread remembers the last region it found.  Plugins normally
+ * have a single regions array so one entry per thread is enough.
  */
-static int
-compare_offset (const void *offsetp, const struct region *region)
+struct last_hit {
+  const regions *rs;
+  size_t i;
+};
+
+static pthread_key_t last_hit_key;
+static pthread_once_t last_hit_once = PTHREAD_ONCE_INIT;
+static bool have_last_hit_key;
+
+static void
+create_last_hit_key (void)
 {
-  const uint64_t offset = *(uint64_t *)offsetp;
+  have_last_hit_key = pthread_key_create (&last_hit_key, free) == 0;
+}
 
-  if (offset < region->start) return -1;
-  if (offset > region->end) return 1;
-  return 0;
+static struct last_hit *
+get_last_hit (void)
+{
+  struct last_hit *h;
+
+  pthread_once (&last_hit_once, create_last_hit_key);
+  if (!have_last_hit_key)
+    return NULL;
+
+  h = pthread_getspecific (last_hit_key);
+  if (h == NULL) {
+    /* If this fails we just don't use the cache. */
+    h = calloc (1, sizeof *h);
+    if (h == NULL || pthread_setspecific (last_hit_key, h) != 0) {
+      free (h);
+      return NULL;
+    }
+  }
+  return h;
+}
+
+static inline bool
+in_region (const struct region *region, uint64_t offset)
+{
+  return region->start <= offset && offset <= region->end;
+}
+
+/* Binary search for the region containing offset in rs->ptr[lo..hi-1].
+ * Returns rs->size if not found.
+ */
+static size_t
+search (const regions *rs, size_t lo, size_t hi, uint64_t offset)
+{
+  size_t mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (offset < rs->ptr[mid].start)
+      hi = mid;
+    else if (offset > rs->ptr[mid].end)
+      lo = mid + 1;
+    else
+      return mid;
+  }
+  return rs->size;
+}
+
+static size_t
+find_index (const regions *rs, uint64_t offset, struct last_hit *h)
+{
+  size_t i;
+
+  if (h && h->rs == rs) {
+    i = h->i;
+    if (i < rs->size && in_region (&rs->ptr[i], offset))
+      return i;
+    if (i+1 < rs->size && in_region (&rs->ptr[i+1], offset))
+      return i+1;
+  }
+
+  return search (rs, 0, rs->size, offset);
+}
+
+static void
+set_last_hit (struct last_hit *h, const regions *rs, size_t i)
+{
+  if (h && i < rs->size) {
+    h->rs = rs;
+    h->i = i;
+  }
 }
 
 const struct region *
 find_region (const regions *rs, uint64_t offset)
 {
-  return regions_search (rs, &offset, compare_offset);
+  struct last_hit *h = get_last_hit ();
+  size_t i;
+
+  i = find_index (rs, offset, h);
+  if (i == rs->size)
+    return NULL;
+  set_last_hit (h, rs, i);
+  return &rs->ptr[i];
+}
+
+const struct region *
+find_regions (const regions *rs, uint64_t offset, uint64_t count,
+              size_t *nr)
+{
+  struct last_hit *h = get_last_hit ();
+  const uint64_t last = offset + count - 1;
+  size_t first, i;
+
+  assert (count > 0);
+
+  first = find_index (rs, offset, h);
+  if (first == rs->size) {
+    *nr = 0;
+    return NULL;
+  }
+
+  /* Most requests are inside one region or cross into the next. */
+  i = first;
+  if (last > rs->ptr[i].end) {
+    i++;
+    if (i < rs->size && last > rs->ptr[i].end)
+      i = search (rs, i+1, rs->size, last);
+    assert (i < rs->size);
+  }
+
+  /* Remember the last region, where a sequential reader will go next. */
+  set_last_hit (h, rs, i);
+  *nr = i - first + 1;
+  return &rs->ptr[first];
 }
 
 /* This is the low level function for constructing the list of
@@ -99,11 +99,26 @@ virtual_size (regions *rs)
 
 /* Look up the region corresponding to the given offset.  If the
  * offset is inside the disk image then this cannot return NULL.
+ *
+ * This is a binary search, but each thread remembers the last region
+ * it found, so sequential access usually finds the region (or the
+ * next one) without searching.
  */
 extern const struct region *find_region (const regions *regions,
                                          uint64_t offset)
   __attribute__((__nonnull__ (1)));
 
+/* Look up all the regions overlapping count bytes (count > 0)
+ * starting at offset.  Returns the first region and sets *nr to the
+ * number of regions.  Since regions are contiguous these are
+ * region[0] .. region[*nr-1].  The range must be inside the disk
+ * image.
+ */
+extern const struct region *find_regions (const regions *regions,
+                                          uint64_t offset, uint64_t count,
+                                          size_t *nr)
+  __attribute__((__nonnull__ (1, 4)));
+
 /* Append one region of a given length, plus up to two optional
  * padding regions.
  *
@@ -0,0 +1,220 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Unit tests of region lookup. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <nbdkit-plugin.h>
+
+#include "random.h"
+#include "regions.h"
+
+/* Build a disk of nr regions of random length, including some
+ * padding regions.
+ */
+static void
+make_regions (regions *rs, size_t nr, uint64_t seed)
+{
+  struct random_state random_state;
+  size_t i;
+
+  init_regions (rs);
+  xsrandom (seed, &random_state);
+  for (i = 0; nr_regions (rs) < nr; ++i) {
+    uint64_t len = 1 + xrandom (&random_state) % 10000;
+    uint64_t align = (xrandom (&random_state) & 3) == 0 ? 4096 : 0;
+
+    if (append_region_len (rs, "test", len, align, 0,
+                           region_file, i) == -1)
+      exit (EXIT_FAILURE);
+  }
+}
+
+/* Slow lookup to check the results against. */
+static size_t
+linear_find (const regions *rs, uint64_t offset)
+{
+  size_t i;
+
+  for (i = 0; i < rs->size; ++i)
+    if (rs->ptr[i].start <= offset && offset <= rs->ptr[i].end)
+      return i;
+  abort ();
+}
+
+static void
+check_find_region (const regions *rs, uint64_t offset)
+{
+  const struct region *region = find_region (rs, offset);
+
+  assert (region != NULL);
+  assert (region == &rs->ptr[linear_find (rs, offset)]);
+}
+
+static void
+check_find_regions (const regions *rs, uint64_t offset, uint64_t count)
+{
+  const struct region *region;
+  size_t nr;
+
+  region = find_regions (rs, offset, count, &nr);
+  assert (region == &rs->ptr[linear_find (rs, offset)]);
+  assert (nr >= 1);
+  assert (region[nr-1].start <= offset + count - 1);
+  assert (region[nr-1].end >= offset + count - 1);
+}
+
+static void
+test_lookups (const regions *rs, uint64_t seed)
+{
+  const uint64_t size = virtual_size ((regions *) rs);
+  struct random_state random_state;
+  uint64_t offset, count;
+  size_t i;
+
+  /* Every boundary. */
+  for (i = 0; i < rs->size; ++i) {
+    check_find_region (rs, rs->ptr[i].start);
+    check_find_region (rs, rs->ptr[i].end);
+  }
+
+  /* Out of range. */
+  assert (find_region (rs, size) == NULL);
+  assert (find_region (rs, UINT64_MAX) == NULL);
+
+  /* Sequential, using the last hit. */
+  for (offset = 0; offset < size; offset += 1000)
+    check_find_region (rs, offset);
+
+  /* Backwards. */
+  for (offset = size; offset >= 1000; offset -= 1000)
+    check_find_region (rs, offset - 1);
+
+  /* Random lookups and ranges. */
+  xsrandom (seed, &random_state);
+  for (i = 0; i < 100000; ++i) {
+    offset = xrandom (&random_state) % size;
+    check_find_region (rs, offset);
+
+    count = 1 + xrandom (&random_state) % 100000;
+    if (count > size - offset)
+      count = size - offset;
+    check_find_regions (rs, offset, count);
+  }
+
+  /* Sequential ranges. */
+  for (offset = 0; offset < size; offset += count) {
+    count = 65536;
+    if (count > size - offset)
+      count = size - offset;
+    check_find_regions (rs, offset, count);
+  }
+}
+
+static void *
+thread_lookups (void *rsv)
+{
+  test_lookups (rsv, (uintptr_t) rsv);
+  return NULL;
+}
+
+int
+main (void)
+{
+  regions rs1, rs2;
+  pthread_t thread;
+  size_t nr;
+  int err;
+
+  /* Empty and single region disks. */
+  init_regions (&rs1);
+  assert (find_region (&rs1, 0) == NULL);
+  if (append_region_len (&rs1, "one", 512, 0, 0, region_zero) == -1)
+    exit (EXIT_FAILURE);
+  assert (find_region (&rs1, 0) == &rs1.ptr[0]);
+  assert (find_region (&rs1, 511) == &rs1.ptr[0]);
+  assert (find_region (&rs1, 512) == NULL);
+  assert (find_regions (&rs1, 0, 512, &nr) == &rs1.ptr[0]);
+  assert (nr == 1);
+  free_regions (&rs1);
+
+  make_regions (&rs1, 10000, 1);
+  make_regions (&rs2, 333, 2);
+
+  /* Alternate between two disks in the same thread. */
+  test_lookups (&rs1, 3);
+  test_lookups (&rs2, 4);
+  test_lookups (&rs1, 5);
+
+  /* Lookups from several threads at once. */
+  err = pthread_create (&thread, NULL, thread_lookups, &rs2);
+  if (err != 0) {
+    errno = err;
+    perror ("pthread_create");
+    exit (EXIT_FAILURE);
+  }
+  test_lookups (&rs1, 6);
+  pthread_join (thread, NULL);
+
+  free_regions (&rs1);
+  free_regions (&rs2);
+  exit (EXIT_SUCCESS);
+}
+
+/* The regions code uses nbdkit_error, normally provided by the main
+ * server program.  So we have to provide it here.
+ */
+void
+nbdkit_error (const char *fs, ...)
+{
+  int err = errno;
+  va_list args;
+
+  va_start (args, fs);
+  fprintf (stderr, "error: ");
+  errno = err; /* Must restore in case fs contains %m */
+  vfprintf (stderr, fs, args);
+  fprintf (stderr, "\n");
+  va_end (args);
+
+  errno = err;
+}
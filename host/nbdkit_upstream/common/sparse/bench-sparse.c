@@ -0,0 +1,229 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Microbenchmark of the sparse array.
+ *
+ * This is built by "make check" but not run as a test.  Run it by
+ * hand:
+ *
+ *   common/sparse/bench-sparse [SECONDS [PAGE-SIZE]]
+ *
+ * For 1, 2, 4, ... up to the number of online CPUs threads it
+ * measures 4K random reads, writes, and a mix of 70% reads, 20%
+ * writes and 10% zeroes, over a 256M region of a single array, and
+ * prints the total operations per second.  It also prints the memory
+ * overhead of the populated array.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <nbdkit-plugin.h>
+
+#include "random.h"
+#include "tvdiff.h"
+#include "sparse.h"
+
+#define BLOCK_SIZE  4096
+#define REGION_SIZE (256 * 1024 * 1024)
+#define NR_BLOCKS   (REGION_SIZE / BLOCK_SIZE)
+#define MAX_THREADS 64
+
+enum workload { READS, WRITES, MIXED };
+static const char *workload_name[] = { "read", "write", "mixed" };
+
+static struct sparse_array *sa;
+static enum workload workload;
+static volatile bool stop;
+
+static void *
+worker (void *arg)
+{
+  uint64_t *ops = arg;
+  char buf[BLOCK_SIZE];
+  struct random_state rs;
+  uint64_t r, offset, n = 0;
+  unsigned pct;
+
+  xsrandom ((uintptr_t) arg, &rs);
+  memset (buf, 0x55, sizeof buf);
+
+  while (!stop) {
+    r = xrandom (&rs);
+    offset = (r % NR_BLOCKS) * BLOCK_SIZE;
+    pct = (r >> 32) % 100;
+
+    switch (workload) {
+    case READS:
+      sparse_array_read (sa, buf, BLOCK_SIZE, offset);
+      break;
+    case WRITES:
+      if (sparse_array_write (sa, buf, BLOCK_SIZE, offset) == -1)
+        exit (EXIT_FAILURE);
+      break;
+    case MIXED:
+      if (pct < 70)
+        sparse_array_read (sa, buf, BLOCK_SIZE, offset);
+      else if (pct < 90) {
+        if (sparse_array_write (sa, buf, BLOCK_SIZE, offset) == -1)
+          exit (EXIT_FAILURE);
+      }
+      else
+        sparse_array_zero (sa, BLOCK_SIZE, offset);
+      break;
+    }
+    n++;
+  }
+
+  *ops = n;
+  return NULL;
+}
+
+static void
+run (enum workload w, unsigned nr_threads, unsigned seconds)
+{
+  pthread_t threads[MAX_THREADS];
+  uint64_t ops[MAX_THREADS], total = 0;
+  struct timeval start, end;
+  unsigned i;
+  int64_t usecs;
+
+  workload = w;
+  stop = false;
+  gettimeofday (&start, NULL);
+  for (i = 0; i < nr_threads; ++i) {
+    ops[i] = i + 1;             /* Used as the random seed. */
+    if ((errno = pthread_create (&threads[i], NULL, worker, &ops[i])) != 0) {
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+  sleep (seconds);
+  stop = true;
+  for (i = 0; i < nr_threads; ++i) {
+    pthread_join (threads[i], NULL);
+    total += ops[i];
+  }
+  gettimeofday (&end, NULL);
+
+  usecs = tvdiff_usec (&start, &end);
+  printf ("%-6s threads=%-3u %12.0f ops/s %10.1f MB/s\n",
+          workload_name[w], nr_threads,
+          total * 1000000.0 / usecs,
+          total * (double) BLOCK_SIZE / usecs);
+  fflush (stdout);
+}
+
+int
+main (int argc, char *argv[])
+{
+  unsigned seconds = 2, nr_threads, max_threads;
+  uint32_t page_size = SPARSE_DEFAULT_PAGE_SIZE;
+  struct sparse_array_stats stats;
+  long ncpus;
+  char buf[BLOCK_SIZE];
+  uint64_t offset;
+  enum workload w;
+
+  if (argc >= 2)
+    seconds = atoi (argv[1]);
+  if (argc >= 3)
+    page_size = atoi (argv[2]);
+  ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+  max_threads = ncpus > 0 ? ncpus : 1;
+  if (max_threads > MAX_THREADS)
+    max_threads = MAX_THREADS;
+
+  sa = alloc_sparse_array (page_size, false);
+  if (sa == NULL) {
+    perror ("alloc_sparse_array");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Populate the region so that reads hit allocated pages. */
+  memset (buf, 0xaa, sizeof buf);
+  for (offset = 0; offset < REGION_SIZE; offset += BLOCK_SIZE)
+    if (sparse_array_write (sa, buf, BLOCK_SIZE, offset) == -1)
+      exit (EXIT_FAILURE);
+
+  sparse_array_get_stats (sa, &stats);
+  printf ("page size %" PRIu32 ": %" PRIu64 " data bytes, "
+          "%" PRIu64 " metadata bytes, allocator %" PRIu64 " bytes, "
+          "overhead %.4f bytes per stored byte\n",
+          stats.page_size, stats.data_bytes, stats.metadata_bytes,
+          stats.arena_bytes,
+          (double) (stats.metadata_bytes + stats.arena_bytes -
+                    stats.arena_used_bytes) / stats.data_bytes);
+
+  for (w = READS; w <= MIXED; ++w)
+    for (nr_threads = 1; nr_threads <= max_threads; nr_threads *= 2)
+      run (w, nr_threads, seconds);
+
+  free_sparse_array (sa);
+  exit (EXIT_SUCCESS);
+}
+
+void
+nbdkit_debug (const char *fs, ...)
+{
+  /* do nothing */
+}
+
+void
+nbdkit_error (const char *fs, ...)
+{
+  va_list args;
+
+  va_start (args, fs);
+  fprintf (stderr, "error: ");
+  vfprintf (stderr, fs, args);
+  fprintf (stderr, "\n");
+  va_end (args);
+}
+
+int
+nbdkit_add_extent (struct nbdkit_extents *extents,
+                   uint64_t offset, uint64_t length, uint32_t type)
+{
+  return 0;
+}
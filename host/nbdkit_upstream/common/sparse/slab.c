@@ -0,0 +1,279 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <nbdkit-plugin.h>
+
+#include "cleanup.h"
+#include "rounding.h"
+#include "slab.h"
+
+/* Slabs are at least this big, and hold at least MIN_OBJECTS
+ * objects.  The slab size is always a power of 2 and slabs are
+ * aligned to their size, so the slab containing an object can be
+ * found by masking the object address.  Because objects are usually a
+ * power of 2 plus a small header, slabs are made bigger (up to
+ * MAX_SLAB_SIZE) until less than 1/128th of the slab is wasted.
+ */
+#define MIN_SLAB_SIZE (1024 * 1024)
+#define MAX_SLAB_SIZE (64 * 1024 * 1024)
+#define MIN_OBJECTS   8
+
+/* Objects are aligned to a cache line. */
+#define OBJ_ALIGN 64
+
+#define MAX_CLASSES 32
+
+/* Header at the start of each slab. */
+struct slab {
+  struct slab *prev, *next;     /* Link in the class partial list. */
+  bool partial;                 /* True if on the partial list. */
+  void *free_list;              /* Freed objects, linked by first word. */
+  char *unused;                 /* Objects never allocated start here. */
+  char *end;
+  unsigned nr_used;             /* Objects allocated from this slab. */
+  unsigned nr_objects;          /* Capacity of this slab. */
+};
+
+struct slab_class {
+  pthread_mutex_t lock;
+  size_t obj_size;
+  size_t slab_size;
+  struct slab *partial;         /* Slabs with some free objects. */
+  struct slab *spare;           /* An empty slab kept in reserve. */
+  uint64_t nr_slabs;
+  uint64_t nr_objects;
+  uint64_t touched_bytes;       /* Parts of slabs that have been used. */
+};
+
+static pthread_mutex_t classes_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct slab_class classes[MAX_CLASSES];
+static size_t nr_classes;
+
+static size_t
+header_size (void)
+{
+  return ROUND_UP (sizeof (struct slab), OBJ_ALIGN);
+}
+
+static size_t
+wasted_bytes (size_t slab_size, size_t obj_size)
+{
+  return (slab_size - header_size ()) % obj_size + header_size ();
+}
+
+struct slab_class *
+slab_class_get (size_t size)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&classes_lock);
+  struct slab_class *cls;
+  size_t i;
+
+  size = ROUND_UP (size, OBJ_ALIGN);
+  for (i = 0; i < nr_classes; ++i)
+    if (classes[i].obj_size == size)
+      return &classes[i];
+
+  if (nr_classes >= MAX_CLASSES) {
+    nbdkit_error ("slab: too many size classes");
+    return NULL;
+  }
+
+  cls = &classes[nr_classes++];
+  pthread_mutex_init (&cls->lock, NULL);
+  cls->obj_size = size;
+  cls->slab_size = MIN_SLAB_SIZE;
+  while (cls->slab_size < header_size () + MIN_OBJECTS * size)
+    cls->slab_size <<= 1;
+  while (cls->slab_size < MAX_SLAB_SIZE &&
+         wasted_bytes (cls->slab_size, size) > cls->slab_size / 128)
+    cls->slab_size <<= 1;
+  return cls;
+}
+
+/* Map a new slab, aligned to the slab size.  We map twice as much as
+ * needed and unmap the unaligned head and tail.
+ */
+static struct slab *
+new_slab (struct slab_class *cls)
+{
+  const size_t size = cls->slab_size;
+  char *p, *aligned;
+  struct slab *slab;
+
+  p = mmap (NULL, size * 2, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    nbdkit_error ("mmap: %m");
+    return NULL;
+  }
+  aligned = (char *) ROUND_UP ((uintptr_t) p, size);
+  if (aligned > p)
+    munmap (p, aligned - p);
+  if (aligned < p + size)
+    munmap (aligned + size, p + size - aligned);
+
+  slab = (struct slab *) aligned;
+  slab->nr_objects = (size - header_size ()) / cls->obj_size;
+  slab->unused = aligned + header_size ();
+  slab->end = slab->unused + slab->nr_objects * cls->obj_size;
+  cls->nr_slabs++;
+  cls->touched_bytes += header_size ();
+  return slab;
+}
+
+static void
+partial_add (struct slab_class *cls, struct slab *slab)
+{
+  slab->prev = NULL;
+  slab->next = cls->partial;
+  if (cls->partial)
+    cls->partial->prev = slab;
+  cls->partial = slab;
+  slab->partial = true;
+}
+
+static void
+partial_remove (struct slab_class *cls, struct slab *slab)
+{
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    cls->partial = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+  slab->partial = false;
+}
+
+void *
+slab_alloc (struct slab_class *cls)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cls->lock);
+  struct slab *slab;
+  void *obj;
+
+  slab = cls->partial;
+  if (slab == NULL) {
+    if (cls->spare) {
+      slab = cls->spare;
+      cls->spare = NULL;
+    }
+    else {
+      slab = new_slab (cls);
+      if (slab == NULL)
+        return NULL;
+    }
+    partial_add (cls, slab);
+  }
+
+  if (slab->free_list) {
+    obj = slab->free_list;
+    slab->free_list = *(void **) obj;
+  }
+  else {
+    assert (slab->unused < slab->end);
+    obj = slab->unused;
+    slab->unused += cls->obj_size;
+    cls->touched_bytes += cls->obj_size;
+  }
+
+  slab->nr_used++;
+  if (slab->nr_used == slab->nr_objects)
+    partial_remove (cls, slab);
+  cls->nr_objects++;
+  return obj;
+}
+
+void
+slab_free (struct slab_class *cls, void *obj)
+{
+  struct slab *slab, *unmap = NULL;
+  char *start;
+
+  slab = (struct slab *) ((uintptr_t) obj & ~(cls->slab_size - 1));
+
+  pthread_mutex_lock (&cls->lock);
+  assert (slab->nr_used > 0);
+  *(void **) obj = slab->free_list;
+  slab->free_list = obj;
+  slab->nr_used--;
+  cls->nr_objects--;
+  if (!slab->partial)
+    partial_add (cls, slab);
+
+  if (slab->nr_used == 0) {
+    partial_remove (cls, slab);
+    start = (char *) slab + header_size ();
+    cls->touched_bytes -= slab->unused - start;
+    if (cls->spare == NULL) {
+      /* Keep the slab as the spare, but give the memory back to the
+       * kernel and start using it from the beginning again.
+       */
+      madvise (start, slab->unused - start, MADV_DONTNEED);
+      slab->free_list = NULL;
+      slab->unused = start;
+      cls->spare = slab;
+    }
+    else {
+      unmap = slab;
+      cls->nr_slabs--;
+      cls->touched_bytes -= header_size ();
+    }
+  }
+  pthread_mutex_unlock (&cls->lock);
+
+  if (unmap)
+    munmap (unmap, cls->slab_size);
+}
+
+void
+slab_get_stats (struct slab_class *cls, struct slab_stats *stats)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&cls->lock);
+
+  stats->obj_size = cls->obj_size;
+  stats->nr_slabs = cls->nr_slabs;
+  stats->mapped_bytes = cls->nr_slabs * cls->slab_size;
+  stats->touched_bytes = cls->touched_bytes;
+  stats->nr_objects = cls->nr_objects;
+}
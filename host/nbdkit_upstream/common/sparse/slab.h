@@ -0,0 +1,81 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_SLAB_H
+#define NBDKIT_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Slab allocator for fixed size objects, used for sparse array pages.
+ *
+ * Objects are grouped into size classes.  Each class carves its
+ * objects out of large slabs obtained from mmap, and keeps freed
+ * objects on per-slab free lists for reuse.  A slab is returned to
+ * the operating system when all of its objects are free, except that
+ * each class keeps one empty slab in reserve (with its memory given
+ * back to the kernel using madvise) so that a workload which
+ * repeatedly frees and allocates one page does not thrash mmap.
+ *
+ * Size classes are shared by everything in the process which asks
+ * for the same object size, and live until the process exits.
+ *
+ * All functions are thread safe.  Each class has its own lock.
+ */
+struct slab_class;
+
+/* Return the size class for objects of ‘size’ bytes, creating it if
+ * necessary.  Returns NULL and calls nbdkit_error on error.
+ */
+extern struct slab_class *slab_class_get (size_t size);
+
+/* Allocate an object.  The contents are uninitialized.  Returns NULL
+ * and calls nbdkit_error on error.
+ */
+extern void *slab_alloc (struct slab_class *cls);
+
+/* Return an object to its class. */
+extern void slab_free (struct slab_class *cls, void *obj);
+
+struct slab_stats {
+  size_t obj_size;              /* Size of objects in this class. */
+  uint64_t nr_slabs;            /* Slabs currently mapped. */
+  uint64_t mapped_bytes;        /* Total bytes of those slabs. */
+  uint64_t touched_bytes;       /* Bytes of slabs which have been used
+                                 * and so are probably resident. */
+  uint64_t nr_objects;          /* Objects currently allocated. */
+};
+
+/* Get statistics for a class. */
+extern void slab_get_stats (struct slab_class *cls, struct slab_stats *stats);
+
+#endif /* NBDKIT_SLAB_H */
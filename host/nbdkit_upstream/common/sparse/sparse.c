@@ -40,14 +40,18 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include <nbdkit-plugin.h>
 
 #include "iszero.h"
+#include "ispowerof2.h"
+#include "rounding.h"
 #include "sparse.h"
-#include "vector.h"
+#include "slab.h"
 
-/* Two level directory for the sparse array.
+/* Radix tree for the sparse array.
  *
  * nbdkit supports disk sizes up to 2⁶³-1.  The aim of the sparse
  * array is to support up to 63 bit images for testing, although it
@@ -68,66 +72,152 @@
  * images, plus some architectures have much larger page sizes than
  * others making behaviour inconsistent across arches.
  *
- * To achieve this we use a B-Tree-like structure.  The L1 directory
- * contains an ordered, non-overlapping, non-contiguous list of
- * (offset, pointer to L2 directory).
+ * The virtual offset is split into a page number and an offset
+ * within the page.  The page size is chosen when the array is
+ * allocated (any power of 2 from SPARSE_MIN_PAGE_SIZE to
+ * SPARSE_MAX_PAGE_SIZE).  The page number is split into sa->levels
+ * fields of
+ * NODE_SHIFT bits, each of which indexes one level of the tree.  The
+ * root node is always present.  Other nodes are allocated when a page
+ * is first written below them, and are only freed when the whole
+ * array is freed.  Leaf node entries point to pages, and can be NULL
+ * (meaning no page / all zeroes).
  *
- * Updating the L1 directory requires a linear scan but that operation
- * should be very rare.  Because the L1 directory is stored in order
- * of offset, we can use an efficient binary search for lookups.
+ *  root node          interior nodes       leaf node
+ * ┌───────────┐      ┌───────────┐       ┌───────────┐
+ * │ slot 0  ───────▶ │ slot 0  ──── ··· ▶ │ slot 0  ───────▶ page
+ * │ slot 1    │      │ ...       │       │ slot 1  ───────▶ page
+ * │ ...       │      └───────────┘       │ ...       │
+ * └───────────┘                          └───────────┘
  *
- * Each L1 directory entry can address up to PAGE_SIZE*L2_SIZE bytes
- * in the virtual disk image.  With the current parameters this is
- * 128MB, which is enough for a 100MB image to fit into a single L1
- * directory, or a 10GB image to fit into 80 L1 entries.  The page
- * pointers in the L2 directory can be NULL (meaning no page / all
- * zeroes).
+ * With the default 32K pages each leaf node addresses 128MB of the
+ * virtual disk and the tree is 4 levels deep.  With 4K pages a leaf
+ * node addresses 16MB and the tree is 5 levels deep.
  *
- * ┌────────────────────┐
- * │ L1 directory       │       ┌────────────────────┐
- * │ offset, entry 0 ─────────▶ | L2 directory       |
- * │ offset, entry 1    │       | page 0          ─────────▶ page
- * │ offset, entry 2    │       │ page 1          ─────────▶ page
- * │ ...                │       │ page 2          ─────────▶ page
- * └────────────────────┘       │ ...                │
- *                              │ page L2_SIZE-1  ─────────▶ page
- *                              └────────────────────┘
+ * Pages are allocated from a slab allocator (see slab.h) shared by
+ * all arrays with the same page size, and zeroed pages are returned
+ * to it.  Each page has a small header before the data, padded so
+ * that the data is aligned to a cache line.
+ *
+ * Concurrency
+ * -----------
+ *
+ * Node and page pointers are only ever installed with an atomic
+ * compare-and-swap (losing the race just frees the new allocation),
+ * and are read with acquire loads, so readers walk the tree without
+ * taking any locks.
+ *
+ * Each page has a mutex which is held by anyone modifying the page
+ * contents (write, fill, zero, blit destination) or removing the page
+ * from the tree.  After taking the lock the caller checks that the
+ * page is still installed, and retries if not.  So writers only
+ * contend with other writers to the same page.
+ *
+ * Pages which become zero are unlinked from the tree while holding
+ * the page lock, but a concurrent reader might still be copying from
+ * them.  They are therefore put on a retired list, and only freed
+ * after a grace period in which every thread that might have seen
+ * the page has finished.  Grace periods are tracked with a two-phase
+ * epoch: every access to the tree (read or write) increments a
+ * reader count for the current epoch on entry and decrements it on
+ * exit, and the reclaimer flips the epoch and waits for the count of
+ * the old epoch to drain.  The counts are striped across threads so
+ * that readers on different CPUs do not bounce a shared cache line.
  */
-#define PAGE_SIZE 32768
-#define L2_SIZE   4096
+#define NODE_SHIFT 12
+#define NODE_SIZE  (1 << NODE_SHIFT)
+
+/* Free retired pages once this many have accumulated. */
+#define RECLAIM_BATCH 64
 
-struct l1_entry {
-  uint64_t offset;              /* Virtual offset of this entry. */
-  void **l2_dir;                /* Pointer to L2 directory. */
+/* Number of reader count stripes. */
+#define NR_STRIPES 16
+
+struct node {
+  void *slot[NODE_SIZE];        /* Next level node, or page in leaves. */
 };
 
-DEFINE_VECTOR_TYPE(l1_dir, struct l1_entry);
+struct page {
+  pthread_mutex_t lock;         /* Held when modifying or unlinking. */
+  struct page *next;            /* Link in the retired list. */
+  char data[] __attribute__((__aligned__ (64))); /* Page contents. */
+};
+
+struct stripe {
+  unsigned readers[2];          /* Threads inside each epoch. */
+  char pad[64 - 2 * sizeof (unsigned)]; /* Keep stripes in own cache line. */
+};
 
 struct sparse_array {
-  l1_dir l1_dir;                /* L1 directory. */
+  struct node *root;            /* Root node, always allocated. */
+  uint32_t page_size;
+  int page_shift;               /* log2 (page_size) */
+  int levels;                   /* Depth of the tree. */
+  struct slab_class *pages;     /* Allocator for pages. */
   bool debug;
+
+  uint64_t nr_pages;            /* Pages in the tree (not retired). */
+  uint64_t nr_nodes;            /* Nodes in the tree. */
+
+  unsigned epoch;               /* Current epoch, only the parity matters. */
+  struct stripe stripes[NR_STRIPES];
+
+  struct page *retired;         /* Unlinked pages waiting to be freed. */
+  unsigned nr_retired;
+  pthread_mutex_t reclaim_lock; /* Held by the thread freeing pages. */
 };
 
-/* Free L1 and/or L2 directories. */
+static struct page *
+alloc_page (struct sparse_array *sa)
+{
+  struct page *page;
+
+  page = slab_alloc (sa->pages);
+  if (page == NULL)
+    return NULL;
+  pthread_mutex_init (&page->lock, NULL);
+  return page;
+}
+
+static void
+free_page (struct sparse_array *sa, struct page *page)
+{
+  pthread_mutex_destroy (&page->lock);
+  slab_free (sa->pages, page);
+}
+
+/* Free a node and everything below it. */
 static void
-free_l2_dir (void **l2_dir)
+free_node (struct sparse_array *sa, struct node *node, int level)
 {
   size_t i;
 
-  for (i = 0; i < L2_SIZE; ++i)
-    free (l2_dir[i]);
-  free (l2_dir);
+  if (node == NULL)
+    return;
+
+  for (i = 0; i < NODE_SIZE; ++i) {
+    if (node->slot[i] == NULL)
+      continue;
+    if (level > 0)
+      free_node (sa, node->slot[i], level-1);
+    else
+      free_page (sa, node->slot[i]);
+  }
+  free (node);
 }
 
 void
 free_sparse_array (struct sparse_array *sa)
 {
-  size_t i;
+  struct page *page, *next;
 
   if (sa) {
-    for (i = 0; i < sa->l1_dir.size; ++i)
-      free_l2_dir (sa->l1_dir.ptr[i].l2_dir);
-    free (sa->l1_dir.ptr);
+    free_node (sa, sa->root, sa->levels-1);
+    for (page = sa->retired; page != NULL; page = next) {
+      next = page->next;
+      free_page (sa, page);
+    }
+    pthread_mutex_destroy (&sa->reclaim_lock);
     free (sa);
   }
 }
@@ -139,163 +229,350 @@ cleanup_free_sparse_array (struct sparse_array **sa)
 }
 
 struct sparse_array *
-alloc_sparse_array (bool debug)
+alloc_sparse_array (uint32_t page_size, bool debug)
 {
   struct sparse_array *sa;
 
+  if (page_size < SPARSE_MIN_PAGE_SIZE || page_size > SPARSE_MAX_PAGE_SIZE ||
+      !is_power_of_2 (page_size)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
   sa = calloc (1, sizeof *sa);
   if (sa == NULL)
     return NULL;
+  sa->page_size = page_size;
+  sa->page_shift = __builtin_ctz (page_size);
+  sa->levels = DIV_ROUND_UP (63 - sa->page_shift, NODE_SHIFT);
+  sa->pages = slab_class_get (sizeof (struct page) + page_size);
+  sa->root = calloc (1, sizeof (struct node));
+  if (sa->pages == NULL || sa->root == NULL) {
+    free (sa->root);
+    free (sa);
+    errno = ENOMEM;
+    return NULL;
+  }
+  sa->nr_nodes = 1;
+  pthread_mutex_init (&sa->reclaim_lock, NULL);
   sa->debug = debug;
   return sa;
 }
 
-/* Comparison function used when searching through the L1 directory. */
-static int
-compare_l1_offsets (const void *offsetp, const struct l1_entry *e)
+void
+sparse_array_get_stats (struct sparse_array *sa,
+                        struct sparse_array_stats *stats)
+{
+  struct slab_stats slab;
+
+  slab_get_stats (sa->pages, &slab);
+
+  stats->page_size = sa->page_size;
+  stats->nr_pages = __atomic_load_n (&sa->nr_pages, __ATOMIC_RELAXED);
+  stats->data_bytes = stats->nr_pages * sa->page_size;
+  stats->metadata_bytes =
+    __atomic_load_n (&sa->nr_nodes, __ATOMIC_RELAXED) * sizeof (struct node) +
+    stats->nr_pages * (slab.obj_size - sa->page_size);
+  stats->arena_bytes = slab.touched_bytes;
+  stats->arena_used_bytes = slab.nr_objects * slab.obj_size;
+}
+
+/* Enter and leave a read-side critical section.  Every function which
+ * dereferences pages must do this, and must not hold on to page
+ * pointers afterwards.  Entering never blocks.
+ */
+struct epoch_guard {
+  struct stripe *stripe;
+  unsigned e;
+};
+
+static struct epoch_guard
+enter_epoch (struct sparse_array *sa)
 {
-  const uint64_t offset = *(uint64_t *)offsetp;
+  struct epoch_guard g;
+  uint64_t h;
+
+  /* Pick a stripe from the thread ID so that threads tend to stay on
+   * their own cache line.
+   */
+  h = (uintptr_t) pthread_self ();
+  h *= UINT64_C(0x9e3779b97f4a7c15);
+  g.stripe = &sa->stripes[h >> 60 & (NR_STRIPES-1)];
+
+  for (;;) {
+    g.e = __atomic_load_n (&sa->epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch (&g.stripe->readers[g.e], 1, __ATOMIC_SEQ_CST);
+    /* If the epoch flipped in the meantime the reclaimer might have
+     * already checked our stripe, so retry in the new epoch.
+     */
+    if ((__atomic_load_n (&sa->epoch, __ATOMIC_SEQ_CST) & 1) == g.e)
+      return g;
+    __atomic_sub_fetch (&g.stripe->readers[g.e], 1, __ATOMIC_SEQ_CST);
+  }
+}
 
-  if (offset < e->offset) return -1;
-  if (offset >= e->offset + PAGE_SIZE*L2_SIZE) return 1;
-  return 0;
+static void
+leave_epoch (struct epoch_guard g)
+{
+  __atomic_sub_fetch (&g.stripe->readers[g.e], 1, __ATOMIC_RELEASE);
 }
 
-/* Insert an entry in the L1 directory, keeping it ordered by offset.
- * This involves an expensive linear scan but should be very rare.
+/* Put an unlinked page on the retired list. */
+static void
+retire_page (struct sparse_array *sa, struct page *page)
+{
+  page->next = __atomic_load_n (&sa->retired, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n (&sa->retired, &page->next, page,
+                                       true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  __atomic_add_fetch (&sa->nr_retired, 1, __ATOMIC_RELAXED);
+}
+
+/* Free retired pages once enough have built up.  This must not be
+ * called inside a read-side critical section since it waits for all
+ * of those to finish.  If another thread is already reclaiming we
+ * leave it to that thread.
  */
-static int
-insert_l1_entry (struct sparse_array *sa, const struct l1_entry *entry)
+static void
+reclaim_pages (struct sparse_array *sa)
 {
+  struct page *list, *next;
+  unsigned e, n = 0;
   size_t i;
 
-  for (i = 0; i < sa->l1_dir.size; ++i) {
-    if (entry->offset < sa->l1_dir.ptr[i].offset) {
-      /* Insert new entry before i'th directory entry. */
-      if (l1_dir_insert (&sa->l1_dir, *entry, i) == -1) {
-        nbdkit_error ("realloc: %m");
-        return -1;
-      }
-      if (sa->debug)
-        nbdkit_debug ("%s: inserted new L1 entry for %" PRIu64
-                      " at l1_dir.ptr[%zu]",
-                      __func__, entry->offset, i);
-      return 0;
-    }
+  if (__atomic_load_n (&sa->nr_retired, __ATOMIC_RELAXED) < RECLAIM_BATCH)
+    return;
+  if (pthread_mutex_trylock (&sa->reclaim_lock) != 0)
+    return;
 
-    /* This should never happens since each entry in the the L1
-     * directory is supposed to be unique.
-     */
-    assert (entry->offset != sa->l1_dir.ptr[i].offset);
+  /* Pages on this list were unlinked before the epoch flip below, so
+   * once all readers of the old epoch have left nobody can still be
+   * using them.
+   */
+  list = __atomic_exchange_n (&sa->retired, NULL, __ATOMIC_ACQUIRE);
+  e = __atomic_fetch_add (&sa->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+  for (i = 0; i < NR_STRIPES; ++i) {
+    while (__atomic_load_n (&sa->stripes[i].readers[e],
+                            __ATOMIC_ACQUIRE) > 0)
+      sched_yield ();
   }
 
-  /* Insert new entry at the end. */
-  if (l1_dir_append (&sa->l1_dir, *entry) == -1) {
-    nbdkit_error ("realloc: %m");
-    return -1;
+  for (; list != NULL; list = next) {
+    next = list->next;
+    free_page (sa, list);
+    n++;
   }
+  __atomic_sub_fetch (&sa->nr_retired, n, __ATOMIC_RELAXED);
   if (sa->debug)
-    nbdkit_debug ("%s: inserted new L1 entry for %" PRIu64
-                  " at end of l1_dir", __func__, entry->offset);
-  return 0;
+    nbdkit_debug ("%s: freed %u retired pages", __func__, n);
+
+  pthread_mutex_unlock (&sa->reclaim_lock);
 }
 
-/* Look up a virtual offset, returning the address of the offset, the
- * count of bytes to the end of the page, and a pointer to the L2
- * directory entry containing the page pointer.
+/* Look up a virtual offset, returning a pointer to the leaf node slot
+ * containing the page pointer, and the count of bytes to the end of
+ * the page.
  *
- * If the create flag is set then a new page and/or directory will be
- * allocated if necessary.  Use this flag when writing.
+ * If the create flag is set then missing nodes are allocated.  Use
+ * this flag when writing.
  *
- * NULL may be returned normally if the page is not mapped (meaning it
- * reads as zero).  However if the create flag is set and NULL is
- * returned, this indicates an error.
+ * NULL may be returned normally if the leaf node is not present
+ * (meaning the page reads as zero).  However if the create flag is
+ * set and NULL is returned, this indicates an error.
  */
-static void *
+static struct page **
 lookup (struct sparse_array *sa, uint64_t offset, bool create,
-        uint32_t *remaining, void ***l2_page)
+        uint32_t *remaining)
 {
-  struct l1_entry *entry;
-  void **l2_dir;
-  uint64_t o;
-  void *page;
-  struct l1_entry new_entry;
-
-  *remaining = PAGE_SIZE - (offset & (PAGE_SIZE-1));
+  struct node *node = sa->root, *child, *new_node;
+  int level;
+  size_t i;
 
- again:
-  /* Search the L1 directory. */
-  entry = l1_dir_search (&sa->l1_dir, &offset, compare_l1_offsets);
+  *remaining = sa->page_size - (offset & (sa->page_size-1));
 
-  if (sa->debug) {
-    if (entry)
-      nbdkit_debug ("%s: search L1 dir: entry found: offset %" PRIu64,
-                    __func__, entry->offset);
-    else
-      nbdkit_debug ("%s: search L1 dir: no entry found", __func__);
-  }
+  for (level = sa->levels-1; level > 0; --level) {
+    i = (offset >> (sa->page_shift + level * NODE_SHIFT)) & (NODE_SIZE-1);
+    child = __atomic_load_n (&node->slot[i], __ATOMIC_ACQUIRE);
+    if (child == NULL) {
+      if (!create)
+        return NULL;
 
-  if (entry) {
-    l2_dir = entry->l2_dir;
-
-    /* Which page in the L2 directory? */
-    o = (offset - entry->offset) / PAGE_SIZE;
-    if (l2_page)
-      *l2_page = &l2_dir[o];
-    page = l2_dir[o];
-    if (!page && create) {
-      /* No page allocated.  Allocate one if creating. */
-      page = calloc (PAGE_SIZE, 1);
-      if (page == NULL) {
-        nbdkit_error ("calloc");
+      new_node = calloc (1, sizeof *new_node);
+      if (new_node == NULL) {
+        nbdkit_error ("calloc: %m");
         return NULL;
       }
-      l2_dir[o] = page;
+      /* If another thread installed a node first, use that one. */
+      if (__atomic_compare_exchange_n (&node->slot[i], &child, new_node,
+                                       false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        child = new_node;
+        __atomic_add_fetch (&sa->nr_nodes, 1, __ATOMIC_RELAXED);
+        if (sa->debug)
+          nbdkit_debug ("%s: allocated level %d node for offset %" PRIu64,
+                        __func__, level-1, offset);
+      }
+      else
+        free (new_node);
     }
-    if (!page)
-      return NULL;
-    else
-      return page + (offset & (PAGE_SIZE-1));
+    node = child;
   }
 
-  /* No L1 directory entry found. */
-  if (!create)
+  i = (offset >> sa->page_shift) & (NODE_SIZE-1);
+  return (struct page **) &node->slot[i];
+}
+
+/* Return the page containing offset, or NULL if it reads as zero. */
+static struct page *
+lookup_page (struct sparse_array *sa, uint64_t offset, uint32_t *remaining)
+{
+  struct page **slot;
+
+  slot = lookup (sa, offset, false, remaining);
+  if (slot == NULL)
     return NULL;
+  return __atomic_load_n (slot, __ATOMIC_ACQUIRE);
+}
 
-  /* No L1 directory entry, and we're creating, so we need to allocate
-   * a new L1 directory entry and insert it in the L1 directory, and
-   * allocate the L2 directory with NULL page pointers.  Then we can
-   * repeat the above search to create the page.
-   */
-  new_entry.offset = offset & ~(PAGE_SIZE*L2_SIZE-1);
-  new_entry.l2_dir = calloc (L2_SIZE, sizeof (void *));
-  if (new_entry.l2_dir == NULL) {
-    nbdkit_error ("calloc");
+/* Find the page containing offset and lock it for modification.  The
+ * page is still installed in *slot_rtn when this returns.
+ *
+ * If the create flag is set a new zero page is allocated if
+ * necessary, and NULL indicates an error.  Otherwise NULL means there
+ * is no page.
+ */
+static struct page *
+lock_page (struct sparse_array *sa, uint64_t offset, bool create,
+           uint32_t *remaining, struct page ***slot_rtn)
+{
+  struct page **slot, *page, *expected;
+
+ again:
+  slot = lookup (sa, offset, create, remaining);
+  if (slot == NULL)
     return NULL;
+
+  page = __atomic_load_n (slot, __ATOMIC_ACQUIRE);
+  if (page == NULL) {
+    if (!create)
+      return NULL;
+
+    page = alloc_page (sa);
+    if (page == NULL)
+      return NULL;
+    memset (page->data, 0, sa->page_size);
+    /* Lock before publishing so that a concurrent zero cannot unlink
+     * the page before we have written to it.
+     */
+    pthread_mutex_lock (&page->lock);
+    expected = NULL;
+    if (!__atomic_compare_exchange_n (slot, &expected, page, false,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      pthread_mutex_unlock (&page->lock);
+      free_page (sa, page);
+      goto again;
+    }
+    __atomic_add_fetch (&sa->nr_pages, 1, __ATOMIC_RELAXED);
   }
-  if (insert_l1_entry (sa, &new_entry) == -1) {
-    free (new_entry.l2_dir);
-    return NULL;
+  else {
+    pthread_mutex_lock (&page->lock);
+    if (__atomic_load_n (slot, __ATOMIC_ACQUIRE) != page) {
+      /* Unlinked while we were waiting for the lock. */
+      pthread_mutex_unlock (&page->lock);
+      goto again;
+    }
   }
-  goto again;
+
+  if (slot_rtn)
+    *slot_rtn = slot;
+  return page;
 }
 
-void
-sparse_array_read (struct sparse_array *sa,
-                   void *buf, uint32_t count, uint64_t offset)
+/* Writing a whole page where there is no page yet is common (eg. 4K
+ * swap writes with 4K pages).  In this case build the page contents
+ * before publishing it, which avoids zeroing the page first and
+ * means no lock is needed.
+ *
+ * Returns 1 if the page was installed, 0 if there was already a page
+ * (the caller should use lock_page), or -1 on error.
+ */
+static int
+install_page (struct sparse_array *sa, uint64_t offset, const void *buf)
+{
+  struct page **slot, *page, *expected = NULL;
+  uint32_t n;
+
+  slot = lookup (sa, offset, true, &n);
+  if (slot == NULL)
+    return -1;
+  if (__atomic_load_n (slot, __ATOMIC_ACQUIRE) != NULL)
+    return 0;
+
+  page = alloc_page (sa);
+  if (page == NULL)
+    return -1;
+  memcpy (page->data, buf, sa->page_size);
+  if (!__atomic_compare_exchange_n (slot, &expected, page, false,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    free_page (sa, page);
+    return 0;
+  }
+  __atomic_add_fetch (&sa->nr_pages, 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/* Zero up to count bytes at offset, stopping at the end of the page.
+ * Returns the number of bytes zeroed.  If the whole page is now zero,
+ * unlink it and free it later.  The caller must be inside the epoch,
+ * and should call reclaim_pages after leaving it.
+ */
+static uint32_t
+zero_in_page (struct sparse_array *sa, uint32_t count, uint64_t offset)
+{
+  uint32_t n;
+  struct page *page, **slot;
+
+  page = lock_page (sa, offset, false, &n, &slot);
+  if (n > count)
+    n = count;
+
+  if (page) {
+    if (n < sa->page_size)
+      memset (&page->data[offset & (sa->page_size-1)], 0, n);
+
+    if (n >= sa->page_size || is_zero (page->data, sa->page_size)) {
+      if (sa->debug)
+        nbdkit_debug ("%s: freeing zero page at offset %" PRIu64,
+                      __func__, offset);
+      __atomic_store_n (slot, NULL, __ATOMIC_RELEASE);
+      __atomic_sub_fetch (&sa->nr_pages, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock (&page->lock);
+      retire_page (sa, page);
+    }
+    else
+      pthread_mutex_unlock (&page->lock);
+  }
+
+  return n;
+}
+
+static void
+read_pages (struct sparse_array *sa,
+            void *buf, uint32_t count, uint64_t offset)
 {
   uint32_t n;
-  void *p;
+  struct page *page;
 
   while (count > 0) {
-    p = lookup (sa, offset, false, &n, NULL);
+    page = lookup_page (sa, offset, &n);
     if (n > count)
       n = count;
 
-    if (p == NULL)
+    if (page == NULL)
       memset (buf, 0, n);
     else
-      memcpy (buf, p, n);
+      memcpy (buf, &page->data[offset & (sa->page_size-1)], n);
 
     buf += n;
     count -= n;
@@ -303,89 +580,119 @@ sparse_array_read (struct sparse_array *sa,
   }
 }
 
+void
+sparse_array_read (struct sparse_array *sa,
+                   void *buf, uint32_t count, uint64_t offset)
+{
+  struct epoch_guard g = enter_epoch (sa);
+
+  read_pages (sa, buf, count, offset);
+  leave_epoch (g);
+}
+
 int
 sparse_array_write (struct sparse_array *sa,
                     const void *buf, uint32_t count, uint64_t offset)
 {
+  struct epoch_guard g = enter_epoch (sa);
   uint32_t n;
-  void *p;
+  struct page *page;
+  int r = 0;
 
   while (count > 0) {
-    p = lookup (sa, offset, true, &n, NULL);
-    if (p == NULL)
-      return -1;
+    /* Writes of zeroes are turned into zeroing, so they do not
+     * allocate pages and can free existing pages.
+     */
+    n = sa->page_size - (offset & (sa->page_size-1));
+    if (n > count)
+      n = count;
+    if (is_zero (buf, n)) {
+      zero_in_page (sa, n, offset);
+      goto next;
+    }
+
+    if ((offset & (sa->page_size-1)) == 0 && count >= sa->page_size) {
+      r = install_page (sa, offset, buf);
+      if (r == -1)
+        break;
+      if (r == 1) {
+        n = sa->page_size;
+        goto next;
+      }
+    }
+
+    page = lock_page (sa, offset, true, &n, NULL);
+    if (page == NULL) {
+      r = -1;
+      break;
+    }
 
     if (n > count)
       n = count;
-    memcpy (p, buf, n);
+    memcpy (&page->data[offset & (sa->page_size-1)], buf, n);
+    pthread_mutex_unlock (&page->lock);
+
+  next:
 
     buf += n;
     count -= n;
     offset += n;
   }
 
-  return 0;
+  leave_epoch (g);
+  reclaim_pages (sa);
+  return r == -1 ? -1 : 0;
 }
 
 int
 sparse_array_fill (struct sparse_array *sa, char c,
                    uint32_t count, uint64_t offset)
 {
+  struct epoch_guard g;
   uint32_t n;
-  void *p;
+  struct page *page;
+  int r = 0;
 
   if (c == 0) {
     sparse_array_zero (sa, count, offset);
     return 0;
   }
 
+  g = enter_epoch (sa);
   while (count > 0) {
-    p = lookup (sa, offset, true, &n, NULL);
-    if (p == NULL)
-      return -1;
+    page = lock_page (sa, offset, true, &n, NULL);
+    if (page == NULL) {
+      r = -1;
+      break;
+    }
 
     if (n > count)
       n = count;
-    memset (p, c, n);
+    memset (&page->data[offset & (sa->page_size-1)], c, n);
+    pthread_mutex_unlock (&page->lock);
 
     count -= n;
     offset += n;
   }
 
-  return 0;
+  leave_epoch (g);
+  return r;
 }
 
 void
 sparse_array_zero (struct sparse_array *sa, uint32_t count, uint64_t offset)
 {
+  struct epoch_guard g = enter_epoch (sa);
   uint32_t n;
-  void *p;
-  void **l2_page;
 
   while (count > 0) {
-    p = lookup (sa, offset, false, &n, &l2_page);
-    if (n > count)
-      n = count;
-
-    if (p) {
-      if (n < PAGE_SIZE)
-        memset (p, 0, n);
-      else
-        assert (p == *l2_page);
-
-      /* If the whole page is now zero, free it. */
-      if (n >= PAGE_SIZE || is_zero (*l2_page, PAGE_SIZE)) {
-        if (sa->debug)
-          nbdkit_debug ("%s: freeing zero page at offset %" PRIu64,
-                        __func__, offset);
-        free (*l2_page);
-        *l2_page = NULL;
-      }
-    }
-
+    n = zero_in_page (sa, count, offset);
     count -= n;
     offset += n;
   }
+
+  leave_epoch (g);
+  reclaim_pages (sa);
 }
 
 int
@@ -393,26 +700,30 @@ sparse_array_extents (struct sparse_array *sa,
                       uint32_t count, uint64_t offset,
                       struct nbdkit_extents *extents)
 {
+  struct epoch_guard g = enter_epoch (sa);
   uint32_t n, type;
-  void *p;
+  struct page *page;
+  int r = 0;
 
   while (count > 0) {
-    p = lookup (sa, offset, false, &n, NULL);
+    page = lookup_page (sa, offset, &n);
 
     /* Work out the type of this extent. */
-    if (p == NULL)
+    if (page == NULL)
       /* No backing page, so it's a hole. */
       type = NBDKIT_EXTENT_HOLE | NBDKIT_EXTENT_ZERO;
     else {
-      if (is_zero (p, n))
+      if (is_zero (&page->data[offset & (sa->page_size-1)], n))
         /* A backing page and it's all zero, it's a zero extent. */
         type = NBDKIT_EXTENT_ZERO;
       else
         /* Normal allocated data. */
         type = 0;
     }
-    if (nbdkit_add_extent (extents, offset, n, type) == -1)
-      return -1;
+    if (nbdkit_add_extent (extents, offset, n, type) == -1) {
+      r = -1;
+      break;
+    }
 
     if (n > count)
       n = count;
@@ -421,7 +732,8 @@ sparse_array_extents (struct sparse_array *sa,
     offset += n;
   }
 
-  return 0;
+  leave_epoch (g);
+  return r;
 }
 
 int
@@ -430,26 +742,34 @@ sparse_array_blit (struct sparse_array *sa1,
                    uint32_t count,
                    uint64_t offset1, uint64_t offset2)
 {
+  struct epoch_guard g1 = enter_epoch (sa1);
+  struct epoch_guard g2 = enter_epoch (sa2);
   uint32_t n;
-  void *p;
+  struct page *page;
+  int r = 0;
 
   while (count > 0) {
-    p = lookup (sa2, offset2, true, &n, NULL);
-    if (p == NULL)
-      return -1;
+    page = lock_page (sa2, offset2, true, &n, NULL);
+    if (page == NULL) {
+      r = -1;
+      break;
+    }
 
     if (n > count)
       n = count;
 
-    /* Read the source array (sa1) directly to p which points into the
-     * right place in sa2.
+    /* Read the source array (sa1) directly into the right place in
+     * the locked page of sa2.
      */
-    sparse_array_read (sa1, p, n, offset1);
+    read_pages (sa1, &page->data[offset2 & (sa2->page_size-1)], n, offset1);
+    pthread_mutex_unlock (&page->lock);
 
     count -= n;
     offset1 += n;
     offset2 += n;
   }
 
-  return 0;
+  leave_epoch (g2);
+  leave_epoch (g1);
+  return r;
 }
@@ -36,6 +36,7 @@
 #include <config.h>
 
 #include <stdbool.h>
+#include <stdint.h>
 
 /* This library implements a sparse array of any size up to 2⁶³-1
  * bytes.
@@ -47,15 +48,28 @@
  * Everything allocated has to be stored in memory.  There is no
  * temporary file backing.
  *
- * The implementation is not protected by locks and issuing parallel
- * calls will cause corruption.  If your plugin uses this library you
- * will probably need to use a suitable thread model such as
- * SERIALIZE_ALL_REQUESTS.
+ * All of the functions below may be called in parallel from multiple
+ * threads (except alloc and free).  Reads never block.  Writes to
+ * different pages do not block each other.  As with a real disk,
+ * parallel requests which overlap give unspecified (but not corrupt)
+ * results.
  */
 struct sparse_array;
 
-/* Allocate the empty sparse array. */
-struct sparse_array *alloc_sparse_array (bool debug);
+/* Data is stored in pages of this size.  Writes allocate whole pages,
+ * so smaller pages waste less memory for small scattered writes (eg.
+ * 4K for swap), while larger pages have less overhead for big
+ * sequential writes.
+ */
+#define SPARSE_DEFAULT_PAGE_SIZE 32768
+#define SPARSE_MIN_PAGE_SIZE     512
+#define SPARSE_MAX_PAGE_SIZE     (1024 * 1024)
+
+/* Allocate the empty sparse array.  page_size must be a power of 2
+ * between SPARSE_MIN_PAGE_SIZE and SPARSE_MAX_PAGE_SIZE.  On error
+ * this returns NULL and sets errno.
+ */
+struct sparse_array *alloc_sparse_array (uint32_t page_size, bool debug);
 
 /* Free sparse array. */
 extern void free_sparse_array (struct sparse_array *sa);
@@ -72,7 +86,9 @@ extern void sparse_array_read (struct sparse_array *sa, void *buf,
   __attribute__((__nonnull__ (1, 2)));
 
 /* Write bytes to the sparse array.
- * This can allocate and can return an error.
+ * This can allocate and can return an error.  Parts of the buffer
+ * which are all zero are handled like sparse_array_zero, so they
+ * never allocate and may free memory.
  */
 extern int sparse_array_write (struct sparse_array *sa, const void *buf,
                                uint32_t count, uint64_t offset)
@@ -115,4 +131,25 @@ extern int sparse_array_blit (struct sparse_array *sa1,
                               uint64_t offset1, uint64_t offset2)
   __attribute__((__nonnull__ (1, 2)));
 
+/* Memory usage of the sparse array. */
+struct sparse_array_stats {
+  uint32_t page_size;
+  uint64_t nr_pages;            /* Pages currently allocated. */
+  uint64_t data_bytes;          /* nr_pages * page_size */
+  uint64_t metadata_bytes;      /* Tree nodes and page headers. */
+
+  /* The page allocator is shared between all arrays with the same
+   * page size.  These are the bytes of memory it has used (not
+   * counting memory which has been mapped but never touched), and
+   * the bytes used by allocated pages including headers, so the
+   * difference is free space in the allocator.
+   */
+  uint64_t arena_bytes;
+  uint64_t arena_used_bytes;
+};
+
+extern void sparse_array_get_stats (struct sparse_array *sa,
+                                    struct sparse_array_stats *stats)
+  __attribute__((__nonnull__ (1, 2)));
+
 #endif /* NBDKIT_SPARSE_H */
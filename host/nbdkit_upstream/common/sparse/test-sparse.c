@@ -0,0 +1,353 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Unit and multithreaded stress tests of the sparse array. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <nbdkit-plugin.h>
+
+#include "random.h"
+#include "sparse.h"
+
+#define SECTOR 512
+
+/* Single threaded checks of each operation against a flat copy. */
+static void
+test_basic (uint32_t page_size)
+{
+  const uint32_t size = 1024 * 1024;
+  const uint64_t far = UINT64_C(1) << 62; /* Near the top of the tree. */
+  struct sparse_array *sa, *sa2;
+  char *shadow, *buf;
+  struct sparse_array_stats stats;
+
+  printf ("test_basic: page size %" PRIu32 "\n", page_size);
+  fflush (stdout);
+
+  sa = alloc_sparse_array (page_size, false);
+  sa2 = alloc_sparse_array (page_size, false);
+  shadow = calloc (size, 1);
+  buf = malloc (size);
+  assert (sa && sa2 && shadow && buf);
+
+  /* Reads of an empty array return zeroes. */
+  memset (buf, 'x', size);
+  sparse_array_read (sa, buf, size, 0);
+  assert (memcmp (buf, shadow, size) == 0);
+
+  /* Writes which straddle page boundaries. */
+  memset (&shadow[1000], 'a', 100000);
+  assert (sparse_array_write (sa, &shadow[1000], 100000, 1000) == 0);
+  memset (&shadow[300000], 'b', 1);
+  assert (sparse_array_write (sa, &shadow[300000], 1, 300000) == 0);
+  assert (sparse_array_fill (sa, 'c', 70000, 500000) == 0);
+  memset (&shadow[500000], 'c', 70000);
+  sparse_array_read (sa, buf, size, 0);
+  assert (memcmp (buf, shadow, size) == 0);
+
+  /* Partial and whole page zeroing. */
+  sparse_array_zero (sa, 50000, 20000);
+  memset (&shadow[20000], 0, 50000);
+  assert (sparse_array_fill (sa, 0, 1, 300000) == 0);
+  shadow[300000] = 0;
+  sparse_array_read (sa, buf, size, 0);
+  assert (memcmp (buf, shadow, size) == 0);
+
+  /* Blit to another array, and within the same array. */
+  assert (sparse_array_blit (sa, sa2, size, 0, 0) == 0);
+  sparse_array_read (sa2, buf, size, 0);
+  assert (memcmp (buf, shadow, size) == 0);
+  assert (sparse_array_blit (sa, sa, 65536, 500000, 700000) == 0);
+  memcpy (&shadow[700000], &shadow[500000], 65536);
+  sparse_array_read (sa, buf, size, 0);
+  assert (memcmp (buf, shadow, size) == 0);
+
+  /* Huge offsets. */
+  assert (sparse_array_write (sa, "hello", 5, far) == 0);
+  sparse_array_read (sa, buf, 5, far);
+  assert (memcmp (buf, "hello", 5) == 0);
+  sparse_array_zero (sa, 5, far);
+  sparse_array_read (sa, buf, 5, far);
+  assert (memcmp (buf, "\0\0\0\0\0", 5) == 0);
+
+  /* Zeroing everything returns all pages to the allocator. */
+  sparse_array_get_stats (sa, &stats);
+  assert (stats.page_size == page_size);
+  assert (stats.nr_pages > 0);
+  assert (stats.data_bytes == stats.nr_pages * page_size);
+  sparse_array_zero (sa, size, 0);
+  sparse_array_zero (sa2, size, 0);
+  sparse_array_get_stats (sa, &stats);
+  assert (stats.nr_pages == 0);
+  assert (stats.data_bytes == 0);
+
+  free_sparse_array (sa);
+  free_sparse_array (sa2);
+  free (shadow);
+  free (buf);
+
+  /* Nothing else is using this page size, so the allocator should be
+   * empty.
+   */
+  sa = alloc_sparse_array (page_size, false);
+  sparse_array_get_stats (sa, &stats);
+  assert (stats.arena_used_bytes == 0);
+  free_sparse_array (sa);
+}
+
+/* In the stress test each writer thread owns every NR_WRITERS'th
+ * sector of the area, so writers share pages but never overlap.
+ * Zeroing frees a page when all of its sectors are zero, which races
+ * with the other writers to the page and with the readers.  Each
+ * writer checks that its own sectors always read back as written.
+ */
+#define NR_WRITERS  8
+#define NR_READERS  4
+#define AREA_SIZE   (256 * 1024)
+#define NR_SECTORS  (AREA_SIZE / SECTOR)
+#define ITERATIONS  200000
+
+static struct sparse_array *stress_sa;
+static unsigned writers_running;
+
+/* Sector contents are a tag byte identifying the owner, or zero. */
+static uint8_t
+make_tag (unsigned owner, uint64_t r)
+{
+  return owner << 4 | (1 + r % 15);
+}
+
+static void
+check_sector (const uint8_t *buf, uint8_t expected)
+{
+  size_t i;
+
+  for (i = 0; i < SECTOR; ++i) {
+    if (buf[i] != expected) {
+      fprintf (stderr, "test-sparse: sector corrupted: "
+               "expected 0x%02x, got 0x%02x at byte %zu\n",
+               expected, buf[i], i);
+      abort ();
+    }
+  }
+}
+
+static void *
+writer (void *arg)
+{
+  const unsigned me = (uintptr_t) arg;
+  uint8_t tags[NR_SECTORS / NR_WRITERS] = { 0 };
+  uint8_t buf[SECTOR];
+  struct random_state rs;
+  unsigned i, j, s;
+  uint64_t r;
+
+  xsrandom (me + 1, &rs);
+
+  for (i = 0; i < ITERATIONS; ++i) {
+    r = xrandom (&rs);
+    j = (r >> 8) % (NR_SECTORS / NR_WRITERS);
+    s = j * NR_WRITERS + me;
+
+    switch (r % 10) {
+    case 0 ... 3:               /* Write. */
+      tags[j] = make_tag (me, r >> 32);
+      memset (buf, tags[j], SECTOR);
+      if (sparse_array_write (stress_sa, buf, SECTOR,
+                              (uint64_t) s * SECTOR) == -1)
+        abort ();
+      break;
+    case 4:                     /* Fill. */
+      tags[j] = make_tag (me, r >> 32);
+      if (sparse_array_fill (stress_sa, tags[j], SECTOR,
+                             (uint64_t) s * SECTOR) == -1)
+        abort ();
+      break;
+    case 5 ... 7:               /* Zero. */
+      tags[j] = 0;
+      sparse_array_zero (stress_sa, SECTOR, (uint64_t) s * SECTOR);
+      break;
+    default:                    /* Read back. */
+      sparse_array_read (stress_sa, buf, SECTOR, (uint64_t) s * SECTOR);
+      check_sector (buf, tags[j]);
+    }
+  }
+
+  /* Final check of all owned sectors. */
+  for (j = 0; j < NR_SECTORS / NR_WRITERS; ++j) {
+    s = j * NR_WRITERS + me;
+    sparse_array_read (stress_sa, buf, SECTOR, (uint64_t) s * SECTOR);
+    check_sector (buf, tags[j]);
+  }
+
+  __atomic_sub_fetch (&writers_running, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/* Readers read large spans across the whole area while pages are
+ * being freed under them.  They can see partial writes, but every
+ * byte must be zero or a tag belonging to the owner of the sector.
+ */
+static void *
+reader (void *arg)
+{
+  static uint8_t bufs[NR_READERS][AREA_SIZE];
+  const unsigned me = (uintptr_t) arg;
+  uint8_t *buf = bufs[me];
+  struct random_state rs;
+  uint32_t offset, count;
+  size_t i;
+  uint64_t r;
+  unsigned owner;
+
+  xsrandom (100 + me, &rs);
+
+  while (__atomic_load_n (&writers_running, __ATOMIC_ACQUIRE) > 0) {
+    r = xrandom (&rs);
+    offset = (r % AREA_SIZE) & ~(SECTOR-1);
+    count = 1 + (r >> 32) % (AREA_SIZE - offset);
+    sparse_array_read (stress_sa, buf, count, offset);
+
+    for (i = 0; i < count; ++i) {
+      owner = (offset + i) / SECTOR % NR_WRITERS;
+      if (buf[i] != 0 && buf[i] >> 4 != owner) {
+        fprintf (stderr, "test-sparse: reader saw 0x%02x "
+                 "in sector owned by %u\n", buf[i], owner);
+        abort ();
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static void
+test_stress (uint32_t page_size)
+{
+  pthread_t threads[NR_WRITERS + NR_READERS];
+  size_t i;
+  int err;
+
+  printf ("test_stress: page size %" PRIu32 ", %d writers, %d readers\n",
+          page_size, NR_WRITERS, NR_READERS);
+  fflush (stdout);
+
+  stress_sa = alloc_sparse_array (page_size, false);
+  assert (stress_sa);
+  writers_running = NR_WRITERS;
+
+  for (i = 0; i < NR_WRITERS + NR_READERS; ++i) {
+    err = pthread_create (&threads[i], NULL,
+                          i < NR_WRITERS ? writer : reader,
+                          (void *) (uintptr_t)
+                          (i < NR_WRITERS ? i : i - NR_WRITERS));
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_create");
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < NR_WRITERS + NR_READERS; ++i) {
+    err = pthread_join (threads[i], NULL);
+    if (err != 0) {
+      errno = err;
+      perror ("pthread_join");
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  free_sparse_array (stress_sa);
+}
+
+int
+main (void)
+{
+  const uint32_t page_sizes[] = { 512, 4096, 32768, 1024 * 1024 };
+  size_t i;
+
+  for (i = 0; i < sizeof page_sizes / sizeof page_sizes[0]; ++i)
+    test_basic (page_sizes[i]);
+
+  /* Bad page sizes. */
+  assert (alloc_sparse_array (0, false) == NULL);
+  assert (alloc_sparse_array (256, false) == NULL);
+  assert (alloc_sparse_array (4097, false) == NULL);
+  assert (alloc_sparse_array (2 * 1024 * 1024, false) == NULL);
+
+  test_stress (4096);
+  test_stress (32768);
+  exit (EXIT_SUCCESS);
+}
+
+/* The sparse array code uses nbdkit_debug, nbdkit_error and
+ * nbdkit_add_extent, normally provided by the main server program.
+ * So we have to provide them here.
+ */
+void
+nbdkit_debug (const char *fs, ...)
+{
+  /* do nothing */
+}
+
+void
+nbdkit_error (const char *fs, ...)
+{
+  int err = errno;
+  va_list args;
+
+  va_start (args, fs);
+  fprintf (stderr, "error: ");
+  errno = err; /* Must restore in case fs contains %m */
+  vfprintf (stderr, fs, args);
+  fprintf (stderr, "\n");
+  va_end (args);
+
+  errno = err;
+}
+
+int
+nbdkit_add_extent (struct nbdkit_extents *extents,
+                   uint64_t offset, uint64_t length, uint32_t type)
+{
+  return 0;
+}
@@ -50,6 +50,23 @@ extern void cleanup_unlock (pthread_mutex_t **ptr);
     assert (!_r); \
   } while (0)
 
+extern void cleanup_rwlock_unlock (pthread_rwlock_t **ptr);
+#define CLEANUP_RWLOCK_UNLOCK __attribute__((cleanup (cleanup_rwlock_unlock)))
+
+#define ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE(rwlock) \
+  CLEANUP_RWLOCK_UNLOCK pthread_rwlock_t *_rwlock = rwlock; \
+  do { \
+    int _r = pthread_rwlock_rdlock (_rwlock); \
+    assert (!_r); \
+  } while (0)
+
+#define ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE(rwlock) \
+  CLEANUP_RWLOCK_UNLOCK pthread_rwlock_t *_rwlock = rwlock; \
+  do { \
+    int _r = pthread_rwlock_wrlock (_rwlock); \
+    assert (!_r); \
+  } while (0)
+
 /* cleanup-nbdkit.c */
 struct nbdkit_extents;
 extern void cleanup_extents_free (struct nbdkit_extents **ptr);
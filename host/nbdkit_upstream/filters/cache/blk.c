@@ -47,9 +47,14 @@
 #include <errno.h>
 #include <sys/statvfs.h>
 
+#if defined (__linux__) && !defined (FALLOC_FL_PUNCH_HOLE)
+#include <linux/falloc.h>   /* For FALLOC_FL_*, glibc < 2.18 */
+#endif
+
 #include <nbdkit-filter.h>
 
 #include "bitmap.h"
+#include "iszero.h"
 #include "minmax.h"
 #include "utils.h"
 
@@ -83,12 +88,6 @@ static int fd = -1;
  */
 static struct bitmap bm;
 
-enum bm_entry {
-  BLOCK_NOT_CACHED = 0, /* assumed to be zero by reclaim code */
-  BLOCK_CLEAN = 1,
-  BLOCK_DIRTY = 3,
-};
-
 int
 blk_init (void)
 {
@@ -179,14 +178,33 @@ blk_set_size (uint64_t new_size)
   return 0;
 }
 
+/* Store a block in the cache file.  If the block is all zeroes we
+ * punch a hole instead of writing it, which saves both the write and
+ * the space in the cache file.
+ */
+static int
+store_block (uint64_t offset, const uint8_t *block)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (is_zero ((const char *) block, blksize) &&
+      fallocate (fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                 offset, blksize) == 0)
+    return 0;
+#endif
+
+  return pwrite (fd, block, blksize, offset);
+}
+
 int
 blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
           uint64_t blknum, uint8_t *block, int *err)
 {
   off_t offset = blknum * blksize;
-  enum bm_entry state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
+  enum bm_entry state;
 
+  /* Reclaim first, since it might reclaim this block. */
   reclaim (fd, &bm);
+  state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
 
   nbdkit_debug ("cache: blk_read block %" PRIu64 " (offset %" PRIu64 ") is %s",
                 blknum, (uint64_t) offset,
@@ -205,7 +223,7 @@ blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
                     " (offset %" PRIu64 ")",
                     blknum, (uint64_t) offset);
 
-      if (pwrite (fd, block, blksize, offset) == -1) {
+      if (store_block (offset, block) == -1) {
         *err = errno;
         nbdkit_error ("pwrite: %m");
         return -1;
@@ -231,9 +249,11 @@ blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
            uint64_t blknum, uint8_t *block, int *err)
 {
   off_t offset = blknum * blksize;
-  enum bm_entry state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
+  enum bm_entry state;
 
+  /* Reclaim first, since it might reclaim this block. */
   reclaim (fd, &bm);
+  state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
 
   nbdkit_debug ("cache: blk_cache block %" PRIu64 " (offset %" PRIu64 ") is %s",
                 blknum, (uint64_t) offset,
@@ -250,7 +270,7 @@ blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
     nbdkit_debug ("cache: cache block %" PRIu64 " (offset %" PRIu64 ")",
                   blknum, (uint64_t) offset);
 
-    if (pwrite (fd, block, blksize, offset) == -1) {
+    if (store_block (offset, block) == -1) {
       *err = errno;
       nbdkit_error ("pwrite: %m");
       return -1;
@@ -284,7 +304,7 @@ blk_writethrough (struct nbdkit_next_ops *next_ops, void *nxdata,
   nbdkit_debug ("cache: writethrough block %" PRIu64 " (offset %" PRIu64 ")",
                 blknum, (uint64_t) offset);
 
-  if (pwrite (fd, block, blksize, offset) == -1) {
+  if (store_block (offset, block) == -1) {
     *err = errno;
     nbdkit_error ("pwrite: %m");
     return -1;
@@ -317,7 +337,7 @@ blk_write (struct nbdkit_next_ops *next_ops, void *nxdata,
   nbdkit_debug ("cache: writeback block %" PRIu64 " (offset %" PRIu64 ")",
                 blknum, (uint64_t) offset);
 
-  if (pwrite (fd, block, blksize, offset) == -1) {
+  if (store_block (offset, block) == -1) {
     *err = errno;
     nbdkit_error ("pwrite: %m");
     return -1;
@@ -331,10 +351,13 @@ blk_write (struct nbdkit_next_ops *next_ops, void *nxdata,
 int
 for_each_dirty_block (block_callback f, void *vp)
 {
-  uint64_t blknum;
+  int64_t blknum;
   enum bm_entry state;
 
-  bitmap_for (&bm, blknum) {
+  /* Only blocks which are in the cache can be dirty, so skip over the
+   * rest of the bitmap quickly.
+   */
+  bitmap_for_each_set (&bm, blknum) {
     state = bitmap_get_blk (&bm, blknum, BLOCK_NOT_CACHED);
     if (state == BLOCK_DIRTY) {
       if (f (blknum, vp) == -1)
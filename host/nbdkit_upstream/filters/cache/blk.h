@@ -33,6 +33,13 @@
 #ifndef NBDKIT_BLK_H
 #define NBDKIT_BLK_H
 
+/* Bitmap entries, see the comment in blk.c. */
+enum bm_entry {
+  BLOCK_NOT_CACHED = 0, /* assumed to be zero by reclaim code */
+  BLOCK_CLEAN = 1,
+  BLOCK_DIRTY = 3,
+};
+
 /* Initialize the cache and bitmap. */
 extern int blk_init (void);
 
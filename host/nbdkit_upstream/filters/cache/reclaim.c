@@ -48,6 +48,7 @@
 #include "bitmap.h"
 
 #include "cache.h"
+#include "blk.h"
 #include "reclaim.h"
 #include "lru.h"
 
@@ -188,6 +189,14 @@ reclaim_block (int fd, struct bitmap *bm)
     return;
   }
 
+  /* Dirty blocks have not been written to the plugin yet, so they
+   * cannot be dropped from the cache.
+   */
+  if (bitmap_get_blk (bm, reclaim_blk, BLOCK_NOT_CACHED) == BLOCK_DIRTY) {
+    nbdkit_debug ("cache: not reclaiming dirty block %" PRIu64, reclaim_blk);
+    return;
+  }
+
   nbdkit_debug ("cache: reclaiming block %" PRIu64, reclaim_blk);
 #ifdef FALLOC_FL_PUNCH_HOLE
   if (fallocate (fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
@@ -57,6 +57,21 @@
  * We allow the client to request FUA, and emulate it with a flush
  * (arguably, since the write overlay is temporary, we could ignore
  * FUA altogether).
+ *
+ * With cow-overlay=memory the overlay is a sparse array instead of a
+ * temporary file.  Everything else works the same way.
+ *
+ * Writes to the overlay file can scatter blocks all over the
+ * filesystem.  If cow-chunk-size is set, the first write to each
+ * chunk of the overlay preallocates the whole chunk so that nearby
+ * blocks end up close together on disk.
+ *
+ * Locking: The caller (cow.c) holds a range lock covering the blocks
+ * being accessed, so this file does not have to worry about two
+ * requests touching the same block.  The bitmaps are shared by all
+ * blocks and so are protected by a separate rwlock, which is only
+ * held while looking at or updating the bitmaps and never across
+ * I/O.
  */
 
 #include <config.h>
@@ -73,6 +88,12 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 
+#if defined (__linux__) && !defined (FALLOC_FL_KEEP_SIZE)
+#include <linux/falloc.h>   /* For FALLOC_FL_*, glibc < 2.18 */
+#endif
+
+#include <pthread.h>
+
 #ifdef HAVE_ALLOCA_H
 #include <alloca.h>
 #endif
@@ -80,6 +101,9 @@
 #include <nbdkit-filter.h>
 
 #include "bitmap.h"
+#include "cleanup.h"
+#include "minmax.h"
+#include "sparse.h"
 #include "utils.h"
 
 #include "blk.h"
@@ -88,14 +112,30 @@
 #define fdatasync fsync
 #endif
 
-/* The temporary overlay. */
+/* The temporary overlay.  Either fd is a temporary file, or sa is a
+ * sparse array in memory.
+ */
 static int fd = -1;
+static struct sparse_array *sa;
 
 /* Bitmap.  Bit = 1 => allocated, 0 => hole. */
 static struct bitmap bm;
 
+/* Chunks of the overlay file which have been preallocated.  Bit = 1
+ * => preallocated (or we tried and failed).  Unused if chunk_size ==
+ * 0.
+ */
+static unsigned chunk_size;
+static struct bitmap chunks;
+
+/* Current size of the overlay. */
+static uint64_t overlay_size;
+
+/* Protects bm, chunks and overlay_size. */
+static pthread_rwlock_t bm_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 int
-blk_init (void)
+blk_init (enum overlay_type type, unsigned chunk_size_)
 {
   const char *tmpdir;
   size_t len;
@@ -103,6 +143,20 @@ blk_init (void)
 
   bitmap_init (&bm, BLKSIZE, 1 /* bits per block */);
 
+  if (type == OVERLAY_MEMORY) {
+    nbdkit_debug ("cow: overlay is stored in memory");
+    sa = alloc_sparse_array (BLKSIZE, false);
+    if (sa == NULL) {
+      nbdkit_error ("malloc: %m");
+      return -1;
+    }
+    return 0;
+  }
+
+  chunk_size = chunk_size_;
+  if (chunk_size > 0)
+    bitmap_init (&chunks, chunk_size, 1 /* bits per block */);
+
   tmpdir = getenv ("TMPDIR");
   if (!tmpdir)
     tmpdir = LARGE_TMPDIR;
@@ -143,18 +197,25 @@ blk_free (void)
 {
   if (fd >= 0)
     close (fd);
+  free_sparse_array (sa);
 
   bitmap_free (&bm);
+  bitmap_free (&chunks);
 }
 
 /* Allocate or resize the overlay file and bitmap. */
 int
 blk_set_size (uint64_t new_size)
 {
+  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&bm_lock);
+
   if (bitmap_resize (&bm, new_size) == -1)
     return -1;
+  if (chunk_size > 0 && bitmap_resize (&chunks, new_size) == -1)
+    return -1;
+  overlay_size = new_size;
 
-  if (ftruncate (fd, new_size) == -1) {
+  if (fd >= 0 && ftruncate (fd, new_size) == -1) {
     nbdkit_error ("ftruncate: %m");
     return -1;
   }
@@ -166,14 +227,104 @@ blk_set_size (uint64_t new_size)
 static bool
 blk_is_allocated (uint64_t blknum)
 {
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&bm_lock);
   return bitmap_get_blk (&bm, blknum, false);
 }
 
-/* Mark a block as allocated. */
+/* Return the number of blocks starting at blknum (up to nrblocks)
+ * which are in the same state as blknum, and the state in
+ * *allocated.
+ */
+static uint64_t
+blk_run (uint64_t blknum, uint64_t nrblocks, bool *allocated)
+{
+  int64_t end;
+
+  ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&bm_lock);
+  *allocated = bitmap_get_blk (&bm, blknum, false);
+  if (*allocated)
+    end = bitmap_next_clear (&bm, blknum);
+  else
+    end = bitmap_next (&bm, blknum);
+  return end == -1 ? nrblocks : MIN (nrblocks, end - blknum);
+}
+
+/* Mark blocks as allocated. */
+static void
+blk_set_allocated (uint64_t blknum, uint64_t nrblocks)
+{
+  ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&bm_lock);
+  bitmap_set_blk_range (&bm, blknum, blknum + nrblocks, true);
+}
+
+/* Preallocate the chunks of the overlay file covering the range. */
 static void
-blk_set_allocated (uint64_t blknum)
+overlay_prealloc (uint64_t offset, uint64_t count)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+  uint64_t chunk, last, start, len;
+
+  if (chunk_size == 0)
+    return;
+
+  last = (offset + count - 1) / chunk_size;
+  for (chunk = offset / chunk_size; chunk <= last; chunk++) {
+    start = chunk * chunk_size;
+    {
+      ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (&bm_lock);
+      if (bitmap_get_blk (&chunks, chunk, true))
+        continue;
+      len = MIN (chunk_size, overlay_size - start);
+    }
+
+    /* Two threads can race to preallocate the same chunk, but this
+     * is harmless.  If preallocation fails we carry on, the writes
+     * will allocate blocks as they did before.
+     */
+    if (fallocate (fd, FALLOC_FL_KEEP_SIZE, start, len) == -1)
+      nbdkit_debug ("cow: fallocate: chunk %" PRIu64 ": %m", chunk);
+
+    ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (&bm_lock);
+    bitmap_set_blk (&chunks, chunk, true);
+  }
+#endif
+}
+
+/* Read and write the overlay. */
+static int
+overlay_read (uint8_t *buf, uint64_t count, uint64_t offset, int *err)
+{
+  if (sa) {
+    sparse_array_read (sa, buf, count, offset);
+    return 0;
+  }
+
+  if (pread (fd, buf, count, offset) == -1) {
+    *err = errno;
+    nbdkit_error ("pread: %m");
+    return -1;
+  }
+  return 0;
+}
+
+static int
+overlay_write (const uint8_t *buf, uint64_t count, uint64_t offset, int *err)
 {
-  bitmap_set_blk (&bm, blknum, true);
+  if (sa) {
+    if (sparse_array_write (sa, buf, count, offset) == -1) {
+      *err = errno;
+      return -1;
+    }
+    return 0;
+  }
+
+  overlay_prealloc (offset, count);
+  if (pwrite (fd, buf, count, offset) == -1) {
+    *err = errno;
+    nbdkit_error ("pwrite: %m");
+    return -1;
+  }
+  return 0;
 }
 
 /* These are the block operations.  They always read or write a single
@@ -192,14 +343,36 @@ blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
 
   if (!allocated)               /* Read underlying plugin. */
     return next_ops->pread (nxdata, block, BLKSIZE, offset, 0, err);
+  else                          /* Read overlay. */
+    return overlay_read (block, BLKSIZE, offset, err);
+}
+
+int64_t
+blk_read_multiple (struct nbdkit_next_ops *next_ops, void *nxdata,
+                   uint64_t blknum, uint64_t nrblocks,
+                   uint8_t *block, int *err)
+{
+  off_t offset = blknum * BLKSIZE;
+  bool allocated;
+  uint64_t n;
+
+  /* Find the end of the run of blocks in the same state. */
+  n = blk_run (blknum, nrblocks, &allocated);
+
+  nbdkit_debug ("cow: blk_read_multiple block %" PRIu64
+                " (offset %" PRIu64 ") x %" PRIu64 " are %s",
+                blknum, (uint64_t) offset, n,
+                !allocated ? "holes" : "allocated");
+
+  if (!allocated) {             /* Read underlying plugin. */
+    if (next_ops->pread (nxdata, block, n * BLKSIZE, offset, 0, err) == -1)
+      return -1;
+  }
   else {                        /* Read overlay. */
-    if (pread (fd, block, BLKSIZE, offset) == -1) {
-      *err = errno;
-      nbdkit_error ("pread: %m");
+    if (overlay_read (block, n * BLKSIZE, offset, err) == -1)
       return -1;
-    }
-    return 0;
   }
+  return n;
 }
 
 int
@@ -215,7 +388,11 @@ blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
 
   if (allocated) {
 #if HAVE_POSIX_FADVISE
-    int r = posix_fadvise (fd, offset, BLKSIZE, POSIX_FADV_WILLNEED);
+    int r;
+
+    if (sa)
+      return 0;
+    r = posix_fadvise (fd, offset, BLKSIZE, POSIX_FADV_WILLNEED);
     if (r) {
       errno = r;
       nbdkit_error ("posix_fadvise: %m");
@@ -231,30 +408,32 @@ blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
   if (next_ops->pread (nxdata, block, BLKSIZE, offset, 0, err) == -1)
     return -1;
   if (mode == BLK_CACHE_COW) {
-    if (pwrite (fd, block, BLKSIZE, offset) == -1) {
-      *err = errno;
-      nbdkit_error ("pwrite: %m");
+    if (overlay_write (block, BLKSIZE, offset, err) == -1)
       return -1;
-    }
-    blk_set_allocated (blknum);
+    blk_set_allocated (blknum, 1);
   }
   return 0;
 }
 
 int
 blk_write (uint64_t blknum, const uint8_t *block, int *err)
+{
+  return blk_write_multiple (blknum, 1, block, err);
+}
+
+int
+blk_write_multiple (uint64_t blknum, uint64_t nrblocks,
+                    const uint8_t *block, int *err)
 {
   off_t offset = blknum * BLKSIZE;
 
-  nbdkit_debug ("cow: blk_write block %" PRIu64 " (offset %" PRIu64 ")",
-                blknum, (uint64_t) offset);
+  nbdkit_debug ("cow: blk_write block %" PRIu64 " (offset %" PRIu64 ")"
+                " x %" PRIu64,
+                blknum, (uint64_t) offset, nrblocks);
 
-  if (pwrite (fd, block, BLKSIZE, offset) == -1) {
-    *err = errno;
-    nbdkit_error ("pwrite: %m");
+  if (overlay_write (block, nrblocks * BLKSIZE, offset, err) == -1)
     return -1;
-  }
-  blk_set_allocated (blknum);
+  blk_set_allocated (blknum, nrblocks);
 
   return 0;
 }
@@ -262,6 +441,10 @@ blk_write (uint64_t blknum, const uint8_t *block, int *err)
 int
 blk_flush (void)
 {
+  /* Nothing to do for an overlay in memory. */
+  if (sa)
+    return 0;
+
   /* I think we don't care about file metadata for this temporary
    * file, so only flush the data.
    */
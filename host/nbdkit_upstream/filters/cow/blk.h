@@ -38,8 +38,16 @@
  */
 #define BLKSIZE 4096
 
-/* Initialize the overlay and bitmap. */
-extern int blk_init (void);
+/* Where the overlay is stored. */
+enum overlay_type {
+  OVERLAY_FILE,          /* Temporary file in $TMPDIR */
+  OVERLAY_MEMORY,        /* Sparse array in memory */
+};
+
+/* Initialize the overlay and bitmap.  If chunk_size is not zero, the
+ * overlay file is preallocated in chunks of this size.
+ */
+extern int blk_init (enum overlay_type type, unsigned chunk_size);
 
 /* Close the overlay, free the bitmap. */
 extern void blk_free (void);
@@ -47,8 +55,11 @@ extern void blk_free (void);
 /*----------------------------------------------------------------------
  * ** NOTE **
  *
- * An exclusive lock must be held when you call any function below
- * this line.
+ * The range lock (see cow.c) covering the blocks must be held when
+ * you call any function below this line: a shared lock is enough
+ * for blk_read, blk_read_multiple and blk_cache unless the mode is
+ * BLK_CACHE_COW, otherwise an exclusive lock is needed.
+ * blk_set_size and blk_flush need no lock.
  */
 
 /* Allocate or resize the overlay and bitmap. */
@@ -59,6 +70,17 @@ extern int blk_read (struct nbdkit_next_ops *next_ops, void *nxdata,
                      uint64_t blknum, uint8_t *block, int *err)
   __attribute__((__nonnull__ (1, 4, 5)));
 
+/* Read blocks from the overlay or plugin, starting at blknum and
+ * stopping after nrblocks or where the blocks switch between
+ * allocated and not allocated.  Returns the number of blocks read, or
+ * -1 on error.
+ */
+extern int64_t blk_read_multiple (struct nbdkit_next_ops *next_ops,
+                                  void *nxdata,
+                                  uint64_t blknum, uint64_t nrblocks,
+                                  uint8_t *block, int *err)
+  __attribute__((__nonnull__ (1, 5, 6)));
+
 /* Cache mode for blocks not already in overlay */
 enum cache_mode {
   BLK_CACHE_IGNORE,      /* Do nothing */
@@ -77,6 +99,11 @@ extern int blk_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
 extern int blk_write (uint64_t blknum, const uint8_t *block, int *err)
   __attribute__((__nonnull__ (2, 3)));
 
+/* Write nrblocks consecutive blocks. */
+extern int blk_write_multiple (uint64_t blknum, uint64_t nrblocks,
+                               const uint8_t *block, int *err)
+  __attribute__((__nonnull__ (3, 4)));
+
 /* Flush the overlay to disk. */
 extern int blk_flush (void);
 
@@ -48,27 +48,61 @@
 
 #include "blk.h"
 #include "isaligned.h"
+#include "ispowerof2.h"
 #include "minmax.h"
 #include "rounding.h"
 
-/* In order to handle parallel requests safely, this lock must be held
- * when calling any blk_* functions.
+/* In order to handle parallel requests safely, the overlay is divided
+ * into ranges of LOCK_RANGE blocks, and the lock for a range must be
+ * held when calling blk_* functions on blocks in that range.  Reads
+ * take the lock shared so they never wait for each other, writes
+ * take it exclusive so that read-modify-write cycles are atomic.
+ * Ranges share NR_LOCKS locks.  We only ever hold one range lock at
+ * a time, so there is no lock ordering to worry about.
  */
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_RANGE 64
+#define NR_LOCKS 1024
+static pthread_rwlock_t range_locks[NR_LOCKS];
+
+static inline pthread_rwlock_t *
+range_lock (uint64_t blknum)
+{
+  return &range_locks[(blknum / LOCK_RANGE) % NR_LOCKS];
+}
+
+/* Return the number of blocks (up to n) starting at blknum which are
+ * covered by the same range lock.
+ */
+static inline uint64_t
+range_blocks (uint64_t blknum, uint64_t n)
+{
+  return MIN (n, LOCK_RANGE - blknum % LOCK_RANGE);
+}
 
 bool cow_on_cache;
 
+/* cow-overlay and cow-chunk-size parameters. */
+static enum overlay_type overlay_type = OVERLAY_FILE;
+static unsigned chunk_size = 0;
+
 static void
 cow_load (void)
 {
-  if (blk_init () == -1)
-    exit (EXIT_FAILURE);
+  size_t i;
+
+  for (i = 0; i < NR_LOCKS; ++i)
+    pthread_rwlock_init (&range_locks[i], NULL);
 }
 
 static void
 cow_unload (void)
 {
+  size_t i;
+
   blk_free ();
+
+  for (i = 0; i < NR_LOCKS; ++i)
+    pthread_rwlock_destroy (&range_locks[i]);
 }
 
 static int
@@ -84,13 +118,50 @@ cow_config (nbdkit_next_config *next, void *nxdata,
     cow_on_cache = r;
     return 0;
   }
+  else if (strcmp (key, "cow-overlay") == 0) {
+    if (strcmp (value, "file") == 0)
+      overlay_type = OVERLAY_FILE;
+    else if (strcmp (value, "memory") == 0)
+      overlay_type = OVERLAY_MEMORY;
+    else {
+      nbdkit_error ("cow-overlay must be 'file' or 'memory'");
+      return -1;
+    }
+    return 0;
+  }
+  else if (strcmp (key, "cow-chunk-size") == 0) {
+    int64_t r;
+
+    r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    if (r != 0 &&
+        (r < BLKSIZE || r > 1024 * 1024 * 1024 || !is_power_of_2 (r))) {
+      nbdkit_error ("cow-chunk-size must be 0, or a power of 2 "
+                    "between %d and 1G", BLKSIZE);
+      return -1;
+    }
+    chunk_size = r;
+    return 0;
+  }
   else {
     return next (nxdata, key, value);
   }
 }
 
 #define cow_config_help \
-  "cow-on-cache=<BOOL>  Set to true to treat client cache requests as writes.\n"
+  "cow-on-cache=<BOOL>  Set to true to treat client cache requests as writes.\n" \
+  "cow-overlay=file|memory  Store the overlay in a file (default) or memory.\n" \
+  "cow-chunk-size=<SIZE>  Preallocate the overlay file in chunks."
+
+static int
+cow_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+{
+  if (blk_init (overlay_type, chunk_size) == -1)
+    return -1;
+
+  return next (nxdata);
+}
 
 static void *
 cow_open (nbdkit_next_open *next, void *nxdata, int readonly)
@@ -119,7 +190,6 @@ cow_get_size (struct nbdkit_next_ops *next_ops, void *nxdata,
   nbdkit_debug ("cow: underlying file size: %" PRIi64, size);
   size = ROUND_DOWN (size, BLKSIZE);
 
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   r = blk_set_size (size);
   if (r == -1)
     return -1;
@@ -225,7 +295,7 @@ cow_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
     uint64_t n = MIN (BLKSIZE - blkoffs, count);
 
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (range_lock (blknum));
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r == -1)
       return -1;
@@ -238,29 +308,31 @@ cow_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
     blknum++;
   }
 
-  /* Aligned body */
-  /* XXX This breaks up large read requests into smaller ones, which
-   * is a problem for plugins which have a large, fixed per-request
-   * overhead (hello, curl).  We should try to keep large requests
-   * together as much as possible, but that requires us to be much
-   * smarter here.
+  /* Aligned body.  Runs of blocks which are all in the overlay or
+   * all in the plugin are read with a single request, which matters
+   * for plugins with a large per-request overhead (hello, curl).
+   * Runs are split at range lock boundaries.
    */
   while (count >= BLKSIZE) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    r = blk_read (next_ops, nxdata, blknum, buf, err);
-    if (r == -1)
+    int64_t n;
+
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (range_lock (blknum));
+    n = blk_read_multiple (next_ops, nxdata, blknum,
+                           range_blocks (blknum, count / BLKSIZE),
+                           buf, err);
+    if (n == -1)
       return -1;
 
-    buf += BLKSIZE;
-    count -= BLKSIZE;
-    offset += BLKSIZE;
-    blknum++;
+    buf += n * BLKSIZE;
+    count -= n * BLKSIZE;
+    offset += n * BLKSIZE;
+    blknum += n;
   }
 
   /* Unaligned tail */
   if (count) {
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_RDLOCK_FOR_CURRENT_SCOPE (range_lock (blknum));
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r == -1)
       return -1;
@@ -301,7 +373,7 @@ cow_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
      * Hold the lock over the whole operation.
      */
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (range_lock (blknum));
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r != -1) {
       memcpy (&block[blkoffs], buf, n);
@@ -318,21 +390,23 @@ cow_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
 
   /* Aligned body */
   while (count >= BLKSIZE) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
-    r = blk_write (blknum, buf, err);
+    uint64_t n = range_blocks (blknum, count / BLKSIZE);
+
+    ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (range_lock (blknum));
+    r = blk_write_multiple (blknum, n, buf, err);
     if (r == -1)
       return -1;
 
-    buf += BLKSIZE;
-    count -= BLKSIZE;
-    offset += BLKSIZE;
-    blknum++;
+    buf += n * BLKSIZE;
+    count -= n * BLKSIZE;
+    offset += n * BLKSIZE;
+    blknum += n;
   }
 
   /* Unaligned tail */
   if (count) {
     assert (block);
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (range_lock (blknum));
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r != -1) {
       memcpy (block, buf, count);
@@ -382,7 +456,7 @@ cow_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
     /* Do a read-modify-write operation on the current block.
      * Hold the lock over the whole operation.
      */
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (range_lock (blknum));
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r != -1) {
       memset (&block[blkoffs], 0, n);
@@ -403,7 +477,7 @@ cow_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
     /* XXX There is the possibility of optimizing this: since this loop is
      * writing a whole, aligned block, we should use FALLOC_FL_ZERO_RANGE.
      */
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (range_lock (blknum));
     r = blk_write (blknum, block, err);
     if (r == -1)
       return -1;
@@ -415,7 +489,7 @@ cow_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
 
   /* Unaligned tail */
   if (count) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    ACQUIRE_WRLOCK_FOR_CURRENT_SCOPE (range_lock (blknum));
     r = blk_read (next_ops, nxdata, blknum, block, err);
     if (r != -1) {
       memset (&block[count], 0, BLKSIZE - count);
@@ -436,7 +510,6 @@ cow_flush (struct nbdkit_next_ops *next_ops, void *nxdata, void *handle,
 {
   int r;
 
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   r = blk_flush ();
   if (r == -1)
     *err = errno;
@@ -490,7 +563,14 @@ cow_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
 
   /* Aligned body */
   while (remaining) {
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+    CLEANUP_RWLOCK_UNLOCK pthread_rwlock_t *rwlock = range_lock (blknum);
+
+    /* Only cow-on-cache modifies the overlay. */
+    if (mode == BLK_CACHE_COW)
+      r = pthread_rwlock_wrlock (rwlock);
+    else
+      r = pthread_rwlock_rdlock (rwlock);
+    assert (r == 0);
     r = blk_cache (next_ops, nxdata, blknum, block, mode, err);
     if (r == -1)
       return -1;
@@ -511,6 +591,7 @@ static struct nbdkit_filter filter = {
   .open              = cow_open,
   .config            = cow_config,
   .config_help       = cow_config_help,
+  .config_complete   = cow_config_complete,
   .prepare           = cow_prepare,
   .get_size          = cow_get_size,
   .can_write         = cow_can_write,
@@ -0,0 +1,464 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* For a note on the implementation of this filter, see scheduler.c. */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <nbdkit-filter.h>
+
+#include "cleanup.h"
+#include "tvdiff.h"
+#include "vector.h"
+
+#include "scheduler.h"
+
+DEFINE_VECTOR_TYPE(string_vector, char *);
+
+/* Connections are latency-critical if the export name matches one of
+ * these glob patterns, or the client address is in this list.
+ */
+static string_vector lc_exports = empty_vector;
+static string_vector lc_peers = empty_vector;
+static enum qos_class default_class = QOS_BE;
+
+static struct qos_sched_config config = {
+  .policy = QOS_POLICY_STRICT,
+  .weight = { [QOS_LC] = 4, [QOS_BE] = 1 },
+  .max_inflight = 0,
+  .target_usecs = { 0, 0 },
+};
+
+static char *statsfile = NULL;
+static struct timeval start_t;
+
+/* Per-connection handle. */
+struct qos_handle {
+  enum qos_class class;
+};
+
+static const char *
+class_name (enum qos_class class)
+{
+  return class == QOS_LC ? "LC" : "BE";
+}
+
+static void
+print_stats (FILE *fp)
+{
+  struct qos_class_stats stats[NR_QOS_CLASSES];
+  struct timeval now;
+  int64_t usecs;
+  size_t i;
+
+  gettimeofday (&now, NULL);
+  usecs = tvdiff_usec (&start_t, &now);
+  sched_get_stats (stats);
+
+  fprintf (fp, "elapsed: %.6f s\n", usecs / 1000000.0);
+  for (i = 0; i < NR_QOS_CLASSES; ++i) {
+    const struct qos_class_stats *st = &stats[i];
+
+    fprintf (fp, "%s: %" PRIu64 " ops, %" PRIu64 " queued, "
+             "%" PRIu64 " deferred, "
+             "wait avg %.1f us max %" PRIu64 " us, "
+             "latency avg %.1f us max %" PRIu64 " us, "
+             "target %" PRIu64 " us, %" PRIu64 " SLO violations\n",
+             class_name (i), st->requests, st->queued, st->deferred,
+             st->requests ? (double) st->wait_usecs / st->requests : 0.,
+             st->max_wait_usecs,
+             st->requests ? (double) st->latency_usecs / st->requests : 0.,
+             st->max_latency_usecs,
+             config.target_usecs[i], st->slo_violations);
+  }
+  fflush (fp);
+}
+
+static void
+qos_unload (void)
+{
+  size_t i;
+
+  if (statsfile) {
+    int fd;
+    FILE *fp;
+
+    fd = open (statsfile, O_CLOEXEC | O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd >= 0 && (fp = fdopen (fd, "w")) != NULL) {
+      print_stats (fp);
+      fclose (fp);
+    }
+    else
+      nbdkit_debug ("qos: could not write %s: %m", statsfile);
+  }
+  free (statsfile);
+
+  for (i = 0; i < lc_exports.size; ++i)
+    free (lc_exports.ptr[i]);
+  free (lc_exports.ptr);
+  for (i = 0; i < lc_peers.size; ++i)
+    free (lc_peers.ptr[i]);
+  free (lc_peers.ptr);
+}
+
+static int
+parse_class (const char *key, const char *value, enum qos_class *class)
+{
+  if (strcmp (value, "lc") == 0 || strcmp (value, "LC") == 0)
+    *class = QOS_LC;
+  else if (strcmp (value, "be") == 0 || strcmp (value, "BE") == 0)
+    *class = QOS_BE;
+  else {
+    nbdkit_error ("%s: unknown class '%s', expecting 'lc' or 'be'",
+                  key, value);
+    return -1;
+  }
+  return 0;
+}
+
+/* Parse a duration which is either a number of seconds, or a number
+ * followed by "ms" or "us".  Returns microseconds or -1 on error.
+ */
+static int64_t
+parse_duration (const char *key, const char *value)
+{
+  size_t len = strlen (value);
+  int64_t mult = 1000000;
+  unsigned r;
+  CLEANUP_FREE char *num = strdup (value);
+
+  if (num == NULL) {
+    nbdkit_error ("strdup: %m");
+    return -1;
+  }
+  if (len > 2 && strcmp (&value[len-2], "ms") == 0) {
+    mult = 1000;
+    num[len-2] = '\0';
+  }
+  else if (len > 2 && strcmp (&value[len-2], "us") == 0) {
+    mult = 1;
+    num[len-2] = '\0';
+  }
+  else if (len > 1 && value[len-1] == 's')
+    num[len-1] = '\0';
+
+  if (nbdkit_parse_unsigned (key, num, &r) == -1)
+    return -1;
+  return r * mult;
+}
+
+static int
+append_string (string_vector *v, const char *value)
+{
+  char *copy = strdup (value);
+
+  if (copy == NULL || string_vector_append (v, copy) == -1) {
+    nbdkit_error ("strdup: %m");
+    free (copy);
+    return -1;
+  }
+  return 0;
+}
+
+/* Called for each key=value passed on the command line. */
+static int
+qos_config (nbdkit_next_config *next, void *nxdata,
+            const char *key, const char *value)
+{
+  int64_t usecs;
+
+  if (strcmp (key, "qos-lc-export") == 0)
+    return append_string (&lc_exports, value);
+  else if (strcmp (key, "qos-lc-peer") == 0)
+    return append_string (&lc_peers, value);
+  else if (strcmp (key, "qos-default") == 0)
+    return parse_class (key, value, &default_class);
+  else if (strcmp (key, "qos-policy") == 0) {
+    if (strcmp (value, "strict") == 0)
+      config.policy = QOS_POLICY_STRICT;
+    else if (strcmp (value, "weighted") == 0)
+      config.policy = QOS_POLICY_WEIGHTED;
+    else {
+      nbdkit_error ("unknown qos-policy '%s'", value);
+      return -1;
+    }
+    return 0;
+  }
+  else if (strcmp (key, "qos-weight") == 0) {
+    unsigned lc, be;
+
+    if (sscanf (value, "%u:%u", &lc, &be) != 2 || lc == 0 || be == 0) {
+      nbdkit_error ("qos-weight must be LC:BE with both weights > 0: %s",
+                    value);
+      return -1;
+    }
+    config.weight[QOS_LC] = lc;
+    config.weight[QOS_BE] = be;
+    return 0;
+  }
+  else if (strcmp (key, "qos-max-inflight") == 0)
+    return nbdkit_parse_unsigned (key, value, &config.max_inflight);
+  else if (strcmp (key, "qos-lc-target") == 0) {
+    usecs = parse_duration (key, value);
+    if (usecs == -1)
+      return -1;
+    config.target_usecs[QOS_LC] = usecs;
+    return 0;
+  }
+  else if (strcmp (key, "qos-be-target") == 0) {
+    usecs = parse_duration (key, value);
+    if (usecs == -1)
+      return -1;
+    config.target_usecs[QOS_BE] = usecs;
+    return 0;
+  }
+  else if (strcmp (key, "qos-statsfile") == 0) {
+    free (statsfile);
+    statsfile = nbdkit_absolute_path (value);
+    if (statsfile == NULL)
+      return -1;
+    return 0;
+  }
+  else
+    return next (nxdata, key, value);
+}
+
+#define qos_config_help \
+  "qos-lc-export=PATTERN      Exports matching glob are latency-critical.\n" \
+  "qos-lc-peer=ADDRESS        Clients from this address are latency-critical.\n" \
+  "qos-default=lc|be          Class of other connections (default: be).\n" \
+  "qos-policy=strict|weighted How LC and BE requests share slots.\n" \
+  "qos-weight=LC:BE           Slot shares for weighted policy (default 4:1).\n" \
+  "qos-max-inflight=N         Limit requests dispatched at once.\n" \
+  "qos-lc-target=DURATION     Defer BE requests when LC latency is higher.\n" \
+  "qos-be-target=DURATION     Latency SLO for counting BE violations.\n" \
+  "qos-statsfile=FILE         Write per-class counters on exit."
+
+static int
+qos_get_ready (nbdkit_next_get_ready *next, void *nxdata)
+{
+  sched_init (&config);
+  gettimeofday (&start_t, NULL);
+  return next (nxdata);
+}
+
+static bool
+peer_is_lc (void)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof addr;
+  char host[NI_MAXHOST];
+  size_t i;
+
+  if (lc_peers.size == 0)
+    return false;
+  if (nbdkit_peer_name ((struct sockaddr *) &addr, &addrlen) == -1)
+    return false;
+  if (getnameinfo ((struct sockaddr *) &addr, addrlen,
+                   host, sizeof host, NULL, 0, NI_NUMERICHOST) != 0)
+    return false;
+
+  for (i = 0; i < lc_peers.size; ++i)
+    if (strcmp (lc_peers.ptr[i], host) == 0)
+      return true;
+  return false;
+}
+
+static bool
+export_is_lc (void)
+{
+  const char *name = nbdkit_export_name ();
+  size_t i;
+
+  if (name == NULL)
+    return false;
+
+  for (i = 0; i < lc_exports.size; ++i)
+    if (fnmatch (lc_exports.ptr[i], name, 0) == 0)
+      return true;
+  return false;
+}
+
+/* Create the per-connection handle and classify the connection. */
+static void *
+qos_open (nbdkit_next_open *next, void *nxdata, int readonly)
+{
+  struct qos_handle *h;
+
+  if (next (nxdata, readonly) == -1)
+    return NULL;
+
+  h = malloc (sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+
+  if (export_is_lc () || peer_is_lc ())
+    h->class = QOS_LC;
+  else
+    h->class = default_class;
+  nbdkit_debug ("qos: connection class %s", class_name (h->class));
+
+  return h;
+}
+
+static void
+qos_close (void *handle)
+{
+  free (handle);
+}
+
+/* Every data operation goes through the scheduler. */
+#define SCHEDULE(h, err, call)                                  \
+  do {                                                          \
+    struct qos_ticket ticket;                                   \
+    int r;                                                      \
+                                                                \
+    if (sched_enter ((h)->class, &ticket, (err)) == -1)         \
+      return -1;                                                \
+    r = (call);                                                 \
+    sched_leave (&ticket);                                      \
+    return r;                                                   \
+  } while (0)
+
+/* Read data. */
+static int
+qos_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
+           void *handle, void *buf, uint32_t count, uint64_t offset,
+           uint32_t flags, int *err)
+{
+  struct qos_handle *h = handle;
+
+  SCHEDULE (h, err,
+            next_ops->pread (nxdata, buf, count, offset, flags, err));
+}
+
+/* Write data. */
+static int
+qos_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
+            void *handle,
+            const void *buf, uint32_t count, uint64_t offset, uint32_t flags,
+            int *err)
+{
+  struct qos_handle *h = handle;
+
+  SCHEDULE (h, err,
+            next_ops->pwrite (nxdata, buf, count, offset, flags, err));
+}
+
+/* Flush. */
+static int
+qos_flush (struct nbdkit_next_ops *next_ops, void *nxdata,
+           void *handle, uint32_t flags, int *err)
+{
+  struct qos_handle *h = handle;
+
+  SCHEDULE (h, err, next_ops->flush (nxdata, flags, err));
+}
+
+/* Trim. */
+static int
+qos_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
+          void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+          int *err)
+{
+  struct qos_handle *h = handle;
+
+  SCHEDULE (h, err, next_ops->trim (nxdata, count, offset, flags, err));
+}
+
+/* Zero. */
+static int
+qos_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
+          void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+          int *err)
+{
+  struct qos_handle *h = handle;
+
+  SCHEDULE (h, err, next_ops->zero (nxdata, count, offset, flags, err));
+}
+
+/* Extents. */
+static int
+qos_extents (struct nbdkit_next_ops *next_ops, void *nxdata,
+             void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+             struct nbdkit_extents *extents, int *err)
+{
+  struct qos_handle *h = handle;
+
+  SCHEDULE (h, err,
+            next_ops->extents (nxdata, count, offset, flags, extents, err));
+}
+
+/* Cache. */
+static int
+qos_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
+           void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+           int *err)
+{
+  struct qos_handle *h = handle;
+
+  SCHEDULE (h, err, next_ops->cache (nxdata, count, offset, flags, err));
+}
+
+static struct nbdkit_filter filter = {
+  .name              = "qos",
+  .longname          = "nbdkit quality of service filter",
+  .unload            = qos_unload,
+  .config            = qos_config,
+  .config_help       = qos_config_help,
+  .get_ready         = qos_get_ready,
+  .open              = qos_open,
+  .close             = qos_close,
+  .pread             = qos_pread,
+  .pwrite            = qos_pwrite,
+  .flush             = qos_flush,
+  .trim              = qos_trim,
+  .zero              = qos_zero,
+  .extents           = qos_extents,
+  .cache             = qos_cache,
+};
+
+NBDKIT_REGISTER_FILTER(filter)
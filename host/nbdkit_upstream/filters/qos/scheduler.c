@@ -0,0 +1,320 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* The scheduler sits between the worker threads and the next layer.
+ * Each request is tagged with a class (latency-critical or
+ * best-effort, chosen per connection in qos.c) and must obtain a
+ * dispatch slot before it is passed down.
+ *
+ * There are three independent controls:
+ *
+ * - max_inflight bounds the total number of requests dispatched to
+ *   the next layer at once.  When all slots are busy, waiting LC
+ *   requests are always preferred over waiting BE requests (strict
+ *   policy), or the two classes share slots in proportion to their
+ *   weights (weighted policy).
+ *
+ * - target_usecs[QOS_LC] is the latency target for LC requests.  We keep
+ *   an exponentially weighted moving average of LC latency and while
+ *   it is over the target and any LC request is queued or in flight,
+ *   BE requests are deferred even if slots are available.  As soon
+ *   as LC traffic stops, or LC latency recovers, BE traffic resumes.
+ *   The average is only updated when LC requests complete, so while
+ *   no LC request is in flight it decays, halving for every target
+ *   interval, and cannot hold back BE traffic forever.
+ *
+ * - The per-class counters record queueing time, end-to-end latency
+ *   and SLO violations (requests whose latency exceeded the target
+ *   for their class).
+ *
+ * Waiting threads block on a condition variable.  To allow the
+ * server to shut down while requests are queued, they wake up
+ * periodically to check if nbdkit is quitting.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "cleanup.h"
+#include "tvdiff.h"
+
+#include "scheduler.h"
+
+/* How often waiting threads check for server shutdown. */
+#define POLL_NSEC 10000000
+
+/* Each new sample contributes 1/EWMA_WEIGHT of the LC latency average. */
+#define EWMA_WEIGHT 8
+
+int qos_debug_sched;            /* -D qos.sched=1 */
+
+static struct qos_sched_config config;
+
+/* This lock protects all fields below. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static unsigned waiting[NR_QOS_CLASSES];
+static unsigned inflight[NR_QOS_CLASSES];
+static unsigned credits[NR_QOS_CLASSES]; /* weighted policy only */
+static int64_t lc_latency_ewma;          /* usecs */
+static struct timeval lc_latency_time;   /* last update of the average */
+static struct qos_class_stats stats[NR_QOS_CLASSES];
+
+void
+sched_init (const struct qos_sched_config *c)
+{
+  size_t i;
+
+  config = *c;
+  for (i = 0; i < NR_QOS_CLASSES; ++i)
+    credits[i] = config.weight[i];
+}
+
+static inline enum qos_class
+other_class (enum qos_class class)
+{
+  return class == QOS_LC ? QOS_BE : QOS_LC;
+}
+
+/* Must be called with the lock held.  Age the LC latency average
+ * while no LC request is in flight, since no new sample can arrive
+ * to bring it down.
+ */
+static void
+decay_lc_latency (void)
+{
+  uint64_t target = config.target_usecs[QOS_LC];
+  struct timeval now;
+  int64_t periods;
+
+  gettimeofday (&now, NULL);
+  if (target == 0 || inflight[QOS_LC] > 0 || lc_latency_ewma == 0) {
+    lc_latency_time = now;
+    return;
+  }
+
+  periods = tvdiff_usec (&lc_latency_time, &now) / target;
+  if (periods <= 0)
+    return;
+  lc_latency_ewma = periods >= 63 ? 0 : lc_latency_ewma >> periods;
+  lc_latency_time = now;
+}
+
+/* Is the LC latency target currently being missed? */
+static inline bool
+lc_over_target (void)
+{
+  uint64_t target = config.target_usecs[QOS_LC];
+
+  if (target == 0 || waiting[QOS_LC] + inflight[QOS_LC] == 0)
+    return false;
+
+  decay_lc_latency ();
+  return lc_latency_ewma > target;
+}
+
+/* Must be called with the lock held.  Returns true if a request of
+ * CLASS may be dispatched now.  *DEFERRED is set if the request is
+ * held back by the LC latency target, whether or not a slot is free.
+ */
+static bool
+can_dispatch (enum qos_class class, bool *deferred)
+{
+  enum qos_class other = other_class (class);
+
+  *deferred = false;
+
+  if (class == QOS_BE && lc_over_target ()) {
+    *deferred = true;
+    return false;
+  }
+
+  if (config.max_inflight > 0 &&
+      inflight[QOS_LC] + inflight[QOS_BE] >= config.max_inflight)
+    return false;
+
+  /* Competing for a slot with the other class. */
+  if (waiting[other] > 0) {
+    switch (config.policy) {
+    case QOS_POLICY_STRICT:
+      if (class == QOS_BE)
+        return false;
+      break;
+    case QOS_POLICY_WEIGHTED:
+      /* Out of credits, so give way, but only to a class which can
+       * actually use the slot.  Waiting BE requests held back by the
+       * LC latency target must not block LC too.
+       */
+      if (credits[class] == 0 && credits[other] > 0 &&
+          !(other == QOS_BE && lc_over_target ()))
+        return false;
+      break;
+    }
+  }
+
+  return true;
+}
+
+/* Must be called with the lock held. */
+static void
+consume_credit (enum qos_class class)
+{
+  enum qos_class other = other_class (class);
+
+  if (config.policy != QOS_POLICY_WEIGHTED || waiting[other] == 0)
+    return;
+
+  if (credits[class] == 0 && credits[other] == 0) {
+    credits[QOS_LC] = config.weight[QOS_LC];
+    credits[QOS_BE] = config.weight[QOS_BE];
+  }
+  if (credits[class] > 0)
+    credits[class]--;
+}
+
+int
+sched_enter (enum qos_class class, struct qos_ticket *ticket, int *err)
+{
+  bool deferred, was_queued = false, was_deferred = false;
+  struct timespec ts;
+  int64_t usecs;
+
+  ticket->class = class;
+  gettimeofday (&ticket->arrival, NULL);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  waiting[class]++;
+  while (!can_dispatch (class, &deferred)) {
+    was_queued = true;
+    if (deferred)
+      was_deferred = true;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_nsec += POLL_NSEC;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    if (pthread_cond_timedwait (&cond, &lock, &ts) == ETIMEDOUT) {
+      /* A zero-length sleep returns an error immediately if the
+       * server or this connection is shutting down.
+       */
+      pthread_mutex_unlock (&lock);
+      if (nbdkit_nanosleep (0, 0) == -1) {
+        *err = errno;
+        pthread_mutex_lock (&lock);
+        waiting[class]--;
+        pthread_cond_broadcast (&cond);
+        return -1;
+      }
+      pthread_mutex_lock (&lock);
+    }
+  }
+  waiting[class]--;
+  inflight[class]++;
+  consume_credit (class);
+
+  gettimeofday (&ticket->dispatch, NULL);
+  usecs = tvdiff_usec (&ticket->arrival, &ticket->dispatch);
+  if (usecs < 0)
+    usecs = 0;
+  if (was_queued)
+    stats[class].queued++;
+  if (was_deferred)
+    stats[class].deferred++;
+  stats[class].wait_usecs += usecs;
+  if (usecs > stats[class].max_wait_usecs)
+    stats[class].max_wait_usecs = usecs;
+
+  if (qos_debug_sched)
+    nbdkit_debug ("qos: dispatch %s request after %" PRIi64 " us, "
+                  "inflight LC %u BE %u, waiting LC %u BE %u",
+                  class == QOS_LC ? "LC" : "BE", usecs,
+                  inflight[QOS_LC], inflight[QOS_BE],
+                  waiting[QOS_LC], waiting[QOS_BE]);
+
+  return 0;
+}
+
+void
+sched_leave (struct qos_ticket *ticket)
+{
+  enum qos_class class = ticket->class;
+  struct timeval now;
+  int64_t usecs;
+
+  gettimeofday (&now, NULL);
+  usecs = tvdiff_usec (&ticket->arrival, &now);
+  if (usecs < 0)
+    usecs = 0;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  inflight[class]--;
+
+  stats[class].requests++;
+  stats[class].latency_usecs += usecs;
+  if (usecs > stats[class].max_latency_usecs)
+    stats[class].max_latency_usecs = usecs;
+  if (config.target_usecs[class] > 0 && usecs > config.target_usecs[class])
+    stats[class].slo_violations++;
+
+  if (class == QOS_LC) {
+    gettimeofday (&lc_latency_time, NULL);
+    if (lc_latency_ewma == 0)
+      lc_latency_ewma = usecs;
+    else
+      lc_latency_ewma += (usecs - lc_latency_ewma) / EWMA_WEIGHT;
+  }
+
+  /* Wake everyone: which class may go next depends on the policy. */
+  pthread_cond_broadcast (&cond);
+}
+
+void
+sched_get_stats (struct qos_class_stats s[NR_QOS_CLASSES])
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
+  memcpy (s, stats, sizeof stats);
+}
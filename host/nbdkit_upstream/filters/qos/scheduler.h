@@ -0,0 +1,95 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_QOS_SCHEDULER_H
+#define NBDKIT_QOS_SCHEDULER_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+/* Service classes.  Lower numbers have higher priority. */
+enum qos_class {
+  QOS_LC = 0,                   /* latency-critical */
+  QOS_BE = 1,                   /* best-effort */
+};
+#define NR_QOS_CLASSES 2
+
+enum qos_policy {
+  QOS_POLICY_STRICT,            /* LC always goes first */
+  QOS_POLICY_WEIGHTED,          /* weighted round robin between classes */
+};
+
+/* Per-class counters.  Latencies are measured from the time the
+ * request enters the scheduler to the time it completes in the
+ * underlying layers, so they include both queueing in this filter
+ * and any queueing further down the stack.
+ */
+struct qos_class_stats {
+  uint64_t requests;            /* Completed requests. */
+  uint64_t queued;              /* Requests which had to wait for a slot. */
+  uint64_t deferred;            /* BE requests held back by the LC target. */
+  uint64_t wait_usecs;          /* Total time spent waiting in the queue. */
+  uint64_t max_wait_usecs;
+  uint64_t latency_usecs;       /* Total end-to-end latency. */
+  uint64_t max_latency_usecs;
+  uint64_t slo_violations;      /* Requests with latency > target. */
+};
+
+struct qos_sched_config {
+  enum qos_policy policy;
+  unsigned weight[NR_QOS_CLASSES];
+  unsigned max_inflight;        /* 0 = unlimited */
+  uint64_t target_usecs[NR_QOS_CLASSES]; /* latency SLO, 0 = none */
+};
+
+/* A request in flight through the scheduler. */
+struct qos_ticket {
+  enum qos_class class;
+  struct timeval arrival;
+  struct timeval dispatch;
+};
+
+extern void sched_init (const struct qos_sched_config *config);
+
+/* Wait until a request of the given class may be dispatched to the
+ * next layer.  Every successful call must be paired with a call to
+ * sched_leave once the request has completed.  Returns -1 and sets
+ * *err if the server is shutting down.
+ */
+extern int sched_enter (enum qos_class class, struct qos_ticket *ticket,
+                        int *err);
+extern void sched_leave (struct qos_ticket *ticket);
+
+/* Copy out a consistent snapshot of the per-class counters. */
+extern void sched_get_stats (struct qos_class_stats stats[NR_QOS_CLASSES]);
+
+#endif /* NBDKIT_QOS_SCHEDULER_H */
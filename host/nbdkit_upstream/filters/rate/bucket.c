@@ -31,30 +31,32 @@
  */
 
 /* This filter is implemented using a Token Bucket
- * (https://en.wikipedia.org/wiki/Token_bucket).  There are two
- * buckets per connection (one each for reading and writing) and two
- * global buckets (also for reading and writing).
+ * (https://en.wikipedia.org/wiki/Token_bucket).  Buckets are
+ * arranged in a hierarchy: global, per export name and per
+ * connection.  At each level there are separate buckets for reading
+ * and writing, and each of those is split into a bucket counting bits
+ * and a bucket counting operations (for IOPS limits).
  *
- * We add tokens at the desired rate (the per-connection rate for the
- * connection buckets, and the global rate for the global buckets).
- * Note that we don't actually keep the buckets updated in real time
- * because as a filter we are called asynchronously.  Instead for each
- * bucket we store the last time we were called and add the
- * appropriate number of tokens when we are called next.
+ * We add tokens at the desired rate.  Note that we don't actually
+ * keep the buckets updated in real time because as a filter we are
+ * called asynchronously.  Instead for each bucket we store the time
+ * up to which the level is accurate, and add the appropriate number
+ * of tokens when we are called next.  Fractions of a token are
+ * carried forward by only advancing that time by the amount
+ * corresponding to the whole tokens added, so that many small
+ * requests arriving quickly do not starve the bucket.
  *
- * The bucket capacity controls the burstiness allowed.  This is
- * hard-coded at the moment but could be configurable.  All buckets
- * start off full.
+ * The bucket capacity controls the burstiness allowed (see the
+ * rate-burst parameter).  All buckets start off full.
  *
- * When a packet is to be read or written, if there are sufficient
- * tokens in the bucket then the packet may be immediately passed
- * through to the underlying plugin.  The number of bits used is
- * deducted from the appropriate per-connection and global bucket.
- *
- * If there are insufficient tokens then the packet must be delayed.
- * This is done by inserting a sleep which has an estimated length
- * that is long enough based on the rate at which enough tokens will
- * replenish the bucket to allow the packet to be sent next time.
+ * When a packet is to be read or written the required tokens are
+ * taken from every bucket in the hierarchy at once.  If a bucket does
+ * not contain enough tokens its level goes negative and the caller is
+ * told how long it has to wait for the bucket to refill.  The filter
+ * waits for the longest of these times in a single sleep.  Because
+ * tokens are reserved rather than retried for, a worker thread sleeps
+ * at most once per request, and requests are released in the order
+ * they arrived rather than racing each other for tokens.
  */
 
 #include <config.h>
@@ -69,7 +71,6 @@
 
 #include <nbdkit-filter.h>
 
-#include "minmax.h"
 #include "tvdiff.h"
 
 #include "bucket.h"
@@ -87,13 +88,19 @@ bucket_init (struct bucket *bucket, uint64_t rate, double capacity_secs)
   bucket->capacity_secs = capacity_secs;
 
   /* Capacity is expressed in seconds, but we want to know the
-   * capacity in tokens, so multiply by the rate to get this.
+   * capacity in tokens, so multiply by the rate to get this.  Always
+   * allow at least one token so that a single operation can pass
+   * when limiting IOPS.
    */
   bucket->capacity = rate * capacity_secs;
+  if (rate > 0 && bucket->capacity == 0)
+    bucket->capacity = 1;
 
   /* Buckets start off full. */
   bucket->level = bucket->capacity;
 
+  bucket->burst_tokens = bucket->delayed_tokens = 0;
+
   gettimeofday (&bucket->tv, NULL);
 }
 
@@ -104,69 +111,98 @@ bucket_adjust_rate (struct bucket *bucket, uint64_t rate)
 
   bucket->rate = rate;
   bucket->capacity = rate * bucket->capacity_secs;
-  if (bucket->level > bucket->capacity)
+  if (rate > 0 && bucket->capacity == 0)
+    bucket->capacity = 1;
+  if (bucket->level > (int64_t) bucket->capacity)
     bucket->level = bucket->capacity;
   return old_rate;
 }
 
-uint64_t
-bucket_run (struct bucket *bucket, uint64_t n, struct timespec *ts)
+/* Add the tokens which have accumulated since we were last called. */
+static void
+bucket_refill (struct bucket *bucket)
 {
   struct timeval now;
   int64_t usec;
-  uint64_t add, nsec;
-
-  /* rate == 0 is a special case meaning that there is no limit being
-   * enforced.
-   */
-  if (bucket->rate == 0)
-    return 0;
+  uint64_t add;
+  double add_d;
 
   gettimeofday (&now, NULL);
 
   /* Work out how much time has elapsed since we last added tokens to
-   * the bucket, and add the correct number of tokens.
+   * the bucket.
    */
   usec = tvdiff_usec (&bucket->tv, &now);
   if (usec < 0)      /* Maybe happens if system time not monotonic? */
     usec = 0;
 
-  add = bucket->rate * usec / 1000000;
-  add = MIN (add, bucket->capacity - bucket->level);
+  /* Use floating point here to avoid overflow if the bucket has been
+   * idle for a long time.
+   */
+  add_d = (double) bucket->rate * usec / 1000000;
+  if (bucket->level + add_d >= bucket->capacity) {
+    add = bucket->capacity - bucket->level;
+    bucket->level = bucket->capacity;
+    bucket->tv = now;
+  }
+  else {
+    add = add_d;
+    if (add > 0) {
+      /* Only advance the time by the whole tokens added, carrying the
+       * remainder forward to the next call.
+       */
+      usec = add * 1000000 / bucket->rate;
+      bucket->tv.tv_sec += usec / 1000000;
+      bucket->tv.tv_usec += usec % 1000000;
+      if (bucket->tv.tv_usec >= 1000000) {
+        bucket->tv.tv_sec++;
+        bucket->tv.tv_usec -= 1000000;
+      }
+      bucket->level += add;
+    }
+  }
+
+  if (rate_debug_bucket)
+    nbdkit_debug ("bucket %p: adding %" PRIu64 " tokens, new level %" PRIi64,
+                  bucket, add, bucket->level);
+}
+
+uint64_t
+bucket_reserve (struct bucket *bucket, uint64_t n)
+{
+  uint64_t usec;
+
+  /* rate == 0 is a special case meaning that there is no limit being
+   * enforced.
+   */
+  if (bucket->rate == 0)
+    return 0;
+
+  bucket_refill (bucket);
+
   if (rate_debug_bucket)
-    nbdkit_debug ("bucket %p: adding %" PRIu64 " tokens, new level %" PRIu64,
-                  bucket, add, bucket->level + add);
-  bucket->level += add;
-  bucket->tv = now;
+    nbdkit_debug ("bucket %p: deducting %" PRIu64 " tokens", bucket, n);
 
   /* Can we deduct N tokens from the bucket?  If yes then we're good,
    * and we can return 0 which means the caller won't sleep.
    */
-  if (bucket->level >= n) {
-    if (rate_debug_bucket)
-      nbdkit_debug ("bucket %p: deducting %" PRIu64 " tokens", bucket, n);
+  if (bucket->level >= (int64_t) n) {
     bucket->level -= n;
+    bucket->burst_tokens += n;
     return 0;
   }
 
-  if (rate_debug_bucket)
-    nbdkit_debug ("bucket %p: deducting %" PRIu64 " tokens, bucket empty, "
-                  "need another %" PRIu64 " tokens",
-                  bucket, bucket->level, n - bucket->level);
-
-  n -= bucket->level;
-  bucket->level = 0;
-
-  /* Now we need to estimate how long it will take to add N tokens to
-   * the bucket, which is how long the caller must sleep for.
+  /* Otherwise take the tokens anyway, leaving the bucket in debt, and
+   * estimate how long it will take for the bucket to refill to zero,
+   * which is how long the caller must sleep for.
    */
-  nsec = 1000000000 * n / bucket->rate;
-  ts->tv_sec = nsec / 1000000000;
-  ts->tv_nsec = nsec % 1000000000;
+  bucket->level -= n;
+  bucket->delayed_tokens += n;
+  usec = (double) -bucket->level * 1000000 / bucket->rate;
 
   if (rate_debug_bucket)
-    nbdkit_debug ("bucket %p: sleeping for %.1f seconds", bucket,
-                  nsec / 1000000000.);
+    nbdkit_debug ("bucket %p: bucket empty, sleeping for %.6f seconds",
+                  bucket, usec / 1000000.);
 
-  return n;
+  return usec;
 }
@@ -37,13 +37,20 @@
 #include <time.h>
 #include <sys/time.h>
 
-/* A token bucket. */
+/* A token bucket.
+ *
+ * The level may go negative.  This means that tokens have been
+ * reserved by callers which are now sleeping until the bucket has
+ * refilled enough to cover them.
+ */
 struct bucket {
   uint64_t rate;                /* Fill rate.  0 = no limit set. */
   double capacity_secs;         /* Capacity as supplied to bucket_init. */
   uint64_t capacity;            /* Maximum capacity of the bucket in tokens. */
-  uint64_t level;               /* How full is the bucket now? */
-  struct timeval tv;            /* Last time we updated the level. */
+  int64_t level;                /* How full is the bucket now? */
+  struct timeval tv;            /* Time up to which level is accurate. */
+  uint64_t burst_tokens;        /* Tokens taken without waiting. */
+  uint64_t delayed_tokens;      /* Tokens which had to wait. */
 };
 
 /* Initialize the bucket structure.  Capacity is expressed in
@@ -55,24 +62,16 @@ extern void bucket_init (struct bucket *bucket,
 /* Dynamically adjust the rate.  The old rate is returned. */
 extern uint64_t bucket_adjust_rate (struct bucket *bucket, uint64_t rate);
 
-/* Take up to N tokens from the bucket.
- *
- * If the bucket has >= N tokens (ie. we can send the packet now) then
- * the number of tokens in the bucket is reduced by N and this
- * function returns 0.
- *
- * If the bucket has fewer than N tokens then the bucket is emptied
- * and the number of tokens we still need to take is returned as a
- * positive number > 0.  In this case, *TS is initialized with the
- * estimated length of time you should sleep.  (Note that *TS is _NOT_
- * initialized if the return value == 0, because the caller should not
- * sleep in that case.)
+/* Take N tokens from the bucket.
  *
- * In the case where the caller needs to sleep, it must make a further
- * call to bucket_run before proceeding, since another thread may have
- * "stolen" the tokens while you were sleeping.
+ * The tokens are always taken, even if the bucket does not contain
+ * enough, so that concurrent callers queue up behind each other in
+ * the order they arrived.  The return value is the number of
+ * microseconds the caller must wait before the tokens are available,
+ * or 0 if the caller can proceed at once.  Because the tokens have
+ * already been taken, the caller must not call this again after
+ * sleeping.
  */
-extern uint64_t bucket_run (struct bucket *bucket, uint64_t n,
-                            struct timespec *ts);
+extern uint64_t bucket_reserve (struct bucket *bucket, uint64_t n);
 
 #endif /* NBDKIT_BUCKET_H */
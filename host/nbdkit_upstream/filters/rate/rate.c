@@ -49,16 +49,23 @@
 #include <nbdkit-filter.h>
 
 #include "cleanup.h"
+#include "minmax.h"
+#include "vector.h"
 
 #include "bucket.h"
 
-/* Per-connection and global limit, both in bits per second, with zero
- * meaning not set / not enforced.  These are only used when reading
- * the command line and initializing the buckets for the first time.
- * They are not involved in dynamic rate adjustment.
+/* Global, per-export and per-connection limits, in bits per second
+ * and operations per second, with zero meaning not set / not
+ * enforced.  These are only used when reading the command line and
+ * initializing the buckets for the first time.  They are not
+ * involved in dynamic rate adjustment.
  */
-static uint64_t connection_rate = 0;
 static uint64_t rate = 0;
+static uint64_t export_rate = 0;
+static uint64_t connection_rate = 0;
+static unsigned iops = 0;
+static unsigned export_iops = 0;
+static unsigned connection_iops = 0;
 
 /* Files for dynamic rate adjustment. */
 static char *connection_rate_file = NULL;
@@ -66,62 +73,146 @@ static char *rate_file = NULL;
 
 /* Bucket capacity controls the burst rate.  It is expressed as the
  * length of time in "rate-equivalent seconds" that the client can
- * burst for after a period of inactivity.  This could be adjustable
- * in future.
+ * burst for after a period of inactivity.
  */
-#define BUCKET_CAPACITY 2.0
+static double burst = 2.0;
 
-/* Global read and write buckets. */
-static struct bucket read_bucket;
-static pthread_mutex_t read_bucket_lock = PTHREAD_MUTEX_INITIALIZER;
-static struct bucket write_bucket;
-static pthread_mutex_t write_bucket_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Buckets are kept separately for each direction. */
+enum direction { READ = 0, WRITE = 1 };
+
+/* One level of the hierarchy. */
+struct limits {
+  pthread_mutex_t lock;
+  struct bucket bits[2];        /* Bandwidth, indexed by direction. */
+  struct bucket ops[2];         /* IOPS, indexed by direction. */
+};
+
+/* Global buckets. */
+static struct limits global_limits = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Per-export buckets, shared by all connections to the same export
+ * name.  These are created on demand and live until the filter is
+ * unloaded.
+ */
+struct export_limits {
+  char *name;
+  struct limits limits;
+};
+DEFINE_VECTOR_TYPE(export_limits_vector, struct export_limits *);
+static export_limits_vector exports = empty_vector;
+static pthread_mutex_t exports_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Per-connection handle. */
 struct rate_handle {
-  /* Per-connection read and write buckets. */
-  struct bucket read_bucket;
-  pthread_mutex_t read_bucket_lock;
-  struct bucket write_bucket;
-  pthread_mutex_t write_bucket_lock;
+  struct limits *export_limits; /* NULL if there is no export limit. */
+  struct limits limits;         /* Per-connection buckets. */
 };
 
+static void
+limits_init (struct limits *l, uint64_t bitrate, unsigned opsrate)
+{
+  bucket_init (&l->bits[READ], bitrate, burst);
+  bucket_init (&l->bits[WRITE], bitrate, burst);
+  bucket_init (&l->ops[READ], opsrate, burst);
+  bucket_init (&l->ops[WRITE], opsrate, burst);
+}
+
+static void
+limits_debug (const char *what, struct limits *l)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&l->lock);
+
+  if (l->bits[READ].rate || l->bits[WRITE].rate)
+    nbdkit_debug ("rate: %s bits: read %" PRIu64 " burst %" PRIu64 " delayed, "
+                  "write %" PRIu64 " burst %" PRIu64 " delayed",
+                  what,
+                  l->bits[READ].burst_tokens, l->bits[READ].delayed_tokens,
+                  l->bits[WRITE].burst_tokens, l->bits[WRITE].delayed_tokens);
+  if (l->ops[READ].rate || l->ops[WRITE].rate)
+    nbdkit_debug ("rate: %s ops: read %" PRIu64 " burst %" PRIu64 " delayed, "
+                  "write %" PRIu64 " burst %" PRIu64 " delayed",
+                  what,
+                  l->ops[READ].burst_tokens, l->ops[READ].delayed_tokens,
+                  l->ops[WRITE].burst_tokens, l->ops[WRITE].delayed_tokens);
+}
+
 static void
 rate_unload (void)
 {
+  size_t i;
+
+  limits_debug ("global", &global_limits);
+  for (i = 0; i < exports.size; ++i) {
+    limits_debug (exports.ptr[i]->name, &exports.ptr[i]->limits);
+    pthread_mutex_destroy (&exports.ptr[i]->limits.lock);
+    free (exports.ptr[i]->name);
+    free (exports.ptr[i]);
+  }
+  free (exports.ptr);
+
   free (connection_rate_file);
   free (rate_file);
 }
 
+static int
+parse_rate (const char *key, const char *value, uint64_t *r)
+{
+  int64_t v;
+
+  if (*r > 0) {
+    nbdkit_error ("%s set twice on the command line", key);
+    return -1;
+  }
+  v = nbdkit_parse_size (value);
+  if (v == -1)
+    return -1;
+  if (v == 0) {
+    nbdkit_error ("%s cannot be set to 0", key);
+    return -1;
+  }
+  *r = v;
+  return 0;
+}
+
+static int
+parse_iops (const char *key, const char *value, unsigned *r)
+{
+  if (*r > 0) {
+    nbdkit_error ("%s set twice on the command line", key);
+    return -1;
+  }
+  if (nbdkit_parse_unsigned (key, value, r) == -1)
+    return -1;
+  if (*r == 0) {
+    nbdkit_error ("%s cannot be set to 0", key);
+    return -1;
+  }
+  return 0;
+}
+
 /* Called for each key=value passed on the command line. */
 static int
 rate_config (nbdkit_next_config *next, void *nxdata,
              const char *key, const char *value)
 {
-  if (strcmp (key, "rate") == 0) {
-    if (rate > 0) {
-      nbdkit_error ("rate set twice on the command line");
-      return -1;
-    }
-    rate = nbdkit_parse_size (value);
-    if (rate == -1)
-      return -1;
-    if (rate == 0) {
-      nbdkit_error ("rate cannot be set to 0");
-      return -1;
-    }
-    return 0;
-  }
-  else if (strcmp (key, "connection-rate") == 0) {
-    if (connection_rate > 0) {
-      nbdkit_error ("connection-rate set twice on the command line");
-      return -1;
-    }
-    connection_rate = nbdkit_parse_size (value);
-    if (connection_rate == -1)
-      return -1;
-    if (connection_rate == 0) {
-      nbdkit_error ("connection-rate cannot be set to 0");
+  if (strcmp (key, "rate") == 0)
+    return parse_rate (key, value, &rate);
+  else if (strcmp (key, "export-rate") == 0)
+    return parse_rate (key, value, &export_rate);
+  else if (strcmp (key, "connection-rate") == 0)
+    return parse_rate (key, value, &connection_rate);
+  else if (strcmp (key, "iops") == 0)
+    return parse_iops (key, value, &iops);
+  else if (strcmp (key, "export-iops") == 0)
+    return parse_iops (key, value, &export_iops);
+  else if (strcmp (key, "connection-iops") == 0)
+    return parse_iops (key, value, &connection_iops);
+  else if (strcmp (key, "rate-burst") == 0) {
+    if (sscanf (value, "%lg", &burst) != 1 || burst <= 0) {
+      nbdkit_error ("cannot parse rate-burst, "
+                    "expecting a positive number of seconds: %s", value);
       return -1;
     }
     return 0;
@@ -148,18 +239,59 @@ static int
 rate_get_ready (nbdkit_next_get_ready *next, void *nxdata)
 {
   /* Initialize the global buckets. */
-  bucket_init (&read_bucket, rate, BUCKET_CAPACITY);
-  bucket_init (&write_bucket, rate, BUCKET_CAPACITY);
+  limits_init (&global_limits, rate, iops);
 
   return next (nxdata);
 }
 
 #define rate_config_help \
   "rate=BITSPERSEC                Limit total bandwidth.\n" \
+  "export-rate=BITSPERSEC         Limit bandwidth per export name.\n" \
   "connection-rate=BITSPERSEC     Limit per-connection bandwidth.\n" \
+  "iops=N                         Limit total operations per second.\n" \
+  "export-iops=N                  Limit operations per second per export.\n" \
+  "connection-iops=N              Limit per-connection operations per second.\n" \
+  "rate-burst=SECS                Burst allowed after inactivity (default 2).\n" \
   "rate-file=FILENAME             Dynamically adjust total bandwidth.\n" \
   "connection-rate-file=FILENAME  Dynamically adjust per-connection bandwidth."
 
+/* Find or create the buckets for the current export name. */
+static struct limits *
+get_export_limits (void)
+{
+  const char *name;
+  struct export_limits *e;
+  size_t i;
+
+  if (export_rate == 0 && export_iops == 0)
+    return NULL;
+
+  name = nbdkit_export_name ();
+  if (name == NULL)
+    name = "";
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&exports_lock);
+  for (i = 0; i < exports.size; ++i)
+    if (strcmp (exports.ptr[i]->name, name) == 0)
+      return &exports.ptr[i]->limits;
+
+  e = calloc (1, sizeof *e);
+  if (e == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  e->name = strdup (name);
+  if (e->name == NULL || export_limits_vector_append (&exports, e) == -1) {
+    nbdkit_error ("strdup: %m");
+    free (e->name);
+    free (e);
+    return NULL;
+  }
+  pthread_mutex_init (&e->limits.lock, NULL);
+  limits_init (&e->limits, export_rate, export_iops);
+  return &e->limits;
+}
+
 /* Create the per-connection handle. */
 static void *
 rate_open (nbdkit_next_open *next, void *nxdata, int readonly)
@@ -175,10 +307,13 @@ rate_open (nbdkit_next_open *next, void *nxdata, int readonly)
     return NULL;
   }
 
-  bucket_init (&h->read_bucket, connection_rate, BUCKET_CAPACITY);
-  bucket_init (&h->write_bucket, connection_rate, BUCKET_CAPACITY);
-  pthread_mutex_init (&h->read_bucket_lock, NULL);
-  pthread_mutex_init (&h->write_bucket_lock, NULL);
+  h->export_limits = get_export_limits ();
+  if ((export_rate > 0 || export_iops > 0) && h->export_limits == NULL) {
+    free (h);
+    return NULL;
+  }
+  limits_init (&h->limits, connection_rate, connection_iops);
+  pthread_mutex_init (&h->limits.lock, NULL);
 
   return h;
 }
@@ -189,8 +324,8 @@ rate_close (void *handle)
 {
   struct rate_handle *h = handle;
 
-  pthread_mutex_destroy (&h->read_bucket_lock);
-  pthread_mutex_destroy (&h->write_bucket_lock);
+  limits_debug ("connection", &h->limits);
+  pthread_mutex_destroy (&h->limits.lock);
   free (h);
 }
 
@@ -242,12 +377,28 @@ maybe_adjust (const char *file, struct bucket *bucket, pthread_mutex_t *lock)
                   old_rate, new_rate);
 }
 
-static inline int
-maybe_sleep (struct bucket *bucket, pthread_mutex_t *lock, uint32_t count,
-             int *err)
+/* Take tokens from all buckets at one level of the hierarchy,
+ * returning how long to wait in microseconds.
+ */
+static uint64_t
+limits_reserve (struct limits *l, enum direction dir, uint64_t bits)
+{
+  uint64_t usec = 0;
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&l->lock);
+  if (bits > 0)
+    usec = bucket_reserve (&l->bits[dir], bits);
+  return MAX (usec, bucket_reserve (&l->ops[dir], 1));
+}
+
+static int
+throttle (struct rate_handle *h, enum direction dir, uint32_t count,
+          int *err)
 {
-  struct timespec ts;
-  uint64_t bits;
+  uint64_t bits, usec;
+
+  maybe_adjust (rate_file, &global_limits.bits[dir], &global_limits.lock);
+  maybe_adjust (connection_rate_file, &h->limits.bits[dir], &h->limits.lock);
 
   /* Count is in bytes, but we rate limit using bits.  We could
    * multiply this by 10 to include start/stop but let's not
@@ -255,17 +406,18 @@ maybe_sleep (struct bucket *bucket, pthread_mutex_t *lock, uint32_t count,
    */
   bits = count * UINT64_C(8);
 
-  while (bits > 0) {
-    /* Run the token bucket algorithm. */
-    {
-      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (lock);
-      bits = bucket_run (bucket, bits, &ts);
-    }
-
-    if (bits > 0 && nbdkit_nanosleep (ts.tv_sec, ts.tv_nsec) == -1) {
-      *err = errno;
-      return -1;
-    }
+  /* Reserve tokens from every level, then sleep once for the longest
+   * wait.  The most restrictive level determines when we can go.
+   */
+  usec = limits_reserve (&global_limits, dir, bits);
+  if (h->export_limits)
+    usec = MAX (usec, limits_reserve (h->export_limits, dir, bits));
+  usec = MAX (usec, limits_reserve (&h->limits, dir, bits));
+
+  if (usec > 0 &&
+      nbdkit_nanosleep (usec / 1000000, (usec % 1000000) * 1000) == -1) {
+    *err = errno;
+    return -1;
   }
   return 0;
 }
@@ -278,11 +430,7 @@ rate_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
 {
   struct rate_handle *h = handle;
 
-  maybe_adjust (rate_file, &read_bucket, &read_bucket_lock);
-  if (maybe_sleep (&read_bucket, &read_bucket_lock, count, err))
-    return -1;
-  maybe_adjust (connection_rate_file, &h->read_bucket, &h->read_bucket_lock);
-  if (maybe_sleep (&h->read_bucket, &h->read_bucket_lock, count, err))
+  if (throttle (h, READ, count, err) == -1)
     return -1;
 
   return next_ops->pread (nxdata, buf, count, offset, flags, err);
@@ -297,16 +445,41 @@ rate_pwrite (struct nbdkit_next_ops *next_ops, void *nxdata,
 {
   struct rate_handle *h = handle;
 
-  maybe_adjust (rate_file, &write_bucket, &write_bucket_lock);
-  if (maybe_sleep (&write_bucket, &write_bucket_lock, count, err))
-    return -1;
-  maybe_adjust (connection_rate_file, &h->write_bucket, &h->write_bucket_lock);
-  if (maybe_sleep (&h->write_bucket, &h->write_bucket_lock, count, err))
+  if (throttle (h, WRITE, count, err) == -1)
     return -1;
 
   return next_ops->pwrite (nxdata, buf, count, offset, flags, err);
 }
 
+/* Zero and trim do not send data over the wire, so they only count
+ * against the IOPS limits.
+ */
+static int
+rate_zero (struct nbdkit_next_ops *next_ops, void *nxdata,
+           void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+           int *err)
+{
+  struct rate_handle *h = handle;
+
+  if (throttle (h, WRITE, 0, err) == -1)
+    return -1;
+
+  return next_ops->zero (nxdata, count, offset, flags, err);
+}
+
+static int
+rate_trim (struct nbdkit_next_ops *next_ops, void *nxdata,
+           void *handle, uint32_t count, uint64_t offset, uint32_t flags,
+           int *err)
+{
+  struct rate_handle *h = handle;
+
+  if (throttle (h, WRITE, 0, err) == -1)
+    return -1;
+
+  return next_ops->trim (nxdata, count, offset, flags, err);
+}
+
 static struct nbdkit_filter filter = {
   .name              = "rate",
   .longname          = "nbdkit rate filter",
@@ -318,6 +491,8 @@ static struct nbdkit_filter filter = {
   .close             = rate_close,
   .pread             = rate_pread,
   .pwrite            = rate_pwrite,
+  .zero              = rate_zero,
+  .trim              = rate_trim,
 };
 
 NBDKIT_REGISTER_FILTER(filter)
@@ -0,0 +1,372 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* The shared segment is a file (normally in /dev/shm, or on a
+ * hugetlbfs mount to use huge pages) which every nbdkit process
+ * using the filter maps with MAP_SHARED.  It contains:
+ *
+ *   header | slots[nr_sets * WAYS] | padding | data[nr_sets * WAYS]
+ *
+ * and works as a set-associative cache.  A (key, blknum) pair hashes
+ * to one set, and the block can be stored in any of the WAYS slots
+ * of that set.  When a set is full the least recently used slot in
+ * the set is replaced.
+ *
+ * Each slot is protected by a sequence count.  A writer makes the
+ * count odd (with compare-and-swap, so only one writer can own a
+ * slot), updates the slot, then makes it even again.  Readers never
+ * write the count: they read the count, check the slot, copy the
+ * data, and then check the count has not changed.  If it has, the
+ * lookup is treated as a miss, which is always safe because the
+ * caller can read the block from the plugin instead.
+ *
+ * If a process dies while it owns a slot, the count is left odd and
+ * the slot is never used again.  That wastes one slot, but nothing
+ * worse.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include <nbdkit-filter.h>
+
+#include "rounding.h"
+
+#include "segment.h"
+
+#define SEGMENT_MAGIC "NBDKSHC1"
+#define SEGMENT_VERSION 1
+
+/* Number of slots in each set. */
+#define WAYS 8
+
+/* Header and data are page aligned. */
+#define HEADER_SIZE 4096
+
+struct header {
+  char magic[8];
+  uint32_t version;
+  uint32_t blksize;
+  uint64_t size;                /* Size of the whole segment. */
+  uint64_t nr_sets;
+  uint64_t data_offset;
+
+  /* Updated atomically by all processes. */
+  uint64_t clock;               /* Incremented on each insert. */
+  uint64_t hits, misses, inserts, evictions;
+};
+
+struct slot {
+  uint32_t seq;                 /* Odd while the slot is being written. */
+  uint32_t unused;
+  uint64_t key;                 /* 0 if the slot is empty. */
+  uint64_t blknum;
+  uint64_t atime;               /* Value of clock when last used. */
+};
+
+static struct header *header;
+static struct slot *slots;
+static uint8_t *data;
+static uint64_t nr_sets;
+
+/* Work out the number of sets which fit in a segment of this size. */
+static uint64_t
+calculate_geometry (uint64_t size, uint64_t *data_offset)
+{
+  uint64_t n;
+
+  if (size < HEADER_SIZE)
+    return 0;
+  n = (size - HEADER_SIZE) /
+    (WAYS * (sizeof (struct slot) + SEGMENT_BLKSIZE));
+  while (n > 0) {
+    *data_offset = ROUND_UP (HEADER_SIZE + n * WAYS * sizeof (struct slot),
+                             SEGMENT_BLKSIZE);
+    if (*data_offset + n * WAYS * SEGMENT_BLKSIZE <= size)
+      break;
+    n--;
+  }
+  return n;
+}
+
+static int
+init_header (int fd, uint64_t size)
+{
+  struct header h;
+  uint64_t data_offset = 0;
+
+  memset (&h, 0, sizeof h);
+  memcpy (h.magic, SEGMENT_MAGIC, sizeof h.magic);
+  h.version = SEGMENT_VERSION;
+  h.blksize = SEGMENT_BLKSIZE;
+  h.size = size;
+  h.nr_sets = calculate_geometry (size, &data_offset);
+  h.data_offset = data_offset;
+  if (h.nr_sets == 0) {
+    nbdkit_error ("shmcache-size is too small");
+    return -1;
+  }
+
+  /* The file is sparse, so this only touches the header.  The rest
+   * of the segment reads as zeroes, which means all slots are empty.
+   */
+  if (ftruncate (fd, size) == -1) {
+    nbdkit_error ("ftruncate: %m");
+    return -1;
+  }
+  if (pwrite (fd, &h, sizeof h, 0) != sizeof h) {
+    nbdkit_error ("pwrite: %m");
+    return -1;
+  }
+  return 0;
+}
+
+static int
+check_header (int fd, const char *path, uint64_t file_size)
+{
+  struct header h;
+
+  if (pread (fd, &h, sizeof h, 0) != sizeof h) {
+    nbdkit_error ("%s: could not read header", path);
+    return -1;
+  }
+  if (memcmp (h.magic, SEGMENT_MAGIC, sizeof h.magic) != 0 ||
+      h.version != SEGMENT_VERSION ||
+      h.blksize != SEGMENT_BLKSIZE ||
+      h.size != file_size ||
+      h.nr_sets == 0 ||
+      h.data_offset + h.nr_sets * WAYS * SEGMENT_BLKSIZE > h.size) {
+    nbdkit_error ("%s: file exists but is not a compatible shmcache segment",
+                  path);
+    return -1;
+  }
+  return 0;
+}
+
+int
+segment_open (const char *path, uint64_t size)
+{
+  int fd;
+  struct stat statbuf;
+  void *p;
+
+  fd = open (path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+  if (fd == -1) {
+    nbdkit_error ("open: %s: %m", path);
+    return -1;
+  }
+
+  /* Serialize creation against other processes starting up. */
+  if (flock (fd, LOCK_EX) == -1) {
+    nbdkit_error ("flock: %s: %m", path);
+    goto err;
+  }
+  if (fstat (fd, &statbuf) == -1) {
+    nbdkit_error ("fstat: %s: %m", path);
+    goto err;
+  }
+  if (statbuf.st_size == 0) {
+    nbdkit_debug ("shmcache: creating segment %s size %" PRIu64, path, size);
+    if (init_header (fd, size) == -1)
+      goto err;
+  }
+  else {
+    size = statbuf.st_size;
+    nbdkit_debug ("shmcache: using existing segment %s size %" PRIu64,
+                  path, size);
+    if (check_header (fd, path, size) == -1)
+      goto err;
+  }
+  flock (fd, LOCK_UN);
+
+  p = mmap (NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    nbdkit_error ("mmap: %s: %m", path);
+    goto err;
+  }
+  close (fd);
+
+  header = p;
+  nr_sets = header->nr_sets;
+  slots = (struct slot *) ((uint8_t *) p + HEADER_SIZE);
+  data = (uint8_t *) p + header->data_offset;
+  nbdkit_debug ("shmcache: %" PRIu64 " sets x %d ways", nr_sets, WAYS);
+  return 0;
+
+ err:
+  close (fd);
+  return -1;
+}
+
+void
+segment_close (void)
+{
+  if (header) {
+    munmap (header, header->size);
+    header = NULL;
+  }
+}
+
+/* Choose the set for a block. */
+static uint64_t
+hash_set (uint64_t key, uint64_t blknum)
+{
+  uint64_t h = key ^ (blknum * UINT64_C(0x9e3779b97f4a7c15));
+
+  h ^= h >> 33;
+  h *= UINT64_C(0xff51afd7ed558ccd);
+  h ^= h >> 33;
+  return h % nr_sets;
+}
+
+static inline uint8_t *
+slot_data (const struct slot *slot)
+{
+  return data + (uint64_t) (slot - slots) * SEGMENT_BLKSIZE;
+}
+
+static inline void
+add_stat (uint64_t *counter)
+{
+  __atomic_add_fetch (counter, 1, __ATOMIC_RELAXED);
+}
+
+bool
+segment_lookup (uint64_t key, uint64_t blknum, void *buf)
+{
+  struct slot *slot = &slots[hash_set (key, blknum) * WAYS];
+  uint32_t seq;
+  size_t i;
+
+  for (i = 0; i < WAYS; ++i, ++slot) {
+    seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;
+    if (__atomic_load_n (&slot->key, __ATOMIC_RELAXED) != key ||
+        __atomic_load_n (&slot->blknum, __ATOMIC_RELAXED) != blknum)
+      continue;
+
+    memcpy (buf, slot_data (slot), SEGMENT_BLKSIZE);
+
+    /* Check that nothing changed the slot while we were copying. */
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    if (__atomic_load_n (&slot->seq, __ATOMIC_RELAXED) != seq)
+      break;
+
+    __atomic_store_n (&slot->atime,
+                      __atomic_load_n (&header->clock, __ATOMIC_RELAXED),
+                      __ATOMIC_RELAXED);
+    add_stat (&header->hits);
+    return true;
+  }
+
+  add_stat (&header->misses);
+  return false;
+}
+
+void
+segment_insert (uint64_t key, uint64_t blknum, const void *buf)
+{
+  struct slot *slot = &slots[hash_set (key, blknum) * WAYS];
+  struct slot *victim = NULL;
+  uint32_t seq, victim_seq = 0;
+  uint64_t atime, oldest = UINT64_MAX;
+  bool evicting;
+  size_t i;
+
+  /* Pick an empty slot, otherwise the least recently used one. */
+  for (i = 0; i < WAYS; ++i, ++slot) {
+    seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;
+    if (__atomic_load_n (&slot->key, __ATOMIC_RELAXED) == 0) {
+      victim = slot;
+      victim_seq = seq;
+      break;
+    }
+    if (__atomic_load_n (&slot->key, __ATOMIC_RELAXED) == key &&
+        __atomic_load_n (&slot->blknum, __ATOMIC_RELAXED) == blknum)
+      return;                   /* Someone else cached it already. */
+    atime = __atomic_load_n (&slot->atime, __ATOMIC_RELAXED);
+    if (atime < oldest) {
+      victim = slot;
+      victim_seq = seq;
+      oldest = atime;
+    }
+  }
+  if (victim == NULL)
+    return;
+
+  /* Take ownership of the slot.  If that fails, another thread or
+   * process got there first and we give up.
+   */
+  if (!__atomic_compare_exchange_n (&victim->seq, &victim_seq, victim_seq + 1,
+                                    false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    return;
+
+  evicting = __atomic_load_n (&victim->key, __ATOMIC_RELAXED) != 0;
+  __atomic_store_n (&victim->key, key, __ATOMIC_RELAXED);
+  __atomic_store_n (&victim->blknum, blknum, __ATOMIC_RELAXED);
+  memcpy (slot_data (victim), buf, SEGMENT_BLKSIZE);
+  __atomic_store_n (&victim->atime,
+                    __atomic_add_fetch (&header->clock, 1, __ATOMIC_RELAXED),
+                    __ATOMIC_RELAXED);
+  __atomic_store_n (&victim->seq, victim_seq + 2, __ATOMIC_RELEASE);
+
+  add_stat (&header->inserts);
+  if (evicting)
+    add_stat (&header->evictions);
+}
+
+void
+segment_get_stats (struct segment_stats *stats)
+{
+  stats->nr_slots = nr_sets * WAYS;
+  stats->hits = __atomic_load_n (&header->hits, __ATOMIC_RELAXED);
+  stats->misses = __atomic_load_n (&header->misses, __ATOMIC_RELAXED);
+  stats->inserts = __atomic_load_n (&header->inserts, __ATOMIC_RELAXED);
+  stats->evictions = __atomic_load_n (&header->evictions, __ATOMIC_RELAXED);
+}
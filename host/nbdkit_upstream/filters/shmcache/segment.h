@@ -0,0 +1,80 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef NBDKIT_SHMCACHE_SEGMENT_H
+#define NBDKIT_SHMCACHE_SEGMENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Size of a block in the shared cache. */
+#define SEGMENT_BLKSIZE 4096
+
+/* Statistics stored in the segment, so they cover all processes
+ * using it.
+ */
+struct segment_stats {
+  uint64_t nr_slots;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t inserts;
+  uint64_t evictions;
+};
+
+/* Open (creating if necessary) and map the shared segment stored in
+ * the file at path.  size is only used when the file is created,
+ * otherwise the existing segment is used as it is.  Returns -1 on
+ * error (with the error already reported).
+ */
+extern int segment_open (const char *path, uint64_t size);
+
+/* Unmap the segment.  The file is left behind for other processes. */
+extern void segment_close (void);
+
+/* Look up block blknum of the image identified by key.  If found the
+ * block is copied to buf and this returns true.  This never blocks
+ * and may be called in parallel from any thread or process.
+ */
+extern bool segment_lookup (uint64_t key, uint64_t blknum, void *buf)
+  __attribute__((__nonnull__ (3)));
+
+/* Insert a block into the cache, evicting another block if needed.
+ * This never blocks: if another thread or process is updating the
+ * same slot the block is simply not inserted.
+ */
+extern void segment_insert (uint64_t key, uint64_t blknum, const void *buf)
+  __attribute__((__nonnull__ (3)));
+
+extern void segment_get_stats (struct segment_stats *stats)
+  __attribute__((__nonnull__ (1)));
+
+#endif /* NBDKIT_SHMCACHE_SEGMENT_H */
@@ -0,0 +1,378 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* For a note on the implementation of this filter, see segment.c. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <nbdkit-filter.h>
+
+#include "cleanup.h"
+#include "minmax.h"
+#include "rounding.h"
+
+#include "segment.h"
+
+#define BLKSIZE SEGMENT_BLKSIZE
+
+/* Largest request sent to the plugin when prefetching. */
+#define MAX_PREFETCH (64 * BLKSIZE)
+
+static char *segment_file = NULL;
+static uint64_t segment_size = 256 * 1024 * 1024;
+static char *image_key = NULL;
+
+/* True once the segment has been mapped. */
+static bool segment_mapped = false;
+
+/* Per-connection handle. */
+struct shmcache_handle {
+  uint64_t size;                /* Size of the underlying image. */
+  uint64_t key;                 /* Key identifying the image. */
+};
+
+static void
+shmcache_unload (void)
+{
+  struct segment_stats stats;
+
+  if (segment_mapped) {
+    segment_get_stats (&stats);
+    nbdkit_debug ("shmcache: %" PRIu64 " slots, "
+                  "%" PRIu64 " hits, %" PRIu64 " misses, "
+                  "%" PRIu64 " inserts, %" PRIu64 " evictions",
+                  stats.nr_slots, stats.hits, stats.misses,
+                  stats.inserts, stats.evictions);
+  }
+  segment_close ();
+  free (segment_file);
+  free (image_key);
+}
+
+static int
+shmcache_config (nbdkit_next_config *next, void *nxdata,
+                 const char *key, const char *value)
+{
+  int64_t r;
+
+  if (strcmp (key, "shmcache-file") == 0) {
+    free (segment_file);
+    segment_file = nbdkit_absolute_path (value);
+    if (segment_file == NULL)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "shmcache-size") == 0) {
+    r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    /* Round up to a multiple of the huge page size so the segment
+     * can be placed on hugetlbfs.
+     */
+    segment_size = ROUND_UP (r, 2 * 1024 * 1024);
+    return 0;
+  }
+  else if (strcmp (key, "shmcache-key") == 0) {
+    free (image_key);
+    image_key = strdup (value);
+    if (image_key == NULL) {
+      nbdkit_error ("strdup: %m");
+      return -1;
+    }
+    return 0;
+  }
+  else {
+    return next (nxdata, key, value);
+  }
+}
+
+static int
+shmcache_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+{
+  if (image_key == NULL) {
+    nbdkit_error ("you must supply the shmcache-key=<ID> parameter "
+                  "identifying the base image");
+    return -1;
+  }
+  if (segment_file == NULL) {
+    segment_file = strdup ("/dev/shm/nbdkit-shmcache");
+    if (segment_file == NULL) {
+      nbdkit_error ("strdup: %m");
+      return -1;
+    }
+  }
+
+  return next (nxdata);
+}
+
+#define shmcache_config_help \
+  "shmcache-key=<ID>      (required) Identity of the base image.\n" \
+  "shmcache-file=<FILE>   Shared segment (default /dev/shm/nbdkit-shmcache).\n" \
+  "shmcache-size=<SIZE>   Size of the segment when it is created."
+
+static int
+shmcache_get_ready (nbdkit_next_get_ready *next, void *nxdata)
+{
+  if (segment_open (segment_file, segment_size) == -1)
+    return -1;
+  segment_mapped = true;
+
+  return next (nxdata);
+}
+
+static void *
+shmcache_open (nbdkit_next_open *next, void *nxdata, int readonly)
+{
+  struct shmcache_handle *h;
+
+  /* Cached blocks are shared with other processes, so the image must
+   * not change underneath them.  Always open the plugin read-only.
+   */
+  if (next (nxdata, 1) == -1)
+    return NULL;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("calloc: %m");
+    return NULL;
+  }
+  return h;
+}
+
+static void
+shmcache_close (void *handle)
+{
+  free (handle);
+}
+
+/* FNV-1a hash of the image key. */
+static uint64_t
+hash_key (const char *s, uint64_t size)
+{
+  uint64_t h = UINT64_C(0xcbf29ce484222325);
+
+  for (; *s; ++s) {
+    h ^= (unsigned char) *s;
+    h *= UINT64_C(0x100000001b3);
+  }
+
+  /* Images with the same key but a different size are different
+   * images.  0 is reserved for empty slots.
+   */
+  h ^= size * UINT64_C(0x9e3779b97f4a7c15);
+  return h ? h : 1;
+}
+
+static int
+shmcache_prepare (struct nbdkit_next_ops *next_ops, void *nxdata,
+                  void *handle, int readonly)
+{
+  struct shmcache_handle *h = handle;
+  int64_t size;
+
+  size = next_ops->get_size (nxdata);
+  if (size == -1)
+    return -1;
+
+  h->size = size;
+  h->key = hash_key (image_key, size);
+  return 0;
+}
+
+static int
+shmcache_can_write (struct nbdkit_next_ops *next_ops, void *nxdata,
+                    void *handle)
+{
+  return 0;
+}
+
+static int
+shmcache_can_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
+                    void *handle)
+{
+  return NBDKIT_CACHE_NATIVE;
+}
+
+/* Read whole blocks, from the shared cache where possible.  Runs of
+ * blocks which are not in the cache are read from the plugin with a
+ * single request and then added to the cache.
+ */
+static int
+read_blocks (struct nbdkit_next_ops *next_ops, void *nxdata,
+             struct shmcache_handle *h,
+             uint64_t blknum, uint64_t nrblocks, uint8_t *buf, int *err)
+{
+  uint64_t i = 0, j;
+
+  while (i < nrblocks) {
+    if (segment_lookup (h->key, blknum + i, &buf[i * BLKSIZE])) {
+      i++;
+      continue;
+    }
+
+    for (j = i + 1; j < nrblocks; ++j)
+      if (segment_lookup (h->key, blknum + j, &buf[j * BLKSIZE]))
+        break;
+
+    if (next_ops->pread (nxdata, &buf[i * BLKSIZE], (j - i) * BLKSIZE,
+                         (blknum + i) * BLKSIZE, 0, err) == -1)
+      return -1;
+    for (; i < j; ++i)
+      segment_insert (h->key, blknum + i, &buf[i * BLKSIZE]);
+
+    /* Block j (if any) was found in the cache. */
+    i = j + 1;
+  }
+
+  return 0;
+}
+
+/* Read data. */
+static int
+shmcache_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
+                void *handle, void *buf, uint32_t count, uint64_t offset,
+                uint32_t flags, int *err)
+{
+  struct shmcache_handle *h = handle;
+  CLEANUP_FREE uint8_t *block = NULL;
+  uint64_t end, blknum, blkoffs, n;
+
+  /* A partial block at the end of the image is never cached. */
+  end = ROUND_DOWN (h->size, BLKSIZE);
+
+  while (count > 0) {
+    if (offset >= end)
+      return next_ops->pread (nxdata, buf, count, offset, flags, err);
+
+    blknum = offset / BLKSIZE;
+    blkoffs = offset % BLKSIZE;
+
+    if (blkoffs || count < BLKSIZE) {
+      /* Unaligned head or tail. */
+      if (block == NULL) {
+        block = malloc (BLKSIZE);
+        if (block == NULL) {
+          *err = errno;
+          nbdkit_error ("malloc: %m");
+          return -1;
+        }
+      }
+      if (read_blocks (next_ops, nxdata, h, blknum, 1, block, err) == -1)
+        return -1;
+      n = MIN (BLKSIZE - blkoffs, count);
+      memcpy (buf, &block[blkoffs], n);
+    }
+    else {
+      /* Aligned body. */
+      n = ROUND_DOWN (MIN (count, end - offset), BLKSIZE);
+      if (read_blocks (next_ops, nxdata, h, blknum, n / BLKSIZE,
+                       buf, err) == -1)
+        return -1;
+    }
+
+    buf += n;
+    count -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+
+/* Cache requests load blocks into the shared cache, so that one
+ * client can warm the cache for every process on the host.
+ */
+static int
+shmcache_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
+                void *handle, uint32_t count, uint64_t offset,
+                uint32_t flags, int *err)
+{
+  struct shmcache_handle *h = handle;
+  CLEANUP_FREE uint8_t *buf = NULL;
+  uint64_t end, blknum, n, remaining;
+
+  assert (!flags);
+
+  end = ROUND_DOWN (h->size, BLKSIZE);
+  remaining = ROUND_UP (offset + count, BLKSIZE);
+  offset = ROUND_DOWN (offset, BLKSIZE);
+  remaining = MIN (remaining, end);
+  if (offset >= remaining)
+    return 0;
+  remaining -= offset;
+
+  buf = malloc (MIN (remaining, MAX_PREFETCH));
+  if (buf == NULL) {
+    *err = errno;
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+
+  while (remaining > 0) {
+    blknum = offset / BLKSIZE;
+    n = MIN (remaining, MAX_PREFETCH);
+    if (read_blocks (next_ops, nxdata, h, blknum, n / BLKSIZE,
+                     buf, err) == -1)
+      return -1;
+    remaining -= n;
+    offset += n;
+  }
+
+  return 0;
+}
+
+static struct nbdkit_filter filter = {
+  .name              = "shmcache",
+  .longname          = "nbdkit shared memory cache filter",
+  .unload            = shmcache_unload,
+  .config            = shmcache_config,
+  .config_complete   = shmcache_config_complete,
+  .config_help       = shmcache_config_help,
+  .get_ready         = shmcache_get_ready,
+  .open              = shmcache_open,
+  .close             = shmcache_close,
+  .prepare           = shmcache_prepare,
+  .can_write         = shmcache_can_write,
+  .can_cache         = shmcache_can_cache,
+  .pread             = shmcache_pread,
+  .cache             = shmcache_cache,
+};
+
+NBDKIT_REGISTER_FILTER(filter)
@@ -1,5 +1,5 @@
 /* nbdkit
- * Copyright (C) 2013 Red Hat Inc.
+ * Copyright (C) 2013-2020 Red Hat Inc.
  *
  * Redistribution and use in source and binary forms, with or without
  * modification, are permitted provided that the following conditions are
@@ -30,6 +30,7 @@
  * SUCH DAMAGE.
  */
 
+
 #include <config.h>
 
 #include <stdio.h>
@@ -37,43 +38,66 @@
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include <nbdkit-plugin.h>
 
+#include "cleanup.h"
+
 #include "blkcache.h"
 
-/* Implemented as a very simple LRU list with a fixed depth. */
 struct blkcache {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;          /* Signalled when a reserved block is done. */
+
   size_t maxdepth;
-  struct block *blocks;
+  uint64_t maxbytes;
+
+  /* Hash table of cached and reserved blocks.  The number of buckets
+   * is a power of 2 and is doubled when the table gets full.
+   */
+  struct block **buckets;
+  unsigned hash_bits;
+  size_t nr_entries;
+
+  /* Loaded blocks, most recently used first. */
+  struct block *lru_head, *lru_tail;
+  size_t nr_loaded;
+  uint64_t bytes;
+
   blkcache_stats stats;
 };
 
-struct block {
-  uint64_t start;
-  uint64_t size;
-  char *data;
-};
+#define INITIAL_HASH_BITS 6
+
+static inline size_t
+hash_block (const blkcache *c, uint64_t blknum)
+{
+  return (blknum * UINT64_C (0x9e3779b97f4a7c15)) >> (64 - c->hash_bits);
+}
 
 blkcache *
-new_blkcache (size_t maxdepth)
+new_blkcache (size_t maxdepth, uint64_t maxbytes)
 {
   blkcache *c;
 
-  c = malloc (sizeof *c);
+  c = calloc (1, sizeof *c);
   if (!c) {
-    nbdkit_error ("malloc: %m");
+    nbdkit_error ("calloc: %m");
     return NULL;
   }
 
-  c->blocks = calloc (maxdepth, sizeof (struct block));
-  if (!c->blocks) {
+  c->hash_bits = INITIAL_HASH_BITS;
+  c->buckets = calloc (1 << c->hash_bits, sizeof (struct block *));
+  if (!c->buckets) {
     nbdkit_error ("calloc: %m");
     free (c);
     return NULL;
   }
+  pthread_mutex_init (&c->lock, NULL);
+  pthread_cond_init (&c->cond, NULL);
   c->maxdepth = maxdepth;
-  c->stats.hits = c->stats.misses = 0;
+  c->maxbytes = maxbytes;
 
   return c;
 }
@@ -82,64 +106,252 @@ void
 free_blkcache (blkcache *c)
 {
   size_t i;
+  struct block *b, *next;
 
-  for (i = 0; i < c->maxdepth; ++i)
-    free (c->blocks[i].data);
-  free (c->blocks);
+  for (i = 0; i < (size_t) 1 << c->hash_bits; ++i) {
+    for (b = c->buckets[i]; b != NULL; b = next) {
+      next = b->hash_next;
+      free (b->data);
+      free (b);
+    }
+  }
+  free (c->buckets);
+  pthread_mutex_destroy (&c->lock);
+  pthread_cond_destroy (&c->cond);
   free (c);
 }
 
-char *
-get_block (blkcache *c, uint64_t offset, uint64_t *start, uint64_t *size)
+/* The following functions are called with the lock held. */
+
+static struct block *
+lookup (blkcache *c, uint64_t blknum)
 {
-  size_t i;
-  struct block tmp;
-
-  for (i = 0; i < c->maxdepth; ++i) {
-    if (c->blocks[i].data != NULL &&
-        c->blocks[i].start <= offset &&
-        offset < c->blocks[i].start + c->blocks[i].size) {
-      /* This block is now most recently used, so put it at the start. */
-      if (i > 0) {
-        tmp = c->blocks[0];
-        c->blocks[0] = c->blocks[i];
-        c->blocks[i] = tmp;
-      }
+  struct block *b;
 
+  for (b = c->buckets[hash_block (c, blknum)]; b != NULL; b = b->hash_next)
+    if (b->blknum == blknum)
+      return b;
+  return NULL;
+}
+
+/* Double the size of the hash table.  If this fails the table just
+ * stays at the current size.
+ */
+static void
+grow_hash (blkcache *c)
+{
+  struct block **old = c->buckets, *b, *next;
+  size_t i, n = (size_t) 1 << c->hash_bits;
+
+  c->buckets = calloc (2 * n, sizeof (struct block *));
+  if (c->buckets == NULL) {
+    c->buckets = old;
+    return;
+  }
+  c->hash_bits++;
+
+  for (i = 0; i < n; ++i) {
+    for (b = old[i]; b != NULL; b = next) {
+      size_t h = hash_block (c, b->blknum);
+
+      next = b->hash_next;
+      b->hash_next = c->buckets[h];
+      c->buckets[h] = b;
+    }
+  }
+  free (old);
+}
+
+static struct block *
+insert (blkcache *c, uint64_t blknum)
+{
+  struct block *b;
+  size_t h;
+
+  b = calloc (1, sizeof *b);
+  if (b == NULL)
+    return NULL;
+  b->blknum = blknum;
+
+  if (c->nr_entries >= (size_t) 1 << c->hash_bits)
+    grow_hash (c);
+  h = hash_block (c, blknum);
+  b->hash_next = c->buckets[h];
+  c->buckets[h] = b;
+  c->nr_entries++;
+  return b;
+}
+
+static void
+remove_hash (blkcache *c, struct block *b)
+{
+  struct block **p;
+
+  for (p = &c->buckets[hash_block (c, b->blknum)]; *p != b;
+       p = &(*p)->hash_next)
+    ;
+  *p = b->hash_next;
+  c->nr_entries--;
+}
+
+static void
+lru_unlink (blkcache *c, struct block *b)
+{
+  if (b->lru_prev)
+    b->lru_prev->lru_next = b->lru_next;
+  else
+    c->lru_head = b->lru_next;
+  if (b->lru_next)
+    b->lru_next->lru_prev = b->lru_prev;
+  else
+    c->lru_tail = b->lru_prev;
+}
+
+static void
+lru_push_front (blkcache *c, struct block *b)
+{
+  b->lru_prev = NULL;
+  b->lru_next = c->lru_head;
+  if (c->lru_head)
+    c->lru_head->lru_prev = b;
+  else
+    c->lru_tail = b;
+  c->lru_head = b;
+}
+
+/* Eject least recently used blocks until the cache is within its
+ * limits.  Blocks which are in use are skipped.
+ */
+static void
+evict (blkcache *c)
+{
+  struct block *b, *prev;
+
+  for (b = c->lru_tail;
+       b != NULL &&
+         (c->nr_loaded > c->maxdepth ||
+          (c->maxbytes > 0 && c->bytes > c->maxbytes));
+       b = prev) {
+    prev = b->lru_prev;
+    if (b->refs > 0)
+      continue;
+
+    lru_unlink (c, b);
+    remove_hash (c, b);
+    c->nr_loaded--;
+    c->bytes -= b->size;
+    c->stats.evictions++;
+    free (b->data);
+    free (b);
+  }
+}
+
+struct block *
+get_block (blkcache *c, uint64_t blknum)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+  struct block *b;
+
+  for (;;) {
+    b = lookup (c, blknum);
+    if (b == NULL) {
+      /* If this fails the caller can still load the block, but other
+       * threads won't wait for it.
+       */
+      insert (c, blknum);
+      c->stats.misses++;
+      return NULL;
+    }
+    if (b->data != NULL) {
       c->stats.hits++;
-      *start = c->blocks[0].start;
-      *size = c->blocks[0].size;
-      return c->blocks[0].data;
+      b->refs++;
+      lru_unlink (c, b);
+      lru_push_front (c, b);
+      return b;
     }
+
+    /* Another thread is loading the block. */
+    pthread_cond_wait (&c->cond, &c->lock);
   }
+}
 
-  c->stats.misses++;
-  return NULL;
+bool
+reserve_block (blkcache *c, uint64_t blknum)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+
+  if (lookup (c, blknum) != NULL)
+    return false;
+  return insert (c, blknum) != NULL;
 }
 
-int
-put_block (blkcache *c, uint64_t start, uint64_t size, char *data)
+struct block *
+put_block (blkcache *c, uint64_t blknum,
+           uint64_t start, uint64_t size, char *data)
 {
-  size_t i;
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+  struct block *b;
+
+  b = lookup (c, blknum);
+  if (b != NULL && b->data != NULL) {
+    /* If inserting the reservation failed in get_block, another
+     * thread may have loaded the same block in the meantime.  Use its
+     * copy, which is already linked into the LRU list.
+     */
+    free (data);
+    b->refs++;
+    lru_unlink (c, b);
+    lru_push_front (c, b);
+    return b;
+  }
+  if (b == NULL) {
+    b = insert (c, blknum);
+    if (b == NULL) {
+      nbdkit_error ("calloc: %m");
+      free (data);
+      return NULL;
+    }
+  }
 
-  /* Eject the least recently used block. */
-  i = c->maxdepth-1;
-  if (c->blocks[i].data != NULL)
-    free (c->blocks[i].data);
+  b->start = start;
+  b->size = size;
+  b->data = data;
+  b->refs = 1;
+  lru_push_front (c, b);
+  c->nr_loaded++;
+  c->bytes += size;
+  pthread_cond_broadcast (&c->cond);
 
-  for (; i >= 1; --i)
-    c->blocks[i] = c->blocks[i-1];
+  evict (c);
+  return b;
+}
 
-  /* The new block is most recently used, so it goes at the start. */
-  c->blocks[0].start = start;
-  c->blocks[0].size = size;
-  c->blocks[0].data = data;
+void
+abandon_block (blkcache *c, uint64_t blknum)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
+  struct block *b;
+
+  b = lookup (c, blknum);
+  if (b != NULL && b->data == NULL) {
+    remove_hash (c, b);
+    free (b);
+  }
+  pthread_cond_broadcast (&c->cond);
+}
+
+void
+release_block (blkcache *c, struct block *b)
+{
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
 
-  return 0;
+  if (--b->refs == 0)
+    evict (c);
 }
 
 void
 blkcache_get_stats (blkcache *c, blkcache_stats *ret)
 {
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&c->lock);
   memcpy (ret, &c->stats, sizeof (c->stats));
 }
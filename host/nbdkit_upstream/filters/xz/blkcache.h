@@ -1,5 +1,5 @@
 /* nbdkit
- * Copyright (C) 2013 Red Hat Inc.
+ * Copyright (C) 2013-2020 Red Hat Inc.
  *
  * Redistribution and use in source and binary forms, with or without
  * modification, are permitted provided that the following conditions are
@@ -33,21 +33,78 @@
 #ifndef NBDKIT_BLKCACHE_H
 #define NBDKIT_BLKCACHE_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Cache of uncompressed blocks.  This is a hash table of blocks,
+ * indexed by block number, with an LRU list used to keep the total
+ * size of the blocks under a limit.  It is thread-safe.
+ *
+ * A block which is not cached can be reserved by one thread while it
+ * decompresses the block.  Other threads looking for the same block
+ * wait until it is added with put_block or the reservation is dropped
+ * with abandon_block.
+ */
+
 typedef struct blkcache blkcache;
 
+struct block {
+  uint64_t blknum;              /* Block number in the xz file. */
+  uint64_t start;               /* Uncompressed offset of the block. */
+  uint64_t size;                /* Uncompressed size of the block. */
+  char *data;                   /* NULL if reserved but not loaded. */
+
+  /* The rest are private to blkcache.c. */
+  unsigned refs;
+  struct block *hash_next;
+  struct block *lru_prev, *lru_next;
+};
+
 typedef struct blkcache_stats {
   size_t hits;
   size_t misses;
+  size_t evictions;
 } blkcache_stats;
 
-extern blkcache *new_blkcache (size_t maxdepth);
+/* Create a cache holding at most maxdepth blocks, and if maxbytes is
+ * not 0, at most maxbytes bytes of uncompressed data.
+ */
+extern blkcache *new_blkcache (size_t maxdepth, uint64_t maxbytes);
 extern void free_blkcache (blkcache *) __attribute__((__nonnull__ (1)));
-extern char *get_block (blkcache *, uint64_t offset,
-                        uint64_t *start, uint64_t *size)
-  __attribute__((__nonnull__ (1, 3, 4)));
-extern int put_block (blkcache *, uint64_t start, uint64_t size, char *data)
-  __attribute__((__nonnull__ (1, 4)));
+
+/* Look up a block, waiting if another thread has reserved it.  If the
+ * block is cached it is returned with a reference held, which must
+ * be dropped with release_block.  If not, the block is reserved for
+ * the caller and NULL is returned.  The caller must then call
+ * put_block or abandon_block.
+ */
+extern struct block *get_block (blkcache *, uint64_t blknum)
+  __attribute__((__nonnull__ (1)));
+
+/* Reserve a block without waiting.  Returns false if the block is
+ * already cached or reserved.
+ */
+extern bool reserve_block (blkcache *, uint64_t blknum)
+  __attribute__((__nonnull__ (1)));
+
+/* Add the data for a block reserved by the caller.  The cache takes
+ * ownership of data.  The block is returned with a reference held.
+ * If the block was loaded by another thread meanwhile, data is freed
+ * and the cached block is returned.  On error data is freed and NULL
+ * is returned.
+ */
+extern struct block *put_block (blkcache *, uint64_t blknum,
+                                uint64_t start, uint64_t size, char *data)
+  __attribute__((__nonnull__ (1, 5)));
+
+/* Drop the reservation on a block after failing to load it. */
+extern void abandon_block (blkcache *, uint64_t blknum)
+  __attribute__((__nonnull__ (1)));
+
+extern void release_block (blkcache *, struct block *)
+  __attribute__((__nonnull__ (1, 2)));
+
 extern void blkcache_get_stats (blkcache *, blkcache_stats *ret)
   __attribute__((__nonnull__ (1, 2)));
 
-#endif /* NBDKIT_XZFILE_H */
+#endif /* NBDKIT_BLKCACHE_H */
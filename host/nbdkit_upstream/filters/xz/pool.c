@@ -0,0 +1,166 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <nbdkit-filter.h>
+
+#include "pool.h"
+
+struct job {
+  void (*fn) (void *);
+  void *arg;
+  struct job *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct job *queue_head, *queue_tail;
+static bool started, stopping;
+static unsigned nr_threads;     /* Number of threads requested. */
+static unsigned nr_running;     /* Number of threads actually started. */
+static pthread_t *threads;
+
+void
+pool_set_threads (unsigned n)
+{
+  nr_threads = n;
+}
+
+static void *
+worker (void *vp)
+{
+  struct job *job;
+
+  pthread_mutex_lock (&lock);
+  for (;;) {
+    while (queue_head == NULL && !stopping)
+      pthread_cond_wait (&cond, &lock);
+    job = queue_head;
+    if (job == NULL)
+      break;
+    queue_head = job->next;
+    if (queue_head == NULL)
+      queue_tail = NULL;
+    pthread_mutex_unlock (&lock);
+
+    job->fn (job->arg);
+    free (job);
+
+    pthread_mutex_lock (&lock);
+  }
+  pthread_mutex_unlock (&lock);
+  return NULL;
+}
+
+/* Called with the lock held.  If threads cannot be created we carry
+ * on with fewer, or none.
+ */
+static void
+start_threads (void)
+{
+  int err;
+
+  started = true;
+  if (nr_threads == 0)
+    return;
+
+  threads = calloc (nr_threads, sizeof (pthread_t));
+  if (threads == NULL) {
+    nbdkit_debug ("xz: calloc: %m");
+    return;
+  }
+  for (nr_running = 0; nr_running < nr_threads; ++nr_running) {
+    err = pthread_create (&threads[nr_running], NULL, worker, NULL);
+    if (err != 0) {
+      errno = err;
+      nbdkit_debug ("xz: pthread_create: %m");
+      break;
+    }
+  }
+  nbdkit_debug ("xz: started %u decompression threads", nr_running);
+}
+
+void
+pool_submit (void (*fn) (void *), void *arg)
+{
+  struct job *job;
+
+  pthread_mutex_lock (&lock);
+  if (!started)
+    start_threads ();
+  if (nr_running == 0 || stopping)
+    goto run_now;
+
+  job = malloc (sizeof *job);
+  if (job == NULL)
+    goto run_now;
+  job->fn = fn;
+  job->arg = arg;
+  job->next = NULL;
+  if (queue_tail)
+    queue_tail->next = job;
+  else
+    queue_head = job;
+  queue_tail = job;
+  pthread_cond_signal (&cond);
+  pthread_mutex_unlock (&lock);
+  return;
+
+ run_now:
+  pthread_mutex_unlock (&lock);
+  fn (arg);
+}
+
+void
+pool_stop (void)
+{
+  unsigned i;
+
+  pthread_mutex_lock (&lock);
+  stopping = true;
+  pthread_cond_broadcast (&cond);
+  pthread_mutex_unlock (&lock);
+
+  for (i = 0; i < nr_running; ++i)
+    pthread_join (threads[i], NULL);
+  free (threads);
+  threads = NULL;
+  nr_running = 0;
+}
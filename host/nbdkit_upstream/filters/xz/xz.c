@@ -35,21 +35,44 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <lzma.h>
 
 #include <nbdkit-filter.h>
 
+#include "cleanup.h"
+
 #include "xzfile.h"
 #include "blkcache.h"
+#include "pool.h"
 
 static uint64_t maxblock = 512 * 1024 * 1024;
 static uint32_t maxdepth = 8;
+static bool maxdepth_set = false;
+static uint64_t maxcache = 0;
+static unsigned prefetch = 2;
+static unsigned nr_threads;
+
+static void
+xz_load (void)
+{
+  long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+  nr_threads = n >= 1 ? n : 1;
+}
+
+static void
+xz_unload (void)
+{
+  pool_stop ();
+}
 
 static int
 xz_config (nbdkit_next_config *next, void *nxdata,
@@ -69,15 +92,49 @@ xz_config (nbdkit_next_config *next, void *nxdata,
       nbdkit_error ("'xz-max-depth' parameter must be >= 1");
       return -1;
     }
+    maxdepth_set = true;
+    return 0;
+  }
+  else if (strcmp (key, "xz-max-cache") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    maxcache = (uint64_t) r;
+    return 0;
+  }
+  else if (strcmp (key, "xz-prefetch") == 0) {
+    if (nbdkit_parse_unsigned ("xz-prefetch", value, &prefetch) == -1)
+      return -1;
+    return 0;
+  }
+  else if (strcmp (key, "xz-threads") == 0) {
+    if (nbdkit_parse_unsigned ("xz-threads", value, &nr_threads) == -1)
+      return -1;
     return 0;
   }
   else
     return next (nxdata, key, value);
 }
 
+static int
+xz_config_complete (nbdkit_next_config_complete *next, void *nxdata)
+{
+  /* If the cache is limited by size, only limit the number of blocks
+   * if asked to.
+   */
+  if (maxcache > 0 && !maxdepth_set)
+    maxdepth = UINT32_MAX;
+  pool_set_threads (nr_threads);
+
+  return next (nxdata);
+}
+
 #define xz_config_help \
   "xz-max-block=<SIZE> (optional) Maximum block size allowed (default: 512M)\n"\
-  "xz-max-depth=<N>    (optional) Maximum blocks in cache (default: 4)\n"
+  "xz-max-depth=<N>    (optional) Maximum blocks in cache (default: 8)\n" \
+  "xz-max-cache=<SIZE> (optional) Maximum size of cached blocks\n" \
+  "xz-prefetch=<N>     (optional) Blocks to read ahead (default: 2)\n" \
+  "xz-threads=<N>      (optional) Decompression threads (default: nr CPUs)\n"
 
 /* The per-connection handle. */
 struct xz_handle {
@@ -85,6 +142,16 @@ struct xz_handle {
 
   /* Block cache. */
   blkcache *c;
+
+  /* Number of blocks being uncompressed in the background. */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  unsigned pending;
+
+  /* Last block read, used to detect sequential access.  Accessed
+   * atomically.
+   */
+  uint64_t last_blknum;
 };
 
 /* Create the per-connection handle. */
@@ -103,11 +170,15 @@ xz_open (nbdkit_next_open *next, void *nxdata, int readonly)
     return NULL;
   }
 
-  h->c = new_blkcache (maxdepth);
+  h->c = new_blkcache (maxdepth, maxcache);
   if (!h->c) {
     free (h);
     return NULL;
   }
+  pthread_mutex_init (&h->lock, NULL);
+  pthread_cond_init (&h->cond, NULL);
+  h->pending = 0;
+  h->last_blknum = UINT64_MAX;
 
   /* Initialized in xz_prepare. */
   h->xz = NULL;
@@ -122,11 +193,20 @@ xz_close (void *handle)
   struct xz_handle *h = handle;
   blkcache_stats stats;
 
+  /* Wait for background jobs which refer to this handle. */
+  pthread_mutex_lock (&h->lock);
+  while (h->pending > 0)
+    pthread_cond_wait (&h->cond, &h->lock);
+  pthread_mutex_unlock (&h->lock);
+
   blkcache_get_stats (h->c, &stats);
-  nbdkit_debug ("cache: hits = %zu, misses = %zu", stats.hits, stats.misses);
+  nbdkit_debug ("cache: hits = %zu, misses = %zu, evictions = %zu",
+                stats.hits, stats.misses, stats.evictions);
 
   xzfile_close (h->xz);
   free_blkcache (h->c);
+  pthread_mutex_destroy (&h->lock);
+  pthread_cond_destroy (&h->cond);
   free (h);
 }
 
@@ -198,6 +278,130 @@ xz_can_cache (struct nbdkit_next_ops *next_ops, void *nxdata,
   return NBDKIT_CACHE_EMULATE;
 }
 
+/* Read and uncompress a block which the caller has reserved in the
+ * cache.  Returns the block with a reference held.
+ */
+static struct block *
+load_block (struct xz_handle *h,
+            struct nbdkit_next_ops *next_ops, void *nxdata,
+            const struct xzblock *blk, int *err)
+{
+  CLEANUP_FREE unsigned char *compressed = NULL;
+  char *data;
+  struct block *b;
+
+  compressed = xzfile_read_compressed (next_ops, nxdata, blk, err);
+  if (compressed == NULL) {
+    abandon_block (h->c, blk->number);
+    return NULL;
+  }
+  data = xzfile_decompress_block (blk, compressed);
+  if (data == NULL) {
+    abandon_block (h->c, blk->number);
+    *err = EIO;
+    return NULL;
+  }
+  b = put_block (h->c, blk->number, blk->start, blk->size, data);
+  if (b == NULL)
+    *err = ENOMEM;
+  return b;
+}
+
+/* Blocks are uncompressed in the background by the thread pool.
+ * Reading the compressed data uses next_ops, which can only be used
+ * from the connection's own threads, so that part is done before the
+ * job is queued.
+ */
+struct job {
+  struct xz_handle *h;
+  struct xzblock blk;
+  unsigned char *compressed;
+};
+
+static void
+decompress_job (void *vp)
+{
+  struct job *job = vp;
+  struct xz_handle *h = job->h;
+  struct block *b;
+  char *data;
+
+  data = xzfile_decompress_block (&job->blk, job->compressed);
+  if (data == NULL)
+    abandon_block (h->c, job->blk.number);
+  else {
+    b = put_block (h->c, job->blk.number, job->blk.start, job->blk.size,
+                   data);
+    if (b)
+      release_block (h->c, b);
+  }
+  free (job->compressed);
+  free (job);
+
+  pthread_mutex_lock (&h->lock);
+  if (--h->pending == 0)
+    pthread_cond_broadcast (&h->cond);
+  pthread_mutex_unlock (&h->lock);
+}
+
+/* Start loading a block in the background, unless it is already
+ * cached or being loaded.  Errors are ignored since the block will
+ * be read again when it is needed.
+ */
+static void
+start_load (struct xz_handle *h,
+            struct nbdkit_next_ops *next_ops, void *nxdata,
+            const struct xzblock *blk)
+{
+  struct job *job;
+  int err;
+
+  if (!reserve_block (h->c, blk->number))
+    return;
+
+  job = malloc (sizeof *job);
+  if (job == NULL) {
+    abandon_block (h->c, blk->number);
+    return;
+  }
+  job->h = h;
+  job->blk = *blk;
+  job->compressed = xzfile_read_compressed (next_ops, nxdata, blk, &err);
+  if (job->compressed == NULL) {
+    abandon_block (h->c, blk->number);
+    free (job);
+    return;
+  }
+
+  pthread_mutex_lock (&h->lock);
+  h->pending++;
+  pthread_mutex_unlock (&h->lock);
+  pool_submit (decompress_job, job);
+}
+
+/* Read-ahead starts after the reply has been sent, so that the
+ * client does not wait while the compressed data is read.  This
+ * still runs in the connection thread, so next_ops can be used.
+ */
+struct readahead {
+  struct xz_handle *h;
+  struct nbdkit_next_ops *next_ops;
+  void *nxdata;
+  unsigned nr_blks;
+  struct xzblock blks[];
+};
+
+static void
+readahead_after_reply (void *vp)
+{
+  struct readahead *ra = vp;
+  unsigned i;
+
+  for (i = 0; i < ra->nr_blks; ++i)
+    start_load (ra->h, ra->next_ops, ra->nxdata, &ra->blks[i]);
+  free (ra);
+}
+
 /* Read data from the file. */
 static int
 xz_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
@@ -205,48 +409,102 @@ xz_pread (struct nbdkit_next_ops *next_ops, void *nxdata,
           uint32_t flags, int *err)
 {
   struct xz_handle *h = handle;
-  char *data;
-  uint64_t start, size;
+  uint64_t size = xzfile_get_size (h->xz);
+  struct xzblock blk;
+  struct block *b;
+  struct readahead *ra;
+  uint64_t prev, o;
   uint32_t n;
 
-  /* Find the block in the cache. */
-  data = get_block (h->c, offset, &start, &size);
-  if (!data) {
-    /* Not in the cache.  We need to read the block from the xz file. */
-    data = xzfile_read_block (h->xz, next_ops, nxdata, flags, err,
-                              offset, &start, &size);
-    if (data == NULL)
-      return -1;
-    put_block (h->c, start, size, data);
+  if (xzfile_locate_block (h->xz, offset, &blk) == -1) {
+    nbdkit_error ("cannot find offset %" PRIu64 " in the xz file", offset);
+    *err = EIO;
+    return -1;
   }
 
-  /* It's possible if the blocks are really small or oddly aligned or
-   * if the requests are large that we need to read the following
-   * block to satisfy the request.
+  /* If the request spans several blocks, start uncompressing the
+   * later blocks in the background while we do the first one.
    */
-  n = count;
-  if (start + size - offset < n)
-    n = start + size - offset;
+  if (nr_threads > 0) {
+    struct xzblock next = blk;
+
+    for (o = blk.start + blk.size; o < offset + count;
+         o = next.start + next.size) {
+      if (xzfile_locate_block (h->xz, o, &next) == -1)
+        break;
+      start_load (h, next_ops, nxdata, &next);
+    }
+  }
+
+  for (;;) {
+    b = get_block (h->c, blk.number);
+    if (b == NULL) {
+      /* Not in the cache.  We need to read the block from the xz file. */
+      b = load_block (h, next_ops, nxdata, &blk, err);
+      if (b == NULL)
+        return -1;
+    }
+
+    /* It's possible if the blocks are really small or oddly aligned or
+     * if the requests are large that we need to read the following
+     * block to satisfy the request.
+     */
+    n = count;
+    if (b->start + b->size - offset < n)
+      n = b->start + b->size - offset;
+
+    memcpy (buf, &b->data[offset - b->start], n);
+    release_block (h->c, b);
+    buf += n;
+    count -= n;
+    offset += n;
+    if (count == 0)
+      break;
+
+    if (xzfile_locate_block (h->xz, offset, &blk) == -1) {
+      nbdkit_error ("cannot find offset %" PRIu64 " in the xz file", offset);
+      *err = EIO;
+      return -1;
+    }
+  }
 
-  memcpy (buf, &data[offset-start], n);
-  buf += n;
-  count -= n;
-  offset += n;
-  if (count > 0)
-    return xz_pread (next_ops, nxdata, h, buf, count, offset, flags, err);
+  /* On sequential access, read ahead the following blocks. */
+  prev = __atomic_exchange_n (&h->last_blknum, blk.number, __ATOMIC_RELAXED);
+  if (nr_threads > 0 && prefetch > 0 &&
+      (blk.number == prev || blk.number == prev + 1)) {
+    ra = malloc (sizeof *ra + prefetch * sizeof (struct xzblock));
+    if (ra == NULL)
+      return 0;                 /* Read-ahead is optional. */
+    ra->h = h;
+    ra->next_ops = next_ops;
+    ra->nxdata = nxdata;
+    ra->nr_blks = 0;
+    for (o = blk.start + blk.size; ra->nr_blks < prefetch && o < size;
+         o = blk.start + blk.size) {
+      if (xzfile_locate_block (h->xz, o, &blk) == -1)
+        break;
+      ra->blks[ra->nr_blks++] = blk;
+    }
+    if (ra->nr_blks == 0 ||
+        nbdkit_after_reply (readahead_after_reply, ra) == -1)
+      free (ra);
+  }
 
   return 0;
 }
 
 static int xz_thread_model (void)
 {
-  return NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS;
+  return NBDKIT_THREAD_MODEL_PARALLEL;
 }
 
 static struct nbdkit_filter filter = {
   .name              = "xz",
   .longname          = "nbdkit XZ filter",
+  .load              = xz_load,
+  .unload            = xz_unload,
   .config            = xz_config,
+  .config_complete   = xz_config_complete,
   .config_help       = xz_config_help,
   .thread_model      = xz_thread_model,
   .open              = xz_open,
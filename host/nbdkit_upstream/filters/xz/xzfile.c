@@ -1,5 +1,5 @@
 /* nbdkit
- * Copyright (C) 2013 Red Hat Inc.
+ * Copyright (C) 2013-2020 Red Hat Inc.
  *
  * Redistribution and use in source and binary forms, with or without
  * modification, are permitted provided that the following conditions are
@@ -42,14 +42,13 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/types.h>
 
 #include <nbdkit-filter.h>
 
 #include <lzma.h>
 
-#include "cleanup.h"
-
 #include "xzfile.h"
 
 #define XZ_HEADER_MAGIC     "\xfd" "7zXZ\0"
@@ -347,78 +346,91 @@ xzfile_get_size (xzfile *xz)
   return lzma_index_uncompressed_size (xz->idx);
 }
 
-char *
-xzfile_read_block (xzfile *xz,
-                   struct nbdkit_next_ops *next_ops,
-                   void *nxdata, uint32_t flags, int *err,
-                   uint64_t offset,
-                   uint64_t *start_rtn, uint64_t *size_rtn)
+int
+xzfile_locate_block (xzfile *xz, uint64_t offset, struct xzblock *blk)
 {
-  int64_t offs, size;
   lzma_index_iter iter;
-  uint8_t header[LZMA_BLOCK_HEADER_SIZE_MAX];
-  lzma_block block;
-  lzma_filter filters[LZMA_FILTERS_MAX + 1];
-  lzma_ret r;
-  lzma_stream strm = LZMA_STREAM_INIT;
-  const size_t bufsize = 1024 * 1024;
-  CLEANUP_FREE unsigned char *buf = NULL;
-  char *data = NULL;
-  size_t i;
 
-  /* Read the total size of the underlying disk, so we don't
-   * read over the end.
+  /* lzma_index_iter_locate only reads the index, so it is safe to
+   * call this from several threads at once.
    */
-  size = next_ops->get_size (nxdata);
-  if (size == -1) {
-    nbdkit_error ("xz: get_size: %m");
-    return NULL;
-  }
-
-  /* Locate the block containing the uncompressed offset. */
   lzma_index_iter_init (&iter, xz->idx);
-  if (lzma_index_iter_locate (&iter, offset)) {
-    nbdkit_error ("cannot find offset %" PRIu64 " in the xz file", offset);
-    return NULL;
-  }
+  if (lzma_index_iter_locate (&iter, offset))
+    return -1;
+
+  blk->number = iter.block.number_in_file;
+  blk->start = iter.block.uncompressed_file_offset;
+  blk->size = iter.block.uncompressed_size;
+  blk->compressed_offset = iter.block.compressed_file_offset;
+  blk->compressed_size = iter.block.total_size;
+  blk->unpadded_size = iter.block.unpadded_size;
+  blk->check = iter.stream.flags->check;
+  return 0;
+}
 
-  *start_rtn = iter.block.uncompressed_file_offset;
-  *size_rtn = iter.block.uncompressed_size;
+unsigned char *
+xzfile_read_compressed (struct nbdkit_next_ops *next_ops, void *nxdata,
+                        const struct xzblock *blk, int *err)
+{
+  const uint64_t bufsize = 1024 * 1024;
+  unsigned char *buf;
+  uint64_t n, done;
 
-  nbdkit_debug ("seek: block number %d at file offset %" PRIu64,
-                (int) iter.block.number_in_file,
-                (uint64_t) iter.block.compressed_file_offset);
+  nbdkit_debug ("seek: block number %" PRIu64 " at file offset %" PRIu64,
+                blk->number, blk->compressed_offset);
 
-  /* Read the block header.  Start by reading a single byte which
-   * tell us how big the block header is.
-   */
-  offs = iter.block.compressed_file_offset;
-  if (next_ops->pread (nxdata, header, 1, offs, 0, err) == -1) {
-    nbdkit_error ("xz: read: could not read block header byte: error %d", *err);
+  buf = malloc (blk->compressed_size);
+  if (buf == NULL) {
+    *err = errno;
+    nbdkit_error ("malloc (%" PRIu64 " bytes): %m\n"
+                  "NOTE: If this error occurs, you need to recompress your "
+                  "xz files with a smaller block size.  "
+                  "Use: 'xz --block-size=16777216 ...'.",
+                  blk->compressed_size);
     return NULL;
   }
-  offs++;
 
-  if (header[0] == '\0') {
+  for (done = 0; done < blk->compressed_size; done += n) {
+    n = blk->compressed_size - done;
+    if (n > bufsize)
+      n = bufsize;
+    if (next_ops->pread (nxdata, buf + done, n,
+                         blk->compressed_offset + done, 0, err) == -1) {
+      nbdkit_error ("xz: read: error %d", *err);
+      free (buf);
+      return NULL;
+    }
+  }
+
+  return buf;
+}
+
+char *
+xzfile_decompress_block (const struct xzblock *blk,
+                         const unsigned char *compressed)
+{
+  lzma_block block;
+  lzma_filter filters[LZMA_FILTERS_MAX + 1];
+  lzma_ret r;
+  size_t in_pos, out_pos;
+  char *data = NULL;
+  size_t i;
+
+  if (compressed[0] == '\0') {
     nbdkit_error ("xz: read: unexpected invalid block in file, header[0] = 0");
     return NULL;
   }
 
   block.version = 0;
-  block.check = iter.stream.flags->check;
+  block.check = blk->check;
   block.filters = filters;
-  block.header_size = lzma_block_header_size_decode (header[0]);
-
-  /* Now read and decode the block header. */
-  if (next_ops->pread (nxdata, &header[1], block.header_size-1, offs,
-                       0, err) == -1) {
-    nbdkit_error ("xz: read: could not read block of compressed data: "
-                  "error %d", *err);
+  block.header_size = lzma_block_header_size_decode (compressed[0]);
+  if (block.header_size > blk->compressed_size) {
+    nbdkit_error ("xz: read: block header is larger than the block");
     return NULL;
   }
-  offs += block.header_size - 1;
 
-  r = lzma_block_header_decode (&block, NULL, header);
+  r = lzma_block_header_decode (&block, NULL, compressed);
   if (r != LZMA_OK) {
     nbdkit_error ("invalid block header (error %d)", r);
     return NULL;
@@ -427,76 +439,36 @@ xzfile_read_block (xzfile *xz,
   /* What this actually does is it checks that the block header
    * matches the index.
    */
-  r = lzma_block_compressed_size (&block, iter.block.unpadded_size);
+  r = lzma_block_compressed_size (&block, blk->unpadded_size);
   if (r != LZMA_OK) {
     nbdkit_error ("cannot calculate compressed size (error %d)", r);
-    goto err1;
-  }
-
-  /* Read the block data. */
-  r = lzma_block_decoder (&strm, &block);
-  if (r != LZMA_OK) {
-    nbdkit_error ("invalid block (error %d)", r);
-    goto err1;
+    goto err;
   }
 
-  data = malloc (*size_rtn);
+  data = malloc (blk->size);
   if (data == NULL) {
     nbdkit_error ("malloc (%" PRIu64 " bytes): %m\n"
                   "NOTE: If this error occurs, you need to recompress your "
                   "xz files with a smaller block size.  "
                   "Use: 'xz --block-size=16777216 ...'.",
-                  *size_rtn);
-    goto err2;
-  }
-
-  buf = malloc (bufsize);
-  if (buf == NULL) {
-    nbdkit_error ("malloc: %m");
-    goto err2;
+                  blk->size);
+    goto err;
   }
 
-  strm.next_in = NULL;
-  strm.avail_in = 0;
-  strm.next_out = (uint8_t *) data;
-  strm.avail_out = block.uncompressed_size;
-  do {
-    if (strm.avail_in == 0) {
-      strm.avail_in = bufsize;
-      if (offs + strm.avail_in > size)
-        strm.avail_in = size - offs;
-      if (strm.avail_in > 0) {
-        strm.next_in = buf;
-        if (next_ops->pread (nxdata, buf, strm.avail_in, offs, 0, err) == -1) {
-          nbdkit_error ("xz: read: error %d", *err);
-          goto err2;
-        }
-        offs += strm.avail_in;
-      }
-    }
-
-    r = lzma_code (&strm, LZMA_RUN);
-  } while (r == LZMA_OK);
-
-  if (r != LZMA_OK && r != LZMA_STREAM_END) {
+  in_pos = block.header_size;
+  out_pos = 0;
+  r = lzma_block_buffer_decode (&block, NULL,
+                                compressed, &in_pos, blk->compressed_size,
+                                (uint8_t *) data, &out_pos, blk->size);
+  if (r != LZMA_OK || out_pos != blk->size) {
     nbdkit_error ("could not parse block data (error %d)", r);
-    goto err2;
+    free (data);
+    data = NULL;
   }
 
-  lzma_end (&strm);
-
+ err:
   for (i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i)
     free (filters[i].options);
 
   return data;
-
- err2:
-  lzma_end (&strm);
- err1:
-  for (i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i)
-    free (filters[i].options);
-
-  free (data);
-
-  return NULL;
 }
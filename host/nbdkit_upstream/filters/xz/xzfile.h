@@ -35,6 +35,10 @@
 #ifndef NBDKIT_XZFILE_H
 #define NBDKIT_XZFILE_H
 
+#include <stdint.h>
+
+#include <lzma.h>
+
 #include <nbdkit-filter.h>
 
 typedef struct xzfile xzfile;
@@ -51,20 +55,37 @@ extern uint64_t xzfile_max_uncompressed_block_size (xzfile *);
 /* Get the total uncompressed size of the file. */
 extern uint64_t xzfile_get_size (xzfile *);
 
-/* Read the xz file block that contains the byte at 'offset' in the
- * uncompressed file.
- *
- * The uncompressed block of data, which probably begins before the
- * requested byte and ends after it, is returned.  The caller must
- * free it.  NULL is returned if there was an error.
- *
- * The start offset & size of the block relative to the uncompressed
- * file are returned in *start and *size.
+/* Location of an xz block, found with xzfile_locate_block. */
+struct xzblock {
+  uint64_t number;              /* Block number in the file. */
+  uint64_t start;               /* Uncompressed offset and size. */
+  uint64_t size;
+  uint64_t compressed_offset;   /* Offset and size in the xz file,
+                                 * including the block header. */
+  uint64_t compressed_size;
+  uint64_t unpadded_size;
+  lzma_check check;
+};
+
+/* Find the xz file block that contains the byte at 'offset' in the
+ * uncompressed file.  Returns -1 if there is no such block.
+ */
+extern int xzfile_locate_block (xzfile *xz, uint64_t offset,
+                                struct xzblock *blk);
+
+/* Read the compressed data of a block from the underlying plugin.
+ * Returns a malloc'd buffer of blk->compressed_size bytes.
+ */
+extern unsigned char *xzfile_read_compressed (struct nbdkit_next_ops *next_ops,
+                                              void *nxdata,
+                                              const struct xzblock *blk,
+                                              int *err);
+
+/* Uncompress a block read by xzfile_read_compressed.  Returns a
+ * malloc'd buffer of blk->size bytes.  This does not use the xzfile
+ * or the underlying plugin, so it may be called from any thread.
  */
-extern char *xzfile_read_block (xzfile *xz,
-                                struct nbdkit_next_ops *next_ops,
-                                void *nxdata, uint32_t flags, int *err,
-                                uint64_t offset,
-                                uint64_t *start, uint64_t *size);
+extern char *xzfile_decompress_block (const struct xzblock *blk,
+                                      const unsigned char *compressed);
 
 #endif /* NBDKIT_XZFILE_H */
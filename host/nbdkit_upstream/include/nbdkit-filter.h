@@ -116,6 +116,9 @@ extern size_t nbdkit_extents_count (const struct nbdkit_extents *);
 extern struct nbdkit_extent nbdkit_get_extent (const struct nbdkit_extents *,
                                                size_t);
 
+/* Deferring work until the reply has been sent. */
+extern int nbdkit_after_reply (void (*fn) (void *opaque), void *opaque);
+
 /* Filter struct. */
 struct nbdkit_filter {
   /* Do not set these fields directly; use NBDKIT_REGISTER_FILTER.
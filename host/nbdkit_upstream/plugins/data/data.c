@@ -37,8 +37,7 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
-
-#include <pthread.h>
+#include <assert.h>
 
 #if defined(HAVE_GNUTLS) && defined(HAVE_GNUTLS_BASE64_DECODE2)
 #include <gnutls/gnutls.h>
@@ -48,7 +47,6 @@
 
 #include <nbdkit-plugin.h>
 
-#include "cleanup.h"
 #include "sparse.h"
 #include "format.h"
 
@@ -61,11 +59,10 @@ static int64_t size = -1;
 /* Size of data specified on the command line. */
 static int64_t data_size = -1;
 
-/* Sparse array - the lock must be held when accessing this from
- * connected callbacks.
+/* Sparse array.  This does its own locking so it can be accessed
+ * from connected callbacks in parallel.
  */
 static struct sparse_array *sa;
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Debug directory operations (-D data.dir=1). */
 int data_debug_dir;
@@ -73,7 +70,7 @@ int data_debug_dir;
 static void
 data_load (void)
 {
-  sa = alloc_sparse_array (data_debug_dir);
+  sa = alloc_sparse_array (SPARSE_DEFAULT_PAGE_SIZE, data_debug_dir);
   if (sa == NULL) {
     perror ("malloc");
     exit (EXIT_FAILURE);
@@ -244,7 +241,6 @@ data_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
             uint32_t flags)
 {
   assert (!flags);
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   sparse_array_read (sa, buf, count, offset);
   return 0;
 }
@@ -256,7 +252,6 @@ data_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
 {
   /* Flushing, and thus FUA flag, is a no-op */
   assert ((flags & ~NBDKIT_FLAG_FUA) == 0);
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   return sparse_array_write (sa, buf, count, offset);
 }
 
@@ -268,7 +263,6 @@ data_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
    * sparse_array_zero generally beats writes, so FAST_ZERO is a no-op. */
   assert ((flags & ~(NBDKIT_FLAG_FUA | NBDKIT_FLAG_MAY_TRIM |
                      NBDKIT_FLAG_FAST_ZERO)) == 0);
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   sparse_array_zero (sa, count, offset);
   return 0;
 }
@@ -279,7 +273,6 @@ data_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   /* Flushing, and thus FUA flag, is a no-op */
   assert ((flags & ~NBDKIT_FLAG_FUA) == 0);
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   sparse_array_zero (sa, count, offset);
   return 0;
 }
@@ -296,7 +289,6 @@ static int
 data_extents (void *handle, uint32_t count, uint64_t offset,
               uint32_t flags, struct nbdkit_extents *extents)
 {
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   return sparse_array_extents (sa, count, offset, extents);
 }
 
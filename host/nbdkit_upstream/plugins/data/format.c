@@ -125,7 +125,7 @@ parse (int level,
       i++;
 
       /* Call self recursively to create a new sparse array. */
-      sa2 = alloc_sparse_array (0);
+      sa2 = alloc_sparse_array (SPARSE_DEFAULT_PAGE_SIZE, 0);
       if (sa2 == NULL) {
         nbdkit_error ("malloc: %m");
         return -1;
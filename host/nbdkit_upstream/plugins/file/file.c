@@ -60,6 +60,7 @@
 
 #include "cleanup.h"
 #include "isaligned.h"
+#include "iszero.h"
 
 #ifndef HAVE_FDATASYNC
 #define fdatasync fsync
@@ -73,6 +74,13 @@ static pthread_mutex_t lseek_lock = PTHREAD_MUTEX_INITIALIZER;
 /* to enable: -D file.zero=1 */
 int file_debug_zero;
 
+/* detect-zeroes=off|on|unmap */
+static enum {
+  DETECT_ZEROES_OFF = 0,
+  DETECT_ZEROES_ON,
+  DETECT_ZEROES_UNMAP,
+} detect_zeroes = DETECT_ZEROES_OFF;
+
 static bool
 is_enotsup (int err)
 {
@@ -98,6 +106,18 @@ file_config (const char *key, const char *value)
     if (!filename)
       return -1;
   }
+  else if (strcmp (key, "detect-zeroes") == 0) {
+    if (strcmp (value, "off") == 0)
+      detect_zeroes = DETECT_ZEROES_OFF;
+    else if (strcmp (value, "on") == 0)
+      detect_zeroes = DETECT_ZEROES_ON;
+    else if (strcmp (value, "unmap") == 0)
+      detect_zeroes = DETECT_ZEROES_UNMAP;
+    else {
+      nbdkit_error ("detect-zeroes must be \"off\", \"on\" or \"unmap\"");
+      return -1;
+    }
+  }
   else if (strcmp (key, "rdelay") == 0 ||
            strcmp (key, "wdelay") == 0) {
     nbdkit_error ("add --filter=delay on the command line");
@@ -125,7 +145,8 @@ file_config_complete (void)
 }
 
 #define file_config_help \
-  "file=<FILENAME>     (required) The filename to serve." \
+  "file=<FILENAME>     (required) The filename to serve.\n" \
+  "detect-zeroes=off|on|unmap     Turn writes of zeroes into zero/trim."
 
 /* Print some extra information about how the plugin was compiled. */
 static void
@@ -350,12 +371,28 @@ file_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
 }
 
 /* Write data to the file. */
+static int file_zero (void *handle, uint32_t count, uint64_t offset,
+                      uint32_t flags);
+
 static int
 file_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
              uint32_t flags)
 {
   struct handle *h = handle;
 
+  /* Write zeroes efficiently if requested, falling back to writing
+   * if the file does not support it.
+   */
+  if (detect_zeroes != DETECT_ZEROES_OFF && is_zero (buf, count)) {
+    if (detect_zeroes == DETECT_ZEROES_UNMAP)
+      flags |= NBDKIT_FLAG_MAY_TRIM;
+    if (file_zero (handle, count, offset, flags) == 0)
+      return 0;
+    if (!is_enotsup (errno))
+      return -1;
+    flags &= ~NBDKIT_FLAG_MAY_TRIM;
+  }
+
   while (count > 0) {
     ssize_t r = pwrite (h->fd, buf, count, offset);
     if (r == -1) {
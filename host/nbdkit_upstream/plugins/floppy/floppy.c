@@ -146,13 +146,22 @@ floppy_can_cache (void *handle)
 static int
 floppy_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
+  size_t nr;
+  const struct region *region =
+    find_regions (&floppy.regions, offset, count, &nr);
+  const struct region *end = region + nr;
+
   while (count > 0) {
-    const struct region *region = find_region (&floppy.regions, offset);
     size_t i, len;
     const char *host_path;
     int fd;
     ssize_t r;
 
+    /* A short read stays in the same region. */
+    if (offset > region->end)
+      region++;
+    assert (region < end);
+
     /* Length to end of region. */
     len = region->end - offset + 1;
     if (len > count)
@@ -0,0 +1,467 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include <nbdkit-plugin.h>
+
+#include "byte-swapping.h"
+#include "cleanup.h"
+
+#include "gzindex.h"
+
+#define CHUNK 131072
+
+#define INDEX_MAGIC "NBDKGZX1"
+
+/* Input buffer used while building the index. */
+struct input {
+  int fd;
+  uint64_t offset;              /* Offset of the next byte to read. */
+  bool eof;
+  unsigned char buf[CHUNK];
+};
+
+/* Make sure there are at least 'need' bytes available in the input,
+ * unless the end of the file is reached.  Returns -1 on error.
+ */
+static int
+fill (z_stream *strm, struct input *in, size_t need)
+{
+  ssize_t r;
+
+  while (strm->avail_in < need && !in->eof) {
+    memmove (in->buf, strm->next_in, strm->avail_in);
+    strm->next_in = in->buf;
+    r = pread (in->fd, in->buf + strm->avail_in, CHUNK - strm->avail_in,
+               in->offset);
+    if (r == -1) {
+      nbdkit_error ("pread: %m");
+      return -1;
+    }
+    if (r == 0)
+      in->eof = true;
+    strm->avail_in += r;
+    in->offset += r;
+  }
+  return 0;
+}
+
+static int
+add_point (struct gzindex *idx, size_t *alloc,
+           uint64_t in, uint64_t out, unsigned bits,
+           const unsigned char *window, size_t pos)
+{
+  unsigned char ordered[GZ_WINSIZE];
+  size_t have;
+  uLongf len;
+  struct gzpoint *p;
+
+  if (idx->nr_points == *alloc) {
+    size_t n = *alloc ? 2 * *alloc : 64;
+
+    p = realloc (idx->points, n * sizeof *p);
+    if (p == NULL) {
+      nbdkit_error ("realloc: %m");
+      return -1;
+    }
+    idx->points = p;
+    *alloc = n;
+  }
+
+  /* The window is a circular buffer, and pos is where the next byte
+   * would be written.  Put the last 32K of output in order.
+   */
+  if (out < GZ_WINSIZE) {
+    have = out;
+    memcpy (ordered, window, have);
+  }
+  else {
+    have = GZ_WINSIZE;
+    memcpy (ordered, window + pos, GZ_WINSIZE - pos);
+    memcpy (ordered + GZ_WINSIZE - pos, window, pos);
+  }
+
+  p = &idx->points[idx->nr_points];
+  p->out = out;
+  p->in = in;
+  p->bits = bits;
+  len = compressBound (have);
+  p->window = malloc (len);
+  if (p->window == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  if (compress2 (p->window, &len, ordered, have, Z_BEST_SPEED) != Z_OK) {
+    nbdkit_error ("compress2: failed to compress window");
+    free (p->window);
+    return -1;
+  }
+  p->window_len = len;
+  idx->nr_points++;
+  return 0;
+}
+
+int
+gzindex_build (int fd, uint64_t span, struct gzindex *idx)
+{
+  CLEANUP_FREE struct input *in = NULL;
+  CLEANUP_FREE unsigned char *window = NULL;
+  z_stream strm = { 0 };
+  uint64_t totout = 0, last = 0;
+  size_t alloc = 0;
+  int ret;
+
+  idx->span = span;
+  idx->nr_points = 0;
+  idx->points = NULL;
+
+  in = malloc (sizeof *in);
+  window = malloc (GZ_WINSIZE);
+  if (in == NULL || window == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  in->fd = fd;
+  in->offset = 0;
+  in->eof = false;
+
+  /* 15 + 16 means expect a gzip header. */
+  if (inflateInit2 (&strm, 15 + 16) != Z_OK) {
+    nbdkit_error ("inflateInit2: %s", strm.msg ? strm.msg : "failed");
+    return -1;
+  }
+  strm.next_in = in->buf;
+
+  for (;;) {
+    uInt before;
+
+    if (strm.avail_in == 0 && fill (&strm, in, 1) == -1)
+      goto err;
+    if (strm.avail_out == 0) {
+      strm.next_out = window;
+      strm.avail_out = GZ_WINSIZE;
+    }
+
+    /* Z_BLOCK makes inflate stop at the end of each deflate block. */
+    before = strm.avail_out;
+    ret = inflate (&strm, Z_BLOCK);
+    totout += before - strm.avail_out;
+
+    if (ret == Z_NEED_DICT)
+      ret = Z_DATA_ERROR;
+    if (ret == Z_BUF_ERROR && in->eof) {
+      nbdkit_error ("gzip: unexpected end of file");
+      goto err;
+    }
+    if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR) {
+      nbdkit_error ("gzip: inflate: %s", strm.msg ? strm.msg : "error");
+      goto err;
+    }
+
+    if (ret == Z_STREAM_END) {
+      /* gzip files may contain several members.  Anything after the
+       * last member other than another gzip header is ignored, as
+       * gzread does.
+       */
+      if (fill (&strm, in, 2) == -1)
+        goto err;
+      if (strm.avail_in < 2 ||
+          strm.next_in[0] != 0x1f || strm.next_in[1] != 0x8b) {
+        if (strm.avail_in > 0)
+          nbdkit_debug ("gzip: ignoring trailing data at offset %" PRIu64,
+                        in->offset - strm.avail_in);
+        break;
+      }
+      inflateReset (&strm);
+      continue;
+    }
+
+    /* At the end of a block (but not the last block in a member), add
+     * an access point if we've gone far enough since the last one.
+     */
+    if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+        (totout == 0 || totout - last >= span)) {
+      if (add_point (idx, &alloc, in->offset - strm.avail_in, totout,
+                     strm.data_type & 7,
+                     window, GZ_WINSIZE - strm.avail_out) == -1)
+        goto err;
+      last = totout;
+    }
+  }
+
+  inflateEnd (&strm);
+  idx->size = totout;
+  return 0;
+
+ err:
+  inflateEnd (&strm);
+  gzindex_free (idx);
+  return -1;
+}
+
+void
+gzindex_free (struct gzindex *idx)
+{
+  size_t i;
+
+  for (i = 0; i < idx->nr_points; ++i)
+    free (idx->points[i].window);
+  free (idx->points);
+  idx->points = NULL;
+  idx->nr_points = 0;
+}
+
+const struct gzpoint *
+gzindex_find (const struct gzindex *idx, uint64_t offset)
+{
+  size_t lo = 0, hi = idx->nr_points, mid;
+
+  /* Find the first point with out > offset. */
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (idx->points[mid].out <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo > 0 ? &idx->points[lo-1] : NULL;
+}
+
+int
+gzindex_get_window (const struct gzpoint *p, unsigned char *buf)
+{
+  uLongf len = GZ_WINSIZE;
+
+  if (uncompress (buf, &len, p->window, p->window_len) != Z_OK) {
+    nbdkit_error ("gzip: uncompress: corrupt window in index");
+    return -1;
+  }
+  return len;
+}
+
+/* Index files.  All fields are little endian:
+ *
+ *   magic "NBDKGZX1"
+ *   u64 size of gzip file
+ *   u64 mtime of gzip file (seconds)
+ *   u64 mtime of gzip file (nanoseconds)
+ *   u64 span
+ *   u64 uncompressed size
+ *   u64 number of points
+ *   for each point:
+ *     u64 out, u64 in, u32 bits, u32 window length, window
+ */
+
+static bool
+read_u64 (FILE *fp, uint64_t *v)
+{
+  if (fread (v, sizeof *v, 1, fp) != 1)
+    return false;
+  *v = le64toh (*v);
+  return true;
+}
+
+static bool
+read_u32 (FILE *fp, uint32_t *v)
+{
+  if (fread (v, sizeof *v, 1, fp) != 1)
+    return false;
+  *v = le32toh (*v);
+  return true;
+}
+
+static bool
+write_u64 (FILE *fp, uint64_t v)
+{
+  v = htole64 (v);
+  return fwrite (&v, sizeof v, 1, fp) == 1;
+}
+
+static bool
+write_u32 (FILE *fp, uint32_t v)
+{
+  v = htole32 (v);
+  return fwrite (&v, sizeof v, 1, fp) == 1;
+}
+
+int
+gzindex_load (const char *filename, int fd, uint64_t span,
+              struct gzindex *idx)
+{
+  FILE *fp;
+  struct stat statbuf;
+  char magic[8];
+  uint64_t v[6], i;
+  uint32_t bits;
+  struct gzpoint *p;
+
+  idx->nr_points = 0;
+  idx->points = NULL;
+
+  if (fstat (fd, &statbuf) == -1) {
+    nbdkit_error ("fstat: %m");
+    return -1;
+  }
+
+  fp = fopen (filename, "r");
+  if (fp == NULL) {
+    if (errno != ENOENT)
+      nbdkit_debug ("gzip: %s: %m", filename);
+    return -1;
+  }
+
+  if (fread (magic, sizeof magic, 1, fp) != 1 ||
+      memcmp (magic, INDEX_MAGIC, sizeof magic) != 0)
+    goto bad;
+  for (i = 0; i < 6; ++i)
+    if (!read_u64 (fp, &v[i]))
+      goto bad;
+  if (v[0] != statbuf.st_size ||
+      v[1] != statbuf.st_mtim.tv_sec ||
+      v[2] != statbuf.st_mtim.tv_nsec ||
+      v[3] != span) {
+    nbdkit_debug ("gzip: %s: index does not match the file", filename);
+    goto out;
+  }
+  idx->span = span;
+  idx->size = v[4];
+
+  if (v[5] > SIZE_MAX / sizeof *p)
+    goto bad;
+  idx->points = calloc (v[5], sizeof *p);
+  if (idx->points == NULL)
+    goto bad;
+  for (i = 0; i < v[5]; ++i) {
+    p = &idx->points[i];
+    if (!read_u64 (fp, &p->out) || !read_u64 (fp, &p->in) ||
+        !read_u32 (fp, &bits) || !read_u32 (fp, &p->window_len) ||
+        bits > 7 || (i > 0 && p->out <= p[-1].out) ||
+        p->window_len > compressBound (GZ_WINSIZE))
+      goto bad;
+    p->bits = bits;
+    p->window = malloc (p->window_len);
+    if (p->window == NULL)
+      goto bad;
+    idx->nr_points++;
+    if (fread (p->window, 1, p->window_len, fp) != p->window_len)
+      goto bad;
+  }
+
+  fclose (fp);
+  nbdkit_debug ("gzip: loaded index %s", filename);
+  return 0;
+
+ bad:
+  nbdkit_debug ("gzip: %s: index is corrupt or truncated", filename);
+ out:
+  fclose (fp);
+  gzindex_free (idx);
+  return -1;
+}
+
+/* Write the index to a temporary file and rename it, so that other
+ * processes never see a partial index.
+ */
+int
+gzindex_save (const char *filename, int fd, const struct gzindex *idx)
+{
+  CLEANUP_FREE char *tmpname = NULL;
+  struct stat statbuf;
+  FILE *fp;
+  int tmpfd;
+  size_t i;
+  bool ok;
+
+  if (fstat (fd, &statbuf) == -1) {
+    nbdkit_error ("fstat: %m");
+    return -1;
+  }
+
+  if (asprintf (&tmpname, "%s.XXXXXX", filename) == -1) {
+    nbdkit_error ("asprintf: %m");
+    return -1;
+  }
+  tmpfd = mkstemp (tmpname);
+  if (tmpfd == -1) {
+    nbdkit_error ("mkstemp: %s: %m", tmpname);
+    return -1;
+  }
+  fp = fdopen (tmpfd, "w");
+  if (fp == NULL) {
+    nbdkit_error ("fdopen: %m");
+    close (tmpfd);
+    unlink (tmpname);
+    return -1;
+  }
+
+  ok = fwrite (INDEX_MAGIC, 8, 1, fp) == 1 &&
+    write_u64 (fp, statbuf.st_size) &&
+    write_u64 (fp, statbuf.st_mtim.tv_sec) &&
+    write_u64 (fp, statbuf.st_mtim.tv_nsec) &&
+    write_u64 (fp, idx->span) &&
+    write_u64 (fp, idx->size) &&
+    write_u64 (fp, idx->nr_points);
+  for (i = 0; ok && i < idx->nr_points; ++i) {
+    const struct gzpoint *p = &idx->points[i];
+
+    ok = write_u64 (fp, p->out) &&
+      write_u64 (fp, p->in) &&
+      write_u32 (fp, p->bits) &&
+      write_u32 (fp, p->window_len) &&
+      fwrite (p->window, 1, p->window_len, fp) == p->window_len;
+  }
+  if (fclose (fp) == EOF)
+    ok = false;
+  if (!ok || rename (tmpname, filename) == -1) {
+    nbdkit_error ("gzip: could not write index %s: %m", filename);
+    unlink (tmpname);
+    return -1;
+  }
+
+  nbdkit_debug ("gzip: saved index %s", filename);
+  return 0;
+}
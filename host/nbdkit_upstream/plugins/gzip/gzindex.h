@@ -0,0 +1,94 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/* Random access index for gzip files.  This is based on the zran.c
+ * example in the zlib sources: while uncompressing the whole file
+ * once we record "access points" every span bytes of uncompressed
+ * data, at deflate block boundaries.  Each access point stores the
+ * position in the compressed file and the previous 32K of
+ * uncompressed data, which is all that is needed to restart inflate
+ * from that point.
+ */
+
+#ifndef NBDKIT_GZINDEX_H
+#define NBDKIT_GZINDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Size of the deflate window. */
+#define GZ_WINSIZE 32768
+
+struct gzpoint {
+  uint64_t out;                 /* Offset in uncompressed data. */
+  uint64_t in;                  /* Offset in compressed file of the
+                                 * first full byte. */
+  unsigned bits;                /* Bits (0-7) of the byte before 'in'
+                                 * still to be used. */
+  uint32_t window_len;          /* Length of compressed window. */
+  unsigned char *window;        /* Window, compressed with compress2. */
+};
+
+struct gzindex {
+  uint64_t size;                /* Total uncompressed size. */
+  uint64_t span;
+  size_t nr_points;
+  struct gzpoint *points;       /* Sorted by out. */
+};
+
+/* Uncompress the gzip file open on fd and build the index. */
+extern int gzindex_build (int fd, uint64_t span, struct gzindex *idx);
+
+/* Load or save an index file.  The index file records the size and
+ * modification time of the gzip file, and gzindex_load returns -1
+ * without an error if the index does not exist or does not match.
+ */
+extern int gzindex_load (const char *filename, int fd, uint64_t span,
+                         struct gzindex *idx);
+extern int gzindex_save (const char *filename, int fd,
+                         const struct gzindex *idx);
+
+extern void gzindex_free (struct gzindex *idx);
+
+/* Find the last access point at or before offset, or NULL if there
+ * is none.
+ */
+extern const struct gzpoint *gzindex_find (const struct gzindex *idx,
+                                           uint64_t offset);
+
+/* Uncompress the window of an access point into buf, which must be
+ * GZ_WINSIZE bytes.  Returns the length or -1 on error.
+ */
+extern int gzindex_get_window (const struct gzpoint *p, unsigned char *buf);
+
+#endif /* NBDKIT_GZINDEX_H */
@@ -35,36 +35,86 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <zlib.h>
 
+#define NBDKIT_API_VERSION 2
+
 #include <nbdkit-plugin.h>
 
+#include "gzindex.h"
+
 static char *filename = NULL;
+static char *indexfile = NULL;
+static uint64_t span = 1024 * 1024;
+
+/* The compressed file and its index, shared by all connections. */
+static int fd = -1;
+static struct gzindex idx;
+
+/* Each thread has its own inflate stream, see struct reader below. */
+static pthread_key_t reader_key;
+
+static void free_reader (void *);
+
+static void
+gzip_load (void)
+{
+  int err;
+
+  err = pthread_key_create (&reader_key, free_reader);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_key_create: %m");
+    exit (EXIT_FAILURE);
+  }
+}
 
 static void
 gzip_unload (void)
 {
   free (filename);
+  free (indexfile);
+  if (fd >= 0)
+    close (fd);
+  gzindex_free (&idx);
 }
 
-/* Called for each key=value passed on the command line.  This plugin
- * only accepts file=<filename>, which is required.
- */
+/* Called for each key=value passed on the command line. */
 static int
 gzip_config (const char *key, const char *value)
 {
   if (strcmp (key, "file") == 0) {
     /* See FILENAMES AND PATHS in nbdkit-plugin(3). */
+    free (filename);
     filename = nbdkit_realpath (value);
     if (!filename)
       return -1;
   }
+  else if (strcmp (key, "index") == 0) {
+    free (indexfile);
+    indexfile = nbdkit_absolute_path (value);
+    if (!indexfile)
+      return -1;
+  }
+  else if (strcmp (key, "span") == 0) {
+    int64_t r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    if (r < GZ_WINSIZE) {
+      nbdkit_error ("span must be at least %d", GZ_WINSIZE);
+      return -1;
+    }
+    span = r;
+  }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -87,124 +137,262 @@ gzip_config_complete (void)
 }
 
 #define gzip_config_help \
-  "file=<FILENAME>     (required) The filename to serve."
-
-/* Translate a gzerror to nbdkit_error. */
-#define nbdkit_gzerror(gz, fs, ...)                        \
-  do {                                                     \
-    int gzerrnum;                                          \
-    const char *gzerr = gzerror ((gz), &gzerrnum);         \
-    if (gzerrnum == Z_ERRNO) {                             \
-      nbdkit_error ((fs ": %m"), ## __VA_ARGS__);          \
-    } else {                                               \
-      nbdkit_error ((fs ": %s"), ## __VA_ARGS__, gzerr);   \
-    }                                                      \
-  } while (0)
-
-/* The per-connection handle. */
-struct gzip_handle {
-  gzFile gz;
-  uint64_t exportsize;
+  "file=<FILENAME>     (required) The filename to serve.\n" \
+  "index=<FILENAME>               Load or save the seek index here.\n" \
+  "span=<SIZE>                    Distance between index points (default 1M)."
+
+/* Open the file and load or build the index.  This is done once
+ * before any client connects.
+ */
+static int
+gzip_get_ready (void)
+{
+  fd = open (filename, O_RDONLY|O_CLOEXEC);
+  if (fd == -1) {
+    nbdkit_error ("open: %s: %m", filename);
+    return -1;
+  }
+
+  if (indexfile == NULL || gzindex_load (indexfile, fd, span, &idx) == -1) {
+    /* This has to uncompress the whole file - expensive! */
+    if (gzindex_build (fd, span, &idx) == -1)
+      return -1;
+    if (indexfile)
+      gzindex_save (indexfile, fd, &idx);
+  }
+
+  nbdkit_debug ("gzip: %s: uncompressed size = %" PRIu64 ", "
+                "%zu index points",
+                filename, idx.size, idx.nr_points);
+  return 0;
+}
+
+/* Per-thread inflate state.  This is kept between requests so that
+ * sequential reads can carry on from where the last read stopped.
+ */
+struct reader {
+  z_stream strm;
+  bool active;                  /* strm is positioned at out_pos. */
+  bool raw;                     /* In raw deflate mode after seeking to
+                                 * an access point. */
+  uint64_t in_offset;           /* Next byte to read from the file. */
+  uint64_t out_pos;             /* Current uncompressed offset. */
+  unsigned char inbuf[65536];
+  unsigned char window[GZ_WINSIZE];
 };
 
-/* Create the per-connection handle. */
-static void *
-gzip_open (int readonly)
+static void
+free_reader (void *vp)
 {
-  struct gzip_handle *h;
-  char buf[BUFSIZ];
-  int r;
+  struct reader *r = vp;
 
-  h = malloc (sizeof *h);
-  if (h == NULL) {
-    nbdkit_error ("malloc: %m");
+  inflateEnd (&r->strm);
+  free (r);
+}
+
+static struct reader *
+get_reader (void)
+{
+  struct reader *r = pthread_getspecific (reader_key);
+  int err;
+
+  if (r)
+    return r;
+
+  r = calloc (1, sizeof *r);
+  if (r == NULL) {
+    nbdkit_error ("calloc: %m");
     return NULL;
   }
-
-  h->gz = gzopen (filename, "r");
-  if (h->gz == NULL) {
-    nbdkit_error ("gzopen: %s: %m", filename);
-    goto err1;
+  if (inflateInit2 (&r->strm, -15) != Z_OK) {
+    nbdkit_error ("inflateInit2: %s", r->strm.msg ? r->strm.msg : "failed");
+    free (r);
+    return NULL;
   }
+  err = pthread_setspecific (reader_key, r);
+  if (err != 0) {
+    errno = err;
+    nbdkit_error ("pthread_setspecific: %m");
+    free_reader (r);
+    return NULL;
+  }
+  return r;
+}
 
-  gzbuffer (h->gz, 128 * 1024);
+/* Read more compressed input if the input buffer is empty. */
+static int
+refill (struct reader *r)
+{
+  ssize_t n;
 
-  /* Work out the size of the uncompressed file - expensive!  Note
-   * that seeking to the end of the file is not supported, so instead
-   * we have to read the file and discard it.
-   */
-  h->exportsize = 0;
-  do {
-    r = gzread (h->gz, buf, BUFSIZ);
-    h->exportsize += r;
-  } while (r > 0);
-  if (r == -1) {
-    nbdkit_gzerror (h->gz, "gzread: %s", filename);
-    goto err2;
+  if (r->strm.avail_in > 0)
+    return 0;
+
+  n = pread (fd, r->inbuf, sizeof r->inbuf, r->in_offset);
+  if (n == -1) {
+    nbdkit_error ("pread: %s: %m", filename);
+    return -1;
   }
+  if (n == 0) {
+    nbdkit_error ("gzip: %s: unexpected end of file", filename);
+    errno = EIO;
+    return -1;
+  }
+  r->in_offset += n;
+  r->strm.next_in = r->inbuf;
+  r->strm.avail_in = n;
+  return 0;
+}
+
+/* Position the reader at an access point, or at the start of the
+ * file if p == NULL.
+ */
+static int
+seek_reader (struct reader *r, const struct gzpoint *p)
+{
+  unsigned char byte;
+  int len;
 
-  nbdkit_debug ("gzip: %s: uncompressed size = %" PRIu64,
-                filename, h->exportsize);
+  r->active = false;
+  r->strm.avail_in = 0;
 
-  if (gzrewind (h->gz) == -1) {
-    nbdkit_gzerror (h->gz, "gzrewind: unable to rewind file");
-    goto err2;
+  if (p == NULL) {
+    inflateReset2 (&r->strm, 15 + 16);
+    r->raw = false;
+    r->in_offset = 0;
+    r->out_pos = 0;
+  }
+  else {
+    inflateReset2 (&r->strm, -15);
+    r->raw = true;
+    r->in_offset = p->in;
+    if (p->bits) {
+      if (pread (fd, &byte, 1, p->in - 1) != 1) {
+        nbdkit_error ("pread: %s: %m", filename);
+        return -1;
+      }
+      inflatePrime (&r->strm, p->bits, byte >> (8 - p->bits));
+    }
+    len = gzindex_get_window (p, r->window);
+    if (len == -1) {
+      errno = EIO;
+      return -1;
+    }
+    if (len > 0)
+      inflateSetDictionary (&r->strm, r->window, len);
+    r->out_pos = p->out;
   }
 
-  return h;
-
- err2:
-  gzclose (h->gz);
- err1:
-  free (h);
-  return NULL;
+  r->active = true;
+  return 0;
 }
 
-/* Free up the per-connection handle. */
-static void
-gzip_close (void *handle)
+/* Uncompress the next count bytes into buf. */
+static int
+inflate_data (struct reader *r, unsigned char *buf, size_t count)
 {
-  struct gzip_handle *h = handle;
+  int ret;
+  size_t skip;
+
+  r->strm.next_out = buf;
+  r->strm.avail_out = count;
+
+  while (r->strm.avail_out > 0) {
+    if (refill (r) == -1)
+      return -1;
 
-  gzclose (h->gz);
-  free (h);
+    ret = inflate (&r->strm, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      /* End of a gzip member.  In raw mode we have to skip the
+       * trailer ourselves, then start parsing the next member's
+       * header.
+       */
+      if (r->raw) {
+        for (skip = 8; skip > 0; ) {
+          size_t n;
+
+          if (refill (r) == -1)
+            return -1;
+          n = skip < r->strm.avail_in ? skip : r->strm.avail_in;
+          r->strm.next_in += n;
+          r->strm.avail_in -= n;
+          skip -= n;
+        }
+        r->raw = false;
+      }
+      inflateReset2 (&r->strm, 15 + 16);
+    }
+    else if (ret != Z_OK) {
+      nbdkit_error ("gzip: %s: inflate: %s", filename,
+                    r->strm.msg ? r->strm.msg : "error");
+      errno = EIO;
+      return -1;
+    }
+  }
+
+  r->out_pos += count;
+  return 0;
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+static void *
+gzip_open (int readonly)
+{
+  return NBDKIT_HANDLE_NOT_NEEDED;
+}
+
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the file size. */
 static int64_t
 gzip_get_size (void *handle)
 {
-  struct gzip_handle *h = handle;
+  return idx.size;
+}
 
-  return h->exportsize;
+/* The file is read-only, so all connections see the same data. */
+static int
+gzip_can_multi_conn (void *handle)
+{
+  return 1;
 }
 
 /* Read data from the file. */
 static int
-gzip_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+gzip_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
+            uint32_t flags)
 {
-  struct gzip_handle *h = handle;
+  struct reader *r;
+  const struct gzpoint *p;
+  size_t n;
 
-  if (gzseek (h->gz, offset, SEEK_SET) == -1) {
-    nbdkit_gzerror (h->gz, "gzseek");
+  r = get_reader ();
+  if (r == NULL)
     return -1;
-  }
 
-  while (count > 0) {
-    int r = gzread (h->gz, buf, count);
-    if (r == -1) {
-      nbdkit_gzerror (h->gz, "gzread");
+  /* Uncompress from the nearest access point before offset, unless
+   * this thread's stream is already closer.
+   */
+  p = gzindex_find (&idx, offset);
+  if (!r->active || r->out_pos > offset ||
+      (p != NULL && r->out_pos < p->out)) {
+    if (seek_reader (r, p) == -1)
       return -1;
-    }
-    if (r == 0) {
-      nbdkit_error ("gzread: unexpected end of file (count=%" PRIu32 ")",
-                    count);
+  }
+
+  /* Skip forward to the offset. */
+  while (r->out_pos < offset) {
+    n = offset - r->out_pos;
+    if (n > sizeof r->window)
+      n = sizeof r->window;
+    if (inflate_data (r, r->window, n) == -1) {
+      r->active = false;
       return -1;
     }
-    buf += r;
-    count -= r;
+  }
+
+  if (inflate_data (r, buf, count) == -1) {
+    r->active = false;
+    return -1;
   }
 
   return 0;
@@ -213,15 +401,21 @@ gzip_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 static struct nbdkit_plugin plugin = {
   .name              = "gzip",
   .version           = PACKAGE_VERSION,
+  .load              = gzip_load,
   .unload            = gzip_unload,
   .config            = gzip_config,
   .config_complete   = gzip_config_complete,
   .config_help       = gzip_config_help,
   .magic_config_key  = "file",
+  .get_ready         = gzip_get_ready,
   .open              = gzip_open,
-  .close             = gzip_close,
   .get_size          = gzip_get_size,
+  .can_multi_conn    = gzip_can_multi_conn,
   .pread             = gzip_pread,
+  /* In this plugin, errno is preserved properly along error return
+   * paths from failed system calls.
+   */
+  .errno_is_preserved = 1,
 };
 
 NBDKIT_REGISTER_PLUGIN(plugin)
@@ -178,11 +178,20 @@ static int
 linuxdisk_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
                  uint32_t flags)
 {
+  size_t nr;
+  const struct region *region =
+    find_regions (&disk.regions, offset, count, &nr);
+  const struct region *end = region + nr;
+
   while (count > 0) {
-    const struct region *region = find_region (&disk.regions, offset);
     size_t len;
     ssize_t r;
 
+    /* A short read stays in the same region. */
+    if (offset > region->end)
+      region++;
+    assert (region < end);
+
     /* Length to end of region. */
     len = region->end - offset + 1;
     if (len > count)
@@ -41,13 +41,11 @@
 #include <errno.h>
 #include <assert.h>
 
-#include <pthread.h>
-
 #define NBDKIT_API_VERSION 2
 
 #include <nbdkit-plugin.h>
 
-#include "cleanup.h"
+#include "ispowerof2.h"
 #include "sparse.h"
 
 /* The size of disk in bytes (initialized by size=<SIZE> parameter). */
@@ -56,36 +54,57 @@ static int64_t size = -1;
 /* Debug directory operations (-D memory.dir=1). */
 int memory_debug_dir;
 
-/* Sparse array - the lock must be held when accessing this from
- * connected callbacks.
+/* Sparse array.  This does its own locking so it can be accessed
+ * from connected callbacks in parallel.
  */
 static struct sparse_array *sa;
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
-static void
-memory_load (void)
-{
-  sa = alloc_sparse_array (memory_debug_dir);
-  if (sa == NULL) {
-    perror ("malloc");
-    exit (EXIT_FAILURE);
-  }
-}
+/* Page size of the sparse array (page-size=<SIZE> parameter). */
+static uint32_t page_size = SPARSE_DEFAULT_PAGE_SIZE;
 
 static void
 memory_unload (void)
 {
+  struct sparse_array_stats stats;
+
+  if (sa) {
+    sparse_array_get_stats (sa, &stats);
+    nbdkit_debug ("sparse array: %" PRIu64 " pages of %" PRIu32 " bytes, "
+                  "%" PRIu64 " bytes of metadata, "
+                  "allocator %" PRIu64 "/%" PRIu64 " bytes used, "
+                  "overhead %.3f bytes per stored byte",
+                  stats.nr_pages, stats.page_size, stats.metadata_bytes,
+                  stats.arena_used_bytes, stats.arena_bytes,
+                  stats.data_bytes > 0
+                  ? (double) (stats.metadata_bytes + stats.arena_bytes -
+                              stats.arena_used_bytes) / stats.data_bytes
+                  : 0.);
+  }
   free_sparse_array (sa);
 }
 
 static int
 memory_config (const char *key, const char *value)
 {
+  int64_t r;
+
   if (strcmp (key, "size") == 0) {
     size = nbdkit_parse_size (value);
     if (size == -1)
       return -1;
   }
+  else if (strcmp (key, "page-size") == 0) {
+    r = nbdkit_parse_size (value);
+    if (r == -1)
+      return -1;
+    if (r < SPARSE_MIN_PAGE_SIZE || r > SPARSE_MAX_PAGE_SIZE ||
+        !is_power_of_2 (r)) {
+      nbdkit_error ("page-size must be a power of 2 between %d and %d",
+                    SPARSE_MIN_PAGE_SIZE, SPARSE_MAX_PAGE_SIZE);
+      return -1;
+    }
+    page_size = r;
+  }
   else {
     nbdkit_error ("unknown parameter '%s'", key);
     return -1;
@@ -101,11 +120,18 @@ memory_config_complete (void)
     nbdkit_error ("you must specify size=<SIZE> on the command line");
     return -1;
   }
+
+  sa = alloc_sparse_array (page_size, memory_debug_dir);
+  if (sa == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
   return 0;
 }
 
 #define memory_config_help \
-  "size=<SIZE>  (required) Size of the backing disk"
+  "size=<SIZE>  (required) Size of the backing disk\n" \
+  "page-size=<SIZE>        Allocation unit (default 32K)"
 
 /* Create the per-connection handle. */
 static void *
@@ -160,7 +186,6 @@ memory_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
               uint32_t flags)
 {
   assert (!flags);
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   sparse_array_read (sa, buf, count, offset);
   return 0;
 }
@@ -172,7 +197,6 @@ memory_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
 {
   /* Flushing, and thus FUA flag, is a no-op */
   assert ((flags & ~NBDKIT_FLAG_FUA) == 0);
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   return sparse_array_write (sa, buf, count, offset);
 }
 
@@ -184,7 +208,6 @@ memory_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
    * sparse_array_zero generally beats writes, so FAST_ZERO is a no-op. */
   assert ((flags & ~(NBDKIT_FLAG_FUA | NBDKIT_FLAG_MAY_TRIM |
                      NBDKIT_FLAG_FAST_ZERO)) == 0);
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   sparse_array_zero (sa, count, offset);
   return 0;
 }
@@ -195,7 +218,6 @@ memory_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   /* Flushing, and thus FUA flag, is a no-op */
   assert ((flags & ~NBDKIT_FLAG_FUA) == 0);
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   sparse_array_zero (sa, count, offset);
   return 0;
 }
@@ -212,14 +234,12 @@ static int
 memory_extents (void *handle, uint32_t count, uint64_t offset,
                 uint32_t flags, struct nbdkit_extents *extents)
 {
-  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lock);
   return sparse_array_extents (sa, count, offset, extents);
 }
 
 static struct nbdkit_plugin plugin = {
   .name              = "memory",
   .version           = PACKAGE_VERSION,
-  .load              = memory_load,
   .unload            = memory_unload,
   .config            = memory_config,
   .config_complete   = memory_config_complete,
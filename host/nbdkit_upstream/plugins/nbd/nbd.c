@@ -58,6 +58,9 @@
 #include "cleanup.h"
 #include "utils.h"
 
+/* Maximum value of the connections parameter */
+#define MAX_CONNECTIONS 16
+
 /* The per-transaction details */
 struct transaction {
   int64_t cookie;
@@ -67,14 +70,28 @@ struct transaction {
   nbd_completion_callback cb;
 };
 
-/* The per-connection handle */
-struct handle {
+/* One connection to the server */
+struct conn {
   /* These fields are read-only once initialized */
   struct nbd_handle *nbd;
   int fd; /* Cache of nbd_aio_get_fd */
   int fds[2]; /* Pipe for kicking the reader thread */
-  bool readonly;
   pthread_t reader;
+
+  /* Number of commands in flight, updated atomically */
+  unsigned in_flight;
+};
+
+/* The per-connection handle.  If the server supports multi-conn and
+ * connections=N was given, this uses up to N connections to the
+ * server, each with its own reader thread, and each command is sent
+ * on the connection with the fewest commands in flight.
+ */
+struct handle {
+  /* These fields are read-only once initialized */
+  struct conn *conns;
+  size_t nr_conns;
+  bool readonly;
 };
 
 /* Connect to server via absolute name of Unix socket */
@@ -93,6 +110,9 @@ static const char *export;
 /* Number of retries */
 static unsigned retry;
 
+/* Number of connections to the server per handle */
+static unsigned connections = 1;
+
 /* True to share single server connection among all clients */
 static bool shared;
 static struct handle *shared_handle;
@@ -120,8 +140,8 @@ nbdplug_unload (void)
 /* Called for each key=value passed on the command line.  This plugin
  * accepts socket=<sockname>, hostname=<hostname>/port=<port>, or
  * [uri=]<uri> (exactly one connection required), and optional
- * parameters export=<name>, retry=<n>, shared=<bool> and various
- * tls settings.
+ * parameters export=<name>, retry=<n>, connections=<n>, shared=<bool>
+ * and various tls settings.
  */
 static int
 nbdplug_config (const char *key, const char *value)
@@ -147,6 +167,14 @@ nbdplug_config (const char *key, const char *value)
     if (nbdkit_parse_unsigned ("retry", value, &retry) == -1)
       return -1;
   }
+  else if (strcmp (key, "connections") == 0) {
+    if (nbdkit_parse_unsigned ("connections", value, &connections) == -1)
+      return -1;
+    if (connections < 1 || connections > MAX_CONNECTIONS) {
+      nbdkit_error ("connections must be between 1 and %d", MAX_CONNECTIONS);
+      return -1;
+    }
+  }
   else if (strcmp (key, "shared") == 0) {
     r = nbdkit_parse_bool (value);
     if (r == -1)
@@ -276,6 +304,8 @@ nbdplug_config_complete (void)
   "port=<PORT>            TCP port or service name to use (default 10809).\n" \
   "export=<NAME>          Export name to connect to (default \"\").\n" \
   "retry=<N>              Retry connection up to N seconds (default 0).\n" \
+  "connections=<N>        Use up to N connections to a multi-conn server\n" \
+  "                       for each handle (default 1).\n" \
   "shared=<BOOL>          True to share one server connection among all clients,\n" \
   "                       rather than a connection per client (default false).\n" \
   "tls=<MODE>             How to use TLS; one of 'off', 'on', or 'require'.\n" \
@@ -301,21 +331,21 @@ nbdplug_dump_plugin (void)
 
 #define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
-/* Reader loop. */
+/* Reader loop, one per connection. */
 void *
-nbdplug_reader (void *handle)
+nbdplug_reader (void *conn)
 {
-  struct handle *h = handle;
+  struct conn *c = conn;
 
-  while (!nbd_aio_is_dead (h->nbd) && !nbd_aio_is_closed (h->nbd)) {
+  while (!nbd_aio_is_dead (c->nbd) && !nbd_aio_is_closed (c->nbd)) {
     struct pollfd fds[2] = {
-      [0].fd = h->fd,
-      [1].fd = h->fds[0],
+      [0].fd = c->fd,
+      [1].fd = c->fds[0],
       [1].events = POLLIN,
     };
     unsigned dir;
 
-    dir = nbd_aio_get_direction (h->nbd);
+    dir = nbd_aio_get_direction (c->nbd);
     nbdkit_debug ("polling, dir=%d", dir);
     if (dir & LIBNBD_AIO_DIRECTION_READ)
       fds[0].events |= POLLIN;
@@ -327,22 +357,22 @@ nbdplug_reader (void *handle)
     }
 
     if (dir & LIBNBD_AIO_DIRECTION_READ && fds[0].revents & POLLIN)
-      nbd_aio_notify_read (h->nbd);
+      nbd_aio_notify_read (c->nbd);
     else if (dir & LIBNBD_AIO_DIRECTION_WRITE && fds[0].revents & POLLOUT)
-      nbd_aio_notify_write (h->nbd);
+      nbd_aio_notify_write (c->nbd);
 
     /* Check if we were kicked because a command was started */
     if (fds[1].revents & POLLIN) {
       char buf[10]; /* Larger than 1 to allow reduction of any backlog */
 
-      if (read (h->fds[0], buf, sizeof buf) == -1 && errno != EAGAIN) {
+      if (read (c->fds[0], buf, sizeof buf) == -1 && errno != EAGAIN) {
         nbdkit_error ("failed to read pipe: %m");
         break;
       }
     }
   }
 
-  nbdkit_debug ("state machine changed to %s", nbd_connection_state (h->nbd));
+  nbdkit_debug ("state machine changed to %s", nbd_connection_state (c->nbd));
   nbdkit_debug ("exiting state machine thread");
   return NULL;
 }
@@ -378,11 +408,37 @@ nbdplug_prepare (struct transaction *trans)
   trans->cb.user_data = trans;
 }
 
+/* Choose the connection with the fewest commands in flight, skipping
+ * connections which have died.  The count is only a hint, so races
+ * between threads do not matter.
+ */
+static struct conn *
+nbdplug_pick (struct handle *h)
+{
+  struct conn *best = NULL, *c;
+  size_t i;
+
+  for (i = 0; i < h->nr_conns; ++i) {
+    c = &h->conns[i];
+    if (nbd_aio_is_dead (c->nbd) || nbd_aio_is_closed (c->nbd))
+      continue;
+    if (best == NULL ||
+        __atomic_load_n (&c->in_flight, __ATOMIC_RELAXED) <
+        __atomic_load_n (&best->in_flight, __ATOMIC_RELAXED))
+      best = c;
+  }
+  /* If every connection has died, the command fails on the first. */
+  if (best == NULL)
+    best = &h->conns[0];
+  __atomic_add_fetch (&best->in_flight, 1, __ATOMIC_RELAXED);
+  return best;
+}
+
 /* Register a cookie and kick the I/O thread. */
 static void
-nbdplug_register (struct handle *h, struct transaction *trans, int64_t cookie)
+nbdplug_register (struct conn *c, struct transaction *trans, int64_t cookie)
 {
-  char c = 0;
+  char kick = 0;
 
   if (cookie == -1) {
     nbdkit_error ("command failed: %s", nbd_get_error ());
@@ -393,13 +449,13 @@ nbdplug_register (struct handle *h, struct transaction *trans, int64_t cookie)
   nbdkit_debug ("cookie %" PRId64 " started by state machine", cookie);
   trans->cookie = cookie;
 
-  if (write (h->fds[1], &c, 1) == -1 && errno != EAGAIN)
+  if (write (c->fds[1], &kick, 1) == -1 && errno != EAGAIN)
     nbdkit_debug ("failed to kick reader thread: %m");
 }
 
 /* Perform the reply half of a transaction. */
 static int
-nbdplug_reply (struct handle *h, struct transaction *trans)
+nbdplug_reply (struct conn *c, struct transaction *trans)
 {
   int err;
 
@@ -417,108 +473,170 @@ nbdplug_reply (struct handle *h, struct transaction *trans)
   }
   if (sem_destroy (&trans->sem))
     abort ();
+  __atomic_sub_fetch (&c->in_flight, 1, __ATOMIC_RELAXED);
   errno = err;
   return err ? -1 : 0;
 }
 
-/* Create the shared or per-connection handle. */
-static struct handle *
-nbdplug_open_handle (int readonly)
+/* Open one connection to the server and start its reader thread.
+ * If extra is true this is one of the optional extra connections, so
+ * failing to connect is only a debug message.
+ */
+static int
+nbdplug_open_conn (struct conn *c, unsigned long retries, bool extra)
 {
-  struct handle *h;
   int r;
-  unsigned long retries = retry;
 
-  h = calloc (1, sizeof *h);
-  if (h == NULL) {
-    nbdkit_error ("malloc: %m");
-    return NULL;
-  }
 #ifdef HAVE_PIPE2
-  if (pipe2 (h->fds, O_NONBLOCK)) {
+  if (pipe2 (c->fds, O_NONBLOCK)) {
     nbdkit_error ("pipe2: %m");
-    free (h);
-    return NULL;
+    return -1;
   }
 #else
   /* This plugin doesn't fork, so we don't care about CLOEXEC. Our use
    * of pipe2 is merely for convenience.
    */
-  if (pipe (h->fds)) {
+  if (pipe (c->fds)) {
     nbdkit_error ("pipe: %m");
-    free (h);
-    return NULL;
+    return -1;
   }
-  if (set_nonblock (h->fds[0]) == -1) {
-    close (h->fds[1]);
-    free (h);
-    return NULL;
+  if (set_nonblock (c->fds[0]) == -1) {
+    close (c->fds[1]);
+    return -1;
   }
-  if (set_nonblock (h->fds[1]) == -1) {
-    close (h->fds[0]);
-    free (h);
-    return NULL;
+  if (set_nonblock (c->fds[1]) == -1) {
+    close (c->fds[0]);
+    return -1;
   }
 #endif
 
  retry:
-  h->fd = -1;
-  h->nbd = nbd_create ();
-  if (!h->nbd)
+  c->fd = -1;
+  c->nbd = nbd_create ();
+  if (!c->nbd)
     goto err;
-  if (nbd_set_export_name (h->nbd, export) == -1)
+  if (nbd_set_export_name (c->nbd, export) == -1)
     goto err;
-  if (nbd_add_meta_context (h->nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1)
+  if (nbd_add_meta_context (c->nbd, LIBNBD_CONTEXT_BASE_ALLOCATION) == -1)
     goto err;
-  if (nbd_set_tls (h->nbd, tls) == -1)
+  if (nbd_set_tls (c->nbd, tls) == -1)
     goto err;
   if (tls_certificates &&
-      nbd_set_tls_certificates (h->nbd, tls_certificates) == -1)
+      nbd_set_tls_certificates (c->nbd, tls_certificates) == -1)
     goto err;
-  if (tls_verify >= 0 && nbd_set_tls_verify_peer (h->nbd, tls_verify) == -1)
+  if (tls_verify >= 0 && nbd_set_tls_verify_peer (c->nbd, tls_verify) == -1)
     goto err;
-  if (tls_username && nbd_set_tls_username (h->nbd, tls_username) == -1)
+  if (tls_username && nbd_set_tls_username (c->nbd, tls_username) == -1)
     goto err;
-  if (tls_psk && nbd_set_tls_psk_file (h->nbd, tls_psk) == -1)
+  if (tls_psk && nbd_set_tls_psk_file (c->nbd, tls_psk) == -1)
     goto err;
   if (uri)
-    r = nbd_connect_uri (h->nbd, uri);
+    r = nbd_connect_uri (c->nbd, uri);
   else if (sockname)
-    r = nbd_connect_unix (h->nbd, sockname);
+    r = nbd_connect_unix (c->nbd, sockname);
   else
-    r = nbd_connect_tcp (h->nbd, hostname, port);
+    r = nbd_connect_tcp (c->nbd, hostname, port);
   if (r == -1) {
     if (retries--) {
       nbdkit_debug ("connect failed; will try again: %s", nbd_get_error ());
-      nbd_close (h->nbd);
+      nbd_close (c->nbd);
       sleep (1);
       goto retry;
     }
     goto err;
   }
-  h->fd = nbd_aio_get_fd (h->nbd);
-  if (h->fd == -1)
+  c->fd = nbd_aio_get_fd (c->nbd);
+  if (c->fd == -1)
     goto err;
 
-  if (readonly)
-    h->readonly = true;
-
   /* Spawn a dedicated reader thread */
-  if ((errno = pthread_create (&h->reader, NULL, nbdplug_reader, h))) {
+  if ((errno = pthread_create (&c->reader, NULL, nbdplug_reader, c))) {
     nbdkit_error ("failed to initialize reader thread: %m");
     goto err;
   }
 
-  return h;
+  return 0;
 
  err:
-  close (h->fds[0]);
-  close (h->fds[1]);
-  nbdkit_error ("failure while creating nbd handle: %s", nbd_get_error ());
-  if (h->nbd)
-    nbd_close (h->nbd);
-  free (h);
-  return NULL;
+  close (c->fds[0]);
+  close (c->fds[1]);
+  if (extra)
+    nbdkit_debug ("failure while creating extra nbd handle: %s",
+                  nbd_get_error ());
+  else
+    nbdkit_error ("failure while creating nbd handle: %s", nbd_get_error ());
+  if (c->nbd)
+    nbd_close (c->nbd);
+  return -1;
+}
+
+/* Stop the reader thread and close one connection. */
+static void
+nbdplug_close_conn (struct conn *c)
+{
+  if (nbd_aio_disconnect (c->nbd, 0) == -1)
+    nbdkit_debug ("failed to clean up handle: %s", nbd_get_error ());
+  if ((errno = pthread_join (c->reader, NULL)))
+    nbdkit_debug ("failed to join reader thread: %m");
+  close (c->fds[0]);
+  close (c->fds[1]);
+  nbd_close (c->nbd);
+}
+
+/* Create the shared or per-connection handle. */
+static struct handle *
+nbdplug_open_handle (int readonly)
+{
+  struct handle *h;
+  struct conn *conn;
+
+  h = calloc (1, sizeof *h);
+  if (h == NULL) {
+    nbdkit_error ("malloc: %m");
+    return NULL;
+  }
+  h->conns = calloc (connections, sizeof *h->conns);
+  if (h->conns == NULL) {
+    nbdkit_error ("malloc: %m");
+    free (h);
+    return NULL;
+  }
+
+  if (nbdplug_open_conn (&h->conns[0], retry, false) == -1) {
+    free (h->conns);
+    free (h);
+    return NULL;
+  }
+  h->nr_conns = 1;
+
+  if (readonly)
+    h->readonly = true;
+
+  /* Extra connections are only safe if the server supports
+   * multi-conn, which also means that a flush sent on any connection
+   * covers the writes completed on all of them.  Failing to open an
+   * extra connection is not an error, we just use fewer.
+   */
+  if (connections > 1 &&
+      nbd_can_multi_conn (h->conns[0].nbd) != 1) {
+    nbdkit_debug ("server does not support multi-conn, "
+                  "using a single connection");
+    return h;
+  }
+  while (h->nr_conns < connections) {
+    conn = &h->conns[h->nr_conns];
+    if (nbdplug_open_conn (conn, 0, true) == -1)
+      break;
+    if (nbd_get_size (conn->nbd) != nbd_get_size (h->conns[0].nbd)) {
+      nbdkit_debug ("export size differs on extra connection");
+      nbdplug_close_conn (conn);
+      break;
+    }
+    h->nr_conns++;
+  }
+  nbdkit_debug ("using %zu connections to the server", h->nr_conns);
+
+  return h;
 }
 
 /* Create the per-connection handle. */
@@ -534,13 +652,11 @@ nbdplug_open (int readonly)
 static void
 nbdplug_close_handle (struct handle *h)
 {
-  if (nbd_aio_disconnect (h->nbd, 0) == -1)
-    nbdkit_debug ("failed to clean up handle: %s", nbd_get_error ());
-  if ((errno = pthread_join (h->reader, NULL)))
-    nbdkit_debug ("failed to join reader thread: %m");
-  close (h->fds[0]);
-  close (h->fds[1]);
-  nbd_close (h->nbd);
+  size_t i;
+
+  for (i = 0; i < h->nr_conns; ++i)
+    nbdplug_close_conn (&h->conns[i]);
+  free (h->conns);
   free (h);
 }
 
@@ -559,7 +675,7 @@ static int64_t
 nbdplug_get_size (void *handle)
 {
   struct handle *h = handle;
-  int64_t size = nbd_get_size (h->nbd);
+  int64_t size = nbd_get_size (h->conns[0].nbd);
 
   if (size == -1) {
     nbdkit_error ("failure to get size: %s", nbd_get_error ());
@@ -572,7 +688,7 @@ static int
 nbdplug_can_write (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_is_read_only (h->nbd);
+  int i = nbd_is_read_only (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check readonly flag: %s", nbd_get_error ());
@@ -585,7 +701,7 @@ static int
 nbdplug_can_flush (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_flush (h->nbd);
+  int i = nbd_can_flush (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check flush flag: %s", nbd_get_error ());
@@ -598,7 +714,7 @@ static int
 nbdplug_is_rotational (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_is_rotational (h->nbd);
+  int i = nbd_is_rotational (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check rotational flag: %s", nbd_get_error ());
@@ -611,7 +727,7 @@ static int
 nbdplug_can_trim (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_trim (h->nbd);
+  int i = nbd_can_trim (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check trim flag: %s", nbd_get_error ());
@@ -624,7 +740,7 @@ static int
 nbdplug_can_zero (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_zero (h->nbd);
+  int i = nbd_can_zero (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check zero flag: %s", nbd_get_error ());
@@ -638,7 +754,7 @@ nbdplug_can_fast_zero (void *handle)
 {
 #if LIBNBD_HAVE_NBD_CAN_FAST_ZERO
   struct handle *h = handle;
-  int i = nbd_can_fast_zero (h->nbd);
+  int i = nbd_can_fast_zero (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check fast zero flag: %s", nbd_get_error ());
@@ -655,7 +771,7 @@ static int
 nbdplug_can_fua (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_fua (h->nbd);
+  int i = nbd_can_fua (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check fua flag: %s", nbd_get_error ());
@@ -668,7 +784,7 @@ static int
 nbdplug_can_multi_conn (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_multi_conn (h->nbd);
+  int i = nbd_can_multi_conn (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check multi-conn flag: %s", nbd_get_error ());
@@ -681,7 +797,7 @@ static int
 nbdplug_can_cache (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_cache (h->nbd);
+  int i = nbd_can_cache (h->conns[0].nbd);
 
   if (i == -1) {
     nbdkit_error ("failure to check cache flag: %s", nbd_get_error ());
@@ -694,7 +810,7 @@ static int
 nbdplug_can_extents (void *handle)
 {
   struct handle *h = handle;
-  int i = nbd_can_meta_context (h->nbd, LIBNBD_CONTEXT_BASE_ALLOCATION);
+  int i = nbd_can_meta_context (h->conns[0].nbd, LIBNBD_CONTEXT_BASE_ALLOCATION);
 
   if (i == -1) {
     nbdkit_error ("failure to check extents ability: %s", nbd_get_error ());
@@ -709,13 +825,14 @@ nbdplug_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
                uint32_t flags)
 {
   struct handle *h = handle;
+  struct conn *c = nbdplug_pick (h);
   struct transaction s;
 
   assert (!flags);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_pread (h->nbd, buf, count, offset,
+  nbdplug_register (c, &s, nbd_aio_pread (c->nbd, buf, count, offset,
                                           s.cb, 0));
-  return nbdplug_reply (h, &s);
+  return nbdplug_reply (c, &s);
 }
 
 /* Write data to the file. */
@@ -724,14 +841,15 @@ nbdplug_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset,
                 uint32_t flags)
 {
   struct handle *h = handle;
+  struct conn *c = nbdplug_pick (h);
   struct transaction s;
   uint32_t f = flags & NBDKIT_FLAG_FUA ? LIBNBD_CMD_FLAG_FUA : 0;
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_pwrite (h->nbd, buf, count, offset,
+  nbdplug_register (c, &s, nbd_aio_pwrite (c->nbd, buf, count, offset,
                                            s.cb, f));
-  return nbdplug_reply (h, &s);
+  return nbdplug_reply (c, &s);
 }
 
 /* Write zeroes to the file. */
@@ -739,6 +857,7 @@ static int
 nbdplug_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
+  struct conn *c = nbdplug_pick (h);
   struct transaction s;
   uint32_t f = 0;
 
@@ -756,8 +875,8 @@ nbdplug_zero (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
   assert (!(flags & NBDKIT_FLAG_FAST_ZERO));
 #endif
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_zero (h->nbd, count, offset, s.cb, f));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (c, &s, nbd_aio_zero (c->nbd, count, offset, s.cb, f));
+  return nbdplug_reply (c, &s);
 }
 
 /* Trim a portion of the file. */
@@ -765,13 +884,14 @@ static int
 nbdplug_trim (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
+  struct conn *c = nbdplug_pick (h);
   struct transaction s;
   uint32_t f = flags & NBDKIT_FLAG_FUA ? LIBNBD_CMD_FLAG_FUA : 0;
 
   assert (!(flags & ~NBDKIT_FLAG_FUA));
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_trim (h->nbd, count, offset, s.cb, f));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (c, &s, nbd_aio_trim (c->nbd, count, offset, s.cb, f));
+  return nbdplug_reply (c, &s);
 }
 
 /* Flush the file to disk. */
@@ -779,12 +899,13 @@ static int
 nbdplug_flush (void *handle, uint32_t flags)
 {
   struct handle *h = handle;
+  struct conn *c = nbdplug_pick (h);
   struct transaction s;
 
   assert (!flags);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_flush (h->nbd, s.cb, 0));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (c, &s, nbd_aio_flush (c->nbd, s.cb, 0));
+  return nbdplug_reply (c, &s);
 }
 
 static int
@@ -814,15 +935,16 @@ nbdplug_extents (void *handle, uint32_t count, uint64_t offset,
                  uint32_t flags, struct nbdkit_extents *extents)
 {
   struct handle *h = handle;
+  struct conn *c = nbdplug_pick (h);
   struct transaction s;
   uint32_t f = flags & NBDKIT_FLAG_REQ_ONE ? LIBNBD_CMD_FLAG_REQ_ONE : 0;
   nbd_extent_callback extcb = { nbdplug_extent, extents };
 
   assert (!(flags & ~NBDKIT_FLAG_REQ_ONE));
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_block_status (h->nbd, count, offset,
+  nbdplug_register (c, &s, nbd_aio_block_status (c->nbd, count, offset,
                                                  extcb, s.cb, f));
-  return nbdplug_reply (h, &s);
+  return nbdplug_reply (c, &s);
 }
 
 /* Cache a portion of the file. */
@@ -830,12 +952,13 @@ static int
 nbdplug_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
 {
   struct handle *h = handle;
+  struct conn *c = nbdplug_pick (h);
   struct transaction s;
 
   assert (!flags);
   nbdplug_prepare (&s);
-  nbdplug_register (h, &s, nbd_aio_cache (h->nbd, count, offset, s.cb, 0));
-  return nbdplug_reply (h, &s);
+  nbdplug_register (c, &s, nbd_aio_cache (c->nbd, count, offset, s.cb, 0));
+  return nbdplug_reply (c, &s);
 }
 
 static struct nbdkit_plugin plugin = {
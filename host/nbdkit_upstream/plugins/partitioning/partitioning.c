@@ -315,11 +315,19 @@ partitioning_can_cache (void *handle)
 static int
 partitioning_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
 {
+  size_t nr;
+  const struct region *region = find_regions (&the_regions, offset, count, &nr);
+  const struct region *end = region + nr;
+
   while (count > 0) {
-    const struct region *region = find_region (&the_regions, offset);
     size_t i, len;
     ssize_t r;
 
+    /* A short read stays in the same region. */
+    if (offset > region->end)
+      region++;
+    assert (region < end);
+
     /* Length to end of region. */
     len = region->end - offset + 1;
     if (len > count)
@@ -364,11 +372,19 @@ static int
 partitioning_pwrite (void *handle,
                      const void *buf, uint32_t count, uint64_t offset)
 {
+  size_t nr;
+  const struct region *region = find_regions (&the_regions, offset, count, &nr);
+  const struct region *end = region + nr;
+
   while (count > 0) {
-    const struct region *region = find_region (&the_regions, offset);
     size_t i, len;
     ssize_t r;
 
+    /* A short write stays in the same region. */
+    if (offset > region->end)
+      region++;
+    assert (region < end);
+
     /* Length to end of region. */
     len = region->end - offset + 1;
     if (len > count)
@@ -40,6 +40,10 @@
 #include <errno.h>
 #include <time.h>
 
+#ifdef HAVE_X86_SIMD_TARGETS
+#include <immintrin.h>
+#endif
+
 #define NBDKIT_API_VERSION 2
 #include <nbdkit-plugin.h>
 
@@ -49,6 +53,68 @@
 /* The size of disk in bytes (initialized by size=<SIZE> parameter). */
 static int64_t size = 0;
 
+/* Write nr_words 8 byte words of the pattern to b, starting at the
+ * 8 byte aligned offset.  b need not be aligned.
+ */
+static void
+fill_generic (char *b, size_t nr_words, uint64_t offset)
+{
+  size_t i;
+  uint64_t d;
+
+  for (i = 0; i < nr_words; ++i) {
+    d = htobe64 (offset);
+    memcpy (b, &d, 8);
+    b += 8;
+    offset += 8;
+  }
+}
+
+#ifdef HAVE_X86_SIMD_TARGETS
+
+/* Keep four offsets in a vector, byte swap them and store them
+ * together.
+ */
+static void __attribute__((__target__ ("avx2")))
+fill_avx2 (char *b, size_t nr_words, uint64_t offset)
+{
+  const __m256i bswap = _mm256_setr_epi8 (7, 6, 5, 4, 3, 2, 1, 0,
+                                          15, 14, 13, 12, 11, 10, 9, 8,
+                                          7, 6, 5, 4, 3, 2, 1, 0,
+                                          15, 14, 13, 12, 11, 10, 9, 8);
+  const __m256i step = _mm256_set1_epi64x (64);
+  __m256i v0 = _mm256_setr_epi64x (offset, offset+8, offset+16, offset+24);
+  __m256i v1 = _mm256_add_epi64 (v0, _mm256_set1_epi64x (32));
+  size_t i;
+
+  for (i = 0; i + 8 <= nr_words; i += 8) {
+    _mm256_storeu_si256 ((__m256i *) b, _mm256_shuffle_epi8 (v0, bswap));
+    _mm256_storeu_si256 ((__m256i *) (b+32), _mm256_shuffle_epi8 (v1, bswap));
+    v0 = _mm256_add_epi64 (v0, step);
+    v1 = _mm256_add_epi64 (v1, step);
+    b += 64;
+  }
+  fill_generic (b, nr_words - i, offset + 8*i);
+}
+
+#endif /* HAVE_X86_SIMD_TARGETS */
+
+/* to enable: -D pattern.generic=1 */
+int pattern_debug_generic;
+
+static void (*fill) (char *b, size_t nr_words, uint64_t offset) =
+  fill_generic;
+
+/* Pick the best fill kernel for this CPU. */
+static void
+pattern_load (void)
+{
+#ifdef HAVE_X86_SIMD_TARGETS
+  if (!pattern_debug_generic && __builtin_cpu_supports ("avx2"))
+    fill = fill_avx2;
+#endif
+}
+
 static int
 pattern_config (const char *key, const char *value)
 {
@@ -114,22 +180,37 @@ pattern_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
   uint64_t o;
   uint32_t n;
 
-  while (count > 0) {
+  /* Partial word at the start. */
+  o = offset & 7;
+  if (o) {
     d = htobe64 (offset & ~7);
-    o = offset & 7;
     n = MIN (count, 8-o);
     memcpy (b, (char *)&d + o, n);
-    b += 8-o;
-    offset += 8-o;
+    b += n;
+    offset += n;
     count -= n;
   }
 
+  /* Whole words. */
+  n = count / 8;
+  fill (b, n, offset);
+  b += 8*n;
+  offset += 8*n;
+  count -= 8*n;
+
+  /* Partial word at the end. */
+  if (count > 0) {
+    d = htobe64 (offset);
+    memcpy (b, &d, count);
+  }
+
   return 0;
 }
 
 static struct nbdkit_plugin plugin = {
   .name              = "pattern",
   .version           = PACKAGE_VERSION,
+  .load              = pattern_load,
   .config            = pattern_config,
   .config_help       = pattern_config_help,
   .magic_config_key  = "size",
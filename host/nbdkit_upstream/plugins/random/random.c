@@ -40,9 +40,15 @@
 #include <errno.h>
 #include <time.h>
 
+#ifdef HAVE_X86_SIMD_TARGETS
+#include <immintrin.h>
+#endif
+
 #define NBDKIT_API_VERSION 2
 #include <nbdkit-plugin.h>
 
+#include "byte-swapping.h"
+#include "minmax.h"
 #include "random.h"
 
 /* The size of disk in bytes (initialized by size=<SIZE> parameter). */
@@ -51,6 +57,117 @@ static int64_t size = 0;
 /* Seed. */
 static uint32_t seed;
 
+/* The disk is made of 4 byte little endian words, and each word is
+ * computed from its index and the seed, so any part of the disk can
+ * be generated without running a PRNG from the start.
+ *
+ * The disk is split into windows of 2^32 words.  For each window two
+ * 32 bit keys are derived from the seed and the window number, and
+ * word i in the window is:
+ *
+ *   hash32 (hash32 (i ^ key1) ^ key2)
+ *
+ * hash32 is the "lowbias32" integer hash by Chris Wellons
+ * (https://nullprogram.com/blog/2018/07/31/).  It only uses 32 bit
+ * multiplies, shifts and xors so it vectorizes well.
+ */
+#define WINDOW_BITS 32
+
+struct keys {
+  uint32_t key1, key2;
+};
+
+static struct keys
+window_keys (uint64_t window)
+{
+  uint64_t s = (window << 32) | seed;
+  uint64_t k = snext (&s);
+  struct keys keys = { .key1 = k, .key2 = k >> 32 };
+
+  return keys;
+}
+
+static inline uint32_t
+hash32 (uint32_t x)
+{
+  x ^= x >> 16;
+  x *= UINT32_C(0x7feb352d);
+  x ^= x >> 15;
+  x *= UINT32_C(0x846ca68b);
+  x ^= x >> 16;
+  return x;
+}
+
+static inline uint32_t
+random_word (uint32_t i, const struct keys *keys)
+{
+  return htole32 (hash32 (hash32 (i ^ keys->key1) ^ keys->key2));
+}
+
+/* Write nr_words words to b, starting at index i in the window.  b
+ * need not be aligned.
+ */
+static void
+fill_generic (char *b, size_t nr_words, uint32_t i, const struct keys *keys)
+{
+  uint32_t w;
+
+  while (nr_words > 0) {
+    w = random_word (i, keys);
+    memcpy (b, &w, 4);
+    b += 4;
+    i++;
+    nr_words--;
+  }
+}
+
+#ifdef HAVE_X86_SIMD_TARGETS
+
+static inline __m256i __attribute__((__target__ ("avx2")))
+hash32_avx2 (__m256i x)
+{
+  const __m256i m1 = _mm256_set1_epi32 (0x7feb352d);
+  const __m256i m2 = _mm256_set1_epi32 (0x846ca68b);
+
+  x = _mm256_xor_si256 (x, _mm256_srli_epi32 (x, 16));
+  x = _mm256_mullo_epi32 (x, m1);
+  x = _mm256_xor_si256 (x, _mm256_srli_epi32 (x, 15));
+  x = _mm256_mullo_epi32 (x, m2);
+  x = _mm256_xor_si256 (x, _mm256_srli_epi32 (x, 16));
+  return x;
+}
+
+/* Hash eight consecutive indexes at a time. */
+static void __attribute__((__target__ ("avx2")))
+fill_avx2 (char *b, size_t nr_words, uint32_t i, const struct keys *keys)
+{
+  const __m256i key1 = _mm256_set1_epi32 (keys->key1);
+  const __m256i key2 = _mm256_set1_epi32 (keys->key2);
+  const __m256i step = _mm256_set1_epi32 (8);
+  __m256i idx = _mm256_add_epi32 (_mm256_set1_epi32 (i),
+                                  _mm256_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7));
+  __m256i x;
+
+  while (nr_words >= 8) {
+    x = hash32_avx2 (_mm256_xor_si256 (idx, key1));
+    x = hash32_avx2 (_mm256_xor_si256 (x, key2));
+    _mm256_storeu_si256 ((__m256i *) b, x);
+    idx = _mm256_add_epi32 (idx, step);
+    b += 32;
+    i += 8;
+    nr_words -= 8;
+  }
+  fill_generic (b, nr_words, i, keys);
+}
+
+#endif /* HAVE_X86_SIMD_TARGETS */
+
+/* to enable: -D random.generic=1 */
+int random_debug_generic;
+
+static void (*fill) (char *b, size_t nr_words, uint32_t i,
+                     const struct keys *keys) = fill_generic;
+
 static void
 random_load (void)
 {
@@ -59,6 +176,12 @@ random_load (void)
    * parameter.
    */
   seed = time (NULL);
+
+  /* Pick the best fill kernel for this CPU. */
+#ifdef HAVE_X86_SIMD_TARGETS
+  if (!random_debug_generic && __builtin_cpu_supports ("avx2"))
+    fill = fill_avx2;
+#endif
 }
 
 static int
@@ -126,31 +249,44 @@ static int
 random_pread (void *handle, void *buf, uint32_t count, uint64_t offset,
               uint32_t flags)
 {
-  uint32_t i;
-  unsigned char *b = buf;
-  uint64_t s;
-
-  for (i = 0; i < count; ++i) {
-    /* We use nbdkit common/include/random.h to make random numbers.
-     *
-     * However we're not quite using it in the ordinary way.  In order
-     * to be able to read any byte of data without needing to run the
-     * PRNG from the start, the random data is computed from the index
-     * and seed through three rounds of PRNG:
-     *
-     * index i     PRNG(seed+i)   -> PRNG -> PRNG -> mod 256 -> b[i]
-     * index i+1   PRNG(seed+i+1) -> PRNG -> PRNG -> mod 256 -> b[i+1]
-     * etc
-     */
-    struct random_state state;
-
-    xsrandom (seed + offset + i, &state);
-    xrandom (&state);
-    xrandom (&state);
-    s = xrandom (&state);
-    s &= 255;
-    b[i] = s;
+  char *b = buf;
+  uint64_t word = offset / 4;
+  uint64_t window_end;
+  struct keys keys = window_keys (word >> WINDOW_BITS);
+  uint32_t o, n, w;
+  size_t nr_words;
+
+  /* Partial word at the start. */
+  o = offset & 3;
+  if (o) {
+    w = random_word (word, &keys);
+    n = MIN (count, 4-o);
+    memcpy (b, (char *)&w + o, n);
+    b += n;
+    count -= n;
+    word++;
   }
+
+  /* Whole words, a window at a time. */
+  while (count >= 4) {
+    if ((word & ((UINT64_C(1) << WINDOW_BITS) - 1)) == 0)
+      keys = window_keys (word >> WINDOW_BITS);
+    window_end = (word | ((UINT64_C(1) << WINDOW_BITS) - 1)) + 1;
+    nr_words = MIN (count / 4, window_end - word);
+    fill (b, nr_words, word, &keys);
+    b += 4*nr_words;
+    count -= 4*nr_words;
+    word += nr_words;
+  }
+
+  /* Partial word at the end. */
+  if (count > 0) {
+    if ((word & ((UINT64_C(1) << WINDOW_BITS) - 1)) == 0)
+      keys = window_keys (word >> WINDOW_BITS);
+    w = random_word (word, &keys);
+    memcpy (b, &w, count);
+  }
+
   return 0;
 }
 
@@ -43,6 +43,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #include <nbdkit-plugin.h>
 
@@ -53,12 +54,12 @@
 DEFINE_VECTOR_TYPE(string_vector, char *);
 static string_vector filenames = empty_vector;
 
-/* Any callbacks using lseek must be protected by this lock. */
-static pthread_mutex_t lseek_lock = PTHREAD_MUTEX_INITIALIZER;
+static void stop_pool (void);
 
 static void
 split_unload (void)
 {
+  stop_pool ();
   string_vector_iter (&filenames, (void *) free);
   free (filenames.ptr);
 }
@@ -98,6 +99,12 @@ struct file {
   uint64_t offset, size;
   int fd;
   bool can_extents;
+
+  /* lseek(SEEK_DATA/SEEK_HOLE) moves the file offset, so callbacks
+   * using lseek on this file must hold this lock.  pread and pwrite
+   * don't need it.
+   */
+  pthread_mutex_t lseek_lock;
 };
 
 /* Create the per-connection handle. */
@@ -123,8 +130,10 @@ split_open (int readonly)
     free (h);
     return NULL;
   }
-  for (i = 0; i < filenames.size; ++i)
+  for (i = 0; i < filenames.size; ++i) {
     h->files[i].fd = -1;
+    pthread_mutex_init (&h->files[i].lseek_lock, NULL);
+  }
 
   /* Open the files. */
   flags = O_CLOEXEC|O_NOCTTY;
@@ -157,7 +166,6 @@ split_open (int readonly)
 
 #ifdef SEEK_HOLE
     /* Test if this file supports extents. */
-    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lseek_lock);
     r = lseek (h->files[i].fd, 0, SEEK_DATA);
     if (r == -1 && errno != ENXIO) {
       nbdkit_debug ("disabling extents: lseek on %s: %m", filenames.ptr[i]);
@@ -178,6 +186,7 @@ split_open (int readonly)
   for (i = 0; i < filenames.size; ++i) {
     if (h->files[i].fd >= 0)
       close (h->files[i].fd);
+    pthread_mutex_destroy (&h->files[i].lseek_lock);
   }
   free (h->files);
   free (h);
@@ -191,13 +200,15 @@ split_close (void *handle)
   struct handle *h = handle;
   size_t i;
 
-  for (i = 0; i < filenames.size; ++i)
+  for (i = 0; i < filenames.size; ++i) {
     close (h->files[i].fd);
+    pthread_mutex_destroy (&h->files[i].lseek_lock);
+  }
   free (h->files);
   free (h);
 }
 
-#define THREAD_MODEL NBDKIT_THREAD_MODEL_SERIALIZE_REQUESTS
+#define THREAD_MODEL NBDKIT_THREAD_MODEL_PARALLEL
 
 /* Get the disk size. */
 static int64_t
@@ -216,9 +227,9 @@ split_can_cache (void *handle)
    * cache.
    */
 #if HAVE_POSIX_FADVISE
-  return NBDKIT_FUA_NATIVE;
+  return NBDKIT_CACHE_NATIVE;
 #else
-  return NBDKIT_FUA_EMULATE;
+  return NBDKIT_CACHE_EMULATE;
 #endif
 }
 
@@ -242,68 +253,271 @@ get_file (struct handle *h, uint64_t offset)
                   compare_offset);
 }
 
-/* Read data. */
+/* Requests which span several files are split into one piece per
+ * file, and if the request is large enough the pieces are done in
+ * parallel by helper threads.  The calling thread and the helpers
+ * take pieces in turn until there are none left.
+ *
+ * The helpers are a pool of threads shared by all connections, which
+ * is started on the first large request (and not in .get_ready,
+ * because nbdkit may fork into the background after that).  If all of
+ * the helpers are busy the calling thread does the whole request.
+ */
+#define MAX_HELPERS 7
+#define MIN_PARALLEL_REQUEST (256 * 1024)
+
+struct piece {
+  struct file *file;
+  uint64_t foffs;
+  uint32_t count;
+  char *buf;
+};
+
+struct request {
+  bool write;
+  struct piece *pieces;
+  size_t nr_pieces;
+  size_t next;                  /* Next piece to do, atomic. */
+  int error;                    /* First errno, atomic. */
+
+  /* The following fields are protected by pool_lock. */
+  struct request *next_req;     /* List of requests wanting helpers. */
+  size_t helpers_wanted;        /* Helpers which may still join. */
+  size_t helpers_active;        /* Helpers working on this request. */
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t pool_threads[MAX_HELPERS];
+static size_t pool_size;        /* Number of helper threads running. */
+static bool pool_started;
+static bool pool_stop;
+static struct request *pool_requests; /* Requests wanting helpers. */
+
 static int
-split_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+do_piece (bool write, const struct piece *p)
 {
-  struct handle *h = handle;
+  char *buf = p->buf;
+  uint32_t count = p->count;
+  uint64_t foffs = p->foffs;
+  ssize_t r;
 
   while (count > 0) {
-    struct file *file = get_file (h, offset);
-    uint64_t foffs = offset - file->offset;
-    uint64_t max;
-    ssize_t r;
-
-    max = file->size - foffs;
-    if (max > count)
-      max = count;
-
-    r = pread (file->fd, buf, max, foffs);
-    if (r == -1) {
-      nbdkit_error ("pread: %m");
-      return -1;
+    if (!write) {
+      r = pread (p->file->fd, buf, count, foffs);
+      if (r == -1) {
+        nbdkit_error ("pread: %m");
+        return -1;
+      }
+      if (r == 0) {
+        nbdkit_error ("pread: unexpected end of file");
+        errno = EIO;
+        return -1;
+      }
     }
-    if (r == 0) {
-      nbdkit_error ("pread: unexpected end of file");
-      return -1;
+    else {
+      r = pwrite (p->file->fd, buf, count, foffs);
+      if (r == -1) {
+        nbdkit_error ("pwrite: %m");
+        return -1;
+      }
     }
     buf += r;
     count -= r;
-    offset += r;
+    foffs += r;
   }
 
   return 0;
 }
 
-/* Write data to the file. */
+static void
+do_pieces (struct request *req)
+{
+  size_t i;
+  int zero = 0;
+
+  while ((i = __atomic_fetch_add (&req->next, 1, __ATOMIC_RELAXED))
+         < req->nr_pieces) {
+    if (do_piece (req->write, &req->pieces[i]) == -1)
+      __atomic_compare_exchange_n (&req->error, &zero, errno ? errno : EIO,
+                                   false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  }
+}
+
+/* Remove req from the list of requests wanting helpers, if it is
+ * still there.  Call with pool_lock held.
+ */
+static void
+unlink_request (struct request *req)
+{
+  struct request **rp;
+
+  for (rp = &pool_requests; *rp != NULL; rp = &(*rp)->next_req) {
+    if (*rp == req) {
+      *rp = req->next_req;
+      break;
+    }
+  }
+}
+
+static void *
+helper_thread (void *vp)
+{
+  struct request *req;
+
+  pthread_mutex_lock (&pool_lock);
+  for (;;) {
+    while (!pool_stop && pool_requests == NULL)
+      pthread_cond_wait (&pool_work_cond, &pool_lock);
+    if (pool_stop)
+      break;
+
+    req = pool_requests;
+    if (--req->helpers_wanted == 0)
+      pool_requests = req->next_req;
+    req->helpers_active++;
+    pthread_mutex_unlock (&pool_lock);
+
+    do_pieces (req);
+
+    pthread_mutex_lock (&pool_lock);
+    if (--req->helpers_active == 0)
+      pthread_cond_broadcast (&pool_done_cond);
+  }
+  pthread_mutex_unlock (&pool_lock);
+  return NULL;
+}
+
+/* Start the helper threads.  Call with pool_lock held. */
+static void
+start_pool (void)
+{
+  int err;
+
+  pool_started = true;
+  for (; pool_size < MAX_HELPERS; ++pool_size) {
+    err = pthread_create (&pool_threads[pool_size], NULL,
+                          helper_thread, NULL);
+    if (err != 0) {
+      /* Not fatal, there will just be fewer helpers. */
+      errno = err;
+      nbdkit_debug ("pthread_create: %m");
+      break;
+    }
+  }
+  nbdkit_debug ("split: started %zu helper threads", pool_size);
+}
+
+static void
+stop_pool (void)
+{
+  size_t i;
+
+  pthread_mutex_lock (&pool_lock);
+  pool_stop = true;
+  pthread_cond_broadcast (&pool_work_cond);
+  pthread_mutex_unlock (&pool_lock);
+
+  for (i = 0; i < pool_size; ++i)
+    pthread_join (pool_threads[i], NULL);
+  pool_size = 0;
+}
+
 static int
-split_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
+do_request (struct handle *h, bool write,
+            char *buf, uint32_t count, uint64_t offset)
 {
-  struct handle *h = handle;
+  struct piece one;
+  CLEANUP_FREE struct piece *pieces = NULL;
+  struct request req = { .write = write };
+  bool queued = false;
+  struct file *file;
+  uint64_t max;
+
+  /* Common case: the request is within one file. */
+  file = get_file (h, offset);
+  if (offset - file->offset + count <= file->size) {
+    one.file = file;
+    one.foffs = offset - file->offset;
+    one.count = count;
+    one.buf = buf;
+    return do_piece (write, &one);
+  }
 
+  /* Split the request at file boundaries.  All but the last file
+   * must be at least 1 byte, so this is bounded by the number of
+   * files.
+   */
+  pieces = malloc (filenames.size * sizeof *pieces);
+  if (pieces == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
   while (count > 0) {
-    struct file *file = get_file (h, offset);
-    uint64_t foffs = offset - file->offset;
-    uint64_t max;
-    ssize_t r;
+    struct piece *p = &pieces[req.nr_pieces++];
+
+    file = get_file (h, offset);
+    p->file = file;
+    p->foffs = offset - file->offset;
+    max = file->size - p->foffs;
+    p->count = max < count ? max : count;
+    p->buf = buf;
+    buf += p->count;
+    count -= p->count;
+    offset += p->count;
+  }
+  req.pieces = pieces;
+
+  if (buf - pieces[0].buf >= MIN_PARALLEL_REQUEST) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+    if (!pool_started)
+      start_pool ();
+    req.helpers_wanted = req.nr_pieces - 1;
+    if (req.helpers_wanted > pool_size)
+      req.helpers_wanted = pool_size;
+    if (req.helpers_wanted > 0) {
+      req.next_req = pool_requests;
+      pool_requests = &req;
+      queued = true;
+      pthread_cond_broadcast (&pool_work_cond);
+    }
+  }
 
-    max = file->size - foffs;
-    if (max > count)
-      max = count;
+  do_pieces (&req);
 
-    r = pwrite (file->fd, buf, max, offset);
-    if (r == -1) {
-      nbdkit_error ("pwrite: %m");
-      return -1;
-    }
-    buf += r;
-    count -= r;
-    offset += r;
+  /* Stop more helpers from joining in, and wait for the ones which
+   * did to finish with req before it goes out of scope.
+   */
+  if (queued) {
+    ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&pool_lock);
+    unlink_request (&req);
+    while (req.helpers_active > 0)
+      pthread_cond_wait (&pool_done_cond, &pool_lock);
   }
 
+  if (req.error) {
+    errno = req.error;
+    return -1;
+  }
   return 0;
 }
 
+/* Read data. */
+static int
+split_pread (void *handle, void *buf, uint32_t count, uint64_t offset)
+{
+  return do_request (handle, false, buf, count, offset);
+}
+
+/* Write data to the file. */
+static int
+split_pwrite (void *handle, const void *buf, uint32_t count, uint64_t offset)
+{
+  /* The buffer is not modified when writing. */
+  return do_request (handle, true, (char *) buf, count, offset);
+}
+
 #if HAVE_POSIX_FADVISE
 /* Caching. */
 static int
@@ -322,14 +536,14 @@ split_cache (void *handle, uint32_t count, uint64_t offset, uint32_t flags)
     if (max > count)
       max = count;
 
-    r = posix_fadvise (file->fd, offset, max, POSIX_FADV_WILLNEED);
+    r = posix_fadvise (file->fd, foffs, max, POSIX_FADV_WILLNEED);
     if (r) {
       errno = r;
       nbdkit_error ("posix_fadvise: %m");
       return -1;
     }
-    count -= r;
-    offset += r;
+    count -= max;
+    offset += max;
   }
 
   return 0;
@@ -417,7 +631,7 @@ split_extents (void *handle, uint32_t count, uint64_t offset,
       max = count;
 
     if (file->can_extents) {
-      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&lseek_lock);
+      ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&file->lseek_lock);
       max = r = do_extents (file, max, foffs, req_one, extents);
     }
     else
@@ -249,6 +249,7 @@ new_connection (int sockin, int sockout, int nworkers)
   pthread_mutex_init (&conn->read_lock, NULL);
   pthread_mutex_init (&conn->write_lock, NULL);
   pthread_mutex_init (&conn->status_lock, NULL);
+  pthread_mutex_init (&conn->crypto_lock, NULL);
 
   conn->handles = calloc (top->i + 1, sizeof *conn->handles);
   if (conn->handles == NULL) {
@@ -324,6 +325,7 @@ new_connection (int sockin, int sockout, int nworkers)
   pthread_mutex_destroy (&conn->read_lock);
   pthread_mutex_destroy (&conn->write_lock);
   pthread_mutex_destroy (&conn->status_lock);
+  pthread_mutex_destroy (&conn->crypto_lock);
   free (conn);
   return NULL;
 }
@@ -355,6 +357,7 @@ free_connection (struct connection *conn)
   pthread_mutex_destroy (&conn->read_lock);
   pthread_mutex_destroy (&conn->write_lock);
   pthread_mutex_destroy (&conn->status_lock);
+  pthread_mutex_destroy (&conn->crypto_lock);
 
   free (conn->handles);
   free (conn);
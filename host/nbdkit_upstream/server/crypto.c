@@ -43,6 +43,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <assert.h>
 
@@ -52,6 +53,20 @@
 
 #include <gnutls/gnutls.h>
 
+#if defined(HAVE_LINUX_TLS_H) && defined(HAVE_GNUTLS_RECORD_GET_STATE)
+#define USE_KTLS 1
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
+
 static int crypto_auth;
 #define CRYPTO_AUTH_CERTIFICATES 1
 #define CRYPTO_AUTH_PSK 2
@@ -308,6 +323,59 @@ crypto_free (void)
   gnutls_global_deinit ();
 }
 
+/* In TLS 1.3 the client can send a KeyUpdate at any time, and when it
+ * asks for one in return GnuTLS sends it from inside
+ * gnutls_record_recv.  This corrupts the session if another worker
+ * thread is in gnutls_record_send at the same time, so with TLS 1.3
+ * the calls into GnuTLS are serialized by conn->crypto_lock.  To
+ * avoid holding the lock while the client is idle, wait for the
+ * socket to become readable before taking it.
+ */
+static ssize_t
+record_recv (gnutls_session_t session, void *buf, size_t len)
+{
+  GET_CONN;
+  struct pollfd fds[1];
+
+  if (gnutls_protocol_get_version (session) != GNUTLS_TLS1_3)
+    return gnutls_record_recv (session, buf, len);
+
+  if (gnutls_record_check_pending (session) == 0) {
+    fds[0].fd = conn->sockin;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    if (poll (fds, 1, -1) == -1 && errno == EINTR)
+      return GNUTLS_E_INTERRUPTED;
+  }
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->crypto_lock);
+  return gnutls_record_recv (session, buf, len);
+}
+
+static ssize_t
+record_send (gnutls_session_t session, const void *buf, size_t len)
+{
+  GET_CONN;
+
+  if (gnutls_protocol_get_version (session) != GNUTLS_TLS1_3)
+    return gnutls_record_send (session, buf, len);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->crypto_lock);
+  return gnutls_record_send (session, buf, len);
+}
+
+static int
+record_uncork (gnutls_session_t session)
+{
+  GET_CONN;
+
+  if (gnutls_protocol_get_version (session) != GNUTLS_TLS1_3)
+    return gnutls_record_uncork (session, GNUTLS_RECORD_WAIT);
+
+  ACQUIRE_LOCK_FOR_CURRENT_SCOPE (&conn->crypto_lock);
+  return gnutls_record_uncork (session, GNUTLS_RECORD_WAIT);
+}
+
 /* Read buffer from GnuTLS and either succeed completely
  * (returns > 0), read an EOF (returns 0), or fail (returns -1).
  */
@@ -323,7 +391,7 @@ crypto_recv (void *vbuf, size_t len)
   assert (session != NULL);
 
   while (len > 0) {
-    r = gnutls_record_recv (session, buf, len);
+    r = record_recv (session, buf, len);
     if (r < 0) {
       if (r == GNUTLS_E_INTERRUPTED || r == GNUTLS_E_AGAIN)
         continue;
@@ -366,14 +434,14 @@ crypto_send (const void *vbuf, size_t len, int flags)
   assert (session != NULL);
 
   if (len + gnutls_record_check_corked (session) > MAX_SEND_MORE_LEN) {
-    if (gnutls_record_uncork (session, GNUTLS_RECORD_WAIT) < 0)
+    if (record_uncork (session) < 0)
       return -1;
   }
   else if (flags & SEND_MORE)
     gnutls_record_cork (session);
 
   while (len > 0) {
-    r = gnutls_record_send (session, buf, len);
+    r = record_send (session, buf, len);
     if (r < 0) {
       if (r == GNUTLS_E_INTERRUPTED || r == GNUTLS_E_AGAIN)
         continue;
@@ -384,12 +452,296 @@ crypto_send (const void *vbuf, size_t len, int flags)
   }
 
   if (!(flags & SEND_MORE) &&
-      gnutls_record_uncork (session, GNUTLS_RECORD_WAIT) < 0)
+      record_uncork (session) < 0)
     return -1;
 
   return 0;
 }
 
+#ifdef USE_KTLS
+
+/* Kernel TLS (kTLS).  After the handshake we can hand the session
+ * keys to the kernel, which then does record encryption and
+ * decryption on the socket.  Reads and writes become ordinary socket
+ * calls, saving a copy and letting the kernel coalesce replies with
+ * MSG_MORE.  If anything is not supported we carry on using GnuTLS.
+ *
+ * This is only done with TLS 1.2.  A TLS 1.3 client can send a
+ * KeyUpdate at any time, which the kernel cannot handle, and GnuTLS
+ * would answer it using keys that are stale once they are in the
+ * kernel.
+ */
+
+/* TLS record content types. */
+#define TLS_RECORD_ALERT 21
+#define TLS_RECORD_APPLICATION_DATA 23
+
+/* The kernel's description of the keys for one direction. */
+struct ktls_keys {
+  union {
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 aes128;
+    struct tls12_crypto_info_aes_gcm_256 aes256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    struct tls12_crypto_info_chacha20_poly1305 chacha;
+#endif
+  } ci;
+  socklen_t len;
+};
+
+/* Get the keys for one direction of the session in the form the
+ * kernel wants.  Returns 0 on success, or -1 if this cipher or
+ * protocol version cannot be offloaded.
+ */
+static int
+ktls_get_keys (gnutls_session_t session, bool read, struct ktls_keys *keys)
+{
+  gnutls_protocol_t version = gnutls_protocol_get_version (session);
+  gnutls_cipher_algorithm_t cipher = gnutls_cipher_get (session);
+  gnutls_datum_t mac_key, iv, cipher_key;
+  unsigned char seq[8];
+  int err;
+
+  memset (keys, 0, sizeof *keys);
+  if (version != GNUTLS_TLS1_2) {
+    debug ("kTLS: unsupported protocol version %s",
+           gnutls_protocol_get_name (version));
+    return -1;
+  }
+  keys->ci.info.version = TLS_1_2_VERSION;
+
+  err = gnutls_record_get_state (session, read, &mac_key, &iv, &cipher_key,
+                                 seq);
+  if (err < 0) {
+    debug ("kTLS: gnutls_record_get_state: %s", gnutls_strerror (err));
+    return -1;
+  }
+
+  /* The GCM ciphers use the 4 byte implicit IV as salt, and the
+   * explicit nonce is the sequence number.
+   */
+#define SET_GCM_KEYS(field, CIPHER)                                     \
+  do {                                                                  \
+    if (cipher_key.size != TLS_CIPHER_##CIPHER##_KEY_SIZE)              \
+      return -1;                                                        \
+    keys->ci.field.info.cipher_type = TLS_CIPHER_##CIPHER;              \
+    memcpy (keys->ci.field.key, cipher_key.data,                        \
+            TLS_CIPHER_##CIPHER##_KEY_SIZE);                            \
+    memcpy (keys->ci.field.salt, iv.data, TLS_CIPHER_##CIPHER##_SALT_SIZE); \
+    memcpy (keys->ci.field.iv, seq, TLS_CIPHER_##CIPHER##_IV_SIZE);     \
+    memcpy (keys->ci.field.rec_seq, seq,                                \
+            TLS_CIPHER_##CIPHER##_REC_SEQ_SIZE);                        \
+    keys->len = sizeof keys->ci.field;                                  \
+  } while (0)
+
+  switch (cipher) {
+  case GNUTLS_CIPHER_AES_128_GCM:
+    SET_GCM_KEYS (aes128, AES_GCM_128);
+    break;
+  case GNUTLS_CIPHER_AES_256_GCM:
+    SET_GCM_KEYS (aes256, AES_GCM_256);
+    break;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+  case GNUTLS_CIPHER_CHACHA20_POLY1305:
+    if (cipher_key.size != TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE ||
+        iv.size != TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE)
+      return -1;
+    keys->ci.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+    memcpy (keys->ci.chacha.key, cipher_key.data,
+            TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+    memcpy (keys->ci.chacha.iv, iv.data,
+            TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+    memcpy (keys->ci.chacha.rec_seq, seq,
+            TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+    keys->len = sizeof keys->ci.chacha;
+    break;
+#endif
+  default:
+    debug ("kTLS: unsupported cipher %s", gnutls_cipher_get_name (cipher));
+    return -1;
+  }
+#undef SET_GCM_KEYS
+
+  return 0;
+}
+
+/* Install the keys for one direction in the kernel. */
+static int
+ktls_set_keys (int sock, bool read, const struct ktls_keys *keys)
+{
+  if (setsockopt (sock, SOL_TLS, read ? TLS_RX : TLS_TX,
+                  &keys->ci, keys->len) == -1) {
+    debug ("kTLS: setsockopt: %s: %m", read ? "TLS_RX" : "TLS_TX");
+    return -1;
+  }
+  return 0;
+}
+
+/* Read from a kTLS socket.  This has the same semantics as
+ * crypto_recv.  We must use recvmsg to see the record type, since
+ * the kernel only decrypts records and does not interpret them.
+ */
+static int
+ktls_recv (void *vbuf, size_t len)
+{
+  GET_CONN;
+  char *buf = vbuf;
+  ssize_t r;
+  bool first_read = true;
+  char cmsgbuf[CMSG_SPACE (sizeof (unsigned char))];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  unsigned char type;
+
+  while (len > 0) {
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset (&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf;
+    msg.msg_controllen = sizeof cmsgbuf;
+
+    r = recvmsg (conn->sockin, &msg, 0);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR (&msg);
+    if (r > 0 && cmsg != NULL &&
+        cmsg->cmsg_level == SOL_TLS &&
+        cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+      type = *CMSG_DATA (cmsg);
+      if (type != TLS_RECORD_APPLICATION_DATA) {
+        /* A close_notify alert is the normal end of the session.
+         * Receive is only offloaded with TLS 1.2, where anything else
+         * (other alerts, renegotiation) is not something we support.
+         */
+        if (type == TLS_RECORD_ALERT && r == 2 && buf[1] == 0)
+          r = 0;
+        else {
+          nbdkit_error ("kTLS: unexpected TLS record type %d", type);
+          errno = EIO;
+          return -1;
+        }
+      }
+    }
+
+    if (r == 0) {
+      if (first_read)
+        return 0;
+      /* Partial record read.  This is an error. */
+      errno = EBADMSG;
+      return -1;
+    }
+    first_read = false;
+    buf += r;
+    len -= r;
+  }
+
+  return 1;
+}
+
+/* Write to a kTLS socket.  This has the same semantics as
+ * crypto_send, but SEND_MORE is passed to the kernel as MSG_MORE so
+ * that a reply header and its data are sent in the same record.
+ */
+static int
+ktls_send (const void *vbuf, size_t len, int flags)
+{
+  GET_CONN;
+  const char *buf = vbuf;
+  ssize_t r;
+  int f = 0;
+
+  if (flags & SEND_MORE)
+    f |= MSG_MORE;
+  while (len > 0) {
+    r = send (conn->sockout, buf, len, f);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    buf += r;
+    len -= r;
+  }
+
+  return 0;
+}
+
+/* Send a close_notify alert, the kTLS equivalent of gnutls_bye. */
+static void
+ktls_send_close_notify (int sock)
+{
+  unsigned char alert[2] = { 1 /* warning */, 0 /* close_notify */ };
+  char cmsgbuf[CMSG_SPACE (sizeof (unsigned char))];
+  struct iovec iov = { .iov_base = alert, .iov_len = sizeof alert };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsgbuf;
+  msg.msg_controllen = sizeof cmsgbuf;
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_TLS;
+  cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (unsigned char));
+  *CMSG_DATA (cmsg) = TLS_RECORD_ALERT;
+
+  sendmsg (sock, &msg, 0);
+}
+
+/* Try to enable kTLS on the connection after the handshake.  This
+ * sets conn->recv and conn->send for whichever directions could be
+ * offloaded.  Receiving is offloaded first and sending only if that
+ * worked, so GnuTLS never reads a message that it answers itself.
+ */
+static void
+ktls_enable (gnutls_session_t session, int sockin, int sockout)
+{
+  GET_CONN;
+  struct ktls_keys send_keys, recv_keys;
+
+  if (no_ktls)
+    return;
+
+  /* kTLS works on a single TCP socket.  If GnuTLS has already
+   * buffered decrypted data we cannot switch over either.
+   */
+  if (sockin != sockout || gnutls_record_check_pending (session) > 0)
+    return;
+
+  /* Check that the keys can be offloaded before attaching the TLS
+   * layer to the socket.
+   */
+  if (ktls_get_keys (session, false, &send_keys) == -1 ||
+      ktls_get_keys (session, true, &recv_keys) == -1)
+    return;
+
+  if (setsockopt (sockout, SOL_TCP, TCP_ULP, "tls", sizeof "tls") == -1) {
+    debug ("kTLS not available: setsockopt: TCP_ULP: %m");
+    return;
+  }
+
+  if (ktls_set_keys (sockin, true, &recv_keys) == -1)
+    return;
+  conn->recv = ktls_recv;
+  if (ktls_set_keys (sockout, false, &send_keys) == 0)
+    conn->send = ktls_send;
+
+  debug ("kTLS enabled for: %s%s",
+         conn->send == ktls_send ? "send " : "",
+         conn->recv == ktls_recv ? "recv" : "");
+}
+
+#endif /* USE_KTLS */
+
 /* There's no place in the NBD protocol to send back errors from
  * close, so this function ignores errors.
  */
@@ -404,6 +756,16 @@ crypto_close (void)
 
   gnutls_transport_get_int2 (session, &sockin, &sockout);
 
+#ifdef USE_KTLS
+  /* If the keys are in the kernel, GnuTLS no longer knows the
+   * current sequence numbers and must not send or receive.
+   */
+  if (conn->send == ktls_send)
+    ktls_send_close_notify (sockout);
+  else if (conn->recv == ktls_recv)
+    gnutls_bye (session, GNUTLS_SHUT_WR);
+  else
+#endif
   gnutls_bye (session, GNUTLS_SHUT_RDWR);
 
   if (sockin >= 0)
@@ -527,6 +889,9 @@ crypto_negotiate_tls (int sockin, int sockout)
   conn->recv = crypto_recv;
   conn->send = crypto_send;
   conn->close = crypto_close;
+#ifdef USE_KTLS
+  ktls_enable (session, sockin, sockout);
+#endif
   return 0;
 
  error:
@@ -112,13 +112,21 @@ enum log_to {
   LOG_TO_NULL,           /* --log=null forced on the command line */
 };
 
+enum detect_zeroes {
+  DETECT_ZEROES_OFF,     /* default: writes are passed through */
+  DETECT_ZEROES_ON,      /* --detect-zeroes=on: zero writes become zero */
+  DETECT_ZEROES_UNMAP,   /* --detect-zeroes=unmap: ... with may_trim */
+};
+
 extern struct debug_flag *debug_flags;
+extern enum detect_zeroes detect_zeroes;
 extern const char *exportname;
 extern bool foreground;
 extern const char *ipaddr;
 extern enum log_to log_to;
 extern unsigned mask_handshake;
 extern bool newstyle;
+extern bool no_ktls;
 extern bool no_sr;
 extern const char *port;
 extern bool read_only;
@@ -247,6 +255,7 @@ struct connection {
   int status; /* 1 for more I/O with client, 0 for shutdown, -1 on error */
   int status_pipe[2]; /* track status changes via poll when nworkers > 1 */
   void *crypto_session;
+  pthread_mutex_t crypto_lock;  /* serializes TLS 1.3 calls, see crypto.c */
   int nworkers;
 
   struct handle *handles;       /* One per plugin and filter. */
@@ -515,6 +524,9 @@ extern int threadlocal_get_error (void);
 extern void *threadlocal_buffer (size_t size);
 extern void threadlocal_set_conn (struct connection *conn);
 extern struct connection *threadlocal_get_conn (void);
+extern void threadlocal_set_in_request (bool in_request);
+extern bool threadlocal_have_after_reply (void);
+extern void threadlocal_run_after_reply (void);
 
 /* Macro which sets local variable struct connection *conn from
  * thread-local storage, asserting that it is non-NULL.  If you want
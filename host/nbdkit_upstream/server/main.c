@@ -78,6 +78,7 @@ static void write_pidfile (void);
 static bool is_config_key (const char *key, size_t len);
 
 struct debug_flag *debug_flags; /* -D */
+enum detect_zeroes detect_zeroes = DETECT_ZEROES_OFF; /* --detect-zeroes */
 bool exit_with_parent;          /* --exit-with-parent */
 const char *exportname;         /* -e */
 bool foreground;                /* -f */
@@ -85,6 +86,7 @@ const char *ipaddr;             /* -i */
 enum log_to log_to = LOG_TO_DEFAULT; /* --log */
 unsigned mask_handshake = ~0U;  /* --mask-handshake */
 bool newstyle = true;           /* false = -o, true = -n */
+bool no_ktls;                   /* --no-ktls */
 bool no_sr;                     /* --no-sr */
 char *pidfile;                  /* -P */
 const char *port;               /* -p */
@@ -252,6 +254,21 @@ main (int argc, char *argv[])
       }
       break;
 
+    case DETECT_ZEROES_OPTION:
+      if (strcmp (optarg, "off") == 0)
+        detect_zeroes = DETECT_ZEROES_OFF;
+      else if (strcmp (optarg, "on") == 0)
+        detect_zeroes = DETECT_ZEROES_ON;
+      else if (strcmp (optarg, "unmap") == 0)
+        detect_zeroes = DETECT_ZEROES_UNMAP;
+      else {
+        fprintf (stderr, "%s: "
+                 "--detect-zeroes must be \"off\", \"on\" or \"unmap\"\n",
+                 program_name);
+        exit (EXIT_FAILURE);
+      }
+      break;
+
     case LOG_OPTION:
       if (strcmp (optarg, "stderr") == 0)
         log_to = LOG_TO_STDERR;
@@ -376,6 +393,10 @@ main (int argc, char *argv[])
       newstyle = true;
       break;
 
+    case NO_KTLS_OPTION:
+      no_ktls = true;
+      break;
+
     case NO_SR_OPTION:
       no_sr = true;
       break;
@@ -40,6 +40,7 @@
 
 enum {
   HELP_OPTION = CHAR_MAX + 1,
+  DETECT_ZEROES_OPTION,
   DUMP_CONFIG_OPTION,
   DUMP_PLUGIN_OPTION,
   EXIT_WITH_PARENT_OPTION,
@@ -47,6 +48,7 @@ enum {
   LOG_OPTION,
   LONG_OPTIONS_OPTION,
   MASK_HANDSHAKE_OPTION,
+  NO_KTLS_OPTION,
   NO_SR_OPTION,
   RUN_OPTION,
   SELINUX_LABEL_OPTION,
@@ -62,6 +64,7 @@ enum {
 static const char *short_options = "D:e:fg:i:nop:P:rst:u:U:vV";
 static const struct option long_options[] = {
   { "debug",            required_argument, NULL, 'D' },
+  { "detect-zeroes",    required_argument, NULL, DETECT_ZEROES_OPTION },
   { "dump-config",      no_argument,       NULL, DUMP_CONFIG_OPTION },
   { "dump-plugin",      no_argument,       NULL, DUMP_PLUGIN_OPTION },
   { "exit-with-parent", no_argument,       NULL, EXIT_WITH_PARENT_OPTION },
@@ -80,6 +83,7 @@ static const struct option long_options[] = {
   { "mask-handshake",   required_argument, NULL, MASK_HANDSHAKE_OPTION },
   { "new-style",        no_argument,       NULL, 'n' },
   { "newstyle",         no_argument,       NULL, 'n' },
+  { "no-ktls",          no_argument,       NULL, NO_KTLS_OPTION },
   { "no-sr",            no_argument,       NULL, NO_SR_OPTION },
   { "old-style",        no_argument,       NULL, 'o' },
   { "oldstyle",         no_argument,       NULL, 'o' },
@@ -44,6 +44,7 @@
 
 #include "internal.h"
 #include "byte-swapping.h"
+#include "iszero.h"
 #include "minmax.h"
 #include "nbd-protocol.h"
 #include "protostrings.h"
@@ -245,6 +246,26 @@ handle_request (uint16_t cmd, uint16_t flags, uint64_t offset, uint32_t count,
   case NBD_CMD_WRITE:
     if (flags & NBD_CMD_FLAG_FUA)
       f |= NBDKIT_FLAG_FUA;
+    if (detect_zeroes != DETECT_ZEROES_OFF &&
+        backend_can_zero (top) == NBDKIT_ZERO_NATIVE &&
+        is_zero (buf, count)) {
+      uint32_t zf = f;
+
+      /* Use a fast zero if possible, so that if the plugin can only
+       * zero by writing we fall back to the write we already have.
+       */
+      if (detect_zeroes == DETECT_ZEROES_UNMAP)
+        zf |= NBDKIT_FLAG_MAY_TRIM;
+      if (backend_can_fast_zero (top) == 1)
+        zf |= NBDKIT_FLAG_FAST_ZERO;
+      if (backend_zero (top, count, offset, zf, &err) == 0)
+        break;
+      if (!(zf & NBDKIT_FLAG_FAST_ZERO) ||
+          (err != ENOTSUP && err != EOPNOTSUPP))
+        return err;
+      threadlocal_set_error (0);
+      err = 0;
+    }
     if (backend_pwrite (top, buf, count, offset, f, &err) == -1)
       return err;
     break;
@@ -613,6 +634,20 @@ send_structured_reply_error (uint64_t handle, uint16_t cmd, uint16_t flags,
   return 1;                     /* command processed ok */
 }
 
+/* Run the work which filters deferred with nbdkit_after_reply.  Like
+ * the request itself, it runs inside the request lock.
+ */
+static void
+run_after_reply (void)
+{
+  if (!threadlocal_have_after_reply ())
+    return;
+
+  lock_request ();
+  threadlocal_run_after_reply ();
+  unlock_request ();
+}
+
 int
 protocol_recv_request_send_reply (void)
 {
@@ -710,15 +745,19 @@ protocol_recv_request_send_reply (void)
   }
   else {
     lock_request ();
+    threadlocal_set_in_request (true);
     error = handle_request (cmd, flags, offset, count, buf, extents);
+    threadlocal_set_in_request (false);
     assert ((int) error >= 0);
     unlock_request ();
   }
 
   /* Send the reply packet. */
  send_reply:
-  if (connection_get_status () < 0)
-    return -1;
+  if (connection_get_status () < 0) {
+    r = -1;
+    goto out;
+  }
 
   if (error != 0) {
     /* Since we're about to send only the limited NBD_E* errno to the
@@ -739,19 +778,23 @@ protocol_recv_request_send_reply (void)
       (cmd == NBD_CMD_READ || cmd == NBD_CMD_BLOCK_STATUS)) {
     if (!error) {
       if (cmd == NBD_CMD_READ)
-        return send_structured_reply_read (request.handle, cmd,
-                                           buf, count, offset);
+        r = send_structured_reply_read (request.handle, cmd,
+                                        buf, count, offset);
       else /* NBD_CMD_BLOCK_STATUS */
-        return send_structured_reply_block_status (request.handle,
-                                                   cmd, flags,
-                                                   count, offset,
-                                                   extents);
+        r = send_structured_reply_block_status (request.handle,
+                                                cmd, flags,
+                                                count, offset,
+                                                extents);
     }
     else
-      return send_structured_reply_error (request.handle, cmd, flags,
-                                          error);
+      r = send_structured_reply_error (request.handle, cmd, flags,
+                                       error);
   }
   else
-    return send_simple_reply (request.handle, cmd, flags, buf, count,
-                              error);
+    r = send_simple_reply (request.handle, cmd, flags, buf, count,
+                           error);
+
+ out:
+  run_after_reply ();
+  return r;
 }
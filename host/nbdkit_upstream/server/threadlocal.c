@@ -34,6 +34,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
@@ -52,6 +53,13 @@
  * *unless* it is serving a request (the '-s' option).
  */
 
+/* Work deferred by nbdkit_after_reply. */
+struct after_reply {
+  struct after_reply *next;
+  void (*fn) (void *opaque);
+  void *opaque;
+};
+
 struct threadlocal {
   char *name;                   /* Can be NULL. */
   size_t instance_num;          /* Can be 0. */
@@ -59,6 +67,9 @@ struct threadlocal {
   void *buffer;
   size_t buffer_size;
   struct connection *conn;
+  bool in_request;              /* Serving a request. */
+  struct after_reply *after_reply; /* List in the order it was added. */
+  struct after_reply **after_reply_tail;
 };
 
 static pthread_key_t threadlocal_key;
@@ -67,7 +78,12 @@ static void
 free_threadlocal (void *threadlocalv)
 {
   struct threadlocal *threadlocal = threadlocalv;
+  struct after_reply *a;
 
+  while ((a = threadlocal->after_reply) != NULL) {
+    threadlocal->after_reply = a->next;
+    free (a);
+  }
   free (threadlocal->name);
   free (threadlocal->buffer);
   free (threadlocal);
@@ -227,3 +243,69 @@ threadlocal_get_conn (void)
 
   return threadlocal ? threadlocal->conn : NULL;
 }
+
+/* Set while the current thread is serving a request, which is when
+ * nbdkit_after_reply may be called.
+ */
+void
+threadlocal_set_in_request (bool in_request)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+
+  if (threadlocal)
+    threadlocal->in_request = in_request;
+}
+
+bool
+threadlocal_have_after_reply (void)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+
+  return threadlocal && threadlocal->after_reply != NULL;
+}
+
+/* Run and free the work deferred by nbdkit_after_reply. */
+void
+threadlocal_run_after_reply (void)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  struct after_reply *a;
+
+  if (!threadlocal)
+    return;
+
+  while ((a = threadlocal->after_reply) != NULL) {
+    threadlocal->after_reply = a->next;
+    a->fn (a->opaque);
+    free (a);
+  }
+}
+
+int
+nbdkit_after_reply (void (*fn) (void *opaque), void *opaque)
+{
+  struct threadlocal *threadlocal = pthread_getspecific (threadlocal_key);
+  struct after_reply *a;
+
+  if (!threadlocal || !threadlocal->in_request) {
+    nbdkit_error ("nbdkit_after_reply can only be called "
+                  "while serving a request");
+    errno = EINVAL;
+    return -1;
+  }
+
+  a = malloc (sizeof *a);
+  if (a == NULL) {
+    nbdkit_error ("malloc: %m");
+    return -1;
+  }
+  a->next = NULL;
+  a->fn = fn;
+  a->opaque = opaque;
+
+  if (threadlocal->after_reply == NULL)
+    threadlocal->after_reply_tail = &threadlocal->after_reply;
+  *threadlocal->after_reply_tail = a;
+  threadlocal->after_reply_tail = &a->next;
+  return 0;
+}
@@ -0,0 +1,137 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test that the pattern and random plugins return the same data with
+ * the vector fill kernels as with the portable code, which is forced
+ * with -D PLUGIN.generic=1.  On CPUs without AVX2 both servers use
+ * the portable code and the test checks nothing interesting.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libnbd.h>
+
+#include "test.h"
+
+/* Larger than one window of the random plugin (2^32 words). */
+#define SIZE "20G"
+#define WINDOW (UINT64_C(4) << 32)
+
+#define MAX_COUNT (256 * 1024)
+
+/* Start the plugin, with the debug flag if not NULL.  seed is only
+ * given to the random plugin.
+ */
+static struct nbd_handle *
+start (const char *plugin, const char *flag, const char *seed)
+{
+  struct nbd_handle *nbd;
+  int r;
+
+  if (flag)
+    r = test_start_nbdkit ("-D", flag, plugin, "size=" SIZE, seed, NULL);
+  else
+    r = test_start_nbdkit (plugin, "size=" SIZE, seed, NULL);
+  if (r == -1)
+    exit (EXIT_FAILURE);
+
+  nbd = nbd_create ();
+  if (nbd == NULL || nbd_connect_unix (nbd, sock) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return nbd;
+}
+
+static void
+compare (const char *plugin, const char *flag, const char *seed_arg)
+{
+  struct nbd_handle *fast, *generic;
+  static char buf1[MAX_COUNT], buf2[MAX_COUNT];
+  uint64_t seed = 1, offset;
+  size_t i, count;
+
+  fast = start (plugin, NULL, seed_arg);
+  generic = start (plugin, flag, seed_arg);
+
+  for (i = 0; i < 200; ++i) {
+    seed = seed * 6364136223846793005 + 1442695040888963407;
+    count = 1 + (seed >> 20) % MAX_COUNT;
+    /* Unaligned reads at the start, around the window boundary and
+     * at the end of the disk, then anywhere.
+     */
+    switch (i) {
+    case 0: offset = 0; break;
+    case 1: offset = WINDOW - count / 2 - 1; break;
+    case 2: offset = WINDOW - 3; count = 7; break;
+    case 3: offset = 20 * UINT64_C(1073741824) - count; break;
+    default:
+      offset = (seed >> 24) % (20 * UINT64_C(1073741824) - count);
+    }
+
+    if (nbd_pread (fast, buf1, count, offset, 0) == -1 ||
+        nbd_pread (generic, buf2, count, offset, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      goto fail;
+    }
+    if (memcmp (buf1, buf2, count) != 0) {
+      fprintf (stderr, "test-fill-kernels: %s: data differs at offset %"
+               PRIu64 " count %zu\n", plugin, offset, count);
+      goto fail;
+    }
+  }
+
+  nbd_close (fast);
+  nbd_close (generic);
+  return;
+
+ fail:
+  /* Disconnect so that the servers can be stopped. */
+  nbd_close (fast);
+  nbd_close (generic);
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char *argv[])
+{
+  compare ("random", "random.generic=1", "seed=1234");
+  compare ("pattern", "pattern.generic=1", NULL);
+  exit (EXIT_SUCCESS);
+}
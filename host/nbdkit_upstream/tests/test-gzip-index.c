@@ -0,0 +1,227 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test random access to a gzip file made of several members, first
+ * with a freshly built seek index, which is saved, and then with the
+ * index loaded from the file.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <libnbd.h>
+
+#include "byte-swapping.h"
+#include "test.h"
+
+#define SIZE (3 * 1024 * 1024)
+#define NR_MEMBERS 3
+#define NR_READS 200
+
+/* Sizes of the members, all but the last.  These are multiples of 8
+ * so that the pattern can be split, but not of the span.
+ */
+static const size_t member_sizes[NR_MEMBERS-1] = { 1000008, 999992 };
+
+static char dir[] = "/tmp/nbdkitgzXXXXXX";
+static char gzfile[64], idxfile[64];
+
+static void
+cleanup_files (void)
+{
+  char cmd[64];
+
+  snprintf (cmd, sizeof cmd, "rm -rf %s", dir);
+  if (system (cmd) != 0)
+    fprintf (stderr, "test-gzip-index: could not remove %s\n", dir);
+}
+
+/* Write the pattern plugin's data, each member compressed separately
+ * and appended to the gzip file.
+ */
+static void
+create_disk (void)
+{
+  static uint64_t data[SIZE / 8];
+  char plain[64], cmd[256];
+  size_t i, offset, count;
+  FILE *fp;
+
+  for (i = 0; i < SIZE / 8; ++i)
+    data[i] = htobe64 (i * 8);
+
+  if (mkdtemp (dir) == NULL) {
+    perror ("mkdtemp");
+    exit (EXIT_FAILURE);
+  }
+  atexit (cleanup_files);
+  snprintf (gzfile, sizeof gzfile, "%s/disk.gz", dir);
+  snprintf (idxfile, sizeof idxfile, "%s/disk.gz.idx", dir);
+  snprintf (plain, sizeof plain, "%s/member", dir);
+
+  for (i = 0, offset = 0; i < NR_MEMBERS; ++i, offset += count) {
+    count = i < NR_MEMBERS-1 ? member_sizes[i] : SIZE - offset;
+    fp = fopen (plain, "w");
+    if (fp == NULL ||
+        fwrite ((char *) data + offset, count, 1, fp) != 1 ||
+        fclose (fp) == EOF) {
+      perror (plain);
+      exit (EXIT_FAILURE);
+    }
+    snprintf (cmd, sizeof cmd, "gzip -c %s >> %s", plain, gzfile);
+    if (system (cmd) != 0) {
+      fprintf (stderr, "test-gzip-index: gzip program must be installed.\n");
+      exit (77);
+    }
+  }
+  unlink (plain);
+}
+
+static void
+check_pattern (const char *buf, uint64_t offset, size_t count)
+{
+  uint64_t i, v;
+
+  for (i = 0; i < count; i += 8) {
+    memcpy (&v, &buf[i], 8);
+    v = be64toh (v);
+    if (v != offset + i) {
+      fprintf (stderr, "test-gzip-index: unexpected data at offset %"
+               PRIu64 ": %" PRIu64 "\n", offset + i, v);
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+/* Read from random offsets, and across the member boundaries. */
+static void
+random_reads (const char *what)
+{
+  struct nbd_handle *nbd;
+  static char buf[256 * 1024];
+  uint64_t seed = 1, offset;
+  size_t i, count;
+
+  nbd = nbd_create ();
+  if (nbd == NULL || nbd_connect_unix (nbd, sock) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_size (nbd) != SIZE) {
+    fprintf (stderr, "test-gzip-index: %s: unexpected size\n", what);
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_READS + NR_MEMBERS-1; ++i) {
+    if (i < NR_MEMBERS-1) {
+      offset = member_sizes[0] + (i > 0 ? member_sizes[1] : 0) - 4096;
+      count = 8192;
+    }
+    else {
+      seed = seed * 6364136223846793005 + 1442695040888963407;
+      count = ((seed >> 20) % sizeof buf) & ~7;
+      if (count == 0)
+        count = 8;
+      offset = ((seed >> 33) % (SIZE - count)) & ~UINT64_C (7);
+    }
+    if (nbd_pread (nbd, buf, count, offset, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    check_pattern (buf, offset, count);
+  }
+
+  nbd_close (nbd);
+}
+
+int
+main (int argc, char *argv[])
+{
+  char file_arg[80], index_arg[80];
+  struct stat statbuf;
+  ino_t ino;
+
+  create_disk ();
+  snprintf (file_arg, sizeof file_arg, "file=%s", gzfile);
+  snprintf (index_arg, sizeof index_arg, "index=%s", idxfile);
+
+  /* Build the index, which is saved. */
+  if (test_start_nbdkit ("gzip", file_arg, index_arg, "span=64K",
+                         NULL) == -1)
+    exit (EXIT_FAILURE);
+  random_reads ("new index");
+  if (stat (idxfile, &statbuf) == -1) {
+    perror (idxfile);
+    exit (EXIT_FAILURE);
+  }
+  ino = statbuf.st_ino;
+
+  /* Start again with the same parameters.  The index is loaded, so
+   * the file is not replaced.
+   */
+  if (test_start_nbdkit ("gzip", file_arg, index_arg, "span=64K",
+                         NULL) == -1)
+    exit (EXIT_FAILURE);
+  random_reads ("loaded index");
+  if (stat (idxfile, &statbuf) == -1) {
+    perror (idxfile);
+    exit (EXIT_FAILURE);
+  }
+  if (statbuf.st_ino != ino) {
+    fprintf (stderr, "test-gzip-index: index was rebuilt\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* A different span does not match, so the index is rebuilt. */
+  if (test_start_nbdkit ("gzip", file_arg, index_arg, "span=128K",
+                         NULL) == -1)
+    exit (EXIT_FAILURE);
+  random_reads ("different span");
+  if (stat (idxfile, &statbuf) == -1) {
+    perror (idxfile);
+    exit (EXIT_FAILURE);
+  }
+  if (statbuf.st_ino == ino) {
+    fprintf (stderr, "test-gzip-index: index was not rebuilt\n");
+    exit (EXIT_FAILURE);
+  }
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,201 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test the nbd plugin with connections=N.  The memory plugin supports
+ * multi-conn, so the nbd plugin opens several connections to it and
+ * spreads requests over them.  Many parallel writes followed by
+ * reads check that no request is lost or misdirected.  The log
+ * filter on the memory plugin counts the connections it receives.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libnbd.h>
+
+#include "test.h"
+
+#define NR_COMMANDS 64
+#define BLOCK 4096
+#define CONNECTIONS 4
+
+static char logfile[] = "/tmp/nbdkitconnXXXXXX";
+
+static char wbuf[NR_COMMANDS][BLOCK];
+static char rbuf[NR_COMMANDS][BLOCK];
+
+static void
+cleanup_logfile (void)
+{
+  unlink (logfile);
+}
+
+/* Count the connections made to the memory plugin. */
+static int
+count_connections (void)
+{
+  FILE *fp;
+  char *line = NULL;
+  size_t len = 0;
+  int n = 0;
+
+  fp = fopen (logfile, "r");
+  if (fp == NULL) {
+    perror (logfile);
+    exit (EXIT_FAILURE);
+  }
+  while (getline (&line, &len, fp) != -1)
+    if (strstr (line, " Connect ") != NULL)
+      n++;
+  free (line);
+  fclose (fp);
+  return n;
+}
+
+static void
+wait_for_commands (struct nbd_handle *nbd, int64_t *cookies,
+                   const char *what)
+{
+  size_t i;
+
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (nbd_aio_command_completed (nbd, cookies[i]) != 1) {
+      fprintf (stderr, "test-nbd-connections: %s %zu failed: %s\n",
+               what, i, nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  int64_t cookies[NR_COMMANDS];
+  char socket_arg[256], logfile_arg[64], connections_arg[32];
+  size_t i;
+  int fd, n;
+
+  fd = mkstemp (logfile);
+  if (fd == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  close (fd);
+  atexit (cleanup_logfile);
+  snprintf (logfile_arg, sizeof logfile_arg, "logfile=%s", logfile);
+
+  if (test_start_nbdkit ("--filter=log", "memory", "size=1M", logfile_arg,
+                         NULL) == -1)
+    exit (EXIT_FAILURE);
+  snprintf (socket_arg, sizeof socket_arg, "socket=%s", sock);
+  snprintf (connections_arg, sizeof connections_arg,
+            "connections=%d", CONNECTIONS);
+
+  if (test_start_nbdkit ("nbd", socket_arg, connections_arg, NULL) == -1)
+    exit (EXIT_FAILURE);
+
+  nbd = nbd_create ();
+  if (nbd == NULL || nbd_connect_unix (nbd, sock) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_can_multi_conn (nbd) != 1) {
+    fprintf (stderr, "test-nbd-connections: multi-conn not passed through\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* The nbd plugin opens all its connections when we connect. */
+  n = count_connections ();
+  if (n != CONNECTIONS) {
+    fprintf (stderr, "test-nbd-connections: "
+             "expected %d connections to the server, got %d\n",
+             CONNECTIONS, n);
+    nbd_close (nbd);
+    exit (EXIT_FAILURE);
+  }
+
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    memset (wbuf[i], 'a' + i % 26, BLOCK);
+    snprintf (wbuf[i], BLOCK, "block %zu", i);
+    cookies[i] = nbd_aio_pwrite (nbd, wbuf[i], BLOCK, i * BLOCK,
+                                 NBD_NULL_COMPLETION, 0);
+    if (cookies[i] == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  wait_for_commands (nbd, cookies, "write");
+
+  if (nbd_flush (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+
+  /* Read the blocks back in the opposite order. */
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    cookies[i] = nbd_aio_pread (nbd, rbuf[i], BLOCK,
+                                (NR_COMMANDS-1-i) * BLOCK,
+                                NBD_NULL_COMPLETION, 0);
+    if (cookies[i] == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  wait_for_commands (nbd, cookies, "read");
+
+  for (i = 0; i < NR_COMMANDS; ++i) {
+    if (memcmp (rbuf[i], wbuf[NR_COMMANDS-1-i], BLOCK) != 0) {
+      fprintf (stderr, "test-nbd-connections: unexpected data in block %zu\n",
+               NR_COMMANDS-1-i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  if (nbd_shutdown (nbd, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,295 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test the scheduling decisions of the qos filter.  The delay filter
+ * below it makes every read slow enough to observe the order in which
+ * requests are dispatched through a single slot.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#include <libnbd.h>
+
+#include "test.h"
+
+#define NR_REQUESTS 6
+#define REQUEST_SIZE 512
+#define TIMEOUT 60              /* seconds */
+
+static char statsfile[] = "/tmp/qosstatsXXXXXX";
+
+/* Completion order, across both connections. */
+static unsigned next_seq;
+
+struct request {
+  char buf[REQUEST_SIZE];
+  unsigned seq;
+};
+static struct request lc_req[NR_REQUESTS], be_req[NR_REQUESTS];
+
+static int
+done (void *user_data, int *error)
+{
+  struct request *req = user_data;
+
+  req->seq = ++next_seq;
+  return 1;
+}
+
+static struct nbd_handle *
+connect_export (const char *name)
+{
+  struct nbd_handle *nbd;
+
+  nbd = nbd_create ();
+  if (nbd == NULL ||
+      nbd_set_export_name (nbd, name) == -1 ||
+      nbd_connect_unix (nbd, sock) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return nbd;
+}
+
+static void
+issue (struct nbd_handle *nbd, struct request *req)
+{
+  if (nbd_aio_pread (nbd, req->buf, REQUEST_SIZE, 0,
+                     (nbd_completion_callback) { .callback = done,
+                                                 .user_data = req },
+                     0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+}
+
+/* Wait for all requests on both connections.  Fails the test if the
+ * scheduler stops dispatching them.
+ */
+static void
+wait_all (struct nbd_handle *lc, struct nbd_handle *be, const char *what)
+{
+  time_t start = time (NULL);
+
+  while (nbd_aio_in_flight (lc) > 0 || nbd_aio_in_flight (be) > 0) {
+    if (time (NULL) - start > TIMEOUT) {
+      fprintf (stderr, "%s FAILED: %s: requests were never dispatched\n",
+               program_name, what);
+      exit (EXIT_FAILURE);
+    }
+    if ((nbd_aio_in_flight (lc) > 0 && nbd_poll (lc, 0) == -1) ||
+        (nbd_aio_in_flight (be) > 0 && nbd_poll (be, 0) == -1)) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    usleep (1000);
+  }
+}
+
+static void
+close_both (struct nbd_handle *lc, struct nbd_handle *be)
+{
+  if (nbd_shutdown (lc, 0) == -1 || nbd_shutdown (be, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (lc);
+  nbd_close (be);
+}
+
+/* With the strict policy, once LC requests are queued no further BE
+ * request may be dispatched until they have all been served.
+ */
+static void
+test_strict (void)
+{
+  struct nbd_handle *lc, *be;
+  size_t i;
+
+  if (test_start_nbdkit ("--filter", "qos", "--filter", "delay",
+                         "memory", "1M", "rdelay=50ms",
+                         "qos-lc-export=lc", "qos-max-inflight=1",
+                         "qos-policy=strict",
+                         NULL) == -1)
+    exit (EXIT_FAILURE);
+
+  lc = connect_export ("lc");
+  be = connect_export ("be");
+
+  next_seq = 0;
+  for (i = 0; i < NR_REQUESTS; ++i)
+    issue (be, &be_req[i]);
+  for (i = 0; i < NR_REQUESTS; ++i)
+    issue (lc, &lc_req[i]);
+  wait_all (lc, be, "strict");
+
+  /* At most one BE request was already in the slot when the LC
+   * requests arrived.
+   */
+  for (i = 0; i < NR_REQUESTS; ++i) {
+    if (lc_req[i].seq > NR_REQUESTS + 1) {
+      fprintf (stderr, "%s FAILED: strict: LC request %zu completed "
+               "in position %u, after BE requests\n",
+               program_name, i, lc_req[i].seq);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  close_both (lc, be);
+}
+
+/* Wait for nbdkit to exit and write the stats file, then check the
+ * counters of one class.
+ */
+static void
+read_stats (const char *class, uint64_t *ops, uint64_t *queued,
+            uint64_t *deferred, uint64_t *violations)
+{
+  char line[512], prefix[8];
+  FILE *fp;
+  size_t i;
+
+  snprintf (prefix, sizeof prefix, "%s: ", class);
+  for (i = 0; i < TIMEOUT * 10; ++i) {
+    fp = fopen (statsfile, "r");
+    if (fp == NULL) {
+      perror (statsfile);
+      exit (EXIT_FAILURE);
+    }
+    while (fgets (line, sizeof line, fp) != NULL) {
+      if (strncmp (line, prefix, strlen (prefix)) == 0 &&
+          strchr (line, '\n') != NULL &&
+          sscanf (line + strlen (prefix),
+                  "%" SCNu64 " ops, %" SCNu64 " queued, "
+                  "%" SCNu64 " deferred, %*[^,], %*[^,], "
+                  "target %*u us, %" SCNu64 " SLO violations",
+                  ops, queued, deferred, violations) == 4) {
+        fclose (fp);
+        printf ("%s", line);
+        return;
+      }
+    }
+    fclose (fp);
+    usleep (100000);
+  }
+  fprintf (stderr, "%s FAILED: no %s line in %s\n",
+           program_name, class, statsfile);
+  exit (EXIT_FAILURE);
+}
+
+/* With the weighted policy and an LC latency target that the slow
+ * reads always miss, BE requests are deferred while LC requests are
+ * outstanding.  This used to deadlock as soon as LC had used up its
+ * credits, since LC then gave way to BE, which was itself deferred.
+ */
+static void
+test_weighted_target (void)
+{
+  struct nbd_handle *lc, *be;
+  struct request prime;
+  uint64_t ops, queued, deferred, violations;
+  size_t i;
+  int fd;
+  char statsarg[64];
+
+  fd = mkstemp (statsfile);
+  if (fd == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  close (fd);
+  snprintf (statsarg, sizeof statsarg, "qos-statsfile=%s", statsfile);
+
+  if (test_start_nbdkit ("--filter", "qos", "--filter", "delay",
+                         "memory", "1M", "rdelay=20ms",
+                         "qos-lc-export=lc", "qos-max-inflight=1",
+                         "qos-policy=weighted", "qos-weight=1:4",
+                         "qos-lc-target=1ms", "qos-be-target=10s",
+                         statsarg,
+                         NULL) == -1)
+    exit (EXIT_FAILURE);
+
+  lc = connect_export ("lc");
+  be = connect_export ("be");
+
+  /* Put the LC latency average over the target. */
+  issue (lc, &prime);
+  wait_all (lc, be, "weighted");
+
+  /* One BE request takes the slot, then LC and BE requests queue up
+   * behind it.  The first LC request to go uses up the LC credit.
+   */
+  next_seq = 0;
+  issue (be, &be_req[0]);
+  usleep (5000);
+  for (i = 0; i < NR_REQUESTS; ++i)
+    issue (lc, &lc_req[i]);
+  for (i = 1; i < NR_REQUESTS; ++i)
+    issue (be, &be_req[i]);
+  wait_all (lc, be, "weighted");
+
+  close_both (lc, be);
+
+  /* The stats file is written when nbdkit exits. */
+  kill (pid, SIGTERM);
+  read_stats ("LC", &ops, &queued, &deferred, &violations);
+  if (ops != NR_REQUESTS + 1 || queued == 0 || deferred != 0 ||
+      violations != NR_REQUESTS + 1) {
+    fprintf (stderr, "%s FAILED: unexpected LC counters\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+  read_stats ("BE", &ops, &queued, &deferred, &violations);
+  if (ops != NR_REQUESTS || queued == 0 || deferred == 0 ||
+      violations != 0) {
+    fprintf (stderr, "%s FAILED: unexpected BE counters\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  unlink (statsfile);
+}
+
+int
+main (int argc, char *argv[])
+{
+  test_strict ();
+  test_weighted_target ();
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,140 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test the qos filter with one latency-critical and one best-effort
+ * connection sharing a single dispatch slot.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libnbd.h>
+
+#include "test.h"
+
+#define NR_REQUESTS 32
+#define REQUEST_SIZE 4096
+
+static struct nbd_handle *
+connect_export (const char *name)
+{
+  struct nbd_handle *nbd;
+
+  nbd = nbd_create ();
+  if (nbd == NULL ||
+      nbd_set_export_name (nbd, name) == -1 ||
+      nbd_connect_unix (nbd, sock) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return nbd;
+}
+
+static void
+wait_all (struct nbd_handle *lc, struct nbd_handle *be)
+{
+  while (nbd_aio_in_flight (lc) > 0 || nbd_aio_in_flight (be) > 0) {
+    if ((nbd_aio_in_flight (lc) > 0 && nbd_poll (lc, 0) == -1) ||
+        (nbd_aio_in_flight (be) > 0 && nbd_poll (be, 0) == -1)) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *lc, *be;
+  static char wbuf[2][NR_REQUESTS][REQUEST_SIZE];
+  static char rbuf[2][NR_REQUESTS][REQUEST_SIZE];
+  size_t i;
+
+  if (test_start_nbdkit ("--filter", "qos", "memory", "1M",
+                         "qos-lc-export=lc*", "qos-max-inflight=1",
+                         "qos-policy=weighted", "qos-weight=2:1",
+                         "qos-lc-target=10ms",
+                         NULL) == -1)
+    exit (EXIT_FAILURE);
+
+  lc = connect_export ("lc-vm");
+  be = connect_export ("batch");
+
+  /* Issue interleaved writes from both connections to separate halves
+   * of the disk.
+   */
+  for (i = 0; i < NR_REQUESTS; ++i) {
+    memset (wbuf[0][i], 'A' + i % 26, REQUEST_SIZE);
+    memset (wbuf[1][i], 'a' + i % 26, REQUEST_SIZE);
+    if (nbd_aio_pwrite (lc, wbuf[0][i], REQUEST_SIZE, i * REQUEST_SIZE,
+                        NBD_NULL_COMPLETION, 0) == -1 ||
+        nbd_aio_pwrite (be, wbuf[1][i], REQUEST_SIZE,
+                        (NR_REQUESTS + i) * REQUEST_SIZE,
+                        NBD_NULL_COMPLETION, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  wait_all (lc, be);
+
+  /* Read back crosswise, so each connection sees the other's data. */
+  for (i = 0; i < NR_REQUESTS; ++i) {
+    if (nbd_aio_pread (be, rbuf[0][i], REQUEST_SIZE, i * REQUEST_SIZE,
+                       NBD_NULL_COMPLETION, 0) == -1 ||
+        nbd_aio_pread (lc, rbuf[1][i], REQUEST_SIZE,
+                       (NR_REQUESTS + i) * REQUEST_SIZE,
+                       NBD_NULL_COMPLETION, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  wait_all (lc, be);
+
+  if (memcmp (wbuf, rbuf, sizeof wbuf) != 0) {
+    fprintf (stderr, "%s FAILED: data read back does not match\n", argv[0]);
+    exit (EXIT_FAILURE);
+  }
+
+  if (nbd_shutdown (lc, 0) == -1 || nbd_shutdown (be, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (lc);
+  nbd_close (be);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,159 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test the shmcache filter.  The first nbdkit process reads the disk
+ * from the pattern plugin, filling the shared segment.  A second
+ * process using the null plugin and the same key should then see the
+ * pattern, since every block comes from the segment.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libnbd.h>
+
+#include "byte-swapping.h"
+#include "test.h"
+
+#define SIZE (1024 * 1024)
+
+static char segment[] = "/tmp/nbdkitshmXXXXXX";
+
+static void
+cleanup_segment (void)
+{
+  unlink (segment);
+}
+
+static struct nbd_handle *
+connect_nbdkit (void)
+{
+  struct nbd_handle *nbd;
+
+  nbd = nbd_create ();
+  if (nbd == NULL || nbd_connect_unix (nbd, sock) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  return nbd;
+}
+
+static void
+read_disk (struct nbd_handle *nbd, char *buf)
+{
+  /* Use an unaligned read for the first part of the disk. */
+  if (nbd_pread (nbd, buf, 1000, 0, 0) == -1 ||
+      nbd_pread (nbd, buf + 1000, SIZE - 1000, 1000, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+}
+
+static void
+check_pattern (const char *buf, const char *what)
+{
+  uint64_t i, v;
+
+  for (i = 0; i < SIZE; i += 8) {
+    memcpy (&v, &buf[i], 8);
+    v = be64toh (v);
+    if (v != i) {
+      fprintf (stderr, "test-shmcache: %s: unexpected data at offset %"
+               PRIu64 ": %" PRIu64 "\n", what, i, v);
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  static char buf[SIZE];
+  char file_arg[64];
+  int fd;
+
+  fd = mkstemp (segment);
+  if (fd == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  close (fd);
+  atexit (cleanup_segment);
+  snprintf (file_arg, sizeof file_arg, "shmcache-file=%s", segment);
+
+  /* Fill the segment from the pattern plugin. */
+  if (test_start_nbdkit ("--filter", "shmcache", "pattern", "size=1M",
+                         "shmcache-key=test", file_arg, "shmcache-size=8M",
+                         NULL) == -1)
+    exit (EXIT_FAILURE);
+  nbd = connect_nbdkit ();
+  read_disk (nbd, buf);
+  check_pattern (buf, "pattern");
+  nbd_close (nbd);
+
+  /* The null plugin with the same key reads the pattern from the
+   * segment.
+   */
+  if (test_start_nbdkit ("--filter", "shmcache", "null", "size=1M",
+                         "shmcache-key=test", file_arg,
+                         NULL) == -1)
+    exit (EXIT_FAILURE);
+  nbd = connect_nbdkit ();
+  memset (buf, 0, sizeof buf);
+  read_disk (nbd, buf);
+  check_pattern (buf, "null with same key");
+  nbd_close (nbd);
+
+  /* With a different key the blocks are not shared. */
+  if (test_start_nbdkit ("--filter", "shmcache", "null", "size=1M",
+                         "shmcache-key=other", file_arg,
+                         NULL) == -1)
+    exit (EXIT_FAILURE);
+  nbd = connect_nbdkit ();
+  memset (buf, 1, sizeof buf);
+  read_disk (nbd, buf);
+  if (buf[0] != 0 || memcmp (buf, buf + 1, SIZE - 1) != 0) {
+    fprintf (stderr, "test-shmcache: null with other key: "
+             "expected zeroes\n");
+    exit (EXIT_FAILURE);
+  }
+  nbd_close (nbd);
+
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,227 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test writing and caching with the split plugin.  Requests cross the
+ * boundaries between files, and the large ones are done in parallel
+ * by the helper threads.  The files are then checked directly, so a
+ * piece written at the wrong offset in its file is detected.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <libnbd.h>
+
+#include "test.h"
+
+#define NR_FILES 4
+
+/* Odd sizes, so that no request is aligned with a file boundary. */
+static const size_t sizes[NR_FILES] = { 100003, 200003, 300007, 212131 };
+#define SIZE (100003 + 200003 + 300007 + 212131)
+
+/* Large writes in flight at the same time, each spanning at least
+ * two files.
+ */
+#define LARGE 300000
+
+static char filenames[NR_FILES][32];
+static char expected[SIZE];
+static char buf[SIZE];
+
+static void
+cleanup_files (void)
+{
+  size_t i;
+
+  for (i = 0; i < NR_FILES; ++i)
+    if (filenames[i][0])
+      unlink (filenames[i]);
+}
+
+static void
+fill (uint64_t offset, size_t count, unsigned seed)
+{
+  size_t i;
+
+  for (i = 0; i < count; ++i)
+    expected[offset+i] = (offset + i) * seed + (offset + i) / 251;
+}
+
+static void
+check_files (const char *what)
+{
+  uint64_t offset = 0;
+  size_t i, j;
+  int fd;
+
+  for (i = 0; i < NR_FILES; ++i) {
+    fd = open (filenames[i], O_RDONLY);
+    if (fd == -1 || pread (fd, buf, sizes[i], 0) != (ssize_t) sizes[i]) {
+      perror (filenames[i]);
+      exit (EXIT_FAILURE);
+    }
+    close (fd);
+    for (j = 0; j < sizes[i]; ++j) {
+      if (buf[j] != expected[offset+j]) {
+        fprintf (stderr, "test-split-write: %s: unexpected data in "
+                 "file %zu at offset %zu\n", what, i, j);
+        exit (EXIT_FAILURE);
+      }
+    }
+    offset += sizes[i];
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd;
+  char file_args[NR_FILES][40];
+  int64_t cookies[SIZE / LARGE + 1];
+  size_t i, nr_cookies = 0;
+  uint64_t offset;
+  int fd;
+
+  for (i = 0; i < NR_FILES; ++i) {
+    strcpy (filenames[i], "/tmp/nbdkitsplitXXXXXX");
+    fd = mkstemp (filenames[i]);
+    if (fd == -1) {
+      perror ("mkstemp");
+      exit (EXIT_FAILURE);
+    }
+    if (ftruncate (fd, sizes[i]) == -1) {
+      perror ("ftruncate");
+      exit (EXIT_FAILURE);
+    }
+    close (fd);
+    snprintf (file_args[i], sizeof file_args[i], "file=%s", filenames[i]);
+  }
+  atexit (cleanup_files);
+
+  if (test_start_nbdkit ("split", file_args[0], file_args[1],
+                         file_args[2], file_args[3], NULL) == -1)
+    exit (EXIT_FAILURE);
+
+  nbd = nbd_create ();
+  if (nbd == NULL || nbd_connect_unix (nbd, sock) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (nbd_get_size (nbd) != SIZE) {
+    fprintf (stderr, "test-split-write: unexpected size\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Write the whole disk with several large requests at once, starting
+   * at an odd offset.
+   */
+  fill (0, SIZE, 7);
+  if (nbd_pwrite (nbd, expected, 1, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  for (offset = 1; offset < SIZE; offset += LARGE) {
+    size_t count = SIZE - offset < LARGE ? SIZE - offset : LARGE;
+
+    cookies[nr_cookies] = nbd_aio_pwrite (nbd, &expected[offset], count,
+                                          offset, NBD_NULL_COMPLETION, 0);
+    if (cookies[nr_cookies] == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+    nr_cookies++;
+  }
+  while (nbd_aio_in_flight (nbd) > 0) {
+    if (nbd_poll (nbd, -1) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < nr_cookies; ++i) {
+    if (nbd_aio_command_completed (nbd, cookies[i]) != 1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  check_files ("large writes");
+
+  /* Small writes just across each boundary, and one spanning a whole
+   * file.
+   */
+  offset = 0;
+  for (i = 0; i < NR_FILES - 1; ++i) {
+    offset += sizes[i];
+    fill (offset - 10, 20, 13 + i);
+    if (nbd_pwrite (nbd, &expected[offset - 10], 20, offset - 10, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  fill (sizes[0] - 1, sizes[1] + 2, 17);
+  if (nbd_pwrite (nbd, &expected[sizes[0] - 1], sizes[1] + 2,
+                  sizes[0] - 1, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  check_files ("small writes");
+
+  /* Read it all back in one request. */
+  if (nbd_pread (nbd, buf, SIZE, 0, 0) == -1) {
+    fprintf (stderr, "%s\n", nbd_get_error ());
+    exit (EXIT_FAILURE);
+  }
+  if (memcmp (buf, expected, SIZE) != 0) {
+    fprintf (stderr, "test-split-write: unexpected data read back\n");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Cache requests across the boundaries must complete. */
+  if (nbd_can_cache (nbd) == 1) {
+    if (nbd_cache (nbd, SIZE, 0, 0) == -1 ||
+        nbd_cache (nbd, 20, sizes[0] - 10, 0) == -1 ||
+        nbd_cache (nbd, SIZE - sizes[0] + 1, sizes[0] - 1, 0) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  nbd_close (nbd);
+  exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,481 @@
+/* nbdkit
+ * Copyright (C) 2017-2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test that TLS 1.3 key updates sent by the client during the
+ * session work.  The client asks nbdkit to update its keys too, so
+ * this checks both directions, while nbdkit uses several worker
+ * threads.  If nbdkit had given the keys to the kernel (kTLS) the
+ * stream would be corrupted.
+ *
+ * nbdkit must serve a TCP socket for kTLS to be possible, and the
+ * test framework always uses -U, so the listening socket is passed
+ * to nbdkit using socket activation as in test-socket-activation.c.
+ * The NBD handshake is done by hand since we need access to the
+ * GnuTLS session.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_GNUTLS
+#include <gnutls/gnutls.h>
+#endif
+
+#include "byte-swapping.h"
+#include "nbd-protocol.h"
+
+/* Declare program_name. */
+#if HAVE_DECL_PROGRAM_INVOCATION_SHORT_NAME == 1
+#include <errno.h>
+#define program_name program_invocation_short_name
+#else
+#define program_name "nbdkit"
+#endif
+
+#if defined (HAVE_GNUTLS) && GNUTLS_VERSION_NUMBER >= 0x030603
+
+#define FIRST_SOCKET_ACTIVATION_FD 3
+
+#define NBDKIT_START_TIMEOUT 30 /* seconds */
+
+#define PRIORITY "NORMAL:-VERS-ALL:+VERS-TLS1.3:+ECDHE-PSK:+DHE-PSK:+PSK"
+#define USERNAME "qemu"
+#define KEY "0123456789abcdef0123456789abcdef"
+
+#define NR_BLOCKS 64
+#define BLOCK 4096
+/* GnuTLS refuses more than 8 key updates a second, so only do a
+ * few.
+ */
+#define KEY_UPDATE_EVERY 32
+
+static char tmpdir[] =  "/tmp/nbdkitXXXXXX";
+static char pskpath[] = "/tmp/nbdkitXXXXXX/keys.psk";
+static char pidpath[] = "/tmp/nbdkitXXXXXX/pid";
+
+static pid_t pid = 0;
+
+static void
+cleanup (void)
+{
+  if (pid > 0)
+    kill (pid, SIGTERM);
+
+  unlink (pskpath);
+  unlink (pidpath);
+  rmdir (tmpdir);
+}
+
+static void
+xread (int sock, void *buf, size_t len)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = read (sock, buf, len);
+    if (r <= 0) {
+      fprintf (stderr, "%s: read: %s\n", program_name,
+               r == 0 ? "unexpected end of file" : strerror (errno));
+      exit (EXIT_FAILURE);
+    }
+    buf += r;
+    len -= r;
+  }
+}
+
+static void
+xwrite (int sock, const void *buf, size_t len)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = write (sock, buf, len);
+    if (r == -1) {
+      perror ("write");
+      exit (EXIT_FAILURE);
+    }
+    buf += r;
+    len -= r;
+  }
+}
+
+static void
+tls_read (gnutls_session_t session, void *buf, size_t len)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = gnutls_record_recv (session, buf, len);
+    if (r == GNUTLS_E_INTERRUPTED || r == GNUTLS_E_AGAIN)
+      continue;
+    if (r <= 0) {
+      fprintf (stderr, "%s: gnutls_record_recv: %s\n", program_name,
+               r == 0 ? "unexpected end of file" : gnutls_strerror (r));
+      exit (EXIT_FAILURE);
+    }
+    buf += r;
+    len -= r;
+  }
+}
+
+static void
+tls_write (gnutls_session_t session, const void *buf, size_t len)
+{
+  ssize_t r;
+
+  while (len > 0) {
+    r = gnutls_record_send (session, buf, len);
+    if (r == GNUTLS_E_INTERRUPTED || r == GNUTLS_E_AGAIN)
+      continue;
+    if (r < 0) {
+      fprintf (stderr, "%s: gnutls_record_send: %s\n", program_name,
+               gnutls_strerror (r));
+      exit (EXIT_FAILURE);
+    }
+    buf += r;
+    len -= r;
+  }
+}
+
+/* Send one request, updating the keys first every few requests. */
+static void
+request (gnutls_session_t session, uint16_t type, uint64_t handle,
+         uint64_t offset, void *buf, uint32_t count)
+{
+  struct nbd_request req;
+  struct nbd_simple_reply reply;
+  int err;
+
+  if (handle % KEY_UPDATE_EVERY == KEY_UPDATE_EVERY - 1) {
+    err = gnutls_session_key_update (session, GNUTLS_KU_PEER);
+    if (err < 0) {
+      fprintf (stderr, "%s: gnutls_session_key_update: %s\n",
+               program_name, gnutls_strerror (err));
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  req.magic = htobe32 (NBD_REQUEST_MAGIC);
+  req.flags = htobe16 (0);
+  req.type = htobe16 (type);
+  req.handle = htobe64 (handle);
+  req.offset = htobe64 (offset);
+  req.count = htobe32 (count);
+  tls_write (session, &req, sizeof req);
+  if (type == NBD_CMD_WRITE)
+    tls_write (session, buf, count);
+
+  tls_read (session, &reply, sizeof reply);
+  if (be32toh (reply.magic) != NBD_SIMPLE_REPLY_MAGIC ||
+      be64toh (reply.handle) != handle ||
+      reply.error != 0) {
+    fprintf (stderr, "%s FAILED: unexpected reply to request %" PRIu64 "\n",
+             program_name, handle);
+    exit (EXIT_FAILURE);
+  }
+  if (type == NBD_CMD_READ)
+    tls_read (session, buf, count);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int sock;
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof addr;
+  char pid_str[16];
+  size_t i, len;
+  FILE *fp;
+  char line[64];
+  bool have_tls = false;
+  struct nbd_new_handshake handshake;
+  uint32_t cflags;
+  struct nbd_new_option option;
+  struct nbd_fixed_new_option_reply reply;
+  struct nbd_export_name_option_reply export;
+  gnutls_psk_client_credentials_t creds;
+  gnutls_session_t session;
+  gnutls_datum_t key;
+  struct nbd_request req;
+  static char wbuf[BLOCK], rbuf[BLOCK];
+  uint64_t handle = 0;
+  int err;
+
+  /* Skip the test if nbdkit was built without TLS. */
+  fp = popen ("nbdkit --dump-config", "r");
+  if (fp == NULL) {
+    perror ("popen: nbdkit --dump-config");
+    exit (EXIT_FAILURE);
+  }
+  while (fgets (line, sizeof line, fp) != NULL) {
+    if (strcmp (line, "tls=yes\n") == 0)
+      have_tls = true;
+  }
+  pclose (fp);
+  if (!have_tls) {
+    fprintf (stderr, "%s: nbdkit built without TLS support\n",
+             program_name);
+    exit (77);
+  }
+
+  if (mkdtemp (tmpdir) == NULL) {
+    perror ("mkdtemp");
+    exit (EXIT_FAILURE);
+  }
+  len = strlen (tmpdir);
+  memcpy (pskpath, tmpdir, len);
+  memcpy (pidpath, tmpdir, len);
+
+  atexit (cleanup);
+
+  fp = fopen (pskpath, "w");
+  if (fp == NULL) {
+    perror (pskpath);
+    exit (EXIT_FAILURE);
+  }
+  fprintf (fp, "%s:%s\n", USERNAME, KEY);
+  if (fclose (fp) == EOF) {
+    perror (pskpath);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Open a listening TCP socket on a free port of the loopback
+   * interface, which will be passed into nbdkit.
+   */
+  sock = socket (AF_INET, SOCK_STREAM /* NB do not use SOCK_CLOEXEC */, 0);
+  if (sock == -1) {
+    perror ("socket");
+    exit (EXIT_FAILURE);
+  }
+
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  if (bind (sock, (struct sockaddr *) &addr, sizeof addr) == -1 ||
+      getsockname (sock, (struct sockaddr *) &addr, &addrlen) == -1) {
+    perror ("bind");
+    exit (EXIT_FAILURE);
+  }
+
+  if (listen (sock, 1) == -1) {
+    perror ("listen");
+    exit (EXIT_FAILURE);
+  }
+
+  if (sock != FIRST_SOCKET_ACTIVATION_FD) {
+    if (dup2 (sock, FIRST_SOCKET_ACTIVATION_FD) == -1) {
+      perror ("dup2");
+      exit (EXIT_FAILURE);
+    }
+    close (sock);
+  }
+
+  /* Run nbdkit. */
+  pid = fork ();
+  if (pid == -1) {
+    perror ("fork");
+    exit (EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    /* Run nbdkit in the child. */
+    setenv ("LISTEN_FDS", "1", 1);
+    snprintf (pid_str, sizeof pid_str, "%d", (int) getpid ());
+    setenv ("LISTEN_PID", pid_str, 1);
+
+    execlp ("nbdkit",
+            "nbdkit",
+            "-P", pidpath,
+            "-f",
+            "-v",
+            "--tls=require",
+            "--tls-psk", pskpath,
+            "memory", "size=1M", NULL);
+    perror ("exec: nbdkit");
+    _exit (EXIT_FAILURE);
+  }
+
+  /* We don't need the listening socket now. */
+  close (FIRST_SOCKET_ACTIVATION_FD);
+
+  /* Wait for the pidfile to turn up, which indicates that nbdkit has
+   * started up successfully and is ready to serve requests.  However
+   * if 'pid' exits in this time it indicates a failure to start up.
+   * Also there is a timeout in case nbdkit hangs.
+   */
+  for (i = 0; i < NBDKIT_START_TIMEOUT; ++i) {
+    if (waitpid (pid, NULL, WNOHANG) == pid)
+      goto early_exit;
+
+    if (kill (pid, 0) == -1) {
+      if (errno == ESRCH) {
+      early_exit:
+        fprintf (stderr,
+                 "%s FAILED: nbdkit exited before starting to serve files\n",
+                 program_name);
+        pid = 0;
+        exit (EXIT_FAILURE);
+      }
+      perror ("kill");
+    }
+
+    if (access (pidpath, F_OK) == 0)
+      break;
+
+    sleep (1);
+  }
+
+  sock = socket (AF_INET, SOCK_STREAM, 0);
+  if (sock == -1) {
+    perror ("socket");
+    exit (EXIT_FAILURE);
+  }
+  if (connect (sock, (struct sockaddr *) &addr, sizeof addr) == -1) {
+    perror ("connect");
+    exit (EXIT_FAILURE);
+  }
+
+  /* Fixed newstyle handshake, then ask to start TLS. */
+  xread (sock, &handshake, sizeof handshake);
+  if (be64toh (handshake.nbdmagic) != NBD_MAGIC ||
+      be64toh (handshake.version) != NBD_NEW_VERSION) {
+    fprintf (stderr, "%s FAILED: did not read handshake from server\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+  cflags = htobe32 (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+  xwrite (sock, &cflags, sizeof cflags);
+
+  option.version = htobe64 (NBD_NEW_VERSION);
+  option.option = htobe32 (NBD_OPT_STARTTLS);
+  option.optlen = htobe32 (0);
+  xwrite (sock, &option, sizeof option);
+  xread (sock, &reply, sizeof reply);
+  if (be64toh (reply.magic) != NBD_REP_MAGIC ||
+      be32toh (reply.option) != NBD_OPT_STARTTLS ||
+      be32toh (reply.reply) != NBD_REP_ACK ||
+      reply.replylen != 0) {
+    fprintf (stderr, "%s FAILED: server did not accept NBD_OPT_STARTTLS\n",
+             program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  key.data = (unsigned char *) KEY;
+  key.size = strlen (KEY);
+  if ((err = gnutls_psk_allocate_client_credentials (&creds)) < 0 ||
+      (err = gnutls_psk_set_client_credentials (creds, USERNAME, &key,
+                                                GNUTLS_PSK_KEY_HEX)) < 0 ||
+      (err = gnutls_init (&session, GNUTLS_CLIENT)) < 0 ||
+      (err = gnutls_priority_set_direct (session, PRIORITY, NULL)) < 0 ||
+      (err = gnutls_credentials_set (session, GNUTLS_CRD_PSK, creds)) < 0) {
+    fprintf (stderr, "%s: gnutls: %s\n", program_name, gnutls_strerror (err));
+    exit (EXIT_FAILURE);
+  }
+  gnutls_transport_set_int (session, sock);
+  do {
+    err = gnutls_handshake (session);
+  } while (err < 0 && gnutls_error_is_fatal (err) == 0);
+  if (err < 0) {
+    fprintf (stderr, "%s: gnutls_handshake: %s\n",
+             program_name, gnutls_strerror (err));
+    exit (EXIT_FAILURE);
+  }
+  if (gnutls_protocol_get_version (session) != GNUTLS_TLS1_3) {
+    fprintf (stderr, "%s: test skipped: TLS 1.3 was not negotiated\n",
+             program_name);
+    exit (77);
+  }
+
+  /* Select the default export. */
+  option.option = htobe32 (NBD_OPT_EXPORT_NAME);
+  tls_write (session, &option, sizeof option);
+  tls_read (session, &export, sizeof export - sizeof export.zeroes);
+  if (be64toh (export.exportsize) != 1024 * 1024) {
+    fprintf (stderr, "%s FAILED: unexpected export size\n", program_name);
+    exit (EXIT_FAILURE);
+  }
+
+  /* Write every block and read it back, updating the keys on the
+   * way.
+   */
+  for (i = 0; i < NR_BLOCKS; ++i) {
+    memset (wbuf, 'a' + i % 26, BLOCK);
+    request (session, NBD_CMD_WRITE, handle++, i * BLOCK, wbuf, BLOCK);
+  }
+  for (i = 0; i < NR_BLOCKS; ++i) {
+    memset (wbuf, 'a' + i % 26, BLOCK);
+    request (session, NBD_CMD_READ, handle++, i * BLOCK, rbuf, BLOCK);
+    if (memcmp (rbuf, wbuf, BLOCK) != 0) {
+      fprintf (stderr, "%s FAILED: unexpected data in block %zu\n",
+               program_name, i);
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  memset (&req, 0, sizeof req);
+  req.magic = htobe32 (NBD_REQUEST_MAGIC);
+  req.type = htobe16 (NBD_CMD_DISC);
+  tls_write (session, &req, sizeof req);
+  gnutls_bye (session, GNUTLS_SHUT_RDWR);
+  gnutls_deinit (session);
+  gnutls_psk_free_client_credentials (creds);
+  close (sock);
+
+  /* Test succeeded. */
+  exit (EXIT_SUCCESS);
+}
+
+#else /* !HAVE_GNUTLS || GnuTLS < 3.6.3 */
+
+int
+main (int argc, char *argv[])
+{
+  fprintf (stderr, "%s: test skipped: TLS key updates are not supported\n",
+           program_name);
+  exit (77);
+}
+
+#endif
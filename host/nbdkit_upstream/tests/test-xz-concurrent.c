@@ -0,0 +1,194 @@
+/* nbdkit
+ * Copyright (C) 2020 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ *
+ * * Neither the name of Red Hat nor the names of its contributors may be
+ * used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY RED HAT AND CONTRIBUTORS ''AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL RED HAT OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Test the xz filter with many concurrent reads crossing block
+ * boundaries and a cache much smaller than the number of blocks, so
+ * that blocks are reserved, waited for, evicted and loaded again
+ * while other requests are using them.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libnbd.h>
+
+#include "byte-swapping.h"
+#include "test.h"
+
+#define SIZE (4 * 1024 * 1024)
+#define XZ_BLOCK_SIZE 65536
+#define NR_CONNS 4
+#define NR_READS 64
+#define READ_SIZE 100000
+
+static char plain[] = "/tmp/nbdkitxzXXXXXX";
+static char compressed[sizeof plain + 3];
+
+static void
+cleanup_files (void)
+{
+  unlink (plain);
+  unlink (compressed);
+}
+
+/* Write the pattern plugin's data (each 8 byte word is its offset)
+ * and compress it with small xz blocks.
+ */
+static void
+create_disk (void)
+{
+  static uint64_t data[SIZE / 8];
+  char cmd[128];
+  size_t i;
+  int fd;
+
+  for (i = 0; i < SIZE / 8; ++i)
+    data[i] = htobe64 (i * 8);
+
+  fd = mkstemp (plain);
+  if (fd == -1) {
+    perror ("mkstemp");
+    exit (EXIT_FAILURE);
+  }
+  snprintf (compressed, sizeof compressed, "%s.xz", plain);
+  atexit (cleanup_files);
+  if (write (fd, data, sizeof data) != sizeof data) {
+    perror ("write");
+    exit (EXIT_FAILURE);
+  }
+  close (fd);
+
+  snprintf (cmd, sizeof cmd, "xz --block-size=%d -k %s",
+            XZ_BLOCK_SIZE, plain);
+  if (system (cmd) != 0) {
+    fprintf (stderr, "test-xz-concurrent: xz program must be installed.\n");
+    exit (77);
+  }
+}
+
+static void
+check_pattern (const char *buf, uint64_t offset, size_t count)
+{
+  uint64_t i, v;
+
+  /* Reads are 8 byte aligned. */
+  for (i = 0; i < count; i += 8) {
+    memcpy (&v, &buf[i], 8);
+    v = be64toh (v);
+    if (v != offset + i) {
+      fprintf (stderr, "test-xz-concurrent: unexpected data at offset %"
+               PRIu64 ": %" PRIu64 "\n", offset + i, v);
+      exit (EXIT_FAILURE);
+    }
+  }
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct nbd_handle *nbd[NR_CONNS];
+  static char bufs[NR_CONNS][NR_READS][READ_SIZE];
+  uint64_t offsets[NR_CONNS][NR_READS];
+  int64_t cookies[NR_CONNS][NR_READS];
+  uint64_t seed = 1;
+  size_t i, j, pass;
+  bool done;
+
+  create_disk ();
+  if (test_start_nbdkit ("--filter=xz", "file", compressed,
+                         "xz-max-depth=4", NULL) == -1)
+    exit (EXIT_FAILURE);
+
+  for (i = 0; i < NR_CONNS; ++i) {
+    nbd[i] = nbd_create ();
+    if (nbd[i] == NULL || nbd_connect_unix (nbd[i], sock) == -1) {
+      fprintf (stderr, "%s\n", nbd_get_error ());
+      exit (EXIT_FAILURE);
+    }
+  }
+  if (nbd_get_size (nbd[0]) != SIZE) {
+    fprintf (stderr, "test-xz-concurrent: unexpected size\n");
+    exit (EXIT_FAILURE);
+  }
+
+  for (pass = 0; pass < 4; ++pass) {
+    /* Start all of the reads on all of the connections. */
+    for (i = 0; i < NR_CONNS; ++i) {
+      for (j = 0; j < NR_READS; ++j) {
+        seed = seed * 6364136223846793005 + 1442695040888963407;
+        offsets[i][j] = ((seed >> 33) % (SIZE - READ_SIZE)) & ~UINT64_C (7);
+        cookies[i][j] = nbd_aio_pread (nbd[i], bufs[i][j], READ_SIZE,
+                                       offsets[i][j],
+                                       NBD_NULL_COMPLETION, 0);
+        if (cookies[i][j] == -1) {
+          fprintf (stderr, "%s\n", nbd_get_error ());
+          exit (EXIT_FAILURE);
+        }
+      }
+    }
+
+    /* Wait for them, polling each connection in turn. */
+    do {
+      done = true;
+      for (i = 0; i < NR_CONNS; ++i) {
+        if (nbd_aio_in_flight (nbd[i]) > 0) {
+          done = false;
+          if (nbd_poll (nbd[i], 10) == -1) {
+            fprintf (stderr, "%s\n", nbd_get_error ());
+            exit (EXIT_FAILURE);
+          }
+        }
+      }
+    } while (!done);
+
+    for (i = 0; i < NR_CONNS; ++i) {
+      for (j = 0; j < NR_READS; ++j) {
+        if (nbd_aio_command_completed (nbd[i], cookies[i][j]) != 1) {
+          fprintf (stderr, "%s\n", nbd_get_error ());
+          exit (EXIT_FAILURE);
+        }
+        check_pattern (bufs[i][j], offsets[i][j], READ_SIZE);
+      }
+    }
+  }
+
+  for (i = 0; i < NR_CONNS; ++i)
+    nbd_close (nbd[i]);
+  exit (EXIT_SUCCESS);
+}